@@ -0,0 +1,152 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Compare listing of public keys through per-octet fprintf() calls with
+ * listing.c engine in all output formats.
+ *
+ * Usage: bench_listing [records] [modulus_bits]
+ *
+ * No token is needed, records are random and output goes to /dev/null.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include "listing.h"
+
+typedef struct {
+	CK_BYTE label[32];
+	CK_ULONG label_len;
+	CK_BYTE id[16];
+	CK_BYTE modulus[512];
+	CK_ULONG modulus_len;
+	CK_BYTE exponent[3];
+} record_t;
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/* the way export_public_keys used to print records */
+static void
+list_stdio(FILE *out, const record_t *r)
+{
+	CK_ULONG i;
+
+	fprintf(out, "Found a key:\n");
+	fprintf(out, "\tlabel: ");
+	for (i = 0; r->label_len > i; ++i) fprintf(out, "%c", r->label[i]);
+	fprintf(out, "\n");
+	fprintf(out, "\tid: ");
+	for (i = 0; sizeof(r->id) > i; ++i) fprintf(out, "%02x", r->id[i]);
+	fprintf(out, "\n");
+	fprintf(out, "\tmodulus: ");
+	for (i = 0; r->modulus_len > i; ++i) fprintf(out, "%02x", r->modulus[i]);
+	fprintf(out, "\n");
+	fprintf(out, "\texponent: ");
+	for (i = 0; sizeof(r->exponent) > i; ++i) fprintf(out, "%02x", r->exponent[i]);
+	fprintf(out, "\n");
+}
+
+static void
+list_engine(listing_t *l, const record_t *r)
+{
+	listing_begin(l, "Found a key");
+	listing_field_str(l, "label", r->label, r->label_len);
+	listing_field_hex(l, "id", r->id, sizeof(r->id));
+	listing_field_hex(l, "modulus", r->modulus, r->modulus_len);
+	listing_field_hex(l, "exponent", r->exponent, sizeof(r->exponent));
+	listing_end(l);
+}
+
+int
+main(int argc, char **argv)
+{
+	unsigned long count = 10000;
+	unsigned long modulus_bits = 2048;
+	unsigned long i, j;
+	record_t *records;
+	FILE *out;
+	listing_t listing;
+	listing_format_t format;
+	const char *formats[] = { "text", "json", "tsv" };
+	double start;
+
+	if (argc > 1)
+		count = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		modulus_bits = strtoul(argv[2], NULL, 10);
+	if (count == 0 || modulus_bits == 0
+	    || modulus_bits / 8 > sizeof(records->modulus)) {
+		fprintf(stderr, "Usage: %s [records] [modulus_bits]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	records = calloc(count, sizeof(record_t));
+	out = fopen("/dev/null", "w");
+	if (records == NULL || out == NULL) {
+		fprintf(stderr, "Unable to prepare benchmark\n");
+		return EXIT_FAILURE;
+	}
+	srand(time(NULL));
+	for (i = 0; i < count; i++) {
+		records[i].label_len = snprintf((char *) records[i].label,
+						sizeof(records[i].label),
+						"replica-key-%lu", i);
+		for (j = 0; j < sizeof(records[i].id); j++)
+			records[i].id[j] = rand() & 0xff;
+		records[i].modulus_len = modulus_bits / 8;
+		for (j = 0; j < records[i].modulus_len; j++)
+			records[i].modulus[j] = rand() & 0xff;
+		memcpy(records[i].exponent, "\x01\x00\x01", 3);
+	}
+
+	printf("records: %lu, modulus bits: %lu\n", count, modulus_bits);
+
+	start = now();
+	for (i = 0; i < count; i++)
+		list_stdio(out, &records[i]);
+	fflush(out);
+	printf("fprintf per octet: %10.1f ns/record\n",
+	       (now() - start) * 1e9 / count);
+
+	for (j = 0; j < sizeof(formats) / sizeof(formats[0]); j++) {
+		listing_parse_format(formats[j], &format);
+		listing_init(&listing, format, out);
+		start = now();
+		for (i = 0; i < count; i++)
+			list_engine(&listing, &records[i]);
+		fflush(out);
+		printf("listing %-4s:      %10.1f ns/record\n", formats[j],
+		       (now() - start) * 1e9 / count);
+		listing_free(&listing);
+	}
+
+	fclose(out);
+	free(records);
+	return EXIT_SUCCESS;
+}
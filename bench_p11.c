@@ -0,0 +1,495 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Benchmark of PKCS#11 calls behind P11_Helper operations
+ *
+ * Usage: bench_p11 [iterations] [token_sizes]
+ *
+ * token_sizes is comma separated list of object counts for find benchmark,
+ * default is 10,100,1000. Use a throwaway token (python/bench.py creates
+ * one), all created objects are destroyed at the end.
+ *
+ * Results are printed to stdout as JSON in the same format as python/bench.py
+ * produces.
+ */
+
+#include <time.h>
+
+#include "common.c"
+#include "spki.h"
+
+#define MAX_GARBAGE 100000
+
+typedef struct bench_ctx bench_ctx_t;
+typedef CK_RV (*bench_fn)(bench_ctx_t *ctx, unsigned long i);
+
+struct bench_ctx {
+	CK_FUNCTION_LIST_PTR p11;
+	CK_SESSION_HANDLE session;
+	CK_OBJECT_HANDLE master;
+	CK_OBJECT_HANDLE secret;
+	CK_OBJECT_HANDLE pub;
+	CK_OBJECT_HANDLE priv;
+	CK_MECHANISM mech;
+	CK_OBJECT_HANDLE wrapped;
+	CK_OBJECT_HANDLE wrapping;
+	CK_OBJECT_HANDLE unwrapping;
+	CK_BYTE blob[4096];
+	CK_ULONG blob_len;
+	char label[64];
+	CK_OBJECT_HANDLE garbage[MAX_GARBAGE];
+	unsigned long garbage_count;
+	int first_result;
+};
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int
+cmp_double(const void *a, const void *b)
+{
+	double x = *(const double *) a;
+	double y = *(const double *) b;
+	return (x > y) - (x < y);
+}
+
+/* nearest-rank percentile of sorted samples */
+static double
+percentile(const double *samples, unsigned long count, unsigned int p)
+{
+	unsigned long k = (p * count + 99) / 100;
+	return samples[k > 0 ? k - 1 : 0];
+}
+
+static void
+add_garbage(bench_ctx_t *ctx, CK_OBJECT_HANDLE object)
+{
+	if (ctx->garbage_count == MAX_GARBAGE)
+		check_return_value(CKR_HOST_MEMORY, "too many objects");
+	ctx->garbage[ctx->garbage_count++] = object;
+}
+
+static void
+cleanup(bench_ctx_t *ctx)
+{
+	CK_RV rv;
+
+	while (ctx->garbage_count > 0) {
+		rv = ctx->p11->C_DestroyObject(ctx->session,
+				ctx->garbage[--ctx->garbage_count]);
+		check_return_value(rv, "destroy object");
+	}
+}
+
+static void
+run(bench_ctx_t *ctx, const char *op, bench_fn fn, unsigned long iterations,
+    const char *param, const char *value)
+{
+	double *samples = malloc(iterations * sizeof(double));
+	double start, total = 0;
+	unsigned long i;
+	CK_RV rv;
+
+	if (samples == NULL)
+		check_return_value(CKR_HOST_MEMORY, "samples allocation");
+	for (i = 0; i < iterations; i++) {
+		start = now();
+		rv = fn(ctx, i);
+		samples[i] = now() - start;
+		check_return_value(rv, op);
+		total += samples[i];
+	}
+	qsort(samples, iterations, sizeof(double), cmp_double);
+
+	printf("%s\n    {\"op\": \"%s\", \"iterations\": %lu, "
+	       "\"ops_per_sec\": %.1f, \"p50_us\": %.1f, \"p90_us\": %.1f, "
+	       "\"p99_us\": %.1f, \"min_us\": %.1f, \"max_us\": %.1f",
+	       ctx->first_result ? "" : ",", op, iterations,
+	       total > 0 ? iterations / total : 0,
+	       percentile(samples, iterations, 50) * 1e6,
+	       percentile(samples, iterations, 90) * 1e6,
+	       percentile(samples, iterations, 99) * 1e6,
+	       samples[0] * 1e6, samples[iterations - 1] * 1e6);
+	if (param != NULL)
+		printf(", \"%s\": %s", param, value);
+	printf("}");
+	ctx->first_result = 0;
+	free(samples);
+}
+
+static CK_RV
+generate_aes(bench_ctx_t *ctx, const char *label, CK_BBOOL *wrap,
+	     CK_OBJECT_HANDLE_PTR key)
+{
+	CK_MECHANISM mechanism = { CKM_AES_KEY_GEN, NULL_PTR, 0 };
+	CK_ULONG key_length = 16;
+	CK_ATTRIBUTE template[] = {
+		{ CKA_ID, (CK_BYTE_PTR) label, strlen(label) },
+		{ CKA_LABEL, (CK_BYTE_PTR) label, strlen(label) },
+		{ CKA_TOKEN, &true, sizeof(true) },
+		{ CKA_VALUE_LEN, &key_length, sizeof(key_length) },
+		{ CKA_EXTRACTABLE, &true, sizeof(true) },
+		{ CKA_WRAP, wrap, sizeof(CK_BBOOL) },
+		{ CKA_UNWRAP, wrap, sizeof(CK_BBOOL) },
+	};
+	CK_RV rv;
+
+	rv = ctx->p11->C_GenerateKey(ctx->session, &mechanism, template,
+			sizeof(template) / sizeof(CK_ATTRIBUTE), key);
+	if (rv == CKR_OK)
+		add_garbage(ctx, *key);
+	return rv;
+}
+
+static CK_RV
+generate_rsa(bench_ctx_t *ctx, const char *label, CK_OBJECT_HANDLE_PTR pub,
+	     CK_OBJECT_HANDLE_PTR priv)
+{
+	CK_MECHANISM mechanism = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0 };
+	CK_ULONG modulus_bits = 2048;
+	CK_BYTE public_exponent[] = { 1, 0, 1 };
+	CK_ATTRIBUTE pub_template[] = {
+		{ CKA_ID, (CK_BYTE_PTR) label, strlen(label) },
+		{ CKA_LABEL, (CK_BYTE_PTR) label, strlen(label) },
+		{ CKA_TOKEN, &true, sizeof(true) },
+		{ CKA_WRAP, &true, sizeof(true) },
+		{ CKA_MODULUS_BITS, &modulus_bits, sizeof(modulus_bits) },
+		{ CKA_PUBLIC_EXPONENT, public_exponent, sizeof(public_exponent) },
+	};
+	CK_ATTRIBUTE priv_template[] = {
+		{ CKA_ID, (CK_BYTE_PTR) label, strlen(label) },
+		{ CKA_LABEL, (CK_BYTE_PTR) label, strlen(label) },
+		{ CKA_TOKEN, &true, sizeof(true) },
+		{ CKA_PRIVATE, &true, sizeof(true) },
+		{ CKA_SENSITIVE, &false, sizeof(false) },
+		{ CKA_UNWRAP, &true, sizeof(true) },
+		{ CKA_EXTRACTABLE, &true, sizeof(true) },
+	};
+	CK_RV rv;
+
+	rv = ctx->p11->C_GenerateKeyPair(ctx->session, &mechanism,
+			pub_template, sizeof(pub_template) / sizeof(CK_ATTRIBUTE),
+			priv_template, sizeof(priv_template) / sizeof(CK_ATTRIBUTE),
+			pub, priv);
+	if (rv == CKR_OK) {
+		add_garbage(ctx, *pub);
+		add_garbage(ctx, *priv);
+	}
+	return rv;
+}
+
+static CK_RV
+op_generate_master_key(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_OBJECT_HANDLE key;
+	char label[32];
+
+	snprintf(label, sizeof(label), "bench-mkey-%lu", i);
+	return generate_aes(ctx, label, &false, &key);
+}
+
+static CK_RV
+op_generate_replica_key_pair(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_OBJECT_HANDLE pub, priv;
+	char label[32];
+
+	snprintf(label, sizeof(label), "bench-replica-%lu", i);
+	return generate_rsa(ctx, label, &pub, &priv);
+}
+
+static CK_RV
+find(bench_ctx_t *ctx, CK_ATTRIBUTE_PTR template, CK_ULONG template_len)
+{
+	CK_OBJECT_HANDLE objects[64];
+	CK_ULONG count;
+	CK_RV rv;
+
+	rv = ctx->p11->C_FindObjectsInit(ctx->session, template, template_len);
+	if (rv != CKR_OK)
+		return rv;
+	do {
+		rv = ctx->p11->C_FindObjects(ctx->session, objects, 64, &count);
+	} while (rv == CKR_OK && count == 64);
+	if (rv != CKR_OK)
+		return rv;
+	return ctx->p11->C_FindObjectsFinal(ctx->session);
+}
+
+static CK_RV
+op_find_keys(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_LABEL, ctx->label, strlen(ctx->label) },
+	};
+
+	return find(ctx, template, 2);
+}
+
+static CK_RV
+op_find_keys_all(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+	};
+
+	return find(ctx, template, 1);
+}
+
+static CK_RV
+op_get_attribute(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_BYTE label[256];
+	CK_ATTRIBUTE template[] = { { CKA_LABEL, label, sizeof(label) } };
+
+	return ctx->p11->C_GetAttributeValue(ctx->session, ctx->pub,
+					     template, 1);
+}
+
+static CK_RV
+op_export_public_key(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_BYTE modulus[SPKI_RSA_MAX_MODULUS_LEN];
+	CK_BYTE exponent[SPKI_RSA_MAX_EXPONENT_LEN];
+	CK_ATTRIBUTE template[] = {
+		{ CKA_MODULUS, modulus, sizeof(modulus) },
+		{ CKA_PUBLIC_EXPONENT, exponent, sizeof(exponent) },
+	};
+	CK_RV rv;
+
+	rv = ctx->p11->C_GetAttributeValue(ctx->session, ctx->pub, template, 2);
+	if (rv != CKR_OK)
+		return rv;
+	ctx->blob_len = sizeof(ctx->blob);
+	return spki_rsa_encode(modulus, template[0].ulValueLen,
+			       exponent, template[1].ulValueLen,
+			       ctx->blob, &ctx->blob_len);
+}
+
+static CK_RV
+op_import_public_key(bench_ctx_t *ctx, unsigned long i)
+{
+	const CK_BYTE *modulus, *exponent;
+	CK_ULONG modulus_len, exponent_len;
+	CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
+	CK_KEY_TYPE key_type = CKK_RSA;
+	CK_OBJECT_HANDLE object;
+	char label[32];
+	spki_t spki;
+	CK_RV rv;
+
+	snprintf(label, sizeof(label), "bench-import-%lu", i);
+	rv = spki_decode(ctx->blob, ctx->blob_len, &spki);
+	if (rv == CKR_OK)
+		rv = spki_rsa_decode(&spki, &modulus, &modulus_len,
+				     &exponent, &exponent_len);
+	if (rv != CKR_OK)
+		return rv;
+
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+		{ CKA_ID, label, strlen(label) },
+		{ CKA_LABEL, label, strlen(label) },
+		{ CKA_TOKEN, &true, sizeof(true) },
+		{ CKA_MODULUS, (CK_BYTE_PTR) modulus, modulus_len },
+		{ CKA_PUBLIC_EXPONENT, (CK_BYTE_PTR) exponent, exponent_len },
+	};
+	rv = ctx->p11->C_CreateObject(ctx->session, template,
+			sizeof(template) / sizeof(CK_ATTRIBUTE), &object);
+	if (rv == CKR_OK)
+		add_garbage(ctx, object);
+	return rv;
+}
+
+static CK_RV
+op_export_wrapped_key(bench_ctx_t *ctx, unsigned long i)
+{
+	ctx->blob_len = sizeof(ctx->blob);
+	return ctx->p11->C_WrapKey(ctx->session, &ctx->mech, ctx->wrapping,
+				   ctx->wrapped, ctx->blob, &ctx->blob_len);
+}
+
+static CK_RV
+op_import_wrapped_key(bench_ctx_t *ctx, unsigned long i)
+{
+	CK_OBJECT_CLASS class = CKO_SECRET_KEY;
+	CK_KEY_TYPE key_type = CKK_AES;
+	CK_OBJECT_HANDLE object;
+	char label[32];
+	CK_RV rv;
+
+	if (ctx->wrapped == ctx->priv) {
+		class = CKO_PRIVATE_KEY;
+		key_type = CKK_RSA;
+	}
+	snprintf(label, sizeof(label), "bench-unwrap-%lu", i);
+	CK_ATTRIBUTE template[] = {
+		{ CKA_CLASS, &class, sizeof(class) },
+		{ CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+		{ CKA_ID, label, strlen(label) },
+		{ CKA_LABEL, label, strlen(label) },
+		{ CKA_TOKEN, &true, sizeof(true) },
+	};
+	rv = ctx->p11->C_UnwrapKey(ctx->session, &ctx->mech, ctx->unwrapping,
+			ctx->blob, ctx->blob_len, template,
+			sizeof(template) / sizeof(CK_ATTRIBUTE), &object);
+	if (rv == CKR_OK)
+		add_garbage(ctx, object);
+	return rv;
+}
+
+CK_RV
+bench(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	static bench_ctx_t ctx;
+	/* same parameters as ipap11helper, tokens reject OAEP without them */
+	static CK_RSA_PKCS_OAEP_PARAMS oaep_params = {
+		CKM_SHA_1, CKG_MGF1_SHA1, CKZ_DATA_SPECIFIED, NULL, 0
+	};
+	unsigned long iterations = 100;
+	const char *token_sizes = "10,100,1000";
+	const char *p;
+	char *end;
+	unsigned long size, filled = 0;
+	char value[32];
+	CK_OBJECT_HANDLE key;
+	CK_RV rv;
+	unsigned int i;
+	struct {
+		const char *name;
+		CK_MECHANISM_TYPE mech;
+		CK_OBJECT_HANDLE *wrapped;
+		CK_OBJECT_HANDLE *wrapping;
+		CK_OBJECT_HANDLE *unwrapping;
+	} wrap_cases[] = {
+		{ "AES_KEY_WRAP", CKM_AES_KEY_WRAP, &ctx.secret, &ctx.master,
+		  &ctx.master },
+		{ "AES_KEY_WRAP_PAD", CKM_AES_KEY_WRAP_PAD, &ctx.priv,
+		  &ctx.master, &ctx.master },
+		{ "RSA_PKCS", CKM_RSA_PKCS, &ctx.secret, &ctx.pub, &ctx.priv },
+		{ "RSA_PKCS_OAEP", CKM_RSA_PKCS_OAEP, &ctx.secret, &ctx.pub,
+		  &ctx.priv },
+	};
+
+	if (cmd_argc > 1)
+		iterations = strtoul(cmd_argv[1], NULL, 10);
+	if (cmd_argc > 2)
+		token_sizes = cmd_argv[2];
+	if (iterations == 0) {
+		fprintf(stderr, "Usage: %s [iterations] [token_sizes]\n",
+			cmd_argv[0]);
+		return CKR_ARGUMENTS_BAD;
+	}
+
+	ctx.p11 = p11;
+	ctx.session = session;
+	ctx.first_result = 1;
+	printf("{\"driver\": \"c\", \"library\": \"%s\", \"iterations\": %lu, "
+	       "\"results\": [", PKCS11LIB, iterations);
+
+	run(&ctx, "generate_master_key", op_generate_master_key, iterations,
+	    NULL, NULL);
+	cleanup(&ctx);
+	/* RSA key generation is slow, limit it to tenth of iterations */
+	run(&ctx, "generate_replica_key_pair", op_generate_replica_key_pair,
+	    iterations / 10 ? iterations / 10 : 1, NULL, NULL);
+	cleanup(&ctx);
+
+	for (p = token_sizes; *p != '\0'; p = *end ? end + 1 : end) {
+		size = strtoul(p, &end, 10);
+		for (; filled < size; filled++) {
+			snprintf(ctx.label, sizeof(ctx.label), "bench-fill-%lu",
+				 filled);
+			rv = generate_aes(&ctx, ctx.label, &false, &key);
+			check_return_value(rv, "fill token");
+		}
+		snprintf(ctx.label, sizeof(ctx.label), "bench-fill-%lu",
+			 size / 2);
+		snprintf(value, sizeof(value), "%lu", size);
+		run(&ctx, "find_keys", op_find_keys, iterations, "token_size",
+		    value);
+		run(&ctx, "find_keys_all", op_find_keys_all, iterations,
+		    "token_size", value);
+	}
+	cleanup(&ctx);
+
+	rv = generate_aes(&ctx, "bench-master", &true, &ctx.master);
+	check_return_value(rv, "generate master key");
+	rv = generate_aes(&ctx, "bench-secret", &false, &ctx.secret);
+	check_return_value(rv, "generate secret key");
+	rv = generate_rsa(&ctx, "bench-replica", &ctx.pub, &ctx.priv);
+	check_return_value(rv, "generate replica key pair");
+	/* keep the keys, imported objects are destroyed separately */
+	ctx.garbage_count = 0;
+
+	run(&ctx, "get_attribute", op_get_attribute, iterations, NULL, NULL);
+	run(&ctx, "export_public_key", op_export_public_key, iterations,
+	    NULL, NULL);
+	run(&ctx, "import_public_key", op_import_public_key, iterations,
+	    NULL, NULL);
+	cleanup(&ctx);
+
+	for (i = 0; i < sizeof(wrap_cases) / sizeof(wrap_cases[0]); i++) {
+		ctx.mech.mechanism = wrap_cases[i].mech;
+		if (wrap_cases[i].mech == CKM_RSA_PKCS_OAEP) {
+			ctx.mech.pParameter = &oaep_params;
+			ctx.mech.ulParameterLen = sizeof(oaep_params);
+		} else {
+			ctx.mech.pParameter = NULL;
+			ctx.mech.ulParameterLen = 0;
+		}
+		ctx.wrapped = *wrap_cases[i].wrapped;
+		ctx.wrapping = *wrap_cases[i].wrapping;
+		ctx.unwrapping = *wrap_cases[i].unwrapping;
+		snprintf(value, sizeof(value), "\"%s\"", wrap_cases[i].name);
+		run(&ctx, "export_wrapped_key", op_export_wrapped_key,
+		    iterations, "mech", value);
+		run(&ctx, ctx.wrapped == ctx.priv ?
+				"import_wrapped_private_key" :
+				"import_wrapped_secret_key",
+		    op_import_wrapped_key, iterations, "mech", value);
+		cleanup(&ctx);
+	}
+
+	add_garbage(&ctx, ctx.master);
+	add_garbage(&ctx, ctx.secret);
+	add_garbage(&ctx, ctx.pub);
+	add_garbage(&ctx, ctx.priv);
+	cleanup(&ctx);
+
+	printf("\n]}\n");
+	return CKR_OK;
+}
+
+CK_RV
+do_something(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	return bench(p11, session);
+}
@@ -0,0 +1,191 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*
+ * Compare SubjectPublicKeyInfo encoding through OpenSSL (BN + RSA + EVP_PKEY +
+ * i2d_PUBKEY) with direct DER encoder from spki.c.
+ *
+ * Usage: bench_spki [iterations] [modulus_bits]
+ *
+ * No token is needed, modulus is random.
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#include <openssl/x509.h>
+#include <openssl/evp.h>
+#include <openssl/rsa.h>
+#include <openssl/bn.h>
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+#include <openssl/core_names.h>
+#include <openssl/param_build.h>
+#endif
+
+#include "spki.h"
+
+static double
+now(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+#if OPENSSL_VERSION_NUMBER >= 0x30000000L
+static int
+openssl_encode(const CK_BYTE *modulus, CK_ULONG modulus_len,
+	       const CK_BYTE *exponent, CK_ULONG exponent_len,
+	       unsigned char **pp)
+{
+	int pp_len = -1;
+	EVP_PKEY *pkey = NULL;
+	EVP_PKEY_CTX *ctx = EVP_PKEY_CTX_new_from_name(NULL, "RSA", NULL);
+	OSSL_PARAM_BLD *bld = OSSL_PARAM_BLD_new();
+	OSSL_PARAM *params = NULL;
+	BIGNUM *n = BN_bin2bn(modulus, modulus_len, NULL);
+	BIGNUM *e = BN_bin2bn(exponent, exponent_len, NULL);
+
+	if (ctx == NULL || bld == NULL || n == NULL || e == NULL)
+		goto cleanup;
+	if (OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_N, n) == 0
+	    || OSSL_PARAM_BLD_push_BN(bld, OSSL_PKEY_PARAM_RSA_E, e) == 0)
+		goto cleanup;
+	params = OSSL_PARAM_BLD_to_param(bld);
+	if (params == NULL || EVP_PKEY_fromdata_init(ctx) <= 0
+	    || EVP_PKEY_fromdata(ctx, &pkey, EVP_PKEY_PUBLIC_KEY, params) <= 0)
+		goto cleanup;
+	pp_len = i2d_PUBKEY(pkey, pp);
+
+cleanup:
+	OSSL_PARAM_free(params);
+	OSSL_PARAM_BLD_free(bld);
+	BN_free(n);
+	BN_free(e);
+	EVP_PKEY_CTX_free(ctx);
+	EVP_PKEY_free(pkey);
+	return pp_len;
+}
+#else
+static int
+openssl_encode(const CK_BYTE *modulus, CK_ULONG modulus_len,
+	       const CK_BYTE *exponent, CK_ULONG exponent_len,
+	       unsigned char **pp)
+{
+	int pp_len = -1;
+	RSA *rsa = RSA_new();
+	EVP_PKEY *pkey = EVP_PKEY_new();
+	BIGNUM *n = BN_bin2bn(modulus, modulus_len, NULL);
+	BIGNUM *e = BN_bin2bn(exponent, exponent_len, NULL);
+
+	if (rsa == NULL || pkey == NULL || n == NULL || e == NULL)
+		goto cleanup;
+#if OPENSSL_VERSION_NUMBER < 0x10100000L
+	rsa->n = n;
+	rsa->e = e;
+#else
+	RSA_set0_key(rsa, n, e, NULL);
+#endif
+	n = e = NULL; /* owned by rsa now */
+	if (EVP_PKEY_set1_RSA(pkey, rsa) == 0)
+		goto cleanup;
+	pp_len = i2d_PUBKEY(pkey, pp);
+
+cleanup:
+	BN_free(n);
+	BN_free(e);
+	RSA_free(rsa);
+	EVP_PKEY_free(pkey);
+	return pp_len;
+}
+#endif
+
+int
+main(int argc, char **argv)
+{
+	unsigned long iterations = 100000;
+	unsigned long modulus_bits = 2048;
+	unsigned long i;
+	CK_BYTE modulus[SPKI_RSA_MAX_MODULUS_LEN];
+	CK_ULONG modulus_len;
+	CK_BYTE exponent[] = { 1, 0, 1 };
+	CK_BYTE spki[SPKI_RSA_MAX_MODULUS_LEN + SPKI_RSA_MAX_EXPONENT_LEN + 64];
+	CK_ULONG spki_len = 0;
+	unsigned char *pp = NULL;
+	int pp_len;
+	double start, t_openssl, t_direct;
+
+	if (argc > 1)
+		iterations = strtoul(argv[1], NULL, 10);
+	if (argc > 2)
+		modulus_bits = strtoul(argv[2], NULL, 10);
+	modulus_len = modulus_bits / 8;
+	if (iterations == 0 || modulus_len == 0
+	    || modulus_len > SPKI_RSA_MAX_MODULUS_LEN) {
+		fprintf(stderr, "Usage: %s [iterations] [modulus_bits]\n", argv[0]);
+		return EXIT_FAILURE;
+	}
+
+	srand(time(NULL));
+	for (i = 0; i < modulus_len; i++)
+		modulus[i] = rand() & 0xff;
+	modulus[0] |= 0x80;
+	modulus[modulus_len - 1] |= 0x01;
+
+	/* both encoders have to produce identical DER */
+	pp_len = openssl_encode(modulus, modulus_len, exponent,
+				sizeof(exponent), &pp);
+	spki_len = sizeof(spki);
+	if (pp_len < 0
+	    || spki_rsa_encode(modulus, modulus_len, exponent, sizeof(exponent),
+			       spki, &spki_len) != CKR_OK
+	    || (CK_ULONG) pp_len != spki_len
+	    || memcmp(pp, spki, spki_len) != 0) {
+		fprintf(stderr, "DER output mismatch\n");
+		return EXIT_FAILURE;
+	}
+	OPENSSL_free(pp);
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		pp = NULL;
+		pp_len = openssl_encode(modulus, modulus_len, exponent,
+					sizeof(exponent), &pp);
+		OPENSSL_free(pp);
+	}
+	t_openssl = now() - start;
+
+	start = now();
+	for (i = 0; i < iterations; i++) {
+		spki_len = sizeof(spki);
+		spki_rsa_encode(modulus, modulus_len, exponent,
+				sizeof(exponent), spki, &spki_len);
+	}
+	t_direct = now() - start;
+
+	printf("modulus bits: %lu, iterations: %lu, SPKI length: %lu\n",
+	       modulus_bits, iterations, (unsigned long) spki_len);
+	printf("openssl i2d_PUBKEY: %10.1f ns/op\n",
+	       t_openssl * 1e9 / iterations);
+	printf("spki_rsa_encode:    %10.1f ns/op\n",
+	       t_direct * 1e9 / iterations);
+	return EXIT_SUCCESS;
+}
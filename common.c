@@ -59,6 +59,10 @@
 #include <pkcs11.h>
 
 #include "library.h"
+#include "p11caps.h"
+#include "p11stats.h"
+#include "p11trace.h"
+#include "secmem.h"
 
 // compat
 #define CKM_AES_KEY_WRAP           (0x1090)
@@ -67,6 +71,9 @@
 CK_BBOOL true = CK_TRUE;
 CK_BBOOL false = CK_FALSE;
 
+/* command line for do_something() */
+int cmd_argc;
+char **cmd_argv;
 
 
 void
@@ -90,10 +97,10 @@ get_slot(CK_FUNCTION_LIST_PTR p11)
 {
      CK_RV rv;
      CK_SLOT_ID slotId;
-     CK_ULONG slotCount = 10;
-     CK_SLOT_ID *slotIds = malloc(sizeof(CK_SLOT_ID) * slotCount);
+     CK_ULONG slotCount = 0;
+     CK_SLOT_ID *slotIds = NULL;
 
-     rv = p11->C_GetSlotList(CK_TRUE, slotIds, &slotCount);
+     rv = p11caps_slot_list(p11, CK_TRUE, &slotIds, &slotCount);
      check_return_value(rv, "get slot list");
 
      if (slotCount < 1) {
@@ -103,7 +110,7 @@ get_slot(CK_FUNCTION_LIST_PTR p11)
 
      slotId = slotIds[0];
      free(slotIds);
-     printf("slot count: %d\n", (int)slotCount);
+     fprintf(stderr, "slot count: %d\n", (int)slotCount);
      return slotId;
 }
 
@@ -159,6 +166,8 @@ int exit_handler(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session) {
      logout(p11, session);
      end_session(p11, session);
      finalize(p11);
+     if (p11stats_enabled())
+          p11stats_print(stderr);
      return EXIT_SUCCESS;
 }
 
@@ -174,6 +183,9 @@ main(int argc, char **argv)
      CK_FUNCTION_LIST_PTR p11;
      void *moduleHandle = NULL;
 
+     cmd_argc = argc;
+     cmd_argv = argv;
+
      // Get a pointer to the function list for PKCS#11 library (argv[2])
      // CK_C_GetFunctionList pGetFunctionList = loadLibrary("/usr/lib64/softhsm/libsofthsm2.so", &moduleHandle);
      CK_C_GetFunctionList pGetFunctionList = loadLibrary(PKCS11LIB, &moduleHandle);
@@ -185,6 +197,12 @@ main(int argc, char **argv)
      
      // Load the function list
      (*pGetFunctionList)(&p11);
+     // P11_TRACE=file records calls for p11replay
+     if (getenv("P11_TRACE") != NULL)
+          p11 = p11trace_wrap(p11, getenv("P11_TRACE"));
+     // P11_STATS=1 in environment prints per-function call statistics
+     if (getenv("P11_STATS") != NULL)
+          p11 = p11stats_wrap(p11);
      
      rv = initialize(p11);
      check_return_value(rv, "initialize");
@@ -301,7 +319,7 @@ wrap_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_MECHANISM wrapp
 
      rv = p11->C_WrapKey(session, &wrappingMech, wrappingKey, toBeWrappedKey, NULL, &wrappedKeyLen);
      check_return_value(rv, "key wrapping: get buffer length");
-     pWrappedKey = malloc(wrappedKeyLen);
+     pWrappedKey = secmem_alloc(wrappedKeyLen);
      if (pWrappedKey == NULL) {
              rv = CKR_HOST_MEMORY;
              check_return_value(rv, "key wrapping: buffer allocation");
@@ -311,6 +329,7 @@ wrap_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_MECHANISM wrapp
      fp = get_key_file(p11, session, toBeWrappedKey);
      fwrite(pWrappedKey, wrappedKeyLen, 1, fp);
      fclose(fp);
+     secmem_free(pWrappedKey);
 
      return CKR_OK;
 }
@@ -1,5 +1,7 @@
 #include "common.c"
 
+#include <ctype.h>
+
 /*
 CK_RV
 unwrap_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
@@ -11,13 +13,116 @@ unwrap_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
 
 }*/
 
+#define FIND_BATCH 64
+#define ID_MAX_LEN 128
+
+static void
+usage(void)
+{
+	fprintf(stderr, "Usage: %s [-n] [-c m|pub|priv] [-i hex-id] [-l label]\n"
+		"  -n  only print number of matching objects\n"
+		"  -i  CKA_ID in hex, as import_public_key uses\n"
+		"Without arguments key type and ID are read from stdin.\n",
+		cmd_argv[0]);
+	exit(EXIT_FAILURE);
+}
+
+static int
+parse_class(const char *keyType, CK_OBJECT_CLASS *class)
+{
+	if (!strcasecmp(keyType, "m"))
+		*class = CKO_SECRET_KEY;
+	else if (!strcasecmp(keyType, "pub"))
+		*class = CKO_PUBLIC_KEY;
+	else if (!strcasecmp(keyType, "priv"))
+		*class = CKO_PRIVATE_KEY;
+	else
+		return 0;
+	return 1;
+}
+
+/*
+ * Strict hex decoding of -i, like import_public_key Id headers
+ */
+static int
+parse_hex_id(const char *hex, CK_BYTE_PTR out, CK_ULONG_PTR out_len)
+{
+	size_t len = strlen(hex);
+	size_t i;
+	int hi, lo;
+
+	if (len == 0 || len % 2 != 0 || len / 2 > *out_len)
+		return 0;
+	for (i = 0; i < len / 2; i++) {
+		hi = (unsigned char) hex[2 * i];
+		lo = (unsigned char) hex[2 * i + 1];
+		if (!isxdigit(hi) || !isxdigit(lo))
+			return 0;
+		hi = isdigit(hi) ? hi - '0' : tolower(hi) - 'a' + 10;
+		lo = isdigit(lo) ? lo - '0' : tolower(lo) - 'a' + 10;
+		out[i] = (CK_BYTE) ((hi << 4) | lo);
+	}
+	*out_len = len / 2;
+	return 1;
+}
+
+/*
+ * Destroy all objects matching template, one search and one
+ * C_DestroyObject per object; failures are reported and skipped.
+ */
+CK_RV
+delete_objects(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+	       CK_ATTRIBUTE_PTR template, CK_ULONG templateLen, int dryRun)
+{
+	CK_RV rv;
+	CK_OBJECT_HANDLE *objects = NULL;
+	CK_OBJECT_HANDLE *tmp;
+	CK_ULONG count = 0;
+	CK_ULONG found = 0;
+	CK_ULONG failed = 0;
+	CK_ULONG i;
+
+	rv = p11->C_FindObjectsInit(session, template, templateLen);
+	check_return_value(rv, "Find objects init");
+	do {
+		tmp = realloc(objects, (count + FIND_BATCH) * sizeof(*objects));
+		if (tmp == NULL) {
+			rv = CKR_HOST_MEMORY;
+			check_return_value(rv, "object list allocation");
+		}
+		objects = tmp;
+		rv = p11->C_FindObjects(session, objects + count, FIND_BATCH,
+					&found);
+		check_return_value(rv, "Find objects");
+		count += found;
+	} while (found == FIND_BATCH);
+	rv = p11->C_FindObjectsFinal(session);
+	check_return_value(rv, "Find objects final");
+
+	if (dryRun) {
+		printf("%lu\n", count);
+		free(objects);
+		return CKR_OK;
+	}
+
+	for (i = 0; i < count; i++) {
+		rv = p11->C_DestroyObject(session, objects[i]);
+		if (rv != CKR_OK) {
+			fprintf(stderr, "Error at object %lu deletion: 0x%x\n",
+				objects[i], (unsigned int)rv);
+			failed++;
+		}
+	}
+	printf("deleted %lu, failed %lu\n", count - failed, failed);
+	free(objects);
+	return failed ? CKR_FUNCTION_FAILED : CKR_OK;
+}
+
 CK_RV
 delete_key_id(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 {
 	CK_RV rv;
 	CK_BYTE id[1024];
-	CK_ULONG idLen;
-	CK_OBJECT_HANDLE obj;
 	CK_OBJECT_CLASS class;
 	char keyType[1024];
 
@@ -25,32 +130,73 @@ delete_key_id(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 		rv = CKR_ARGUMENTS_BAD;
 		check_return_value(rv, "scanf key type: m / pub / priv expected");
 	}
-	if (!strcasecmp(keyType, "m"))
-		class = CKO_SECRET_KEY;
-	else if (!strcasecmp(keyType, "pub"))
-		class = CKO_PUBLIC_KEY;
-	else if (!strcasecmp(keyType, "priv"))
-		class = CKO_PRIVATE_KEY;
-	else {
+	if (!parse_class(keyType, &class)) {
 		rv = CKR_ARGUMENTS_BAD;
 		check_return_value(rv, "key type: m / pub / priv expected");
 	}
 
-	idLen = scanf("%s", id);
-	/*
-	if (!feof(stdin)) {
-		rv = CKR_BUFFER_TOO_SMALL;
-		check_return_value(rv, "input too long");
+	if (scanf("%1023s", id) != 1) {
+		rv = CKR_ARGUMENTS_BAD;
+		check_return_value(rv, "scanf ID");
+	}
+	CK_ATTRIBUTE template[] = {
+		{ CKA_ID, id, strlen((char *)id) },
+		{ CKA_CLASS, &class, sizeof(class) }
+	};
+	return delete_objects(p11, session, template, 2, 0);
+}
+
+/*
+ * Filter from command line, at least one criterion is required so that
+ * a typo does not wipe the token
+ */
+CK_RV
+delete_filter(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	CK_OBJECT_CLASS class;
+	CK_BYTE id[ID_MAX_LEN];
+	CK_ULONG idLen = sizeof(id);
+	CK_ATTRIBUTE template[3];
+	CK_ULONG templateLen = 0;
+	int dryRun = 0;
+	int seenClass = 0, seenId = 0, seenLabel = 0;
+	int i;
+
+	/* each criterion once, template has room for all three */
+	for (i = 1; i < cmd_argc; i++) {
+		if (!strcmp(cmd_argv[i], "-n")) {
+			dryRun = 1;
+		} else if (!strcmp(cmd_argv[i], "-c") && i + 1 < cmd_argc) {
+			if (seenClass++ || !parse_class(cmd_argv[++i], &class))
+				usage();
+			template[templateLen].type = CKA_CLASS;
+			template[templateLen].pValue = &class;
+			template[templateLen++].ulValueLen = sizeof(class);
+		} else if (!strcmp(cmd_argv[i], "-i") && i + 1 < cmd_argc) {
+			if (seenId++ || !parse_hex_id(cmd_argv[++i], id, &idLen))
+				usage();
+			template[templateLen].type = CKA_ID;
+			template[templateLen].pValue = id;
+			template[templateLen++].ulValueLen = idLen;
+		} else if (!strcmp(cmd_argv[i], "-l") && i + 1 < cmd_argc) {
+			if (seenLabel++)
+				usage();
+			template[templateLen].type = CKA_LABEL;
+			template[templateLen].pValue = cmd_argv[++i];
+			template[templateLen++].ulValueLen = strlen(cmd_argv[i]);
+		} else {
+			usage();
+		}
 	}
-	*/
-	obj = find_key_id(p11, session, id, idLen, class);
-	rv = p11->C_DestroyObject(session, obj);
-	check_return_value(rv, "object deletion");
-	return rv;
+	if (templateLen == 0)
+		usage();
+	return delete_objects(p11, session, template, templateLen, dryRun);
 }
 
 CK_RV
 do_something(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 {
+	if (cmd_argc > 1)
+		return delete_filter(p11, session);
 	return delete_key_id(p11, session);
 }
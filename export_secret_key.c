@@ -88,7 +88,11 @@ export_secret_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
     check_return_value(rv, "get attribute value - prepare");
     
     /* Set proper size for attributes*/
-    value = (CK_UTF8CHAR_PTR) malloc(obj_template[0].ulValueLen * sizeof(CK_BYTE));
+    value = (CK_UTF8CHAR_PTR) secmem_alloc(obj_template[0].ulValueLen * sizeof(CK_BYTE));
+    if (value == NULL) {
+         rv = CKR_HOST_MEMORY;
+         check_return_value(rv, "value buffer allocation");
+    }
     obj_template[0].pValue = value;
     
     rv = p11->C_GetAttributeValue(session, object, obj_template, 1);
@@ -101,10 +105,13 @@ export_secret_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
          fprintf(stdout, "\n");
          FILE *fp = get_key_file(p11, session, object);
          fwrite(obj_template[0].pValue, obj_template[0].ulValueLen, 1, fp);
+         fclose(fp);
     } else {
          fprintf(stderr, "\tvalue too large, or not found\n");
+         secmem_free(value);
          return CKR_GENERAL_ERROR;
     }
+    secmem_free(value);
        
     rv = p11->C_FindObjectsFinal(session);
     check_return_value(rv, "Find objects final");
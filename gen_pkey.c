@@ -53,6 +53,14 @@
  */
 
 #include "common.c"
+#include "spki.h"
+
+/*
+ * Usage: gen_pkey [rsa|p256|p384]
+ *
+ * EC replica key pair can not wrap, the private key is used to derive
+ * AES wrapping key with ECDH instead.
+ */
 
 CK_RV
 create_replica_key_pair(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
@@ -63,34 +71,64 @@ create_replica_key_pair(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
           CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0
      };
      CK_ULONG modulusBits = 2048;
+     CK_ULONG curveBits = 0;
+     const CK_BYTE *ecParams = NULL;
+     CK_ULONG ecParamsLen = 0;
+     CK_BBOOL *wrap = &true;
      CK_BYTE publicExponent[] = { 1, 0, 1 }; /* 65537 (RFC 6376 section 3.3.1)*/
      CK_BYTE subject[] = "replica1-keypair";
      CK_BYTE id[] = {'r'};
+
+     if (cmd_argc > 1 && strcmp(cmd_argv[1], "rsa") != 0) {
+          if (strcmp(cmd_argv[1], "p256") == 0)
+               curveBits = 256;
+          else if (strcmp(cmd_argv[1], "p384") == 0)
+               curveBits = 384;
+          if (spki_ec_params(curveBits, &ecParams, &ecParamsLen) != CKR_OK) {
+               fprintf(stderr, "Usage: %s [rsa|p256|p384]\n", cmd_argv[0]);
+               return CKR_ARGUMENTS_BAD;
+          }
+          mechanism.mechanism = CKM_EC_KEY_PAIR_GEN;
+          wrap = &false;
+     }
+
+     /* key type specific attributes are at the end */
      CK_ATTRIBUTE publicKeyTemplate[] = {
           {CKA_ID, id, sizeof(id)},
           {CKA_LABEL, subject, sizeof(subject) - 1},
           {CKA_TOKEN, &true, sizeof(true)},
-          {CKA_WRAP, &true, sizeof(true)},
+          {CKA_WRAP, wrap, sizeof(CK_BBOOL)},
           {CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits)},
           {CKA_PUBLIC_EXPONENT, publicExponent, 3},
      };
+     CK_ULONG publicKeyTemplateLen = 6;
      CK_ATTRIBUTE privateKeyTemplate[] = {
           {CKA_ID, id, sizeof(id)},
           {CKA_LABEL, subject, sizeof(subject) - 1},
           {CKA_TOKEN, &true, sizeof(true)},
           {CKA_PRIVATE, &true, sizeof(true)},
           {CKA_SENSITIVE, &false, sizeof(false)}, // prevents wrapping
-          {CKA_UNWRAP, &true, sizeof(true)},
+          {CKA_UNWRAP, wrap, sizeof(CK_BBOOL)},
           {CKA_EXTRACTABLE, &true, sizeof(true)},
-          {CKA_WRAP_WITH_TRUSTED, &false, sizeof(false)} // prevents wrapping
+          {CKA_WRAP_WITH_TRUSTED, &false, sizeof(false)}, // prevents wrapping
+          {CKA_DERIVE, &true, sizeof(true)}
      };
+     CK_ULONG privateKeyTemplateLen = 8;
+
+     if (mechanism.mechanism == CKM_EC_KEY_PAIR_GEN) {
+          publicKeyTemplate[4].type = CKA_EC_PARAMS;
+          publicKeyTemplate[4].pValue = (CK_BYTE_PTR) ecParams;
+          publicKeyTemplate[4].ulValueLen = ecParamsLen;
+          publicKeyTemplateLen = 5;
+          privateKeyTemplateLen = 9;
+     }
 
      rv = p11->C_GenerateKeyPair(session,
                             &mechanism,
                             publicKeyTemplate,
-			    sizeof(publicKeyTemplate)/sizeof(CK_ATTRIBUTE),
+			    publicKeyTemplateLen,
                             privateKeyTemplate,
-			    sizeof(privateKeyTemplate)/sizeof(CK_ATTRIBUTE),
+			    privateKeyTemplateLen,
                             &publicKey,
                             &privateKey);
      check_return_value(rv, "generate key pair");
@@ -51,90 +51,372 @@
  * SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 #include "common.c"
+#include "spki.h"
+
+/*
+ * Usage: import_public_key [file]
+ *
+ * Input is read from file (mmaped if it is a regular file) or from STDIN.
+ * It can contain:
+ * - concatenated DER or PEM SubjectPublicKeyInfo records; PEM records may
+ *   carry "Label:" and hex encoded "Id:" headers,
+ * - length-delimited binary records, all lengths are big endian:
+ *     u16 label_len | label | u16 id_len | id | u32 der_len | DER
+ *   (label has to be shorter than 11520 bytes so the first octet can not be
+ *   mistaken for DER SEQUENCE or PEM dash).
+ * Records without label/id get label "imported-pubkey" and id {6,6,6}.
+ * All keys are imported in one session.
+ */
+
+#define READ_BLOCK_SIZE (1024 * 1024)
+
+static CK_BYTE default_label[] = "imported-pubkey";
+static CK_BYTE default_id[] = {6,6,6};
+
+typedef struct {
+	CK_BYTE_PTR data;
+	CK_ULONG len;
+	int mapped;
+} input_t;
+
+static void
+read_input(const char *file_name, input_t *in)
+{
+	int fd = STDIN_FILENO;
+	struct stat st;
+	CK_ULONG size = 0;
+	ssize_t n;
+
+	memset(in, 0, sizeof(*in));
+	if (file_name != NULL && strcmp(file_name, "-") != 0) {
+		fd = open(file_name, O_RDONLY);
+		if (fd < 0) {
+			fprintf(stderr, "Unable to open %s: %s\n", file_name,
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (fstat(fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+		in->data = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (in->data != MAP_FAILED) {
+			madvise(in->data, st.st_size, MADV_SEQUENTIAL);
+			in->len = st.st_size;
+			in->mapped = 1;
+			goto done;
+		}
+		in->data = NULL;
+	}
+
+	/* pipe or mmap failure: read in large blocks */
+	do {
+		if (in->len == size) {
+			size += READ_BLOCK_SIZE;
+			in->data = realloc(in->data, size);
+			if (in->data == NULL) {
+				fprintf(stderr, "Unable to realloc memory\n");
+				exit(EXIT_FAILURE);
+			}
+		}
+		n = read(fd, in->data + in->len, size - in->len);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0) {
+			fprintf(stderr, "Unable to read input: %s\n",
+				strerror(errno));
+			exit(EXIT_FAILURE);
+		}
+		in->len += n;
+	} while (n > 0);
+
+done:
+	if (fd != STDIN_FILENO)
+		close(fd);
+}
+
+static void
+free_input(input_t *in)
+{
+	if (in->mapped)
+		munmap(in->data, in->len);
+	else
+		free(in->data);
+}
+
+static int
+hex_nibble(int c)
+{
+	if (isdigit(c))
+		return c - '0';
+	return tolower(c) - 'a' + 10;
+}
+
+static int
+hex_to_bin(const char *hex, CK_ULONG hex_len, CK_BYTE_PTR out,
+	   CK_ULONG_PTR out_len)
+{
+	CK_ULONG i;
+	int hi, lo;
+
+	if (hex_len % 2 != 0 || hex_len / 2 > *out_len)
+		return 0;
+	for (i = 0; i < hex_len / 2; i++) {
+		/* sscanf would accept sign and leading space */
+		hi = (unsigned char) hex[2 * i];
+		lo = (unsigned char) hex[2 * i + 1];
+		if (!isxdigit(hi) || !isxdigit(lo))
+			return 0;
+		out[i] = (hex_nibble(hi) << 4) | hex_nibble(lo);
+	}
+	*out_len = hex_len / 2;
+	return 1;
+}
+
+static CK_RV
+create_ec_public_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+		     CK_BYTE_PTR label, CK_ULONG label_len,
+		     CK_BYTE_PTR id, CK_ULONG id_len, const spki_t *spki)
+{
+	CK_RV rv;
+	const CK_BYTE *params = NULL;
+	CK_ULONG params_len = 0;
+	const CK_BYTE *point = NULL;
+	CK_ULONG point_len = 0;
+	/* CKA_EC_POINT is DER encoded OCTET STRING */
+	CK_BYTE ec_point[SPKI_EC_MAX_POINT_LEN + 4];
+	CK_ULONG ec_point_len = sizeof(ec_point);
+
+	rv = spki_ec_decode(spki, &params, &params_len, &point, &point_len);
+	if (rv != CKR_OK)
+		return rv;
+	rv = spki_ec_point_encode(point, point_len, ec_point, &ec_point_len);
+	if (rv != CKR_OK)
+		return rv;
+
+	CK_OBJECT_CLASS keyClass = CKO_PUBLIC_KEY;
+	CK_OBJECT_HANDLE data;
+	CK_KEY_TYPE keyType = CKK_EC;
+	CK_ATTRIBUTE publicKeyTemplate[] = {
+		{CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+		{CKA_ID, id, id_len},
+		{CKA_LABEL, label, label_len},
+		{CKA_TOKEN, &true, sizeof(true)},
+		{CKA_DERIVE, &true, sizeof(true)},
+		{CKA_EC_PARAMS, (CK_BYTE_PTR) params, params_len},
+		{CKA_EC_POINT, ec_point, ec_point_len},
+		{CKA_CLASS, &keyClass, sizeof(keyClass)},
+	};
+
+	return p11->C_CreateObject(session, publicKeyTemplate, 8, &data);
+}
+
+static CK_RV
+create_public_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+		  CK_BYTE_PTR label, CK_ULONG label_len,
+		  CK_BYTE_PTR id, CK_ULONG id_len,
+		  const CK_BYTE *der, CK_ULONG der_len)
+{
+	CK_RV rv;
+	const CK_BYTE *modulus = NULL;
+	CK_ULONG modulus_len = 0;
+	const CK_BYTE *exponent = NULL;
+	CK_ULONG exponent_len = 0;
+	spki_t spki;
+
+	/* modulus and exponent are used in place, no conversion is needed */
+	rv = spki_decode(der, der_len, &spki);
+	if (rv != CKR_OK)
+		return rv;
+	if (spki.algorithm == SPKI_ALG_EC)
+		return create_ec_public_key(p11, session, label, label_len,
+					    id, id_len, &spki);
+	rv = spki_rsa_decode(&spki, &modulus, &modulus_len, &exponent, &exponent_len);
+	if (rv != CKR_OK)
+		return rv;
 
-#include <openssl/asn1.h>
-#include <openssl/x509.h>
-#include <openssl/evp.h>
-#include <openssl/rsa.h>
-#include <openssl/bn.h>
+	CK_OBJECT_CLASS keyClass = CKO_PUBLIC_KEY;
+	CK_OBJECT_HANDLE data;
+	CK_KEY_TYPE keyType = CKK_RSA;
+	CK_ATTRIBUTE publicKeyTemplate[] = {
+		//TODO parameters
+		{CKA_KEY_TYPE, &keyType, sizeof(keyType)},
+		{CKA_ID, id, id_len},
+		{CKA_LABEL, label, label_len},
+		{CKA_TOKEN, &true, sizeof(true)},
+		{CKA_WRAP, &true, sizeof(true)},
+		//{CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits)},
+		{CKA_PUBLIC_EXPONENT, (CK_BYTE_PTR) exponent, exponent_len},
+		{CKA_MODULUS, (CK_BYTE_PTR) modulus, modulus_len},
+		{CKA_CLASS, &keyClass, sizeof(keyClass)},
+	};
+
+	return p11->C_CreateObject(session, publicKeyTemplate, 8, &data);
+}
+
+static CK_ULONG
+get_be(const CK_BYTE *p, int octets)
+{
+	CK_ULONG v = 0;
+
+	while (octets-- > 0)
+		v = (v << 8) | *p++;
+	return v;
+}
+
+/* u16 label_len | label | u16 id_len | id | u32 der_len | DER */
+static int
+next_binary_record(const input_t *in, CK_ULONG *offset,
+		   CK_BYTE_PTR *label, CK_ULONG *label_len,
+		   CK_BYTE_PTR *id, CK_ULONG *id_len,
+		   CK_BYTE_PTR *der, CK_ULONG *der_len)
+{
+	CK_ULONG left = in->len - *offset;
+	CK_BYTE_PTR p = in->data + *offset;
+
+	if (left < 2 || left - 2 < (*label_len = get_be(p, 2)))
+		return 0;
+	*label = p + 2;
+	p += 2 + *label_len;
+	left -= 2 + *label_len;
+
+	if (left < 2 || left - 2 < (*id_len = get_be(p, 2)))
+		return 0;
+	*id = p + 2;
+	p += 2 + *id_len;
+	left -= 2 + *id_len;
+
+	if (left < 4 || left - 4 < (*der_len = get_be(p, 4)))
+		return 0;
+	*der = p + 4;
+	*offset = (p + 4 + *der_len) - in->data;
+	return 1;
+}
 
-//import from STDIN
 CK_RV
 import_public_key(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
 {
 	CK_RV rv;
-	CK_BYTE_PTR modulus = NULL;
-	int modulus_len = 0;
-	CK_BYTE_PTR exponent = NULL;
-	int exponent_len = 0;
-	
-    unsigned char *pp = NULL;
-    EVP_PKEY *pkey;
-    RSA *rsa;
-    long l;
-    long size;
-    int c;
-    
-    l=0;
-    size = 1024;
-    pp = (unsigned char *) malloc(size * sizeof(unsigned char));
-    
-    /* load PUBKEY from STDIN */
-    while((c = getchar()) != EOF){
-    	pp[l] = (unsigned char) c;
-    	++l;
-    	if(l>=size) {
-    		size += 1024;
-    		pp = (unsigned char *) realloc(pp, size * sizeof(unsigned char));
-    		if (pp == NULL) {
-    			fprintf(stderr, "Unable to realloc memory");
-    			exit(EXIT_FAILURE);
-    		}
-    	}
-    }
-
-    pkey = d2i_PUBKEY(NULL, (const unsigned char **) &pp, l);
-    //TODO detect if type is RSA
-
-    rsa = EVP_PKEY_get1_RSA(pkey);
-    fprintf(stderr, "BIGNUM n:");
-    BN_print_fp(stderr, rsa->n);
-    fprintf(stderr, "\nBIGNUM e:");
-    BN_print_fp(stderr, rsa->e);
-    fprintf(stderr, "\n");
-    
-    //convert BIGNUM to binary array
-    modulus = (CK_BYTE_PTR) malloc(BN_num_bytes(rsa->n));
-    modulus_len = BN_bn2bin(rsa->n, (unsigned char *) modulus);
-    exponent = (CK_BYTE_PTR) malloc(BN_num_bytes(rsa->e));
-    exponent_len = BN_bn2bin(rsa->e, (unsigned char *) exponent);
-    //TODO get Type of algorithm from PUBKEY
-    CK_OBJECT_CLASS keyClass = CKO_PUBLIC_KEY;
-    CK_BYTE subject[] = "imported-pubkey";
-    CK_BYTE id[] = {6,6,6};
-    CK_OBJECT_HANDLE data;
-    CK_KEY_TYPE keyType = CKK_RSA;
-    CK_ATTRIBUTE publicKeyTemplate[] = {
-    	//TODO parameters
-    	//TODO type RSA.. etc
-         {CKA_KEY_TYPE, &keyType, sizeof(keyType)},
-         {CKA_ID, id, sizeof(id)},
-         {CKA_LABEL, subject, sizeof(subject) - 1},
-         {CKA_TOKEN, &true, sizeof(true)},
-         {CKA_WRAP, &true, sizeof(true)},
-         //{CKA_MODULUS_BITS, &modulusBits, sizeof(modulusBits)},
-         {CKA_PUBLIC_EXPONENT, exponent, exponent_len},
-         {CKA_MODULUS, modulus, modulus_len},
-         {CKA_CLASS, &keyClass, sizeof(keyClass)},
-    };
-    
-    rv = p11->C_CreateObject(session, publicKeyTemplate, 8, &data);
-    check_return_value(rv, "create public key object");
-    
-    EVP_PKEY_free(pkey);
-    RSA_free(rsa);
-    return CKR_OK;
+	input_t in;
+	CK_ULONG offset = 0;
+	CK_ULONG imported = 0;
+	CK_ULONG failed = 0;
+	CK_BYTE_PTR scratch = NULL;
+	CK_BYTE_PTR scratch_pos;
+	CK_ULONG scratch_len;
+	spki_record_t rec;
+	CK_BYTE_PTR label, id, der;
+	CK_ULONG label_len, id_len, der_len;
+	const char *value;
+	CK_ULONG value_len;
+	CK_BYTE id_buf[256];
+
+	read_input(cmd_argc > 1 ? cmd_argv[1] : NULL, &in);
+
+	/*
+	 * Format is decided by the first octet, binary record starts with
+	 * length which can look like whitespace. Only PEM is expected
+	 * after leading whitespace.
+	 */
+	if (in.len > 0 && isspace(in.data[0])) {
+		while (offset < in.len && isspace(in.data[offset]))
+			++offset;
+		if (offset < in.len
+		    && (in.len - offset < strlen("-----BEGIN ")
+		    || memcmp(in.data + offset, "-----BEGIN ",
+			      strlen("-----BEGIN ")) != 0))
+			offset = 0;
+	}
+	if (offset < in.len && in.data[offset] != 0x30
+	    && in.data[offset] != '-') {
+		/* length-delimited binary records */
+		while (offset < in.len) {
+			if (!next_binary_record(&in, &offset, &label,
+						&label_len, &id, &id_len,
+						&der, &der_len)) {
+				fprintf(stderr, "Truncated record at offset %lu\n",
+					offset);
+				++failed;
+				break;
+			}
+			rv = create_public_key(p11, session, label, label_len,
+					       id, id_len, der, der_len);
+			if (rv != CKR_OK) {
+				fprintf(stderr, "Error at import of record "
+					"%lu: 0x%x\n", imported + failed,
+					(unsigned int) rv);
+				++failed;
+			} else {
+				++imported;
+			}
+		}
+		goto cleanup;
+	}
+
+	/* DER or PEM records, one PEM record is decoded at a time */
+	scratch = malloc(in.len);
+	if (scratch == NULL) {
+		fprintf(stderr, "Unable to allocate memory\n");
+		exit(EXIT_FAILURE);
+	}
+	while (1) {
+		scratch_pos = scratch;
+		scratch_len = in.len;
+		rv = spki_bundle_next(in.data, in.len, &offset, &scratch_pos,
+				      &scratch_len, &rec);
+		if (rv != CKR_OK) {
+			fprintf(stderr, "Malformed record at offset %lu\n",
+				offset);
+			++failed;
+			break;
+		}
+		if (rec.der == NULL)
+			break;
+
+		label = default_label;
+		label_len = sizeof(default_label) - 1;
+		id = default_id;
+		id_len = sizeof(default_id);
+		if (spki_record_header(&rec, "Label", &value, &value_len)) {
+			label = (CK_BYTE_PTR) value;
+			label_len = value_len;
+		}
+		if (spki_record_header(&rec, "Id", &value, &value_len)) {
+			id_len = sizeof(id_buf);
+			if (!hex_to_bin(value, value_len, id_buf, &id_len)) {
+				fprintf(stderr, "Invalid Id header in record "
+					"%lu\n", imported + failed);
+				++failed;
+				continue;
+			}
+			id = id_buf;
+		}
+
+		rv = create_public_key(p11, session, label, label_len,
+				       id, id_len, rec.der, rec.der_len);
+		if (rv != CKR_OK) {
+			fprintf(stderr, "Error at import of record %lu: 0x%x\n",
+				imported + failed, (unsigned int) rv);
+			++failed;
+		} else {
+			++imported;
+		}
+	}
+
+cleanup:
+	fprintf(stderr, "imported keys: %lu, failed: %lu\n", imported, failed);
+	free(scratch);
+	free_input(&in);
+	if (failed > 0 || imported == 0)
+		return CKR_GENERAL_ERROR;
+	return CKR_OK;
 }
 
 
@@ -0,0 +1,264 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ listing.c
+
+ Formatting of object listings in human readable or machine readable form
+
+ Listing of a big token used to be dominated by stdio: every octet of
+ modulus went through its own fprintf("%02x") call. Here each record is
+ assembled in one growing buffer (reused between records) and written with
+ single fwrite(), hex encoding is done through a lookup table.
+
+ Missing attributes (value == NULL) are reported as "not found" in text
+ mode, as null in JSON and as empty field in TSV.
+ *****************************************************************************/
+
+#include <stdlib.h>
+#include <string.h>
+
+#include "listing.h"
+
+static const char hex_table[] =
+    "000102030405060708090a0b0c0d0e0f101112131415161718191a1b1c1d1e1f"
+    "202122232425262728292a2b2c2d2e2f303132333435363738393a3b3c3d3e3f"
+    "404142434445464748494a4b4c4d4e4f505152535455565758595a5b5c5d5e5f"
+    "606162636465666768696a6b6c6d6e6f707172737475767778797a7b7c7d7e7f"
+    "808182838485868788898a8b8c8d8e8f909192939495969798999a9b9c9d9e9f"
+    "a0a1a2a3a4a5a6a7a8a9aaabacadaeafb0b1b2b3b4b5b6b7b8b9babbbcbdbebf"
+    "c0c1c2c3c4c5c6c7c8c9cacbcccdcecfd0d1d2d3d4d5d6d7d8d9dadbdcdddedf"
+    "e0e1e2e3e4e5e6e7e8e9eaebecedeeeff0f1f2f3f4f5f6f7f8f9fafbfcfdfeff";
+
+/**
+ * Encode octets as lowercase hex, out has to have space for 2 * in_len
+ * characters. Output is not NUL terminated.
+ *
+ * @return pointer behind the last written character
+ */
+char *hex_encode(const CK_BYTE *in, CK_ULONG in_len, char *out) {
+    CK_ULONG i;
+
+    for (i = 0; i < in_len; i++) {
+        memcpy(out, hex_table + 2 * in[i], 2);
+        out += 2;
+    }
+    return out;
+}
+
+/**
+ * @retval 1 if name is one of "text", "json" or "tsv"
+ */
+int listing_parse_format(const char *name, listing_format_t *format) {
+    if (strcmp(name, "text") == 0)
+        *format = LISTING_TEXT;
+    else if (strcmp(name, "json") == 0)
+        *format = LISTING_JSON;
+    else if (strcmp(name, "tsv") == 0)
+        *format = LISTING_TSV;
+    else
+        return 0;
+    return 1;
+}
+
+void listing_init(listing_t *l, listing_format_t format, FILE *out) {
+    memset(l, 0, sizeof(*l));
+    l->format = format;
+    l->out = out;
+}
+
+void listing_free(listing_t *l) {
+    free(l->buf);
+    free(l->header);
+    memset(l, 0, sizeof(*l));
+}
+
+/**
+ * Make sure that buffer has space for another len characters
+ */
+static char *reserve(char **buf, size_t *used, size_t *size, size_t len) {
+    char *tmp;
+    size_t new_size;
+
+    if (*used + len > *size) {
+        new_size = *size ? *size : 256;
+        while (new_size < *used + len)
+            new_size *= 2;
+        tmp = realloc(*buf, new_size);
+        if (tmp == NULL) {
+            fprintf(stderr, "Unable to allocate listing buffer\n");
+            exit(EXIT_FAILURE);
+        }
+        *buf = tmp;
+        *size = new_size;
+    }
+    return *buf + *used;
+}
+
+static void append(listing_t *l, const char *s, size_t len) {
+    memcpy(reserve(&l->buf, &l->len, &l->size, len), s, len);
+    l->len += len;
+}
+
+#define APPEND_LITERAL(l, s) append((l), (s), sizeof(s) - 1)
+
+/**
+ * Append string with escaping required by the output format
+ */
+static void append_escaped(listing_t *l, const CK_BYTE *s, CK_ULONG len) {
+    char *p = reserve(&l->buf, &l->len, &l->size, 6 * len);
+    char *start = p;
+    CK_ULONG i;
+
+    for (i = 0; i < len; i++) {
+        if (l->format == LISTING_TEXT || (s[i] >= 0x20 && s[i] != '\\'
+                && (s[i] != '"' || l->format != LISTING_JSON))) {
+            *p++ = s[i];
+            continue;
+        }
+        *p++ = '\\';
+        switch (s[i]) {
+        case '\t': *p++ = 't'; break;
+        case '\n': *p++ = 'n'; break;
+        case '\r': *p++ = 'r'; break;
+        case '\\': *p++ = '\\'; break;
+        case '"': *p++ = '"'; break;
+        default:
+            if (l->format == LISTING_JSON) {
+                memcpy(p, "u00", 3);
+                p = hex_encode(&s[i], 1, p + 3);
+            } else {
+                *p++ = 'x';
+                p = hex_encode(&s[i], 1, p);
+            }
+        }
+    }
+    l->len += p - start;
+}
+
+/**
+ * Start new record, title is used only in text mode
+ */
+void listing_begin(listing_t *l, const char *title) {
+    l->len = 0;
+    l->fields = 0;
+    if (l->format == LISTING_TEXT) {
+        append(l, title, strlen(title));
+        APPEND_LITERAL(l, ":\n");
+    } else if (l->format == LISTING_JSON) {
+        APPEND_LITERAL(l, "{");
+    }
+}
+
+static void field_name(listing_t *l, const char *name) {
+    size_t name_len = strlen(name);
+
+    switch (l->format) {
+    case LISTING_TEXT:
+        APPEND_LITERAL(l, "\t");
+        append(l, name, name_len);
+        APPEND_LITERAL(l, ": ");
+        break;
+    case LISTING_JSON:
+        if (l->fields > 0)
+            APPEND_LITERAL(l, ",");
+        APPEND_LITERAL(l, "\"");
+        append(l, name, name_len);
+        APPEND_LITERAL(l, "\":");
+        break;
+    case LISTING_TSV:
+        if (l->fields > 0)
+            APPEND_LITERAL(l, "\t");
+        if (l->records == 0) {
+            char *h = reserve(&l->header, &l->header_len, &l->header_size,
+                    name_len + 1);
+            if (l->fields > 0)
+                *h++ = '\t';
+            memcpy(h, name, name_len);
+            l->header_len += name_len + (l->fields > 0);
+        }
+        break;
+    }
+    l->fields++;
+}
+
+static void field_missing(listing_t *l, const char *name) {
+    if (l->format == LISTING_TEXT) {
+        /* keep the record on stdout intact, report to stderr */
+        fprintf(stderr, "\t%s too large, or not found\n", name);
+        return;
+    }
+    field_name(l, name);
+    if (l->format == LISTING_JSON)
+        APPEND_LITERAL(l, "null");
+}
+
+void listing_field_str(listing_t *l, const char *name,
+        const CK_BYTE *value, CK_ULONG value_len) {
+    if (value == NULL) {
+        field_missing(l, name);
+        return;
+    }
+    field_name(l, name);
+    if (l->format == LISTING_JSON)
+        APPEND_LITERAL(l, "\"");
+    append_escaped(l, value, value_len);
+    if (l->format == LISTING_JSON)
+        APPEND_LITERAL(l, "\"");
+    else if (l->format == LISTING_TEXT)
+        APPEND_LITERAL(l, "\n");
+}
+
+void listing_field_hex(listing_t *l, const char *name,
+        const CK_BYTE *value, CK_ULONG value_len) {
+    if (value == NULL) {
+        field_missing(l, name);
+        return;
+    }
+    field_name(l, name);
+    if (l->format == LISTING_JSON)
+        APPEND_LITERAL(l, "\"");
+    l->len = hex_encode(value, value_len,
+            reserve(&l->buf, &l->len, &l->size, 2 * value_len)) - l->buf;
+    if (l->format == LISTING_JSON)
+        APPEND_LITERAL(l, "\"");
+    else if (l->format == LISTING_TEXT)
+        APPEND_LITERAL(l, "\n");
+}
+
+/**
+ * Finish record and write it out
+ *
+ * @retval 0 if write failed
+ */
+int listing_end(listing_t *l) {
+    if (l->format == LISTING_JSON)
+        APPEND_LITERAL(l, "}\n");
+    else if (l->format == LISTING_TSV)
+        APPEND_LITERAL(l, "\n");
+
+    if (l->format == LISTING_TSV && l->records == 0) {
+        *reserve(&l->header, &l->header_len, &l->header_size, 1) = '\n';
+        l->header_len++;
+        if (fwrite(l->header, 1, l->header_len, l->out) != l->header_len)
+            return 0;
+    }
+    l->records++;
+    return fwrite(l->buf, 1, l->len, l->out) == l->len;
+}
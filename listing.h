@@ -0,0 +1,69 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ listing.h
+
+ Formatting of object listings in human readable or machine readable form
+ *****************************************************************************/
+
+#ifndef _IPA_P11_LISTING_H
+#define _IPA_P11_LISTING_H
+
+#include <stdio.h>
+
+#include "pkcs11.h"
+
+typedef enum {
+    LISTING_TEXT = 0,   /* "Found a key:" followed by indented fields */
+    LISTING_JSON,       /* one JSON object per line */
+    LISTING_TSV         /* header line followed by one line per record */
+} listing_format_t;
+
+/**
+ * Record is built in one buffer and written out with single fwrite()
+ */
+typedef struct {
+    listing_format_t format;
+    FILE *out;
+    char *buf;
+    size_t len;
+    size_t size;
+    char *header;       /* TSV header collected from the first record */
+    size_t header_len;
+    size_t header_size;
+    unsigned long records;
+    unsigned int fields;
+} listing_t;
+
+char *hex_encode(const CK_BYTE *in, CK_ULONG in_len, char *out);
+
+int listing_parse_format(const char *name, listing_format_t *format);
+
+void listing_init(listing_t *l, listing_format_t format, FILE *out);
+void listing_free(listing_t *l);
+
+void listing_begin(listing_t *l, const char *title);
+void listing_field_str(listing_t *l, const char *name,
+        const CK_BYTE *value, CK_ULONG value_len);
+void listing_field_hex(listing_t *l, const char *name,
+        const CK_BYTE *value, CK_ULONG value_len);
+int listing_end(listing_t *l);
+
+#endif // !_IPA_P11_LISTING_H
@@ -0,0 +1,597 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+
+/*
+ * Replay PKCS#11 call trace recorded with P11_TRACE=file (see p11trace.h)
+ *
+ * Usage: p11replay trace [original|max]
+ *
+ * Calls are issued in recorded order, either with the original spacing
+ * ("original", default) or back to back ("max"). Object and session handles
+ * from the trace are mapped to handles created during replay; objects which
+ * existed on the original token before the trace started are not known.
+ * Redacted data are replaced by zeros of the same length and wrapped keys
+ * are matched with keys wrapped earlier in the replay by FNV-1a hash.
+ *
+ * C_Initialize, C_Finalize, C_Login and C_Logout are skipped, session is
+ * already logged in. Set P11_STATS=1 to get per-function latencies.
+ */
+
+#include <time.h>
+
+#include "common.c"
+#include "p11trace.h"
+
+#define MAX_TEMPLATE_LEN 64
+
+typedef struct {
+	CK_ULONG from;
+	CK_ULONG to;
+} handle_entry_t;
+
+/* open addressing, traced handle 0 is CK_INVALID_HANDLE and marks free slot */
+typedef struct {
+	handle_entry_t *entries;
+	size_t size;
+	size_t used;
+} handle_map_t;
+
+typedef struct {
+	uint64_t hash;
+	CK_BYTE_PTR data;
+	CK_ULONG len;
+} blob_entry_t;
+
+typedef struct {
+	CK_FUNCTION_LIST_PTR p11;
+	CK_SESSION_HANDLE session;
+	CK_SLOT_ID slot;
+	handle_map_t sessions;
+	handle_map_t objects;
+	blob_entry_t *blobs;
+	size_t blob_count;
+	unsigned long records;
+	unsigned long replayed;
+	unsigned long skipped;
+	unsigned long mismatches;
+	uint64_t traced_ns;
+	uint64_t replayed_ns;
+} replay_t;
+
+static uint64_t
+now_ns(void)
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+static size_t
+handle_slot(const handle_map_t *map, CK_ULONG from)
+{
+	size_t i = (from * 0x9e3779b97f4a7c15ULL) & (map->size - 1);
+
+	while (map->entries[i].from != 0 && map->entries[i].from != from)
+		i = (i + 1) & (map->size - 1);
+	return i;
+}
+
+static CK_RV
+handle_put(handle_map_t *map, CK_ULONG from, CK_ULONG to)
+{
+	handle_entry_t *old = map->entries;
+	size_t old_size = map->size;
+	size_t i;
+
+	if (from == 0)
+		return CKR_OK;
+	if ((map->used + 1) * 2 > map->size) {
+		map->size = old_size ? old_size * 2 : 64;
+		map->entries = calloc(map->size, sizeof(handle_entry_t));
+		if (map->entries == NULL)
+			return CKR_HOST_MEMORY;
+		map->used = 0;
+		for (i = 0; i < old_size; i++) {
+			if (old[i].from != 0) {
+				map->entries[handle_slot(map, old[i].from)] = old[i];
+				map->used++;
+			}
+		}
+		free(old);
+	}
+	i = handle_slot(map, from);
+	if (map->entries[i].from == 0)
+		map->used++;
+	map->entries[i].from = from;
+	map->entries[i].to = to;
+	return CKR_OK;
+}
+
+/* replayed handle, CK_INVALID_HANDLE if traced handle is not known */
+static CK_ULONG
+handle_get(const handle_map_t *map, CK_ULONG from)
+{
+	size_t i;
+
+	if (map->size == 0)
+		return CK_INVALID_HANDLE;
+	i = handle_slot(map, from);
+	return map->entries[i].from == from ? map->entries[i].to
+					    : CK_INVALID_HANDLE;
+}
+
+static CK_SESSION_HANDLE
+session_get(replay_t *r, const p11trace_arg_t *arg)
+{
+	CK_SESSION_HANDLE session = handle_get(&r->sessions, arg->value);
+	return session != CK_INVALID_HANDLE ? session : r->session;
+}
+
+static CK_OBJECT_HANDLE
+object_get(replay_t *r, const p11trace_arg_t *arg)
+{
+	return handle_get(&r->objects, arg->value);
+}
+
+/* map handles returned by traced call to handles returned by replay */
+static CK_RV
+objects_put(replay_t *r, const p11trace_arg_t *arg,
+	    const CK_OBJECT_HANDLE *objects, CK_ULONG count)
+{
+	CK_RV rv = CKR_OK;
+	CK_ULONG i;
+
+	for (i = 0; i < arg->value && i < count && rv == CKR_OK; i++)
+		rv = handle_put(&r->objects, p11trace_handle(arg, i),
+				objects[i]);
+	return rv;
+}
+
+static CK_RV
+blob_put(replay_t *r, uint64_t hash, const CK_BYTE *data, CK_ULONG len)
+{
+	blob_entry_t *blobs;
+	CK_BYTE_PTR copy = malloc(len ? len : 1);
+
+	blobs = realloc(r->blobs, (r->blob_count + 1) * sizeof(blob_entry_t));
+	if (copy == NULL || blobs == NULL) {
+		free(copy);
+		return CKR_HOST_MEMORY;
+	}
+	memcpy(copy, data, len);
+	r->blobs = blobs;
+	r->blobs[r->blob_count].hash = hash;
+	r->blobs[r->blob_count].data = copy;
+	r->blobs[r->blob_count].len = len;
+	r->blob_count++;
+	return CKR_OK;
+}
+
+static const blob_entry_t *
+blob_get(const replay_t *r, uint64_t hash)
+{
+	size_t i;
+
+	for (i = r->blob_count; i > 0; i--) {
+		if (r->blobs[i - 1].hash == hash)
+			return &r->blobs[i - 1];
+	}
+	return NULL;
+}
+
+/* zero filled buffer for redacted data and outputs */
+static CK_BYTE_PTR
+zero_buf(CK_ULONG len)
+{
+	return calloc(len ? len : 1, 1);
+}
+
+static void
+free_template(CK_ATTRIBUTE_PTR template, CK_ULONG count)
+{
+	CK_ULONG i;
+
+	for (i = 0; i < count; i++)
+		free(template[i].pValue);
+}
+
+/*
+ * Rebuild template from trace, every value is in its own allocated buffer
+ */
+static CK_RV
+build_template(const p11trace_arg_t *arg, CK_ATTRIBUTE_PTR template,
+	       CK_ULONG_PTR count)
+{
+	p11trace_attr_t attr;
+	uint32_t offset = 0;
+
+	*count = 0;
+	if (arg->type != P11TRACE_ARG_TEMPLATE)
+		return CKR_ARGUMENTS_BAD;
+	while (p11trace_attr_next(arg, &offset, &attr)) {
+		if (*count == MAX_TEMPLATE_LEN)
+			return CKR_ARGUMENTS_BAD;
+		template[*count].type = attr.type;
+		template[*count].ulValueLen = attr.length;
+		template[*count].pValue = NULL;
+		if (attr.kind != P11TRACE_ATTR_NO_BUFFER
+		    && attr.length < (1UL << 24)) {
+			template[*count].pValue = zero_buf(attr.length);
+			if (template[*count].pValue == NULL)
+				return CKR_HOST_MEMORY;
+			if (attr.kind == P11TRACE_ATTR_VALUE)
+				memcpy(template[*count].pValue, attr.value,
+				       attr.length);
+		}
+		(*count)++;
+	}
+	return CKR_OK;
+}
+
+/* mechanism parameter is copied to get proper alignment */
+static CK_RV
+build_mechanism(const p11trace_arg_t *arg, CK_MECHANISM_PTR mech)
+{
+	mech->mechanism = arg->value;
+	mech->pParameter = NULL;
+	mech->ulParameterLen = 0;
+	if (arg->type != P11TRACE_ARG_MECHANISM)
+		return CKR_ARGUMENTS_BAD;
+	if (arg->data_len > 0) {
+		mech->pParameter = malloc(arg->data_len);
+		if (mech->pParameter == NULL)
+			return CKR_HOST_MEMORY;
+		memcpy(mech->pParameter, arg->data, arg->data_len);
+		mech->ulParameterLen = arg->data_len;
+	}
+	return CKR_OK;
+}
+
+/* check argument types, types has one P11TRACE_ARG_* digit per argument */
+static int
+check_args(const p11trace_record_t *rec, const char *types)
+{
+	unsigned int i;
+
+	for (i = 0; types[i] != '\0'; i++) {
+		if (i >= rec->arg_count
+		    || (int) rec->args[i].type != types[i] - '0')
+			return 0;
+	}
+	return 1;
+}
+
+/*
+ * Issue one traced call, return value of the replayed call is in *result
+ */
+static CK_RV
+replay_record(replay_t *r, const p11trace_record_t *rec, CK_RV *result)
+{
+	CK_FUNCTION_LIST_PTR p11 = r->p11;
+	const p11trace_arg_t *a = rec->args;
+	CK_ATTRIBUTE template[MAX_TEMPLATE_LEN];
+	CK_ATTRIBUTE template2[MAX_TEMPLATE_LEN];
+	CK_ULONG count = 0, count2 = 0;
+	CK_MECHANISM mech = { 0, NULL, 0 };
+	CK_OBJECT_HANDLE objects[2] = { CK_INVALID_HANDLE, CK_INVALID_HANDLE };
+	CK_OBJECT_HANDLE_PTR found = NULL;
+	CK_ULONG found_count = 0;
+	CK_SESSION_HANDLE session;
+	CK_SESSION_INFO info;
+	CK_BYTE_PTR in = NULL, out = NULL;
+	CK_ULONG out_len = 0;
+	const blob_entry_t *blob;
+	CK_RV rv = CKR_OK;
+
+#define ARGS(types) \
+	if (!check_args(rec, types)) \
+		return CKR_ARGUMENTS_BAD
+#define TRY(call) \
+	if ((rv = (call)) != CKR_OK) \
+		goto cleanup
+
+	*result = CKR_OK;
+	switch (rec->function) {
+	case P11TRACE_C_OpenSession:
+		ARGS("115");
+		/* open on the token used by common.c, traced slot otherwise */
+		if (p11->C_GetSessionInfo(r->session, &info) != CKR_OK)
+			info.slotID = a[0].value;
+		*result = p11->C_OpenSession(info.slotID, a[1].value, NULL,
+					     NULL, &session);
+		if (*result == CKR_OK && a[2].value == 1)
+			TRY(handle_put(&r->sessions, p11trace_handle(&a[2], 0),
+				       session));
+		break;
+	case P11TRACE_C_CloseSession:
+		ARGS("1");
+		session = handle_get(&r->sessions, a[0].value);
+		/* never close the session opened by common.c */
+		*result = session != CK_INVALID_HANDLE
+			  ? p11->C_CloseSession(session)
+			  : CKR_SESSION_HANDLE_INVALID;
+		break;
+	case P11TRACE_C_CreateObject:
+		ARGS("175");
+		TRY(build_template(&a[1], template, &count));
+		*result = p11->C_CreateObject(session_get(r, &a[0]), template,
+					      count, objects);
+		if (*result == CKR_OK)
+			TRY(objects_put(r, &a[2], objects, 1));
+		break;
+	case P11TRACE_C_DestroyObject:
+		ARGS("11");
+		*result = p11->C_DestroyObject(session_get(r, &a[0]),
+					       object_get(r, &a[1]));
+		break;
+	case P11TRACE_C_GetAttributeValue:
+	case P11TRACE_C_SetAttributeValue:
+		ARGS("117");
+		TRY(build_template(&a[2], template, &count));
+		*result = (rec->function == P11TRACE_C_GetAttributeValue
+			   ? p11->C_GetAttributeValue
+			   : p11->C_SetAttributeValue)(session_get(r, &a[0]),
+						       object_get(r, &a[1]),
+						       template, count);
+		break;
+	case P11TRACE_C_FindObjectsInit:
+		ARGS("17");
+		TRY(build_template(&a[1], template, &count));
+		*result = p11->C_FindObjectsInit(session_get(r, &a[0]),
+						 template, count);
+		break;
+	case P11TRACE_C_FindObjects:
+		ARGS("115");
+		found = calloc(a[1].value ? a[1].value : 1,
+			       sizeof(CK_OBJECT_HANDLE));
+		if (found == NULL)
+			return CKR_HOST_MEMORY;
+		*result = p11->C_FindObjects(session_get(r, &a[0]), found,
+					     a[1].value, &found_count);
+		if (*result == CKR_OK)
+			TRY(objects_put(r, &a[2], found, found_count));
+		break;
+	case P11TRACE_C_FindObjectsFinal:
+		ARGS("1");
+		*result = p11->C_FindObjectsFinal(session_get(r, &a[0]));
+		break;
+	case P11TRACE_C_DigestInit:
+		ARGS("16");
+		TRY(build_mechanism(&a[1], &mech));
+		*result = p11->C_DigestInit(session_get(r, &a[0]), &mech);
+		break;
+	case P11TRACE_C_SignInit:
+	case P11TRACE_C_VerifyInit:
+		ARGS("161");
+		TRY(build_mechanism(&a[1], &mech));
+		*result = (rec->function == P11TRACE_C_SignInit
+			   ? p11->C_SignInit
+			   : p11->C_VerifyInit)(session_get(r, &a[0]), &mech,
+						object_get(r, &a[2]));
+		break;
+	case P11TRACE_C_Digest:
+	case P11TRACE_C_Sign:
+		ARGS("124");
+		in = zero_buf(a[1].length);
+		out_len = a[2].length;
+		out = a[2].present ? zero_buf(out_len) : NULL;
+		if (in == NULL || (a[2].present && out == NULL)) {
+			rv = CKR_HOST_MEMORY;
+			goto cleanup;
+		}
+		*result = (rec->function == P11TRACE_C_Digest
+			   ? p11->C_Digest
+			   : p11->C_Sign)(session_get(r, &a[0]), in,
+					  a[1].length, out, &out_len);
+		break;
+	case P11TRACE_C_Verify:
+		ARGS("122");
+		in = zero_buf(a[1].length);
+		out = zero_buf(a[2].length);
+		if (in == NULL || out == NULL) {
+			rv = CKR_HOST_MEMORY;
+			goto cleanup;
+		}
+		*result = p11->C_Verify(session_get(r, &a[0]), in, a[1].length,
+					out, a[2].length);
+		break;
+	case P11TRACE_C_GenerateKey:
+		ARGS("1675");
+		TRY(build_mechanism(&a[1], &mech));
+		TRY(build_template(&a[2], template, &count));
+		*result = p11->C_GenerateKey(session_get(r, &a[0]), &mech,
+					     template, count, objects);
+		if (*result == CKR_OK)
+			TRY(objects_put(r, &a[3], objects, 1));
+		break;
+	case P11TRACE_C_GenerateKeyPair:
+		ARGS("167755");
+		TRY(build_mechanism(&a[1], &mech));
+		TRY(build_template(&a[2], template, &count));
+		TRY(build_template(&a[3], template2, &count2));
+		*result = p11->C_GenerateKeyPair(session_get(r, &a[0]), &mech,
+						 template, count, template2,
+						 count2, &objects[0],
+						 &objects[1]);
+		if (*result == CKR_OK) {
+			TRY(objects_put(r, &a[4], &objects[0], 1));
+			TRY(objects_put(r, &a[5], &objects[1], 1));
+		}
+		break;
+	case P11TRACE_C_WrapKey:
+		ARGS("16114");
+		TRY(build_mechanism(&a[1], &mech));
+		out_len = a[4].length;
+		out = a[4].present ? zero_buf(out_len) : NULL;
+		if (a[4].present && out == NULL) {
+			rv = CKR_HOST_MEMORY;
+			goto cleanup;
+		}
+		*result = p11->C_WrapKey(session_get(r, &a[0]), &mech,
+					 object_get(r, &a[2]),
+					 object_get(r, &a[3]), out, &out_len);
+		if (*result == CKR_OK && out != NULL && rec->arg_count > 5
+		    && a[5].type == P11TRACE_ARG_BLOB)
+			TRY(blob_put(r, a[5].hash, out, out_len));
+		break;
+	case P11TRACE_C_UnwrapKey:
+		ARGS("161375");
+		TRY(build_mechanism(&a[1], &mech));
+		TRY(build_template(&a[4], template, &count));
+		blob = blob_get(r, a[3].hash);
+		if (blob == NULL) {
+			in = zero_buf(a[3].length);
+			if (in == NULL) {
+				rv = CKR_HOST_MEMORY;
+				goto cleanup;
+			}
+		}
+		*result = p11->C_UnwrapKey(session_get(r, &a[0]), &mech,
+					   object_get(r, &a[2]),
+					   blob ? blob->data : in,
+					   blob ? blob->len : a[3].length,
+					   template, count, objects);
+		if (*result == CKR_OK)
+			TRY(objects_put(r, &a[5], objects, 1));
+		break;
+	case P11TRACE_C_GenerateRandom:
+		ARGS("12");
+		out = zero_buf(a[1].length);
+		if (out == NULL)
+			return CKR_HOST_MEMORY;
+		*result = p11->C_GenerateRandom(session_get(r, &a[0]), out,
+						a[1].length);
+		break;
+	default:
+		/* C_Initialize, C_Finalize, C_Login, C_Logout */
+		r->skipped++;
+		return CKR_OK;
+	}
+	r->replayed++;
+
+cleanup:
+#undef ARGS
+#undef TRY
+	free_template(template, count);
+	free_template(template2, count2);
+	free(mech.pParameter);
+	free(found);
+	free(in);
+	free(out);
+	return rv;
+}
+
+CK_RV
+do_something(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+{
+	replay_t r;
+	p11trace_record_t rec;
+	FILE *in;
+	int max_speed = 0, ret;
+	uint64_t first = 0, replay_start = 0, target, start;
+	struct timespec delay;
+	CK_RV rv = CKR_OK, result;
+	size_t i;
+
+	if (cmd_argc < 2 || cmd_argc > 3
+	    || (cmd_argc == 3 && strcmp(cmd_argv[2], "max") != 0
+		&& strcmp(cmd_argv[2], "original") != 0)) {
+		fprintf(stderr, "Usage: %s trace [original|max]\n",
+			cmd_argv[0]);
+		return CKR_ARGUMENTS_BAD;
+	}
+	max_speed = cmd_argc == 3 && strcmp(cmd_argv[2], "max") == 0;
+
+	in = fopen(cmd_argv[1], "rb");
+	if (in == NULL) {
+		perror(cmd_argv[1]);
+		return CKR_GENERAL_ERROR;
+	}
+	if (!p11trace_open(in)) {
+		fprintf(stderr, "%s: not a PKCS#11 trace\n", cmd_argv[1]);
+		fclose(in);
+		return CKR_GENERAL_ERROR;
+	}
+
+	memset(&r, 0, sizeof(r));
+	memset(&rec, 0, sizeof(rec));
+	r.p11 = p11;
+	r.session = session;
+
+	while ((ret = p11trace_read(in, &rec)) == 1) {
+		r.records++;
+		r.traced_ns += rec.duration_ns;
+		if (r.records == 1) {
+			first = rec.start_ns;
+			replay_start = now_ns();
+		}
+		if (!max_speed) {
+			/* records are written at completion, not in start order;
+			 * calls which started before the first one run at once */
+			target = replay_start + (rec.start_ns > first
+						 ? rec.start_ns - first : 0);
+			start = now_ns();
+			if (target > start) {
+				delay.tv_sec = (target - start) / 1000000000U;
+				delay.tv_nsec = (target - start) % 1000000000U;
+				nanosleep(&delay, NULL);
+			}
+		}
+		start = now_ns();
+		rv = replay_record(&r, &rec, &result);
+		r.replayed_ns += now_ns() - start;
+		if (rv != CKR_OK) {
+			fprintf(stderr, "record %lu: %s cannot be replayed: "
+				"0x%lx\n", r.records,
+				p11stats_name(rec.function), rv);
+			break;
+		}
+		if (result != rec.rv) {
+			r.mismatches++;
+			fprintf(stderr, "record %lu: %s returned 0x%lx, "
+				"traced 0x%lx\n", r.records,
+				p11stats_name(rec.function), result, rec.rv);
+		}
+	}
+	if (ret < 0) {
+		fprintf(stderr, "%s: malformed record %lu\n", cmd_argv[1],
+			r.records + 1);
+		rv = CKR_GENERAL_ERROR;
+	}
+
+	printf("records: %lu, replayed: %lu, skipped: %lu, "
+	       "return value mismatches: %lu\n", r.records, r.replayed,
+	       r.skipped, r.mismatches);
+	printf("time in calls: traced %.6f s, replayed %.6f s\n",
+	       r.traced_ns / 1e9, r.replayed_ns / 1e9);
+	if (r.records > 0)
+		printf("wall clock: replayed %.6f s (%s speed)\n",
+		       (now_ns() - replay_start) / 1e9,
+		       max_speed ? "max" : "original");
+
+	for (i = 0; i < r.blob_count; i++)
+		free(r.blobs[i].data);
+	free(r.blobs);
+	free(r.sessions.entries);
+	free(r.objects.entries);
+	free(rec.buf);
+	fclose(in);
+	return rv;
+}
@@ -0,0 +1,843 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ p11stats.c
+
+ Statistics collecting wrapper of CK_FUNCTION_LIST
+
+ Every wrapper reads monotonic clock before and after the call to the
+ original function and updates per-function counters with relaxed atomic
+ operations, so wrapped module can be used from multiple threads.
+
+ Histogram bucket of value v is computed HDR-style: values below
+ 2^P11STATS_SUB_BITS have a bucket each, larger values are split into
+ 2^P11STATS_SUB_BITS linear sub-buckets per power of two. 64-bit nanosecond
+ values fit into P11STATS_BUCKETS buckets with relative error below 12.5 %.
+
+ Only one module per process can be wrapped; the function list is copied
+ so the wrapped module remains usable after p11stats_wrap().
+ *****************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "p11stats.h"
+
+#include <string.h>
+#include <time.h>
+
+#define P11STATS_SUB_COUNT (1U << P11STATS_SUB_BITS)
+
+enum {
+#define X(name) P11STATS_ ## name,
+    P11STATS_FUNCTIONS(X)
+#undef X
+    P11STATS_COUNT
+};
+
+static const char *const names[P11STATS_COUNT] = {
+#define X(name) #name,
+    P11STATS_FUNCTIONS(X)
+#undef X
+};
+
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint32_t histogram[P11STATS_BUCKETS];
+} counters_t;
+
+static counters_t counters[P11STATS_COUNT];
+static CK_FUNCTION_LIST orig;
+static CK_FUNCTION_LIST wrapped;
+static CK_FUNCTION_LIST_PTR wrapped_module = NULL;
+
+static uint64_t p11stats_now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+static unsigned int bucket_index(uint64_t value) {
+    unsigned int exp;
+
+    if (value < P11STATS_SUB_COUNT)
+        return (unsigned int) value;
+    exp = 63 - (unsigned int) __builtin_clzll(value);
+    return ((exp - P11STATS_SUB_BITS + 1) << P11STATS_SUB_BITS)
+           + (unsigned int) ((value >> (exp - P11STATS_SUB_BITS))
+                             & (P11STATS_SUB_COUNT - 1));
+}
+
+/**
+ * Highest value which falls into given bucket
+ */
+static uint64_t bucket_upper(unsigned int idx) {
+    unsigned int shift;
+
+    if (idx < P11STATS_SUB_COUNT)
+        return idx;
+    shift = (idx >> P11STATS_SUB_BITS) - 1;
+    return ((uint64_t) ((idx & (P11STATS_SUB_COUNT - 1)) + P11STATS_SUB_COUNT)
+            << shift) + (((uint64_t) 1 << shift) - 1);
+}
+
+static void record(unsigned int fn, CK_RV rv, uint64_t start, uint64_t bytes) {
+    counters_t *c = &counters[fn];
+    uint64_t elapsed = p11stats_now() - start;
+    uint64_t max = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+
+    __atomic_fetch_add(&c->calls, 1, __ATOMIC_RELAXED);
+    if (rv != CKR_OK)
+        __atomic_fetch_add(&c->errors, 1, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->bytes, bytes, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->total_ns, elapsed, __ATOMIC_RELAXED);
+    __atomic_fetch_add(&c->histogram[bucket_index(elapsed)], 1,
+                       __ATOMIC_RELAXED);
+    while (elapsed > max
+           && !__atomic_compare_exchange_n(&c->max_ns, &max, elapsed, 1,
+                                           __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+}
+
+static uint64_t attribute_bytes(CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+    uint64_t bytes = 0;
+    CK_ULONG i;
+
+    for (i = 0; i < count; i++) {
+        if (templ[i].pValue != NULL && templ[i].ulValueLen != (CK_ULONG) -1)
+            bytes += templ[i].ulValueLen;
+    }
+    return bytes;
+}
+
+/* length of output buffer, 0 if caller asked only for the size */
+#define OUT_LEN(buf, len) ((buf) != NULL && (len) != NULL ? *(len) : 0)
+
+#define STATS_BEGIN \
+    CK_RV rv; \
+    uint64_t start = p11stats_now()
+
+#define STATS_END(name, bytes) \
+    record(P11STATS_ ## name, rv, start, \
+           rv == CKR_OK ? (uint64_t) (bytes) : 0); \
+    return rv
+
+static CK_RV
+stats_C_Initialize(CK_VOID_PTR init_args) {
+    STATS_BEGIN;
+    rv = orig.C_Initialize(init_args);
+    STATS_END(C_Initialize, 0);
+}
+
+static CK_RV
+stats_C_Finalize(CK_VOID_PTR reserved) {
+    STATS_BEGIN;
+    rv = orig.C_Finalize(reserved);
+    STATS_END(C_Finalize, 0);
+}
+
+static CK_RV
+stats_C_GetInfo(CK_INFO_PTR info) {
+    STATS_BEGIN;
+    rv = orig.C_GetInfo(info);
+    STATS_END(C_GetInfo, 0);
+}
+
+static CK_RV
+stats_C_GetFunctionList(CK_FUNCTION_LIST_PTR_PTR function_list) {
+    STATS_BEGIN;
+    rv = orig.C_GetFunctionList(function_list);
+    if (rv == CKR_OK && function_list != NULL)
+        *function_list = &wrapped;
+    STATS_END(C_GetFunctionList, 0);
+}
+
+static CK_RV
+stats_C_GetSlotList(CK_BBOOL token_present, CK_SLOT_ID_PTR slot_list,
+        CK_ULONG_PTR count) {
+    STATS_BEGIN;
+    rv = orig.C_GetSlotList(token_present, slot_list, count);
+    STATS_END(C_GetSlotList, 0);
+}
+
+static CK_RV
+stats_C_GetSlotInfo(CK_SLOT_ID slot_id, CK_SLOT_INFO_PTR info) {
+    STATS_BEGIN;
+    rv = orig.C_GetSlotInfo(slot_id, info);
+    STATS_END(C_GetSlotInfo, 0);
+}
+
+static CK_RV
+stats_C_GetTokenInfo(CK_SLOT_ID slot_id, CK_TOKEN_INFO_PTR info) {
+    STATS_BEGIN;
+    rv = orig.C_GetTokenInfo(slot_id, info);
+    STATS_END(C_GetTokenInfo, 0);
+}
+
+static CK_RV
+stats_C_GetMechanismList(CK_SLOT_ID slot_id,
+        CK_MECHANISM_TYPE_PTR mechanism_list, CK_ULONG_PTR count) {
+    STATS_BEGIN;
+    rv = orig.C_GetMechanismList(slot_id, mechanism_list, count);
+    STATS_END(C_GetMechanismList, 0);
+}
+
+static CK_RV
+stats_C_GetMechanismInfo(CK_SLOT_ID slot_id, CK_MECHANISM_TYPE type,
+        CK_MECHANISM_INFO_PTR info) {
+    STATS_BEGIN;
+    rv = orig.C_GetMechanismInfo(slot_id, type, info);
+    STATS_END(C_GetMechanismInfo, 0);
+}
+
+static CK_RV
+stats_C_InitToken(CK_SLOT_ID slot_id, CK_BYTE_PTR pin, CK_ULONG pin_len,
+        CK_BYTE_PTR label) {
+    STATS_BEGIN;
+    rv = orig.C_InitToken(slot_id, pin, pin_len, label);
+    STATS_END(C_InitToken, 0);
+}
+
+static CK_RV
+stats_C_InitPIN(CK_SESSION_HANDLE session, CK_BYTE_PTR pin, CK_ULONG pin_len) {
+    STATS_BEGIN;
+    rv = orig.C_InitPIN(session, pin, pin_len);
+    STATS_END(C_InitPIN, 0);
+}
+
+static CK_RV
+stats_C_SetPIN(CK_SESSION_HANDLE session, CK_BYTE_PTR old_pin,
+        CK_ULONG old_len, CK_BYTE_PTR new_pin, CK_ULONG new_len) {
+    STATS_BEGIN;
+    rv = orig.C_SetPIN(session, old_pin, old_len, new_pin, new_len);
+    STATS_END(C_SetPIN, 0);
+}
+
+static CK_RV
+stats_C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
+        CK_VOID_PTR application, CK_NOTIFY notify,
+        CK_SESSION_HANDLE_PTR session) {
+    STATS_BEGIN;
+    rv = orig.C_OpenSession(slot_id, flags, application, notify, session);
+    STATS_END(C_OpenSession, 0);
+}
+
+static CK_RV
+stats_C_CloseSession(CK_SESSION_HANDLE session) {
+    STATS_BEGIN;
+    rv = orig.C_CloseSession(session);
+    STATS_END(C_CloseSession, 0);
+}
+
+static CK_RV
+stats_C_CloseAllSessions(CK_SLOT_ID slot_id) {
+    STATS_BEGIN;
+    rv = orig.C_CloseAllSessions(slot_id);
+    STATS_END(C_CloseAllSessions, 0);
+}
+
+static CK_RV
+stats_C_GetSessionInfo(CK_SESSION_HANDLE session, CK_SESSION_INFO_PTR info) {
+    STATS_BEGIN;
+    rv = orig.C_GetSessionInfo(session, info);
+    STATS_END(C_GetSessionInfo, 0);
+}
+
+static CK_RV
+stats_C_GetOperationState(CK_SESSION_HANDLE session,
+        CK_BYTE_PTR operation_state, CK_ULONG_PTR operation_state_len) {
+    STATS_BEGIN;
+    rv = orig.C_GetOperationState(session, operation_state,
+            operation_state_len);
+    STATS_END(C_GetOperationState,
+            OUT_LEN(operation_state, operation_state_len));
+}
+
+static CK_RV
+stats_C_SetOperationState(CK_SESSION_HANDLE session,
+        CK_BYTE_PTR operation_state, CK_ULONG operation_state_len,
+        CK_OBJECT_HANDLE encryption_key, CK_OBJECT_HANDLE authentication_key) {
+    STATS_BEGIN;
+    rv = orig.C_SetOperationState(session, operation_state,
+            operation_state_len, encryption_key, authentication_key);
+    STATS_END(C_SetOperationState, operation_state_len);
+}
+
+static CK_RV
+stats_C_Login(CK_SESSION_HANDLE session, CK_USER_TYPE user_type,
+        CK_BYTE_PTR pin, CK_ULONG pin_len) {
+    STATS_BEGIN;
+    rv = orig.C_Login(session, user_type, pin, pin_len);
+    STATS_END(C_Login, 0);
+}
+
+static CK_RV
+stats_C_Logout(CK_SESSION_HANDLE session) {
+    STATS_BEGIN;
+    rv = orig.C_Logout(session);
+    STATS_END(C_Logout, 0);
+}
+
+static CK_RV
+stats_C_CreateObject(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR templ,
+        CK_ULONG count, CK_OBJECT_HANDLE_PTR object) {
+    STATS_BEGIN;
+    rv = orig.C_CreateObject(session, templ, count, object);
+    STATS_END(C_CreateObject, 0);
+}
+
+static CK_RV
+stats_C_CopyObject(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        CK_OBJECT_HANDLE_PTR new_object) {
+    STATS_BEGIN;
+    rv = orig.C_CopyObject(session, object, templ, count, new_object);
+    STATS_END(C_CopyObject, 0);
+}
+
+static CK_RV
+stats_C_DestroyObject(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object) {
+    STATS_BEGIN;
+    rv = orig.C_DestroyObject(session, object);
+    STATS_END(C_DestroyObject, 0);
+}
+
+static CK_RV
+stats_C_GetObjectSize(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        CK_ULONG_PTR size) {
+    STATS_BEGIN;
+    rv = orig.C_GetObjectSize(session, object, size);
+    STATS_END(C_GetObjectSize, 0);
+}
+
+static CK_RV
+stats_C_GetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+    STATS_BEGIN;
+    rv = orig.C_GetAttributeValue(session, object, templ, count);
+    STATS_END(C_GetAttributeValue, attribute_bytes(templ, count));
+}
+
+static CK_RV
+stats_C_SetAttributeValue(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+    STATS_BEGIN;
+    rv = orig.C_SetAttributeValue(session, object, templ, count);
+    STATS_END(C_SetAttributeValue, attribute_bytes(templ, count));
+}
+
+static CK_RV
+stats_C_FindObjectsInit(CK_SESSION_HANDLE session, CK_ATTRIBUTE_PTR templ,
+        CK_ULONG count) {
+    STATS_BEGIN;
+    rv = orig.C_FindObjectsInit(session, templ, count);
+    STATS_END(C_FindObjectsInit, 0);
+}
+
+static CK_RV
+stats_C_FindObjects(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE_PTR object,
+        CK_ULONG max_object_count, CK_ULONG_PTR object_count) {
+    STATS_BEGIN;
+    rv = orig.C_FindObjects(session, object, max_object_count, object_count);
+    STATS_END(C_FindObjects, 0);
+}
+
+static CK_RV
+stats_C_FindObjectsFinal(CK_SESSION_HANDLE session) {
+    STATS_BEGIN;
+    rv = orig.C_FindObjectsFinal(session);
+    STATS_END(C_FindObjectsFinal, 0);
+}
+
+static CK_RV
+stats_C_EncryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_EncryptInit(session, mechanism, key);
+    STATS_END(C_EncryptInit, 0);
+}
+
+static CK_RV
+stats_C_Encrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR encrypted_data, CK_ULONG_PTR encrypted_data_len) {
+    STATS_BEGIN;
+    rv = orig.C_Encrypt(session, data, data_len, encrypted_data,
+            encrypted_data_len);
+    STATS_END(C_Encrypt,
+            data_len + OUT_LEN(encrypted_data, encrypted_data_len));
+}
+
+static CK_RV
+stats_C_EncryptUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR part,
+        CK_ULONG part_len, CK_BYTE_PTR encrypted_part,
+        CK_ULONG_PTR encrypted_part_len) {
+    STATS_BEGIN;
+    rv = orig.C_EncryptUpdate(session, part, part_len, encrypted_part,
+            encrypted_part_len);
+    STATS_END(C_EncryptUpdate,
+            part_len + OUT_LEN(encrypted_part, encrypted_part_len));
+}
+
+static CK_RV
+stats_C_EncryptFinal(CK_SESSION_HANDLE session,
+        CK_BYTE_PTR last_encrypted_part, CK_ULONG_PTR last_encrypted_part_len) {
+    STATS_BEGIN;
+    rv = orig.C_EncryptFinal(session, last_encrypted_part,
+            last_encrypted_part_len);
+    STATS_END(C_EncryptFinal,
+            OUT_LEN(last_encrypted_part, last_encrypted_part_len));
+}
+
+static CK_RV
+stats_C_DecryptInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_DecryptInit(session, mechanism, key);
+    STATS_END(C_DecryptInit, 0);
+}
+
+static CK_RV
+stats_C_Decrypt(CK_SESSION_HANDLE session, CK_BYTE_PTR encrypted_data,
+        CK_ULONG encrypted_data_len, CK_BYTE_PTR data, CK_ULONG_PTR data_len) {
+    STATS_BEGIN;
+    rv = orig.C_Decrypt(session, encrypted_data, encrypted_data_len, data,
+            data_len);
+    STATS_END(C_Decrypt, encrypted_data_len + OUT_LEN(data, data_len));
+}
+
+static CK_RV
+stats_C_DecryptUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR encrypted_part,
+        CK_ULONG encrypted_part_len, CK_BYTE_PTR part, CK_ULONG_PTR part_len) {
+    STATS_BEGIN;
+    rv = orig.C_DecryptUpdate(session, encrypted_part, encrypted_part_len,
+            part, part_len);
+    STATS_END(C_DecryptUpdate, encrypted_part_len + OUT_LEN(part, part_len));
+}
+
+static CK_RV
+stats_C_DecryptFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR last_part,
+        CK_ULONG_PTR last_part_len) {
+    STATS_BEGIN;
+    rv = orig.C_DecryptFinal(session, last_part, last_part_len);
+    STATS_END(C_DecryptFinal, OUT_LEN(last_part, last_part_len));
+}
+
+static CK_RV
+stats_C_DigestInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism) {
+    STATS_BEGIN;
+    rv = orig.C_DigestInit(session, mechanism);
+    STATS_END(C_DigestInit, 0);
+}
+
+static CK_RV
+stats_C_Digest(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR digest, CK_ULONG_PTR digest_len) {
+    STATS_BEGIN;
+    rv = orig.C_Digest(session, data, data_len, digest, digest_len);
+    STATS_END(C_Digest, data_len + OUT_LEN(digest, digest_len));
+}
+
+static CK_RV
+stats_C_DigestUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR part,
+        CK_ULONG part_len) {
+    STATS_BEGIN;
+    rv = orig.C_DigestUpdate(session, part, part_len);
+    STATS_END(C_DigestUpdate, part_len);
+}
+
+static CK_RV
+stats_C_DigestKey(CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_DigestKey(session, key);
+    STATS_END(C_DigestKey, 0);
+}
+
+static CK_RV
+stats_C_DigestFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR digest,
+        CK_ULONG_PTR digest_len) {
+    STATS_BEGIN;
+    rv = orig.C_DigestFinal(session, digest, digest_len);
+    STATS_END(C_DigestFinal, OUT_LEN(digest, digest_len));
+}
+
+static CK_RV
+stats_C_SignInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_SignInit(session, mechanism, key);
+    STATS_END(C_SignInit, 0);
+}
+
+static CK_RV
+stats_C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+    STATS_BEGIN;
+    rv = orig.C_Sign(session, data, data_len, signature, signature_len);
+    STATS_END(C_Sign, data_len + OUT_LEN(signature, signature_len));
+}
+
+static CK_RV
+stats_C_SignUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR part,
+        CK_ULONG part_len) {
+    STATS_BEGIN;
+    rv = orig.C_SignUpdate(session, part, part_len);
+    STATS_END(C_SignUpdate, part_len);
+}
+
+static CK_RV
+stats_C_SignFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR signature,
+        CK_ULONG_PTR signature_len) {
+    STATS_BEGIN;
+    rv = orig.C_SignFinal(session, signature, signature_len);
+    STATS_END(C_SignFinal, OUT_LEN(signature, signature_len));
+}
+
+static CK_RV
+stats_C_SignRecoverInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_SignRecoverInit(session, mechanism, key);
+    STATS_END(C_SignRecoverInit, 0);
+}
+
+static CK_RV
+stats_C_SignRecover(CK_SESSION_HANDLE session, CK_BYTE_PTR data,
+        CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+    STATS_BEGIN;
+    rv = orig.C_SignRecover(session, data, data_len, signature, signature_len);
+    STATS_END(C_SignRecover, data_len + OUT_LEN(signature, signature_len));
+}
+
+static CK_RV
+stats_C_VerifyInit(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_VerifyInit(session, mechanism, key);
+    STATS_END(C_VerifyInit, 0);
+}
+
+static CK_RV
+stats_C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR data, CK_ULONG data_len,
+        CK_BYTE_PTR signature, CK_ULONG signature_len) {
+    STATS_BEGIN;
+    rv = orig.C_Verify(session, data, data_len, signature, signature_len);
+    STATS_END(C_Verify, data_len + signature_len);
+}
+
+static CK_RV
+stats_C_VerifyUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR part,
+        CK_ULONG part_len) {
+    STATS_BEGIN;
+    rv = orig.C_VerifyUpdate(session, part, part_len);
+    STATS_END(C_VerifyUpdate, part_len);
+}
+
+static CK_RV
+stats_C_VerifyFinal(CK_SESSION_HANDLE session, CK_BYTE_PTR signature,
+        CK_ULONG signature_len) {
+    STATS_BEGIN;
+    rv = orig.C_VerifyFinal(session, signature, signature_len);
+    STATS_END(C_VerifyFinal, signature_len);
+}
+
+static CK_RV
+stats_C_VerifyRecoverInit(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key) {
+    STATS_BEGIN;
+    rv = orig.C_VerifyRecoverInit(session, mechanism, key);
+    STATS_END(C_VerifyRecoverInit, 0);
+}
+
+static CK_RV
+stats_C_VerifyRecover(CK_SESSION_HANDLE session, CK_BYTE_PTR signature,
+        CK_ULONG signature_len, CK_BYTE_PTR data, CK_ULONG_PTR data_len) {
+    STATS_BEGIN;
+    rv = orig.C_VerifyRecover(session, signature, signature_len, data,
+            data_len);
+    STATS_END(C_VerifyRecover, signature_len + OUT_LEN(data, data_len));
+}
+
+static CK_RV
+stats_C_DigestEncryptUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR part,
+        CK_ULONG part_len, CK_BYTE_PTR encrypted_part,
+        CK_ULONG_PTR encrypted_part_len) {
+    STATS_BEGIN;
+    rv = orig.C_DigestEncryptUpdate(session, part, part_len, encrypted_part,
+            encrypted_part_len);
+    STATS_END(C_DigestEncryptUpdate,
+            part_len + OUT_LEN(encrypted_part, encrypted_part_len));
+}
+
+static CK_RV
+stats_C_DecryptDigestUpdate(CK_SESSION_HANDLE session,
+        CK_BYTE_PTR encrypted_part, CK_ULONG encrypted_part_len,
+        CK_BYTE_PTR part, CK_ULONG_PTR part_len) {
+    STATS_BEGIN;
+    rv = orig.C_DecryptDigestUpdate(session, encrypted_part,
+            encrypted_part_len, part, part_len);
+    STATS_END(C_DecryptDigestUpdate,
+            encrypted_part_len + OUT_LEN(part, part_len));
+}
+
+static CK_RV
+stats_C_SignEncryptUpdate(CK_SESSION_HANDLE session, CK_BYTE_PTR part,
+        CK_ULONG part_len, CK_BYTE_PTR encrypted_part,
+        CK_ULONG_PTR encrypted_part_len) {
+    STATS_BEGIN;
+    rv = orig.C_SignEncryptUpdate(session, part, part_len, encrypted_part,
+            encrypted_part_len);
+    STATS_END(C_SignEncryptUpdate,
+            part_len + OUT_LEN(encrypted_part, encrypted_part_len));
+}
+
+static CK_RV
+stats_C_DecryptVerifyUpdate(CK_SESSION_HANDLE session,
+        CK_BYTE_PTR encrypted_part, CK_ULONG encrypted_part_len,
+        CK_BYTE_PTR part, CK_ULONG_PTR part_len) {
+    STATS_BEGIN;
+    rv = orig.C_DecryptVerifyUpdate(session, encrypted_part,
+            encrypted_part_len, part, part_len);
+    STATS_END(C_DecryptVerifyUpdate,
+            encrypted_part_len + OUT_LEN(part, part_len));
+}
+
+static CK_RV
+stats_C_GenerateKey(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count, CK_OBJECT_HANDLE_PTR key) {
+    STATS_BEGIN;
+    rv = orig.C_GenerateKey(session, mechanism, templ, count, key);
+    STATS_END(C_GenerateKey, 0);
+}
+
+static CK_RV
+stats_C_GenerateKeyPair(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_ATTRIBUTE_PTR public_key_template,
+        CK_ULONG public_key_attribute_count,
+        CK_ATTRIBUTE_PTR private_key_template,
+        CK_ULONG private_key_attribute_count, CK_OBJECT_HANDLE_PTR public_key,
+        CK_OBJECT_HANDLE_PTR private_key) {
+    STATS_BEGIN;
+    rv = orig.C_GenerateKeyPair(session, mechanism, public_key_template,
+            public_key_attribute_count, private_key_template,
+            private_key_attribute_count, public_key, private_key);
+    STATS_END(C_GenerateKeyPair, 0);
+}
+
+static CK_RV
+stats_C_WrapKey(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE wrapping_key, CK_OBJECT_HANDLE key,
+        CK_BYTE_PTR wrapped_key, CK_ULONG_PTR wrapped_key_len) {
+    STATS_BEGIN;
+    rv = orig.C_WrapKey(session, mechanism, wrapping_key, key, wrapped_key,
+            wrapped_key_len);
+    STATS_END(C_WrapKey, OUT_LEN(wrapped_key, wrapped_key_len));
+}
+
+static CK_RV
+stats_C_UnwrapKey(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE unwrapping_key, CK_BYTE_PTR wrapped_key,
+        CK_ULONG wrapped_key_len, CK_ATTRIBUTE_PTR templ,
+        CK_ULONG attribute_count, CK_OBJECT_HANDLE_PTR key) {
+    STATS_BEGIN;
+    rv = orig.C_UnwrapKey(session, mechanism, unwrapping_key, wrapped_key,
+            wrapped_key_len, templ, attribute_count, key);
+    STATS_END(C_UnwrapKey, wrapped_key_len);
+}
+
+static CK_RV
+stats_C_DeriveKey(CK_SESSION_HANDLE session, CK_MECHANISM_PTR mechanism,
+        CK_OBJECT_HANDLE base_key, CK_ATTRIBUTE_PTR templ,
+        CK_ULONG attribute_count, CK_OBJECT_HANDLE_PTR key) {
+    STATS_BEGIN;
+    rv = orig.C_DeriveKey(session, mechanism, base_key, templ, attribute_count,
+            key);
+    STATS_END(C_DeriveKey, 0);
+}
+
+static CK_RV
+stats_C_SeedRandom(CK_SESSION_HANDLE session, CK_BYTE_PTR seed,
+        CK_ULONG seed_len) {
+    STATS_BEGIN;
+    rv = orig.C_SeedRandom(session, seed, seed_len);
+    STATS_END(C_SeedRandom, seed_len);
+}
+
+static CK_RV
+stats_C_GenerateRandom(CK_SESSION_HANDLE session, CK_BYTE_PTR random_data,
+        CK_ULONG random_len) {
+    STATS_BEGIN;
+    rv = orig.C_GenerateRandom(session, random_data, random_len);
+    STATS_END(C_GenerateRandom, random_len);
+}
+
+static CK_RV
+stats_C_GetFunctionStatus(CK_SESSION_HANDLE session) {
+    STATS_BEGIN;
+    rv = orig.C_GetFunctionStatus(session);
+    STATS_END(C_GetFunctionStatus, 0);
+}
+
+static CK_RV
+stats_C_CancelFunction(CK_SESSION_HANDLE session) {
+    STATS_BEGIN;
+    rv = orig.C_CancelFunction(session);
+    STATS_END(C_CancelFunction, 0);
+}
+
+static CK_RV
+stats_C_WaitForSlotEvent(CK_FLAGS flags, CK_SLOT_ID_PTR slot,
+        CK_VOID_PTR reserved) {
+    STATS_BEGIN;
+    rv = orig.C_WaitForSlotEvent(flags, slot, reserved);
+    STATS_END(C_WaitForSlotEvent, 0);
+}
+
+/**
+ * Return function list which collects statistics and forwards calls to module
+ *
+ * The same wrapped list is returned for repeated calls with the same module.
+ * Only one module can be wrapped, other modules are returned unchanged.
+ */
+CK_FUNCTION_LIST_PTR p11stats_wrap(CK_FUNCTION_LIST_PTR module) {
+    if (module == NULL || module == &wrapped)
+        return module;
+    if (wrapped_module != NULL)
+        return wrapped_module == module ? &wrapped : module;
+
+    orig = *module;
+    wrapped.version = module->version;
+#define X(name) wrapped.name = module->name != NULL ? stats_ ## name : NULL;
+    P11STATS_FUNCTIONS(X)
+#undef X
+    wrapped_module = module;
+    return &wrapped;
+}
+
+int p11stats_enabled(void) {
+    return wrapped_module != NULL;
+}
+
+void p11stats_reset(void) {
+    memset(counters, 0, sizeof(counters));
+}
+
+unsigned int p11stats_count(void) {
+    return P11STATS_COUNT;
+}
+
+const char *p11stats_name(unsigned int fn) {
+    if (fn >= P11STATS_COUNT)
+        return NULL;
+    return names[fn];
+}
+
+/**
+ * Fill snapshot of counters for function fn
+ *
+ * Return 0 if function was not called at all, 1 otherwise.
+ */
+int p11stats_get(unsigned int fn, p11stats_t *st) {
+    const counters_t *c;
+    uint64_t seen = 0;
+    uint64_t p50, p90, p99;
+    unsigned int i;
+
+    memset(st, 0, sizeof(*st));
+    if (fn >= P11STATS_COUNT)
+        return 0;
+    c = &counters[fn];
+    st->calls = __atomic_load_n(&c->calls, __ATOMIC_RELAXED);
+    if (st->calls == 0)
+        return 0;
+    st->errors = __atomic_load_n(&c->errors, __ATOMIC_RELAXED);
+    st->bytes = __atomic_load_n(&c->bytes, __ATOMIC_RELAXED);
+    st->total_ns = __atomic_load_n(&c->total_ns, __ATOMIC_RELAXED);
+    st->max_ns = __atomic_load_n(&c->max_ns, __ATOMIC_RELAXED);
+
+    /* nearest-rank percentiles, ranks are rounded up */
+    p50 = (st->calls * 50 + 99) / 100;
+    p90 = (st->calls * 90 + 99) / 100;
+    p99 = (st->calls * 99 + 99) / 100;
+    for (i = 0; i < P11STATS_BUCKETS && st->p99_ns == 0; i++) {
+        seen += __atomic_load_n(&c->histogram[i], __ATOMIC_RELAXED);
+        if (st->p50_ns == 0 && seen >= p50)
+            st->p50_ns = bucket_upper(i);
+        if (st->p90_ns == 0 && seen >= p90)
+            st->p90_ns = bucket_upper(i);
+        if (st->p99_ns == 0 && seen >= p99)
+            st->p99_ns = bucket_upper(i);
+    }
+    /* bucket bounds are coarser than the exact maximum */
+    if (st->p50_ns > st->max_ns)
+        st->p50_ns = st->max_ns;
+    if (st->p90_ns > st->max_ns)
+        st->p90_ns = st->max_ns;
+    if (st->p99_ns > st->max_ns)
+        st->p99_ns = st->max_ns;
+    return 1;
+}
+
+/**
+ * Copy at most max non-empty histogram buckets of function fn
+ *
+ * Return number of buckets written.
+ */
+unsigned int p11stats_histogram(unsigned int fn, p11stats_bucket_t *buckets,
+        unsigned int max) {
+    unsigned int i, n = 0;
+    uint32_t count;
+
+    if (fn >= P11STATS_COUNT)
+        return 0;
+    for (i = 0; i < P11STATS_BUCKETS && n < max; i++) {
+        count = __atomic_load_n(&counters[fn].histogram[i], __ATOMIC_RELAXED);
+        if (count == 0)
+            continue;
+        buckets[n].upper_ns = bucket_upper(i);
+        buckets[n].count = count;
+        n++;
+    }
+    return n;
+}
+
+/**
+ * Print table of called functions
+ */
+void p11stats_print(FILE *out) {
+    p11stats_t st;
+    unsigned int fn;
+
+    fprintf(out, "%-22s %8s %6s %10s %10s %10s %10s %10s %10s\n",
+            "function", "calls", "errors", "bytes", "avg_us", "p50_us",
+            "p90_us", "p99_us", "max_us");
+    for (fn = 0; fn < P11STATS_COUNT; fn++) {
+        if (!p11stats_get(fn, &st))
+            continue;
+        fprintf(out, "%-22s %8llu %6llu %10llu %10.1f %10.1f %10.1f %10.1f "
+                "%10.1f\n", names[fn], (unsigned long long) st.calls,
+                (unsigned long long) st.errors, (unsigned long long) st.bytes,
+                (double) st.total_ns / st.calls / 1e3, st.p50_ns / 1e3,
+                st.p90_ns / 1e3, st.p99_ns / 1e3, st.max_ns / 1e3);
+    }
+}
@@ -0,0 +1,130 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ p11trace.h
+
+ Recording of PKCS#11 call sequences into compact binary trace and reading
+ of the trace back (see p11replay.c).
+
+ Trace file starts with P11TRACE_MAGIC followed by 32-bit version. Every
+ record is
+
+   u32 payload length
+   u16 function index (position in CK_FUNCTION_LIST, see P11STATS_FUNCTIONS)
+   u16 reserved, 0
+   u64 return value
+   u64 start of call in ns since the trace was started
+   u64 duration in ns
+   payload: arguments, each starts with one octet of P11TRACE_ARG_* type
+
+ All integers are little-endian. Secrets never reach the trace: PINs,
+ random and signed data and sensitive attribute values are stored as
+ lengths only, wrapped keys as length and FNV-1a hash.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_TRACE_H
+#define _IPA_P11_TRACE_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include "pkcs11.h"
+
+#include "p11stats.h"
+
+#define P11TRACE_MAGIC      "P11TRACE"
+#define P11TRACE_VERSION    1
+#define P11TRACE_MAX_ARGS   8
+
+enum {
+#define X(name) P11TRACE_ ## name,
+    P11STATS_FUNCTIONS(X)
+#undef X
+    P11TRACE_FUNCTION_COUNT
+};
+
+typedef enum {
+    P11TRACE_ARG_ULONG = 1,     /* u64 value */
+    P11TRACE_ARG_REDACTED = 2,  /* u64 length of secret data */
+    P11TRACE_ARG_BLOB = 3,      /* u64 length, u64 FNV-1a hash */
+    P11TRACE_ARG_OUTPUT = 4,    /* u8 buffer present, u64 length */
+    P11TRACE_ARG_HANDLES = 5,   /* u32 count, count x u64 handle */
+    P11TRACE_ARG_MECHANISM = 6, /* u64 type, u32 length, parameter */
+    P11TRACE_ARG_TEMPLATE = 7   /* u32 count, count x attribute */
+} p11trace_arg_type_t;
+
+/* attribute in P11TRACE_ARG_TEMPLATE: u64 type, u8 kind, u64 length, value */
+typedef enum {
+    P11TRACE_ATTR_VALUE = 0,    /* value follows */
+    P11TRACE_ATTR_LENGTH = 1,   /* secret or output buffer, length only */
+    P11TRACE_ATTR_NO_BUFFER = 2 /* pValue was NULL */
+} p11trace_attr_kind_t;
+
+/**
+ * One decoded argument, pointers point into record buffer
+ */
+typedef struct {
+    p11trace_arg_type_t type;
+    uint64_t value;         /* ULONG value, mechanism type, handle count */
+    uint64_t length;        /* REDACTED, BLOB and OUTPUT length */
+    uint64_t hash;          /* BLOB hash */
+    int present;            /* OUTPUT buffer was not NULL */
+    const unsigned char *data;  /* handles, mechanism parameter, attributes */
+    uint32_t data_len;
+} p11trace_arg_t;
+
+typedef struct {
+    unsigned int function;
+    CK_RV rv;
+    uint64_t start_ns;
+    uint64_t duration_ns;
+    unsigned int arg_count;
+    p11trace_arg_t args[P11TRACE_MAX_ARGS];
+    unsigned char *buf;
+    size_t buf_size;
+} p11trace_record_t;
+
+/**
+ * One attribute decoded from P11TRACE_ARG_TEMPLATE
+ */
+typedef struct {
+    CK_ATTRIBUTE_TYPE type;
+    p11trace_attr_kind_t kind;
+    CK_ULONG length;
+    const unsigned char *value;
+} p11trace_attr_t;
+
+CK_FUNCTION_LIST_PTR p11trace_wrap(CK_FUNCTION_LIST_PTR module,
+        const char *path);
+
+int p11trace_enabled(void);
+
+void p11trace_close(void);
+
+int p11trace_open(FILE *in);
+
+int p11trace_read(FILE *in, p11trace_record_t *rec);
+
+uint64_t p11trace_handle(const p11trace_arg_t *arg, uint32_t idx);
+
+int p11trace_attr_next(const p11trace_arg_t *arg, uint32_t *offset,
+        p11trace_attr_t *attr);
+
+#endif // !_IPA_P11_TRACE_H
@@ -0,0 +1,263 @@
+#!/usr/bin/python
+# -*- coding: utf-8 -*-
+
+"""
+Microbenchmarks for P11_Helper operations
+
+Every run creates a throwaway SoftHSM token directory (unless --no-init is
+given), so results do not depend on leftovers from previous runs. Labels and
+IDs are deterministic. Results are written as JSON:
+
+{"driver": "python", "library": ..., "iterations": ..., "results": [
+    {"op": "find_keys", "token_size": 100, "iterations": 200,
+     "ops_per_sec": ..., "p50_us": ..., "p90_us": ..., "p99_us": ...,
+     "min_us": ..., "max_us": ...}, ...]}
+
+With --c-driver the C driver (bench_p11 from the top level directory)
+is run against the same token and its results are merged into the output.
+"""
+
+import argparse
+import json
+import math
+import os
+import os.path
+import shutil
+import subprocess
+import sys
+import tempfile
+import time
+
+import _ipap11helper
+from _ipap11helper import P11_Helper
+
+PIN = "1234"
+
+# (name, wrapping mechanism, what is wrapped, wrapping key)
+WRAP_CASES = [
+    ("AES_KEY_WRAP", _ipap11helper.MECH_AES_KEY_WRAP, "secret", "master"),
+    ("AES_KEY_WRAP_PAD", _ipap11helper.MECH_AES_KEY_WRAP_PAD, "private",
+     "master"),
+    ("RSA_PKCS", _ipap11helper.MECH_RSA_PKCS, "secret", "replica"),
+    ("RSA_PKCS_OAEP", _ipap11helper.MECH_RSA_PKCS_OAEP, "secret", "replica"),
+]
+
+
+def percentile(samples, p):
+    """Nearest-rank percentile of sorted samples"""
+    k = max(0, int(math.ceil(p * len(samples) / 100.0)) - 1)
+    return samples[min(k, len(samples) - 1)]
+
+
+def summarize(op, samples, **params):
+    samples = sorted(samples)
+    total = sum(samples)
+    result = {
+        "op": op,
+        "iterations": len(samples),
+        "ops_per_sec": len(samples) / total if total > 0 else None,
+        "p50_us": percentile(samples, 50) * 1e6,
+        "p90_us": percentile(samples, 90) * 1e6,
+        "p99_us": percentile(samples, 99) * 1e6,
+        "min_us": samples[0] * 1e6,
+        "max_us": samples[-1] * 1e6,
+    }
+    result.update(params)
+    return result
+
+
+def measure(func, iterations):
+    """Call func(i) iterations times, return list of durations in seconds"""
+    samples = []
+    clock = time.time
+    for i in xrange(iterations):
+        start = clock()
+        func(i)
+        samples.append(clock() - start)
+    return samples
+
+
+def init_token(token_dir):
+    """Create SoftHSM configuration and token in empty directory"""
+    conf = os.path.join(token_dir, 'softhsm2.conf')
+    with open(conf, 'w') as f:
+        f.write("directories.tokendir = %s\n" % token_dir)
+        f.write("objectstore.backend = file\n")
+    os.environ['SOFTHSM2_CONF'] = conf
+    with open(os.devnull, 'w') as devnull:
+        subprocess.check_call(['softhsm2-util', '--init-token', '--slot', '0',
+                               '--label', 'bench', '--pin', PIN,
+                               '--so-pin', PIN], stdout=devnull)
+
+
+class Bench(object):
+    def __init__(self, p11, iterations):
+        self.p11 = p11
+        self.iterations = iterations
+        self.results = []
+        self.garbage = []
+
+    def run(self, op, func, iterations=None, **params):
+        samples = measure(func, iterations or self.iterations)
+        self.results.append(summarize(op, samples, **params))
+
+    def cleanup(self):
+        for handle in self.garbage:
+            self.p11.delete_key(handle)
+        del self.garbage[:]
+
+    def bench_generate(self):
+        p11 = self.p11
+        garbage = self.garbage
+
+        def master(i):
+            garbage.append(p11.generate_master_key(
+                u"bench-mkey-%d" % i, "bench-mkey-%d" % i, key_length=16))
+        self.run("generate_master_key", master)
+        self.cleanup()
+
+        def replica(i):
+            garbage.extend(p11.generate_replica_key_pair(
+                u"bench-replica-%d" % i, "bench-replica-%d" % i))
+        # RSA key generation is slow, limit it to tenth of iterations
+        self.run("generate_replica_key_pair", replica,
+                 max(1, self.iterations / 10))
+        self.cleanup()
+
+    def bench_find(self, token_sizes):
+        p11 = self.p11
+        for size in sorted(token_sizes):
+            while len(self.garbage) < size:
+                i = len(self.garbage)
+                self.garbage.append(p11.generate_master_key(
+                    u"bench-fill-%d" % i, "bench-fill-%d" % i,
+                    key_length=16))
+            target = u"bench-fill-%d" % (size / 2)
+
+            self.run("find_keys", lambda i: p11.find_keys(
+                _ipap11helper.KEY_CLASS_SECRET_KEY, label=target),
+                token_size=size)
+            self.run("find_keys_all", lambda i: p11.find_keys(
+                _ipap11helper.KEY_CLASS_SECRET_KEY), token_size=size)
+        self.cleanup()
+
+    def bench_keys(self):
+        p11 = self.p11
+        master = p11.generate_master_key(u"bench-master", "bench-master",
+                                         key_length=16, cka_wrap=True,
+                                         cka_unwrap=True)
+        secret = p11.generate_master_key(u"bench-secret", "bench-secret",
+                                         key_length=16)
+        pub, priv = p11.generate_replica_key_pair(u"bench-replica",
+                                                  "bench-replica",
+                                                  pub_cka_wrap=True,
+                                                  priv_cka_unwrap=True,
+                                                  priv_cka_extractable=True)
+        keys = {"master": master, "secret": secret, "private": priv,
+                "replica": pub}
+        unwrapping = {"master": master, "replica": priv}
+
+        self.run("get_attribute",
+                 lambda i: p11.get_attribute(pub, _ipap11helper.CKA_LABEL))
+        self.run("get_attribute_modulus",
+                 lambda i: p11.get_attribute(pub, _ipap11helper.CKA_MODULUS))
+
+        self.run("export_public_key", lambda i: p11.export_public_key(pub))
+        spki = p11.export_public_key(pub)
+        imported = []
+        self.run("import_public_key", lambda i: imported.append(
+            p11.import_public_key(u"bench-import-%d" % i,
+                                  "bench-import-%d" % i, spki)))
+        self.garbage.extend(imported)
+        self.cleanup()
+
+        for name, mech, wrapped, wrapping in WRAP_CASES:
+            self.run("export_wrapped_key",
+                     lambda i: p11.export_wrapped_key(keys[wrapped],
+                                                      keys[wrapping], mech),
+                     mech=name)
+            blob = p11.export_wrapped_key(keys[wrapped], keys[wrapping], mech)
+            imported = []
+            if wrapped == "private":
+                self.run("import_wrapped_private_key",
+                         lambda i: imported.append(
+                             p11.import_wrapped_private_key(
+                                 u"bench-unwrap-%d" % i,
+                                 "bench-unwrap-%s-%d" % (name, i), blob,
+                                 unwrapping[wrapping], mech,
+                                 _ipap11helper.KEY_TYPE_RSA)),
+                         mech=name)
+            else:
+                self.run("import_wrapped_secret_key",
+                         lambda i: imported.append(
+                             p11.import_wrapped_secret_key(
+                                 u"bench-unwrap-%d" % i,
+                                 "bench-unwrap-%s-%d" % (name, i), blob,
+                                 unwrapping[wrapping], mech,
+                                 _ipap11helper.KEY_TYPE_AES)),
+                         mech=name)
+            self.garbage.extend(imported)
+            self.cleanup()
+
+        self.garbage.extend([master, secret, pub, priv])
+        self.cleanup()
+
+
+def main():
+    parser = argparse.ArgumentParser(description=__doc__.split('\n')[1])
+    parser.add_argument('--library',
+                        default='/usr/lib64/pkcs11/libsofthsm2.so')
+    parser.add_argument('--slot', type=int, default=0)
+    parser.add_argument('--iterations', type=int, default=100)
+    parser.add_argument('--token-sizes', default='10,100,1000',
+                        help='comma separated numbers of objects on token '
+                             'for find_keys')
+    parser.add_argument('--output', help='JSON output file, default stdout')
+    parser.add_argument('--no-init', action='store_true',
+                        help='use existing token instead of throwaway one')
+    parser.add_argument('--keep', action='store_true',
+                        help='do not remove throwaway token directory')
+    parser.add_argument('--c-driver',
+                        help='path to bench_p11 binary to run as well')
+    args = parser.parse_args()
+    token_sizes = [int(s) for s in args.token_sizes.split(',') if s]
+
+    token_dir = None
+    if not args.no_init:
+        token_dir = tempfile.mkdtemp(prefix='p11bench-')
+        init_token(token_dir)
+
+    try:
+        p11 = P11_Helper(args.slot, PIN, args.library)
+        bench = Bench(p11, args.iterations)
+        bench.bench_generate()
+        bench.bench_find(token_sizes)
+        bench.bench_keys()
+        p11.finalize()
+
+        output = {
+            "driver": "python",
+            "library": args.library,
+            "iterations": args.iterations,
+            "token_sizes": token_sizes,
+            "results": bench.results,
+        }
+        if args.c_driver:
+            out = subprocess.check_output([args.c_driver,
+                                           str(args.iterations),
+                                           args.token_sizes])
+            output["c_driver"] = json.loads(out)
+    finally:
+        if token_dir is not None and not args.keep:
+            shutil.rmtree(token_dir)
+
+    text = json.dumps(output, indent=2, sort_keys=True)
+    if args.output:
+        with open(args.output, 'w') as f:
+            f.write(text + '\n')
+    else:
+        print text
+
+
+if __name__ == '__main__':
+    sys.exit(main())
@@ -0,0 +1,129 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+/*****************************************************************************
+ dnskey.c
+
+ DNSKEY RDATA of RSA keys (RFC 4034, RFC 3110)
+ *****************************************************************************/
+
+#include "dnskey.h"
+
+#include <string.h>
+
+/**
+ * Convert name in presentation format to canonical wire format
+ *
+ * Letters are lowercased as DS digests require (RFC 4034 section 6.2).
+ * The trailing dot is optional, "." is the root. Escapes are not
+ * supported.
+ *
+ * :param out: buffer of DNSKEY_NAME_MAX bytes
+ * :return: 0 on success, -1 if name is not valid
+ */
+int dnskey_name_to_wire(const char *name, size_t len, CK_BYTE *out,
+        size_t *out_len) {
+    size_t pos = 0;
+    size_t start;
+    size_t i;
+
+    if (len == 1 && name[0] == '.')
+        len = 0;
+    else if (len > 0 && name[len - 1] == '.')
+        len--;
+
+    i = 0;
+    while (i < len) {
+        start = i;
+        while (i < len && name[i] != '.') {
+            if (name[i] == '\\')
+                return -1;
+            i++;
+        }
+        if (i == start || i - start > 63
+                || pos + 1 + (i - start) + 1 > DNSKEY_NAME_MAX)
+            return -1;
+        out[pos++] = (CK_BYTE) (i - start);
+        for (; start < i; start++) {
+            char c = name[start];
+
+            out[pos++] = (CK_BYTE) (c >= 'A' && c <= 'Z' ? c - 'A' + 'a' : c);
+        }
+        /* skip dot, but "a." with dot removed above must not end here */
+        if (i < len && ++i == len)
+            return -1;
+    }
+    out[pos++] = 0;
+    *out_len = pos;
+    return 0;
+}
+
+/**
+ * Build DNSKEY RDATA with RSA public key in RFC 3110 format
+ *
+ * Leading zero octets of the big integers are dropped.
+ *
+ * :param out: buffer of DNSKEY_RDATA_MAX bytes, exponent and modulus must
+ *             not be longer than DNSKEY_EXPONENT_MAX and DNSKEY_MODULUS_MAX
+ * :return: length of RDATA
+ */
+size_t dnskey_rsa_rdata(uint16_t flags, uint8_t algorithm,
+        const CK_BYTE *exponent, CK_ULONG exponent_len,
+        const CK_BYTE *modulus, CK_ULONG modulus_len, CK_BYTE *out) {
+    size_t pos = 0;
+
+    while (exponent_len > 1 && exponent[0] == 0) {
+        exponent++;
+        exponent_len--;
+    }
+    while (modulus_len > 1 && modulus[0] == 0) {
+        modulus++;
+        modulus_len--;
+    }
+
+    out[pos++] = flags >> 8;
+    out[pos++] = flags & 0xff;
+    out[pos++] = 3; /* protocol */
+    out[pos++] = algorithm;
+    if (exponent_len <= 255) {
+        out[pos++] = (CK_BYTE) exponent_len;
+    } else {
+        out[pos++] = 0;
+        out[pos++] = (CK_BYTE) (exponent_len >> 8);
+        out[pos++] = (CK_BYTE) (exponent_len & 0xff);
+    }
+    memcpy(out + pos, exponent, exponent_len);
+    pos += exponent_len;
+    memcpy(out + pos, modulus, modulus_len);
+    return pos + modulus_len;
+}
+
+/**
+ * Key tag as in RFC 4034 appendix B
+ *
+ * Not valid for algorithm 1 (RSA/MD5) which uses a different definition.
+ */
+uint16_t dnskey_key_tag(const CK_BYTE *rdata, size_t len) {
+    uint32_t ac = 0;
+    size_t i;
+
+    for (i = 0; i < len; i++)
+        ac += (i & 1) ? rdata[i] : (uint32_t) rdata[i] << 8;
+    ac += (ac >> 16) & 0xffff;
+    return ac & 0xffff;
+}
@@ -0,0 +1,55 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+/*****************************************************************************
+ dnskey.h
+
+ DNSKEY RDATA of RSA keys (RFC 4034, RFC 3110)
+
+ RDATA is built directly from CKA_MODULUS and CKA_PUBLIC_EXPONENT, so keys
+ can be published without going through SubjectPublicKeyInfo. DS digests
+ are computed over owner name in wire format followed by the RDATA; the
+ digest itself is left to the caller (the token does it).
+ *****************************************************************************/
+
+#ifndef _IPA_P11_DNSKEY_H
+#define _IPA_P11_DNSKEY_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <p11-kit/pkcs11.h>
+
+#define DNSKEY_NAME_MAX      255
+#define DNSKEY_EXPONENT_MAX  256
+#define DNSKEY_MODULUS_MAX   1024   /* 8192 bit keys */
+/* flags, protocol, algorithm, exponent length, exponent, modulus */
+#define DNSKEY_RDATA_MAX     (4 + 3 + DNSKEY_EXPONENT_MAX + DNSKEY_MODULUS_MAX)
+
+#define DNSKEY_FLAG_ZONE     0x0100
+#define DNSKEY_FLAG_SEP      0x0001
+
+int dnskey_name_to_wire(const char *name, size_t len, CK_BYTE *out,
+        size_t *out_len);
+
+size_t dnskey_rsa_rdata(uint16_t flags, uint8_t algorithm,
+        const CK_BYTE *exponent, CK_ULONG exponent_len,
+        const CK_BYTE *modulus, CK_ULONG modulus_len, CK_BYTE *out);
+
+uint16_t dnskey_key_tag(const CK_BYTE *rdata, size_t len);
+
+#endif // !_IPA_P11_DNSKEY_H
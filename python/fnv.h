@@ -0,0 +1,57 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ fnv.h
+
+ 64-bit FNV-1a hash (http://www.isthe.com/chongo/tech/comp/fnv/)
+
+ Used to identify binary blobs (e.g. wrapped keys) without storing them.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_FNV_H
+#define _IPA_P11_FNV_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define FNV64_OFFSET_BASIS  0xcbf29ce484222325ULL
+#define FNV64_PRIME         0x100000001b3ULL
+
+/**
+ * Continue FNV-1a hash h over len octets of data
+ *
+ * Start with h = FNV64_OFFSET_BASIS.
+ */
+static inline uint64_t fnv1a64_update(uint64_t h, const void *data,
+        size_t len) {
+    const unsigned char *p = data;
+
+    while (len-- > 0) {
+        h ^= *p++;
+        h *= FNV64_PRIME;
+    }
+    return h;
+}
+
+static inline uint64_t fnv1a64(const void *data, size_t len) {
+    return fnv1a64_update(FNV64_OFFSET_BASIS, data, len);
+}
+
+#endif // !_IPA_P11_FNV_H
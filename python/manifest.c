@@ -0,0 +1,434 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ manifest.c
+
+ Token manifest
+
+ Each object costs one C_GetAttributeValue call with fixed buffers; only
+ CKA_ID and CKA_LABEL longer than the buffers need a second one.
+
+ File format (native byte order, the file is local to the host):
+   "IPAMF001" | u64 count
+   { u64 handle | u64 class | u64 key_type | u64 digest | u64 id_len |
+     u64 label_len | id | label }*
+ *****************************************************************************/
+
+#include "manifest.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "fnv.h"
+
+#define MANIFEST_MAGIC      "IPAMF001"
+#define MANIFEST_MAX_FIELD  (64 * 1024)
+#define MANIFEST_BATCH      64
+
+void manifest_init(manifest_t *m) {
+    memset(m, 0, sizeof(*m));
+}
+
+void manifest_free(manifest_t *m) {
+    size_t i;
+
+    for (i = 0; i < m->count; i++)
+        free(m->entries[i].id);
+    free(m->entries);
+    manifest_init(m);
+}
+
+static manifest_entry_t *new_entry(manifest_t *m) {
+    manifest_entry_t *tmp;
+    size_t allocated;
+
+    if (m->count == m->allocated) {
+        allocated = m->allocated ? m->allocated * 2 : 64;
+        tmp = realloc(m->entries, allocated * sizeof(manifest_entry_t));
+        if (tmp == NULL)
+            return NULL;
+        m->entries = tmp;
+        m->allocated = allocated;
+    }
+    tmp = &m->entries[m->count];
+    memset(tmp, 0, sizeof(*tmp));
+    return tmp;
+}
+
+/**
+ * Copy CKA_ID and CKA_LABEL to one buffer owned by entry
+ */
+static CK_RV set_names(manifest_entry_t *e, const void *id, CK_ULONG id_len,
+        const void *label, CK_ULONG label_len) {
+    e->id = malloc(id_len + label_len + 1);
+    if (e->id == NULL)
+        return CKR_HOST_MEMORY;
+    memcpy(e->id, id, id_len);
+    memcpy(e->id + id_len, label, label_len);
+    e->id_len = id_len;
+    e->label = e->id + id_len;
+    e->label_len = label_len;
+    return CKR_OK;
+}
+
+/**
+ * CKA_ID and CKA_LABEL which did not fit to the buffers
+ */
+static CK_RV read_long_names(CK_FUNCTION_LIST_PTR p11,
+        CK_SESSION_HANDLE session, CK_OBJECT_HANDLE object,
+        manifest_entry_t *e) {
+    CK_ATTRIBUTE names[] = { { CKA_ID, NULL, 0 }, { CKA_LABEL, NULL, 0 } };
+    CK_BYTE *buf;
+    CK_RV rv;
+    unsigned int i;
+
+    p11->C_GetAttributeValue(session, object, names, 2);
+    for (i = 0; i < 2; i++) {
+        if (names[i].ulValueLen == (CK_ULONG) -1)
+            names[i].ulValueLen = 0;
+        if (names[i].ulValueLen > MANIFEST_MAX_FIELD)
+            return CKR_ATTRIBUTE_VALUE_INVALID;
+    }
+    buf = malloc(names[0].ulValueLen + names[1].ulValueLen + 1);
+    if (buf == NULL)
+        return CKR_HOST_MEMORY;
+    names[0].pValue = buf;
+    names[1].pValue = buf + names[0].ulValueLen;
+    rv = p11->C_GetAttributeValue(session, object, names, 2);
+    if (rv == CKR_OK) {
+        e->id = buf;
+        e->id_len = names[0].ulValueLen;
+        e->label = buf + e->id_len;
+        e->label_len = names[1].ulValueLen;
+    } else {
+        free(buf);
+    }
+    return rv;
+}
+
+/**
+ * Read attributes of one object into entry
+ */
+static CK_RV read_entry(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object, manifest_entry_t *e) {
+    CK_BYTE id[256];
+    CK_BYTE label[256];
+    CK_ULONG value_len;
+    CK_BYTE modulus[1024];
+    CK_BYTE public_exponent[16];
+    CK_BYTE ec_params[32];
+    CK_BYTE ec_point[160];
+    CK_BYTE check_value[16];
+    CK_BBOOL flags[14];
+    CK_ATTRIBUTE template[] = {
+            { CKA_CLASS, &e->key_class, sizeof(e->key_class) },
+            { CKA_KEY_TYPE, &e->key_type, sizeof(e->key_type) },
+            { CKA_ID, id, sizeof(id) },
+            { CKA_LABEL, label, sizeof(label) },
+            /* digested */
+            { CKA_VALUE_LEN, &value_len, sizeof(value_len) },
+            { CKA_MODULUS, modulus, sizeof(modulus) },
+            { CKA_PUBLIC_EXPONENT, public_exponent, sizeof(public_exponent) },
+            { CKA_EC_PARAMS, ec_params, sizeof(ec_params) },
+            { CKA_EC_POINT, ec_point, sizeof(ec_point) },
+            { CKA_CHECK_VALUE, check_value, sizeof(check_value) },
+            { CKA_PRIVATE, &flags[0], sizeof(CK_BBOOL) },
+            { CKA_MODIFIABLE, &flags[1], sizeof(CK_BBOOL) },
+            { CKA_COPYABLE, &flags[2], sizeof(CK_BBOOL) },
+            { CKA_SENSITIVE, &flags[3], sizeof(CK_BBOOL) },
+            { CKA_EXTRACTABLE, &flags[4], sizeof(CK_BBOOL) },
+            { CKA_ENCRYPT, &flags[5], sizeof(CK_BBOOL) },
+            { CKA_DECRYPT, &flags[6], sizeof(CK_BBOOL) },
+            { CKA_WRAP, &flags[7], sizeof(CK_BBOOL) },
+            { CKA_UNWRAP, &flags[8], sizeof(CK_BBOOL) },
+            { CKA_SIGN, &flags[9], sizeof(CK_BBOOL) },
+            { CKA_VERIFY, &flags[10], sizeof(CK_BBOOL) },
+            { CKA_DERIVE, &flags[11], sizeof(CK_BBOOL) },
+            { CKA_TRUSTED, &flags[12], sizeof(CK_BBOOL) },
+            { CKA_WRAP_WITH_TRUSTED, &flags[13], sizeof(CK_BBOOL) } };
+    const unsigned int count = sizeof(template) / sizeof(CK_ATTRIBUTE);
+    const unsigned int digested = 4;
+    unsigned int i;
+    uint64_t h;
+    CK_RV rv;
+
+    e->handle = object;
+    rv = p11->C_GetAttributeValue(session, object, template, count);
+    if (rv != CKR_OK && rv != CKR_ATTRIBUTE_TYPE_INVALID
+            && rv != CKR_ATTRIBUTE_SENSITIVE && rv != CKR_BUFFER_TOO_SMALL)
+        return rv;
+    if (template[0].ulValueLen == (CK_ULONG) -1)
+        return CKR_GENERAL_ERROR;
+    if (template[1].ulValueLen == (CK_ULONG) -1)
+        e->key_type = MANIFEST_NO_KEY_TYPE;
+
+    if (template[2].ulValueLen == (CK_ULONG) -1
+            || template[3].ulValueLen == (CK_ULONG) -1)
+        rv = read_long_names(p11, session, object, e);
+    else
+        rv = set_names(e, id, template[2].ulValueLen, label,
+                template[3].ulValueLen);
+    if (rv != CKR_OK)
+        return rv;
+
+    h = fnv1a64(&e->key_class, sizeof(e->key_class));
+    h = fnv1a64_update(h, &e->key_type, sizeof(e->key_type));
+    h = fnv1a64_update(h, &e->id_len, sizeof(e->id_len));
+    h = fnv1a64_update(h, e->id, e->id_len);
+    h = fnv1a64_update(h, &e->label_len, sizeof(e->label_len));
+    h = fnv1a64_update(h, e->label, e->label_len);
+    for (i = digested; i < count; i++) {
+        if (template[i].ulValueLen == (CK_ULONG) -1)
+            continue;
+        h = fnv1a64_update(h, &template[i].type, sizeof(template[i].type));
+        h = fnv1a64_update(h, &template[i].ulValueLen,
+                sizeof(template[i].ulValueLen));
+        h = fnv1a64_update(h, template[i].pValue, template[i].ulValueLen);
+    }
+    e->digest = h;
+    return CKR_OK;
+}
+
+/**
+ * Add all token objects visible in session, handle_base is ORed to handles
+ *
+ * Session objects are left out, they are private to the process. Objects
+ * destroyed while the manifest is built are skipped.
+ */
+CK_RV manifest_add_session(manifest_t *m, CK_FUNCTION_LIST_PTR p11,
+        CK_SESSION_HANDLE session, CK_OBJECT_HANDLE handle_base) {
+    CK_OBJECT_HANDLE objects[MANIFEST_BATCH];
+    CK_ULONG found = 0;
+    CK_ULONG i;
+    manifest_entry_t *e;
+    CK_BBOOL token = CK_TRUE;
+    CK_ATTRIBUTE template[] = { { CKA_TOKEN, &token, sizeof(token) } };
+    CK_RV rv;
+
+    rv = p11->C_FindObjectsInit(session, template, 1);
+    if (rv != CKR_OK)
+        return rv;
+    do {
+        rv = p11->C_FindObjects(session, objects, MANIFEST_BATCH, &found);
+        for (i = 0; rv == CKR_OK && i < found; i++) {
+            e = new_entry(m);
+            if (e == NULL) {
+                rv = CKR_HOST_MEMORY;
+                break;
+            }
+            rv = read_entry(p11, session, objects[i], e);
+            if (rv == CKR_OBJECT_HANDLE_INVALID) {
+                free(e->id);
+                rv = CKR_OK;
+                continue;
+            }
+            if (rv != CKR_OK) {
+                free(e->id);
+                break;
+            }
+            e->handle |= handle_base;
+            m->count++;
+        }
+    } while (rv == CKR_OK && found == MANIFEST_BATCH);
+    p11->C_FindObjectsFinal(session);
+    return rv;
+}
+
+static int cmp_bytes(const CK_BYTE *a, CK_ULONG a_len, const CK_BYTE *b,
+        CK_ULONG b_len) {
+    int r = memcmp(a, b, a_len < b_len ? a_len : b_len);
+
+    if (r != 0)
+        return r;
+    return (a_len > b_len) - (a_len < b_len);
+}
+
+/**
+ * Compare identity of objects, (class, CKA_ID)
+ */
+static int cmp_identity(const manifest_entry_t *a, const manifest_entry_t *b) {
+    if (a->key_class != b->key_class)
+        return a->key_class < b->key_class ? -1 : 1;
+    return cmp_bytes(a->id, a->id_len, b->id, b->id_len);
+}
+
+static int cmp_entry(const void *a, const void *b) {
+    const manifest_entry_t *x = a;
+    const manifest_entry_t *y = b;
+    int r = cmp_identity(x, y);
+
+    if (r != 0)
+        return r;
+    return (x->handle > y->handle) - (x->handle < y->handle);
+}
+
+void manifest_sort(manifest_t *m) {
+    qsort(m->entries, m->count, sizeof(manifest_entry_t), cmp_entry);
+}
+
+/**
+ * Report differences between sorted manifests
+ *
+ * Objects are matched by class and CKA_ID; objects sharing both are paired
+ * in handle order. Matched objects with different digest are changed.
+ *
+ * :return: 0, or nonzero value returned by callback
+ */
+int manifest_diff(const manifest_t *old_m, const manifest_t *new_m,
+        manifest_diff_cb cb, void *ctx) {
+    size_t i = 0;
+    size_t j = 0;
+    int r = 0;
+    int c;
+
+    while (r == 0 && (i < old_m->count || j < new_m->count)) {
+        if (i == old_m->count)
+            c = 1;
+        else if (j == new_m->count)
+            c = -1;
+        else
+            c = cmp_identity(&old_m->entries[i], &new_m->entries[j]);
+
+        if (c < 0) {
+            r = cb(MANIFEST_REMOVED, &old_m->entries[i++], NULL, ctx);
+        } else if (c > 0) {
+            r = cb(MANIFEST_ADDED, NULL, &new_m->entries[j++], ctx);
+        } else {
+            if (old_m->entries[i].digest != new_m->entries[j].digest)
+                r = cb(MANIFEST_CHANGED, &old_m->entries[i],
+                        &new_m->entries[j], ctx);
+            i++;
+            j++;
+        }
+    }
+    return r;
+}
+
+/**
+ * Read manifest written by manifest_save()
+ *
+ * Missing file gives empty manifest. Damaged file is an error and leaves
+ * the manifest empty.
+ */
+CK_RV manifest_load(manifest_t *m, const char *path) {
+    FILE *f;
+    char magic[sizeof(MANIFEST_MAGIC) - 1];
+    uint64_t count;
+    uint64_t rec[6];
+    manifest_entry_t *e;
+    CK_RV rv = CKR_OK;
+
+    manifest_init(m);
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return errno == ENOENT ? CKR_OK : CKR_GENERAL_ERROR;
+
+    if (fread(magic, sizeof(magic), 1, f) != 1
+            || memcmp(magic, MANIFEST_MAGIC, sizeof(magic)) != 0
+            || fread(&count, sizeof(count), 1, f) != 1) {
+        rv = CKR_DATA_INVALID;
+        goto done;
+    }
+    while (count-- > 0) {
+        if (fread(rec, sizeof(rec), 1, f) != 1 || rec[4] > MANIFEST_MAX_FIELD
+                || rec[5] > MANIFEST_MAX_FIELD) {
+            rv = CKR_DATA_INVALID;
+            break;
+        }
+        e = new_entry(m);
+        if (e == NULL) {
+            rv = CKR_HOST_MEMORY;
+            break;
+        }
+        e->handle = rec[0];
+        e->key_class = rec[1];
+        e->key_type = rec[2];
+        e->digest = rec[3];
+        e->id = malloc(rec[4] + rec[5] + 1);
+        if (e->id == NULL) {
+            rv = CKR_HOST_MEMORY;
+            break;
+        }
+        if (fread(e->id, 1, rec[4] + rec[5], f) != rec[4] + rec[5]) {
+            free(e->id);
+            rv = CKR_DATA_INVALID;
+            break;
+        }
+        e->id_len = rec[4];
+        e->label = e->id + e->id_len;
+        e->label_len = rec[5];
+        m->count++;
+    }
+
+done:
+    fclose(f);
+    if (rv != CKR_OK)
+        manifest_free(m);
+    return rv;
+}
+
+/**
+ * Write manifest to temporary file and rename it over path
+ */
+CK_RV manifest_save(const manifest_t *m, const char *path) {
+    FILE *f;
+    char *tmp;
+    const manifest_entry_t *e;
+    uint64_t count = m->count;
+    uint64_t rec[6];
+    size_t i;
+    int ok;
+
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp == NULL)
+        return CKR_HOST_MEMORY;
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+
+    f = fopen(tmp, "wb");
+    if (f == NULL) {
+        free(tmp);
+        return CKR_GENERAL_ERROR;
+    }
+    ok = fwrite(MANIFEST_MAGIC, sizeof(MANIFEST_MAGIC) - 1, 1, f) == 1
+            && fwrite(&count, sizeof(count), 1, f) == 1;
+    for (i = 0; ok && i < m->count; i++) {
+        e = &m->entries[i];
+        rec[0] = e->handle;
+        rec[1] = e->key_class;
+        rec[2] = e->key_type;
+        rec[3] = e->digest;
+        rec[4] = e->id_len;
+        rec[5] = e->label_len;
+        ok = fwrite(rec, sizeof(rec), 1, f) == 1
+                && fwrite(e->id, 1, e->id_len + e->label_len, f)
+                        == e->id_len + e->label_len;
+    }
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmp, path) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmp);
+    free(tmp);
+    return ok ? CKR_OK : CKR_GENERAL_ERROR;
+}
@@ -0,0 +1,89 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ manifest.h
+
+ Token manifest
+
+ One compact record per token object: handle, class, key type, CKA_ID,
+ CKA_LABEL and 64-bit digest of all public attributes. Records are sorted
+ by (class, CKA_ID, handle), so two manifests are compared with one merge
+ pass and synchronization only has to look at objects which were added,
+ removed or changed since the previous manifest.
+
+ Only attributes which can be read from any object are digested; secret
+ values (CKA_VALUE, private exponents) never are.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_MANIFEST_H
+#define _IPA_P11_MANIFEST_H
+
+#include <stdint.h>
+#include <p11-kit/pkcs11.h>
+
+/* key_type of objects which are not keys */
+#define MANIFEST_NO_KEY_TYPE ((CK_KEY_TYPE) -1)
+
+typedef struct {
+    CK_OBJECT_HANDLE handle;
+    CK_OBJECT_CLASS key_class;
+    CK_KEY_TYPE key_type;
+    uint64_t digest;
+    CK_BYTE *id;            /* id_len bytes followed by label_len bytes */
+    CK_ULONG id_len;
+    CK_BYTE *label;         /* points into id buffer */
+    CK_ULONG label_len;
+} manifest_entry_t;
+
+typedef struct {
+    manifest_entry_t *entries;
+    size_t count;
+    size_t allocated;
+} manifest_t;
+
+typedef enum {
+    MANIFEST_ADDED, MANIFEST_REMOVED, MANIFEST_CHANGED
+} manifest_change_t;
+
+/**
+ * Called by manifest_diff() for every difference, old or new entry is NULL
+ * for added and removed objects. Nonzero return stops the diff.
+ */
+typedef int (*manifest_diff_cb)(manifest_change_t change,
+        const manifest_entry_t *old_entry, const manifest_entry_t *new_entry,
+        void *ctx);
+
+void manifest_init(manifest_t *m);
+
+void manifest_free(manifest_t *m);
+
+CK_RV manifest_add_session(manifest_t *m, CK_FUNCTION_LIST_PTR p11,
+        CK_SESSION_HANDLE session, CK_OBJECT_HANDLE handle_base);
+
+void manifest_sort(manifest_t *m);
+
+int manifest_diff(const manifest_t *old_m, const manifest_t *new_m,
+        manifest_diff_cb cb, void *ctx);
+
+CK_RV manifest_load(manifest_t *m, const char *path);
+
+CK_RV manifest_save(const manifest_t *m, const char *path);
+
+#endif // !_IPA_P11_MANIFEST_H
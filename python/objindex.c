@@ -0,0 +1,257 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ objindex.c
+
+ Object index file
+
+ File layout (native byte order, the file is local to the host):
+   header | objindex_entry_t[count]
+ Entries are sorted by (class, CKA_ID, handle) as in manifest_sort(), so
+ lookups by class and ID are binary searches.
+ *****************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include "objindex.h"
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#define OBJINDEX_MAGIC      "IPAOI001"
+
+struct objindex_header {
+    char magic[8];
+    uint32_t version;
+    uint32_t count;
+    uint64_t tokens;        /* hash of tokens the entries come from */
+    uint64_t entry_size;    /* sizeof(objindex_entry_t) of the writer */
+};
+
+/**
+ * Write index of sorted manifest
+ *
+ * Objects with ID or label too long to be indexed are left out, lookups
+ * which the index cannot answer go to the token anyway.
+ *
+ * :return: CKR_ATTRIBUTE_VALUE_INVALID if there are too many objects,
+ *          CKR_GENERAL_ERROR if the file cannot be written
+ */
+CK_RV objindex_write(const char *path, uint64_t tokens, const manifest_t *m) {
+    objindex_header_t h;
+    objindex_entry_t e;
+    const manifest_entry_t *me;
+    FILE *f;
+    char *tmp;
+    size_t i;
+    size_t count = 0;
+    int ok;
+
+    for (i = 0; i < m->count; i++) {
+        if (m->entries[i].id_len <= OBJINDEX_MAX_ID
+                && m->entries[i].label_len <= OBJINDEX_MAX_LABEL)
+            count++;
+    }
+    if (count > UINT32_MAX)
+        return CKR_ATTRIBUTE_VALUE_INVALID;
+
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp == NULL)
+        return CKR_HOST_MEMORY;
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+    f = fopen(tmp, "wb");
+    if (f == NULL) {
+        free(tmp);
+        return CKR_GENERAL_ERROR;
+    }
+
+    memset(&h, 0, sizeof(h));
+    memcpy(h.magic, OBJINDEX_MAGIC, sizeof(h.magic));
+    h.version = OBJINDEX_VERSION;
+    h.count = (uint32_t) count;
+    h.tokens = tokens;
+    h.entry_size = sizeof(objindex_entry_t);
+    ok = fwrite(&h, sizeof(h), 1, f) == 1;
+    for (i = 0; ok && i < m->count; i++) {
+        me = &m->entries[i];
+        if (me->id_len > OBJINDEX_MAX_ID || me->label_len > OBJINDEX_MAX_LABEL)
+            continue;
+        memset(&e, 0, sizeof(e));
+        e.handle = me->handle;
+        e.key_class = me->key_class;
+        e.key_type = me->key_type;
+        e.id_len = me->id_len;
+        memcpy(e.id, me->id, me->id_len);
+        e.label_len = me->label_len;
+        memcpy(e.label, me->label, me->label_len);
+        ok = fwrite(&e, sizeof(e), 1, f) == 1;
+    }
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmp, path) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmp);
+    free(tmp);
+    return ok ? CKR_OK : CKR_GENERAL_ERROR;
+}
+
+/**
+ * Map index file written for the same tokens
+ *
+ * :return: CKR_OK, CKR_DATA_INVALID if the file is missing, damaged, of
+ *          other version or written for other tokens
+ */
+CK_RV objindex_load(objindex_t *idx, const char *path, uint64_t tokens) {
+    const objindex_header_t *h;
+    struct stat st;
+    void *map;
+    int fd;
+
+    memset(idx, 0, sizeof(*idx));
+    fd = open(path, O_RDONLY);
+    if (fd < 0)
+        return CKR_DATA_INVALID;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(*h)) {
+        close(fd);
+        return CKR_DATA_INVALID;
+    }
+    map = mmap(NULL, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (map == MAP_FAILED)
+        return CKR_DATA_INVALID;
+
+    h = map;
+    if (memcmp(h->magic, OBJINDEX_MAGIC, sizeof(h->magic)) != 0
+            || h->version != OBJINDEX_VERSION
+            || h->entry_size != sizeof(objindex_entry_t)
+            || h->tokens != tokens
+            || (size_t) st.st_size
+                    != sizeof(*h) + h->count * sizeof(objindex_entry_t)) {
+        munmap(map, st.st_size);
+        return CKR_DATA_INVALID;
+    }
+    idx->header = h;
+    idx->entries = (const objindex_entry_t *) (h + 1);
+    idx->count = h->count;
+    idx->map_len = st.st_size;
+    idx->dev = st.st_dev;
+    idx->ino = st.st_ino;
+    return CKR_OK;
+}
+
+void objindex_close(objindex_t *idx) {
+    if (idx->header != NULL)
+        munmap((void *) idx->header, idx->map_len);
+    memset(idx, 0, sizeof(*idx));
+}
+
+/**
+ * Test if path was replaced or removed since objindex_load()
+ */
+int objindex_stale(const objindex_t *idx, const char *path) {
+    struct stat st;
+
+    return stat(path, &st) != 0 || st.st_dev != idx->dev
+            || st.st_ino != idx->ino;
+}
+
+/**
+ * Entry i of n spread evenly over the index, for spot checks
+ *
+ * :return: NULL if the index has no entries
+ */
+const objindex_entry_t *objindex_sample(const objindex_t *idx,
+        unsigned int i, unsigned int n) {
+    if (idx->count == 0 || n == 0)
+        return NULL;
+    if (n == 1)
+        return &idx->entries[0];
+    return &idx->entries[(uint64_t) (idx->count - 1) * i / (n - 1)];
+}
+
+static int cmp_key(const objindex_entry_t *e, CK_OBJECT_CLASS key_class,
+        const CK_BYTE *id, CK_ULONG id_len) {
+    int r;
+
+    if (e->key_class != key_class)
+        return e->key_class < key_class ? -1 : 1;
+    r = memcmp(e->id, id, e->id_len < id_len ? e->id_len : id_len);
+    if (r != 0)
+        return r;
+    return (e->id_len > id_len) - (e->id_len < id_len);
+}
+
+static int entry_matches(const objindex_entry_t *e, CK_OBJECT_CLASS key_class,
+        const CK_BYTE *id, CK_ULONG id_len, const CK_BYTE *label,
+        CK_ULONG label_len) {
+    return (key_class == OBJINDEX_ANY_CLASS || e->key_class == key_class)
+            && (id == NULL || (e->id_len == id_len
+                    && memcmp(e->id, id, id_len) == 0))
+            && (label == NULL || (e->label_len == label_len
+                    && memcmp(e->label, label, label_len) == 0));
+}
+
+/**
+ * Find handles of objects by class, CKA_ID and CKA_LABEL
+ *
+ * NULL id or label matches any value.
+ *
+ * :return: number of matching objects, only first max handles are stored
+ */
+uint32_t objindex_find(const objindex_t *idx, CK_OBJECT_CLASS key_class,
+        const CK_BYTE *id, CK_ULONG id_len, const CK_BYTE *label,
+        CK_ULONG label_len, CK_OBJECT_HANDLE *handles, uint32_t max) {
+    uint32_t lo = 0;
+    uint32_t hi = idx->count;
+    uint32_t mid;
+    uint32_t found = 0;
+
+    /* lower bound of (class, id) */
+    if (key_class != OBJINDEX_ANY_CLASS && id != NULL) {
+        while (lo < hi) {
+            mid = lo + (hi - lo) / 2;
+            if (cmp_key(&idx->entries[mid], key_class, id, id_len) < 0)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        hi = idx->count;
+    }
+    for (; lo < hi; lo++) {
+        const objindex_entry_t *e = &idx->entries[lo];
+
+        if (key_class != OBJINDEX_ANY_CLASS && id != NULL
+                && cmp_key(e, key_class, id, id_len) != 0)
+            break;
+        if (!entry_matches(e, key_class, id, id_len, label, label_len))
+            continue;
+        if (found < max)
+            handles[found] = e->handle;
+        found++;
+    }
+    return found;
+}
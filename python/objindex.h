@@ -0,0 +1,88 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ objindex.h
+
+ Object index file
+
+ Sorted table of token objects (handle, class, key type, CKA_ID and
+ CKA_LABEL) written after a full scan of the tokens and mapped read-only by
+ later processes, so finding master and replica keys at startup does not
+ need a scan. Unlike shmindex, handles are stored: the caller has to check
+ that they still refer to the same objects (see objindex_sample()) before
+ trusting the file, and must fall back to a scan otherwise.
+
+ Replacing the file (write to temporary file and rename) is the only way
+ to change it; objindex_stale() tells mapped readers about it.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_OBJINDEX_H
+#define _IPA_P11_OBJINDEX_H
+
+#include <stdint.h>
+#include <sys/types.h>
+#include <p11-kit/pkcs11.h>
+
+#include "manifest.h"
+
+#define OBJINDEX_VERSION    1
+#define OBJINDEX_MAX_ID     128
+#define OBJINDEX_MAX_LABEL  128
+
+/* key_class of objindex_find() which matches all objects */
+#define OBJINDEX_ANY_CLASS  ((CK_OBJECT_CLASS) -1)
+
+typedef struct {
+    uint64_t handle;
+    uint64_t key_class;
+    uint64_t key_type;
+    uint32_t id_len;
+    uint32_t label_len;
+    CK_BYTE id[OBJINDEX_MAX_ID];
+    CK_BYTE label[OBJINDEX_MAX_LABEL];
+} objindex_entry_t;
+
+typedef struct objindex_header objindex_header_t;
+
+typedef struct {
+    const objindex_header_t *header;
+    const objindex_entry_t *entries;
+    uint32_t count;
+    size_t map_len;
+    dev_t dev;
+    ino_t ino;
+} objindex_t;
+
+CK_RV objindex_write(const char *path, uint64_t tokens, const manifest_t *m);
+
+CK_RV objindex_load(objindex_t *idx, const char *path, uint64_t tokens);
+
+void objindex_close(objindex_t *idx);
+
+int objindex_stale(const objindex_t *idx, const char *path);
+
+const objindex_entry_t *objindex_sample(const objindex_t *idx,
+        unsigned int i, unsigned int n);
+
+uint32_t objindex_find(const objindex_t *idx, CK_OBJECT_CLASS key_class,
+        const CK_BYTE *id, CK_ULONG id_len, const CK_BYTE *label,
+        CK_ULONG label_len, CK_OBJECT_HANDLE *handles, uint32_t max);
+
+#endif // !_IPA_P11_OBJINDEX_H
@@ -0,0 +1,244 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ p11caps.c
+
+ Slot, token and mechanism discovery
+
+ C_GetSlotList and C_GetMechanismList are called with the usual two-call
+ pattern and repeated while the module keeps returning CKR_BUFFER_TOO_SMALL
+ (the list can grow between the calls when tokens are hot-plugged).
+ *****************************************************************************/
+
+#include "p11caps.h"
+
+#include <stdlib.h>
+#include <string.h>
+
+/**
+ * Get list of slot IDs
+ *
+ * :param slots: newly allocated array, caller frees it; NULL if count is 0
+ */
+CK_RV p11caps_slot_list(CK_FUNCTION_LIST_PTR p11, CK_BBOOL token_present,
+        CK_SLOT_ID_PTR *slots, CK_ULONG_PTR count) {
+    CK_RV rv;
+    CK_SLOT_ID_PTR list = NULL;
+    CK_SLOT_ID_PTR tmp;
+    CK_ULONG len = 0;
+
+    *slots = NULL;
+    *count = 0;
+    do {
+        rv = p11->C_GetSlotList(token_present, NULL, &len);
+        if (rv != CKR_OK)
+            break;
+        if (len == 0)
+            break;
+        tmp = realloc(list, len * sizeof(CK_SLOT_ID));
+        if (tmp == NULL) {
+            rv = CKR_HOST_MEMORY;
+            break;
+        }
+        list = tmp;
+        rv = p11->C_GetSlotList(token_present, list, &len);
+    } while (rv == CKR_BUFFER_TOO_SMALL);
+
+    if (rv != CKR_OK || len == 0) {
+        free(list);
+        return rv;
+    }
+    *slots = list;
+    *count = len;
+    return CKR_OK;
+}
+
+static int mech_cmp(const void *a, const void *b) {
+    CK_MECHANISM_TYPE x = ((const p11caps_mech_t *) a)->type;
+    CK_MECHANISM_TYPE y = ((const p11caps_mech_t *) b)->type;
+
+    return (x > y) - (x < y);
+}
+
+/**
+ * Fill mechanism list of one slot with token present
+ *
+ * Mechanisms whose C_GetMechanismInfo fails are left out.
+ */
+static CK_RV load_mechanisms(CK_FUNCTION_LIST_PTR p11, p11caps_slot_t *slot) {
+    CK_RV rv;
+    CK_MECHANISM_TYPE_PTR types = NULL;
+    CK_MECHANISM_TYPE_PTR tmp;
+    CK_ULONG len = 0;
+    CK_ULONG i;
+
+    do {
+        rv = p11->C_GetMechanismList(slot->id, NULL, &len);
+        if (rv != CKR_OK || len == 0)
+            break;
+        tmp = realloc(types, len * sizeof(CK_MECHANISM_TYPE));
+        if (tmp == NULL) {
+            rv = CKR_HOST_MEMORY;
+            break;
+        }
+        types = tmp;
+        rv = p11->C_GetMechanismList(slot->id, types, &len);
+    } while (rv == CKR_BUFFER_TOO_SMALL);
+
+    if (rv != CKR_OK || len == 0)
+        goto cleanup;
+
+    slot->mechs = calloc(len, sizeof(p11caps_mech_t));
+    if (slot->mechs == NULL) {
+        rv = CKR_HOST_MEMORY;
+        goto cleanup;
+    }
+    for (i = 0; i < len; i++) {
+        p11caps_mech_t *m = &slot->mechs[slot->mech_count];
+
+        m->type = types[i];
+        if (p11->C_GetMechanismInfo(slot->id, types[i], &m->info) == CKR_OK)
+            slot->mech_count++;
+    }
+    qsort(slot->mechs, slot->mech_count, sizeof(p11caps_mech_t), mech_cmp);
+
+cleanup:
+    free(types);
+    return rv;
+}
+
+/**
+ * Enumerate all slots of initialized module
+ *
+ * Slots without token are included with empty mechanism list. Modules
+ * which do not implement C_GetMechanismList still load, with mechs_known
+ * left 0. On error caps is left empty.
+ */
+CK_RV p11caps_load(CK_FUNCTION_LIST_PTR p11, p11caps_t *caps) {
+    CK_RV rv;
+    CK_SLOT_ID_PTR ids = NULL;
+    CK_ULONG count = 0;
+    CK_ULONG i;
+
+    memset(caps, 0, sizeof(*caps));
+    rv = p11caps_slot_list(p11, CK_FALSE, &ids, &count);
+    if (rv != CKR_OK || count == 0)
+        return rv;
+
+    caps->slots = calloc(count, sizeof(p11caps_slot_t));
+    if (caps->slots == NULL) {
+        free(ids);
+        return CKR_HOST_MEMORY;
+    }
+    caps->slot_count = count;
+
+    for (i = 0; i < count; i++) {
+        p11caps_slot_t *slot = &caps->slots[i];
+
+        slot->id = ids[i];
+        rv = p11->C_GetSlotInfo(slot->id, &slot->slot_info);
+        if (rv != CKR_OK)
+            goto error;
+        if (!(slot->slot_info.flags & CKF_TOKEN_PRESENT))
+            continue;
+
+        /* token could be removed since C_GetSlotInfo */
+        rv = p11->C_GetTokenInfo(slot->id, &slot->token_info);
+        if (rv == CKR_TOKEN_NOT_PRESENT) {
+            slot->slot_info.flags &= ~CKF_TOKEN_PRESENT;
+            continue;
+        }
+        if (rv != CKR_OK)
+            goto error;
+
+        rv = load_mechanisms(p11, slot);
+        if (rv == CKR_HOST_MEMORY)
+            goto error;
+        slot->mechs_known = (rv == CKR_OK);
+    }
+    free(ids);
+    return CKR_OK;
+
+error:
+    free(ids);
+    p11caps_free(caps);
+    return rv;
+}
+
+void p11caps_free(p11caps_t *caps) {
+    CK_ULONG i;
+
+    for (i = 0; i < caps->slot_count; i++)
+        free(caps->slots[i].mechs);
+    free(caps->slots);
+    caps->slots = NULL;
+    caps->slot_count = 0;
+}
+
+const p11caps_slot_t *p11caps_slot(const p11caps_t *caps, CK_SLOT_ID id) {
+    CK_ULONG i;
+
+    for (i = 0; i < caps->slot_count; i++) {
+        if (caps->slots[i].id == id)
+            return &caps->slots[i];
+    }
+    return NULL;
+}
+
+const CK_MECHANISM_INFO *p11caps_mechanism(const p11caps_slot_t *slot,
+        CK_MECHANISM_TYPE type) {
+    p11caps_mech_t key;
+    const p11caps_mech_t *found;
+
+    key.type = type;
+    found = bsearch(&key, slot->mechs, slot->mech_count,
+            sizeof(p11caps_mech_t), mech_cmp);
+    return found != NULL ? &found->info : NULL;
+}
+
+/**
+ * Check that token supports mechanism for given purpose
+ *
+ * :param flags: required CKF_* mechanism flags, e.g. CKF_WRAP
+ * :param key_size: key size in units of the mechanism (bits or bytes,
+ *                  see PKCS#11 specification), 0 skips range check
+ * :return: CKR_OK if request can succeed or nothing is known about the slot,
+ *          CKR_MECHANISM_INVALID if mechanism is missing or lacks flags,
+ *          CKR_KEY_SIZE_RANGE if key_size is outside of advertised range
+ */
+CK_RV p11caps_check(const p11caps_slot_t *slot, CK_MECHANISM_TYPE type,
+        CK_FLAGS flags, CK_ULONG key_size) {
+    const CK_MECHANISM_INFO *info;
+
+    if (slot == NULL || !slot->mechs_known)
+        return CKR_OK;
+
+    info = p11caps_mechanism(slot, type);
+    if (info == NULL || (info->flags & flags) != flags)
+        return CKR_MECHANISM_INVALID;
+
+    /* some modules leave the range empty */
+    if (key_size != 0 && info->ulMaxKeySize != 0
+            && (key_size < info->ulMinKeySize
+                || key_size > info->ulMaxKeySize))
+        return CKR_KEY_SIZE_RANGE;
+
+    return CKR_OK;
+}
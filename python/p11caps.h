@@ -0,0 +1,81 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ p11caps.h
+
+ Slot, token and mechanism discovery
+
+ p11caps_load() enumerates all slots of a module once and caches slot and
+ token information together with mechanism lists and CK_MECHANISM_INFO
+ (key size ranges and CKF_WRAP/CKF_UNWRAP/... flags), so callers can reject
+ requests the token cannot handle without a round trip to the HSM.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_CAPS_H
+#define _IPA_P11_CAPS_H
+
+#include <p11-kit/pkcs11.h>
+
+/**
+ * One mechanism supported by token
+ */
+typedef struct {
+    CK_MECHANISM_TYPE type;
+    CK_MECHANISM_INFO info;
+} p11caps_mech_t;
+
+/**
+ * One slot and token in it
+ *
+ * token_info and mechanisms are valid only when slot_info.flags contains
+ * CKF_TOKEN_PRESENT. Mechanisms are sorted by type. mechs_known is 0 when
+ * the module could not list mechanisms; p11caps_check() accepts anything
+ * in that case.
+ */
+typedef struct {
+    CK_SLOT_ID id;
+    CK_SLOT_INFO slot_info;
+    CK_TOKEN_INFO token_info;
+    p11caps_mech_t *mechs;
+    CK_ULONG mech_count;
+    int mechs_known;
+} p11caps_slot_t;
+
+typedef struct {
+    p11caps_slot_t *slots;
+    CK_ULONG slot_count;
+} p11caps_t;
+
+CK_RV p11caps_slot_list(CK_FUNCTION_LIST_PTR p11, CK_BBOOL token_present,
+        CK_SLOT_ID_PTR *slots, CK_ULONG_PTR count);
+
+CK_RV p11caps_load(CK_FUNCTION_LIST_PTR p11, p11caps_t *caps);
+
+void p11caps_free(p11caps_t *caps);
+
+const p11caps_slot_t *p11caps_slot(const p11caps_t *caps, CK_SLOT_ID id);
+
+const CK_MECHANISM_INFO *p11caps_mechanism(const p11caps_slot_t *slot,
+        CK_MECHANISM_TYPE type);
+
+CK_RV p11caps_check(const p11caps_slot_t *slot, CK_MECHANISM_TYPE type,
+        CK_FLAGS flags, CK_ULONG key_size);
+
+#endif // !_IPA_P11_CAPS_H
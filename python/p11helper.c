@@ -25,17 +25,30 @@
 #include <Python.h>
 #include "structmember.h"
 
-#include <openssl/asn1.h>
-#include <openssl/x509.h>
-#include <openssl/evp.h>
-#include <openssl/rsa.h>
-#include <openssl/bn.h>
-#include <openssl/bio.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <time.h>
+#include <sys/file.h>
 
 #include <p11-kit/pkcs11.h>
 #include <p11-kit/uri.h>
 
 #include "library.h"
+#include "spki.h"
+#include "p11caps.h"
+#include "p11stats.h"
+#include "p11trace.h"
+#include "secmem.h"
+#include "fnv.h"
+#include "wrapcache.h"
+#include "manifest.h"
+#include "shmindex.h"
+#include "objindex.h"
+#include "dnskey.h"
 
 // compat TODO
 #define CKM_AES_KEY_WRAP           (0x1090)
@@ -49,6 +62,79 @@ CK_BBOOL false = CK_FALSE;
 
 #define MAX_TEMPLATE_LEN 32
 
+/* object handles of sharded helper carry shard index in the top octet */
+#define SHARD_HANDLE_SHIFT (sizeof(CK_OBJECT_HANDLE) * 8 - 8)
+#define SHARD_MAX 256
+#define OBJINDEX_SPOT_CHECKS 4 /* handles checked when index file is loaded */
+#define OBJINDEX_MISS_RATIO 16 /* rescan after count / ratio misses ... */
+#define OBJINDEX_MIN_MISSES 16 /* ... but not sooner than this */
+#define ID_POOL_SIZE 4096 /* bytes of token randomness fetched at once */
+#define ID_MAX_LENGTH 128
+#define ID_MAX_COUNT 65536 /* IDs returned by one allocate_ids() call */
+#define KCV_LENGTH 3
+#define SIGN_MAX_THREADS 16 /* sessions of one sign_many() call */
+#define SESSION_POOL_SIZE SIGN_MAX_THREADS /* idle sessions kept per shard */
+
+/* export_wrapped_key() picks the mechanism itself */
+#define MECH_AUTO CK_UNAVAILABLE_INFORMATION
+
+/**
+ * Wrapping mechanism considered by MECH_AUTO
+ */
+typedef struct {
+    CK_MECHANISM_TYPE mech;
+    CK_KEY_TYPE key_type;       /* type of wrapping key */
+    CK_BBOOL wraps_private;     /* can wrap PKCS#8 private key */
+    CK_BBOOL default_allowed;   /* allowed unless caller says otherwise */
+} wrap_mech_t;
+
+/* in order of preference when nothing was measured */
+static const wrap_mech_t wrap_mechs[] = {
+    { CKM_AES_KEY_WRAP, CKK_AES, CK_FALSE, CK_TRUE },
+    { CKM_AES_KEY_WRAP_PAD, CKK_AES, CK_TRUE, CK_TRUE },
+    { CKM_RSA_PKCS_OAEP, CKK_RSA, CK_FALSE, CK_TRUE },
+    /* PKCS#1 v1.5 padding is prone to padding oracle attacks */
+    { CKM_RSA_PKCS, CKK_RSA, CK_FALSE, CK_FALSE }
+};
+
+#define WRAP_MECH_COUNT (sizeof(wrap_mechs) / sizeof(wrap_mechs[0]))
+
+/*
+ * OAEP parameters of every wrapping and unwrapping; they are fixed, so the
+ * mechanism type stored with a blob is enough to unwrap it again
+ */
+static CK_RSA_PKCS_OAEP_PARAMS oaep_params = { CKM_SHA_1, CKG_MGF1_SHA1,
+        CKZ_DATA_SPECIFIED, NULL, 0 };
+
+/**
+ * Set parameters of wrapping mechanism according to its type
+ */
+static void _wrap_mech_params(CK_MECHANISM_PTR mech) {
+    if (mech->mechanism == CKM_RSA_PKCS_OAEP) {
+        mech->pParameter = &oaep_params;
+        mech->ulParameterLen = sizeof(oaep_params);
+    } else {
+        mech->pParameter = NULL;
+        mech->ulParameterLen = 0;
+    }
+}
+
+/**
+ * One token (slot) used by P11_Helper
+ */
+typedef struct {
+    CK_SLOT_ID slot;
+    CK_SESSION_HANDLE session;
+    uint64_t wrap_ns[WRAP_MECH_COUNT]; /* C_WrapKey duration, 0 = unknown */
+    CK_SESSION_HANDLE pool[SESSION_POOL_SIZE]; /* idle own sessions */
+    unsigned int pool_len;
+} p11_shard_t;
+
+typedef enum {
+    SHARD_ROUTING_HASH = 0,     /* jump consistent hash of CKA_ID */
+    SHARD_ROUTING_ROUND_ROBIN
+} shard_routing_t;
+
 /**
  * P11_Helper type
  */
@@ -57,6 +143,26 @@ PyObject_HEAD
 CK_SLOT_ID slot;
 CK_FUNCTION_LIST_PTR p11;
 CK_SESSION_HANDLE session;
+p11_shard_t *shards; /* shards[0] is slot and session above */
+unsigned int shard_count;
+shard_routing_t routing;
+unsigned int next_shard;
+p11caps_t caps; /* slots, tokens and mechanisms seen at initialization */
+char *calibration; /* file with wrap_ns of tokens or NULL */
+wrapcache_t *wrap_cache; /* wrapped keys by fingerprint or NULL */
+shmindex_t *index; /* object index shared with other processes or NULL */
+uint64_t index_tokens; /* hash of identities of tokens in shards */
+uint64_t index_negative_ns; /* age of index trusted for "not found", 0 = never */
+objindex_t *objindex; /* mapped index file or NULL */
+char *objindex_path; /* index file or NULL */
+uint32_t objindex_misses; /* lookups the file missed but the token had */
+int objindex_failed; /* file cannot be written, do not scan again */
+CK_BYTE *id_pool; /* randomness for allocate_ids() */
+CK_ULONG id_pool_len;
+CK_ULONG id_pool_used;
+PyObject *issued_ids; /* set of IDs from allocate_ids() not used yet */
+char *wrap_cache_path; /* file wrap_cache is saved to or NULL */
+PyObject *kcv_cache; /* (handle, cmac) -> key check value */
 } P11_Helper;
 
 typedef enum {
@@ -107,6 +213,60 @@ PyObject* py_obj;
 CK_BBOOL* bool;
 } PyObj2Bool_mapping_t;
 
+#define PROFILE_MAX_ATTRS 13
+
+/**
+ * AttributeProfile type
+ *
+ * Boolean attributes of one key class indexed by the enums above, created
+ * by P11_Helper.attribute_profile(). Only attributes in set[] override
+ * defaults of the method the profile is passed to.
+ */
+typedef struct {
+PyObject_HEAD
+CK_OBJECT_CLASS key_class;
+CK_BBOOL values[PROFILE_MAX_ATTRS];
+CK_BBOOL set[PROFILE_MAX_ATTRS];
+} AttributeProfile;
+
+static PyTypeObject AttributeProfileType;
+
+/* keyword names of profile attributes in enum order */
+static const char *sec_attr_names[] = { "cka_copyable", "cka_decrypt",
+        "cka_derive", "cka_encrypt", "cka_extractable", "cka_modifiable",
+        "cka_private", "cka_sensitive", "cka_sign", "cka_unwrap",
+        "cka_verify", "cka_wrap", "cka_wrap_with_trusted" };
+static const char *pub_attr_names[] = { "cka_copyable", "cka_derive",
+        "cka_encrypt", "cka_modifiable", "cka_private", "cka_trusted",
+        "cka_verify", "cka_verify_recover", "cka_wrap" };
+static const char *priv_attr_names[] = { "cka_always_authenticate",
+        "cka_copyable", "cka_decrypt", "cka_derive", "cka_extractable",
+        "cka_modifiable", "cka_private", "cka_sensitive", "cka_sign",
+        "cka_sign_recover", "cka_unwrap", "cka_wrap_with_trusted" };
+
+/**
+ * Attribute which needs a mechanism with given flags on every token
+ */
+typedef struct {
+    CK_OBJECT_CLASS key_class;
+    unsigned int attr;
+    CK_FLAGS flags;
+    CK_MECHANISM_TYPE mechs[2]; /* any of them is sufficient */
+} profile_rule_t;
+
+static const profile_rule_t profile_rules[] = {
+    { CKO_SECRET_KEY, sec_en_cka_wrap, CKF_WRAP,
+            { CKM_AES_KEY_WRAP, CKM_AES_KEY_WRAP_PAD } },
+    { CKO_SECRET_KEY, sec_en_cka_unwrap, CKF_UNWRAP,
+            { CKM_AES_KEY_WRAP, CKM_AES_KEY_WRAP_PAD } },
+    { CKO_PUBLIC_KEY, pub_en_cka_wrap, CKF_WRAP,
+            { CKM_RSA_PKCS_OAEP, CKM_RSA_PKCS } },
+    { CKO_PRIVATE_KEY, priv_en_cka_unwrap, CKF_UNWRAP,
+            { CKM_RSA_PKCS_OAEP, CKM_RSA_PKCS } },
+    { CKO_PRIVATE_KEY, priv_en_cka_derive, CKF_DERIVE,
+            { CKM_ECDH1_DERIVE, CKM_ECDH1_DERIVE } }
+};
+
 /**
  * ipap11helper Exceptions
  */
@@ -139,6 +299,57 @@ void convert_py2bool(PyObj2Bool_mapping_t* mapping, int length) {
     }
 }
 
+/**
+ * Keyword names of profile attributes of key class
+ *
+ * :return: NULL for classes without profile
+ */
+static const char **_profile_names(CK_OBJECT_CLASS key_class,
+        unsigned int *count) {
+    switch (key_class) {
+        case CKO_SECRET_KEY:
+            *count = sizeof(sec_attr_names) / sizeof(sec_attr_names[0]);
+            return sec_attr_names;
+        case CKO_PUBLIC_KEY:
+            *count = sizeof(pub_attr_names) / sizeof(pub_attr_names[0]);
+            return pub_attr_names;
+        case CKO_PRIVATE_KEY:
+            *count = sizeof(priv_attr_names) / sizeof(priv_attr_names[0]);
+            return priv_attr_names;
+    }
+    *count = 0;
+    return NULL;
+}
+
+/**
+ * Point boolean attributes set in profile to its values
+ *
+ * Has to be called before convert_py2bool() so keyword arguments of the
+ * call still win. The profile has to outlive use of the mapping.
+ *
+ * :param profile: AttributeProfile, None or NULL (nothing to apply)
+ * :return: 1 if success, otherwise return 0 and set the exception
+ */
+static int _apply_profile(PyObject *profile, CK_OBJECT_CLASS key_class,
+        PyObj2Bool_mapping_t *mapping, unsigned int length) {
+    AttributeProfile *p = (AttributeProfile *) profile;
+    unsigned int i;
+
+    if (profile == NULL || profile == Py_None)
+        return 1;
+    if (!PyObject_TypeCheck(profile, &AttributeProfileType)
+            || p->key_class != key_class) {
+        PyErr_SetString(PyExc_TypeError,
+                "profile has to be AttributeProfile of the key class");
+        return 0;
+    }
+    for (i = 0; i < length; ++i) {
+        if (p->set[i])
+            mapping[i].bool = &p->values[i];
+    }
+    return 1;
+}
+
 /**
  * Convert a unicode string to the utf8 encoded char array
  * :param unicode: input python unicode object
@@ -192,6 +403,21 @@ int check_return_value(CK_RV rv, const char *message) {
     return 1;
 }
 
+/**
+ * Convert one hexadecimal digit to its value
+ *
+ * :return: value 0-15 or -1 if c is not a hexadecimal digit
+ */
+static int hex_value(char c) {
+    if (c >= '0' && c <= '9')
+        return c - '0';
+    if (c >= 'a' && c <= 'f')
+        return c - 'a' + 10;
+    if (c >= 'A' && c <= 'F')
+        return c - 'A' + 10;
+    return -1;
+}
+
 /**
  * Fill template structure with pointers to attributes passed as independent
  * variables.
@@ -288,6 +514,72 @@ int _parse_uri(const char *uri_str, P11KitUri **urip) {
     return 0;
 }
 
+/**
+ * Virtual object handle returned to Python
+ *
+ * Helper with one shard returns handles of the token unchanged.
+ * Does not touch Python objects.
+ */
+static CK_OBJECT_HANDLE _shard_handle(P11_Helper* self, unsigned int shard,
+        CK_OBJECT_HANDLE object) {
+    if (self->shard_count <= 1)
+        return object;
+    return ((CK_OBJECT_HANDLE) shard << SHARD_HANDLE_SHIFT) | object;
+}
+
+/**
+ * Shard which owns virtual object handle
+ *
+ * *object is replaced with handle of the token.
+ *
+ * :return: shard, NULL if the handle is invalid and set the exception
+ */
+static p11_shard_t *_shard_of(P11_Helper* self, CK_OBJECT_HANDLE *object) {
+    unsigned int shard;
+
+    if (self->shard_count <= 1)
+        return &self->shards[0];
+    shard = (unsigned int) (*object >> SHARD_HANDLE_SHIFT);
+    if (shard >= self->shard_count) {
+        PyErr_SetString(ipap11helperError, "Invalid object handle");
+        return NULL;
+    }
+    *object &= ((CK_OBJECT_HANDLE) 1 << SHARD_HANDLE_SHIFT) - 1;
+    return &self->shards[shard];
+}
+
+/**
+ * Jump consistent hash (Lamping, Veach: arXiv:1406.2294)
+ *
+ * Only 1/n of the keys move to another bucket when n-th bucket is added.
+ */
+static unsigned int _jump_hash(uint64_t key, unsigned int buckets) {
+    int64_t b = -1;
+    int64_t j = 0;
+
+    while (j < (int64_t) buckets) {
+        b = j;
+        key = key * 2862933555777941757ULL + 1;
+        j = (int64_t) ((b + 1) * ((double) (1LL << 31)
+                / (double) ((key >> 33) + 1)));
+    }
+    return (unsigned int) b;
+}
+
+/**
+ * Shard for new object with given CKA_ID
+ *
+ * Has to be called with GIL held, round-robin counter is not atomic.
+ */
+static unsigned int _shard_route(P11_Helper* self, const CK_BYTE *id,
+        CK_ULONG id_length) {
+    if (self->shard_count <= 1)
+        return 0;
+    if (self->routing == SHARD_ROUTING_ROUND_ROBIN)
+        return self->next_shard++ % self->shard_count;
+    return _jump_hash(fnv1a64(id, id_length), self->shard_count);
+}
+
 /*
  * Find keys matching specified template.
  * Function returns list of key handles via objects parameter.
@@ -306,50 +598,62 @@ int _find_key(P11_Helper* self, CK_ATTRIBUTE_PTR template,
     CK_OBJECT_HANDLE *tmp_objects_ptr = NULL;
     unsigned int count = 0;
     unsigned int allocated = 0;
+    unsigned int shard;
+    CK_SESSION_HANDLE session;
     CK_RV rv;
 
-    rv = self->p11->C_FindObjectsInit(self->session, template, template_len);
-    if (!check_return_value(rv, "Find key init"))
-        return 0;
+    /* search all shards, results are concatenated in shard order */
+    for (shard = 0; shard < self->shard_count; shard++) {
+        session = self->shards[shard].session;
 
-    rv = self->p11->C_FindObjects(self->session, &result_object, 1,
-            &objectCount);
-    if (!check_return_value(rv, "Find key"))
-        return 0;
+        rv = self->p11->C_FindObjectsInit(session, template, template_len);
+        if (!check_return_value(rv, "Find key init")) {
+            free(result_objects);
+            return 0;
+        }
+
+        rv = self->p11->C_FindObjects(session, &result_object, 1,
+                &objectCount);
+        if (!check_return_value(rv, "Find key")) {
+            free(result_objects);
+            return 0;
+        }
 
-    while (objectCount > 0) {
-        if (allocated <= count) {
-            allocated += 32;
-            tmp_objects_ptr = (CK_OBJECT_HANDLE*) realloc(result_objects,
-                    allocated * sizeof(CK_OBJECT_HANDLE));
-            if (tmp_objects_ptr == NULL) {
-                *objects_count = 0;
-                PyErr_SetString(ipap11helperError, "_find_key realloc failed");
+        while (objectCount > 0) {
+            if (allocated <= count) {
+                allocated += 32;
+                tmp_objects_ptr = (CK_OBJECT_HANDLE*) realloc(result_objects,
+                        allocated * sizeof(CK_OBJECT_HANDLE));
+                if (tmp_objects_ptr == NULL) {
+                    *objects_count = 0;
+                    PyErr_SetString(ipap11helperError,
+                            "_find_key realloc failed");
+                    if (result_objects != NULL)
+                        free(result_objects);
+                    return 0;
+                } else {
+                    result_objects = tmp_objects_ptr;
+                }
+            }
+            result_objects[count] = _shard_handle(self, shard, result_object);
+            count++;
+            rv = self->p11->C_FindObjects(session, &result_object, 1,
+                    &objectCount);
+            if (!check_return_value(rv, "Check for duplicated key")) {
                 if (result_objects != NULL)
                     free(result_objects);
                 return 0;
-            } else {
-                result_objects = tmp_objects_ptr;
             }
         }
-        result_objects[count] = result_object;
-        count++;
-        rv = self->p11->C_FindObjects(self->session, &result_object, 1,
-                &objectCount);
-        if (!check_return_value(rv, "Check for duplicated key")) {
+
+        rv = self->p11->C_FindObjectsFinal(session);
+        if (!check_return_value(rv, "Find objects final")) {
             if (result_objects != NULL)
                 free(result_objects);
             return 0;
         }
     }
 
-    rv = self->p11->C_FindObjectsFinal(self->session);
-    if (!check_return_value(rv, "Find objects final")) {
-        if (result_objects != NULL)
-            free(result_objects);
-        return 0;
-    }
-
     *objects = result_objects;
     *objects_count = count;
     return 1;
@@ -368,8 +672,8 @@ int _find_key(P11_Helper* self, CK_ATTRIBUTE_PTR template,
  * and set the exception
  *
  */
-int _id_exists(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
-        CK_OBJECT_CLASS class) {
+static int _id_exists_in_session(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_BYTE_PTR id, CK_ULONG id_len, CK_OBJECT_CLASS class) {
 
     CK_RV rv;
     CK_ULONG object_count = 0;
@@ -388,16 +692,16 @@ int _id_exists(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
      * Only one secret key with same ID is allowed
      */
     if (class == CKO_SECRET_KEY){
-        rv = self->p11->C_FindObjectsInit(self->session, template_id, 1);
+        rv = self->p11->C_FindObjectsInit(session, template_id, 1);
         if (!check_return_value(rv, "id, label exists init"))
             return -1;
 
-        rv = self->p11->C_FindObjects(self->session, &result_object, 1,
+        rv = self->p11->C_FindObjects(session, &result_object, 1,
                 &object_count);
         if (!check_return_value(rv, "id, label exists"))
             return -1;
 
-        rv = self->p11->C_FindObjectsFinal(self->session);
+        rv = self->p11->C_FindObjectsFinal(session);
         if (!check_return_value(rv, "id, label exists final"))
             return -1;
 
@@ -413,16 +717,16 @@ int _id_exists(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
      */
 
     /* test if secret key with same ID exists*/
-    rv = self->p11->C_FindObjectsInit(self->session, template_sec, 2);
+    rv = self->p11->C_FindObjectsInit(session, template_sec, 2);
     if (!check_return_value(rv, "id, label exists init"))
         return -1;
 
-    rv = self->p11->C_FindObjects(self->session, &result_object, 1,
+    rv = self->p11->C_FindObjects(session, &result_object, 1,
             &object_count);
     if (!check_return_value(rv, "id, label exists"))
         return -1;
 
-    rv = self->p11->C_FindObjectsFinal(self->session);
+    rv = self->p11->C_FindObjectsFinal(session);
     if (!check_return_value(rv, "id, label exists final"))
         return -1;
 
@@ -434,16 +738,16 @@ int _id_exists(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
     /* test if pub/private key with same id exists*/
     object_count = 0;
 
-    rv = self->p11->C_FindObjectsInit(self->session, template_pub_priv, 2);
+    rv = self->p11->C_FindObjectsInit(session, template_pub_priv, 2);
     if (!check_return_value(rv, "id, label exists init"))
         return -1;
 
-    rv = self->p11->C_FindObjects(self->session, &result_object, 1,
+    rv = self->p11->C_FindObjects(session, &result_object, 1,
             &object_count);
     if (!check_return_value(rv, "id, label exists"))
         return -1;
 
-    rv = self->p11->C_FindObjectsFinal(self->session);
+    rv = self->p11->C_FindObjectsFinal(session);
     if (!check_return_value(rv, "id, label exists final"))
         return -1;
 
@@ -454,129 +758,3295 @@ int _id_exists(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
     return 0; /* Object not found*/
 }
 
-/***********************************************************************
- * P11_Helper object
+/*
+ * Test if object with specified id and class exists on any shard
+ *
+ * :return: 1 if object was found, 0 if object doesnt exists, -1 if error
+ * and set the exception
  */
+int _id_exists(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
+        CK_OBJECT_CLASS class) {
+    unsigned int shard;
+    int r;
 
-static void P11_Helper_dealloc(P11_Helper* self) {
-    self->ob_type->tp_free((PyObject*) self);
+    for (shard = 0; shard < self->shard_count; shard++) {
+        r = _id_exists_in_session(self, self->shards[shard].session, id,
+                id_len, class);
+        if (r != 0)
+            return r;
+    }
+    return 0;
 }
 
-static PyObject *
-P11_Helper_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
-    P11_Helper *self;
-
-    self = (P11_Helper *) type->tp_alloc(type, 0);
-    if (self != NULL) {
+/**
+ * Take ID issued by allocate_ids(), its uniqueness was checked already
+ *
+ * :return: 1 if the ID was issued and not used yet, it cannot be used again
+ */
+static int _id_issued(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len) {
+    PyObject *key;
+    int r;
 
-        self->slot = 0;
-        self->session = 0;
-        self->p11 = NULL;
+    if (self->issued_ids == NULL || PySet_GET_SIZE(self->issued_ids) == 0)
+        return 0;
+    key = PyString_FromStringAndSize((const char *) id, id_len);
+    if (key == NULL) {
+        PyErr_Clear();
+        return 0;
     }
+    r = PySet_Discard(self->issued_ids, key);
+    Py_DECREF(key);
+    if (r < 0) {
+        PyErr_Clear();
+        return 0;
+    }
+    return r;
+}
 
-    return (PyObject *) self;
+/**
+ * Open additional R/W session to the slot of given shard
+ *
+ * Login state is shared by all sessions of the application so the new
+ * session is already logged in. Does not touch Python objects.
+ */
+static CK_RV _open_session(P11_Helper* self, const p11_shard_t *shard,
+        CK_SESSION_HANDLE_PTR session) {
+    return self->p11->C_OpenSession(shard->slot,
+            CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, session);
 }
 
-static int P11_Helper_init(P11_Helper *self, PyObject *args, PyObject *kwds) {
-    const char* user_pin = NULL;
-    const char* library_path = NULL;
+/**
+ * Own session of a batch processed with GIL released
+ *
+ * The main sessions may be used by other Python threads meanwhile, so the
+ * batch opens one session per shard on first use. Does not touch Python
+ * objects.
+ *
+ * :param sessions: shard_count handles, CK_INVALID_HANDLE if not open yet;
+ *                  close them with _close_batch_sessions()
+ */
+static CK_RV _batch_session(P11_Helper* self, CK_SESSION_HANDLE *sessions,
+        const p11_shard_t *shard, CK_SESSION_HANDLE_PTR session) {
+    CK_SESSION_HANDLE *own = &sessions[shard - self->shards];
     CK_RV rv;
-    void *module_handle = NULL;
 
-    /* Parse method args*/
-    if (!PyArg_ParseTuple(args, "iss", &self->slot, &user_pin, &library_path))
-        return -1;
+    if (*own == CK_INVALID_HANDLE) {
+        rv = _open_session(self, shard, own);
+        if (rv != CKR_OK) {
+            *own = CK_INVALID_HANDLE;
+            return rv;
+        }
+    }
+    *session = *own;
+    return CKR_OK;
+}
 
-    CK_C_GetFunctionList pGetFunctionList = loadLibrary(library_path,
-            &module_handle);
-    if (!pGetFunctionList) {
-        PyErr_SetString(ipap11helperError, "Could not load the library.");
-        return -1;
+static void _close_batch_sessions(P11_Helper* self,
+        CK_SESSION_HANDLE *sessions) {
+    unsigned int s;
+
+    for (s = 0; s < self->shard_count; s++) {
+        if (sessions[s] != CK_INVALID_HANDLE)
+            self->p11->C_CloseSession(sessions[s]);
+        sessions[s] = CK_INVALID_HANDLE;
     }
+}
 
-    /*
-     * Load the function list
-     */
-    (*pGetFunctionList)(&self->p11);
+/**
+ * Take idle own session of the shard, call with GIL held
+ *
+ * :return: CK_INVALID_HANDLE if there is none, caller opens new one
+ */
+static CK_SESSION_HANDLE _pool_get(p11_shard_t *shard) {
+    if (shard->pool_len == 0)
+        return CK_INVALID_HANDLE;
+    return shard->pool[--shard->pool_len];
+}
 
-    /*
-     * Initialize
-     */
-    rv = self->p11->C_Initialize(NULL);
-    if (!check_return_value(rv, "initialize"))
-        return -1;
+/**
+ * Keep own session without active operation for later, call with GIL held
+ */
+static void _pool_put(P11_Helper* self, p11_shard_t *shard,
+        CK_SESSION_HANDLE session) {
+    if (session == CK_INVALID_HANDLE)
+        return;
+    if (shard->pool_len < SESSION_POOL_SIZE)
+        shard->pool[shard->pool_len++] = session;
+    else
+        self->p11->C_CloseSession(session);
+}
 
-    /*
-     *Start session
-     */
-    rv = self->p11->C_OpenSession(self->slot,
-    CKF_SERIAL_SESSION | CKF_RW_SESSION, NULL, NULL, &self->session);
-    if (!check_return_value(rv, "open session"))
-        return -1;
+static void _pool_close(P11_Helper* self) {
+    unsigned int s;
 
-    /*
-     * Login
-     */
-    rv = self->p11->C_Login(self->session, CKU_USER, (CK_BYTE*) user_pin,
-            strlen((char *) user_pin));
-    if (!check_return_value(rv, "log in"))
-        return -1;
+    for (s = 0; s < self->shard_count; s++) {
+        while (self->shards[s].pool_len > 0)
+            self->p11->C_CloseSession(
+                    self->shards[s].pool[--self->shards[s].pool_len]);
+    }
+}
 
-    return 0;
+/**
+ * Reject mechanism which the token of given shard cannot use
+ *
+ * Only cached capabilities are consulted, nothing is sent to the token.
+ *
+ * :param flags: required CKF_* mechanism flags
+ * :param key_size: key size in units of the mechanism, 0 skips the check
+ * :return: 1 if mechanism may be used, 0 if not and set the error message
+ */
+static int _check_mechanism(P11_Helper* self, const p11_shard_t *shard,
+        CK_MECHANISM_TYPE type, CK_FLAGS flags, CK_ULONG key_size,
+        const char *message) {
+    const p11caps_slot_t *slot = p11caps_slot(&self->caps, shard->slot);
+    const CK_MECHANISM_INFO *info;
+
+    switch (p11caps_check(slot, type, flags, key_size)) {
+        case CKR_OK:
+            return 1;
+        case CKR_KEY_SIZE_RANGE:
+            info = p11caps_mechanism(slot, type);
+            PyErr_Format(ipap11helperError,
+                    "%s: key size %lu is outside of range %lu-%lu supported "
+                    "by token in slot %lu", message, key_size,
+                    info->ulMinKeySize, info->ulMaxKeySize, shard->slot);
+            return 0;
+        default:
+            PyErr_Format(ipap11helperError,
+                    "%s: mechanism 0x%x is not supported by token in slot "
+                    "%lu", message, (unsigned int) type, shard->slot);
+            return 0;
+    }
 }
 
-static PyMemberDef P11_Helper_members[] = { { NULL } /* Sentinel */
-};
+/**
+ * Length of blank padded string from CK_SLOT_INFO/CK_TOKEN_INFO
+ */
+static size_t _padded_len(const CK_UTF8CHAR *str, size_t len) {
+    while (len > 0 && (str[len - 1] == ' ' || str[len - 1] == '\0'))
+        len--;
+    return len;
+}
 
-/*
- * Finalize operations with pkcs11 library
+/**
+ * Identification of token in calibration file: "model<TAB>serial"
+ *
+ * :return: 0 if there is no token in the slot of shard
  */
-static PyObject *
-P11_Helper_finalize(P11_Helper* self) {
+static int _token_id(P11_Helper* self, const p11_shard_t *shard, char *buf,
+        size_t len) {
+    const p11caps_slot_t *slot = p11caps_slot(&self->caps, shard->slot);
+    const CK_TOKEN_INFO *ti;
+
+    if (slot == NULL || !(slot->slot_info.flags & CKF_TOKEN_PRESENT))
+        return 0;
+    ti = &slot->token_info;
+    snprintf(buf, len, "%.*s\t%.*s",
+            (int) _padded_len(ti->model, sizeof(ti->model)), ti->model,
+            (int) _padded_len(ti->serialNumber, sizeof(ti->serialNumber)),
+            ti->serialNumber);
+    return 1;
+}
+
+/**
+ * Fingerprint of key for wrap cache
+ *
+ * Hash of token identity and of attributes which identify key material and
+ * its use for wrapping. Handles are left out, so fingerprints are stable
+ * across sessions and processes. Keys without public material or check
+ * value cannot be told apart from a regenerated key with the same ID and
+ * label, they are not cached. Secret keys have only the 3 byte check value,
+ * a regenerated key matches it with probability 2^-24, so their blobs are
+ * kept in memory but not saved to the cache file.
+ *
+ * :return: 2 and fingerprint of key with public material, 1 and fingerprint
+ *          of key identified by check value only, 0 if key cannot be cached
+ *          (no exception set)
+ */
+static int _key_fingerprint(P11_Helper* self, const p11_shard_t *shard,
+        CK_OBJECT_HANDLE object, uint64_t *fp) {
+    CK_OBJECT_CLASS key_class;
+    CK_KEY_TYPE key_type;
+    CK_ULONG value_len;
+    CK_BYTE id[256];
+    CK_BYTE label[256];
+    CK_BYTE modulus[1024];
+    CK_BYTE ec_point[SPKI_EC_MAX_POINT_LEN + 4];
+    CK_BYTE check_value[16];
+    CK_BBOOL extractable, wrap, trusted, wrap_with_trusted;
+    char token[64];
+    CK_ATTRIBUTE template[] = {
+            { CKA_CLASS, &key_class, sizeof(key_class) },
+            { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+            { CKA_VALUE_LEN, &value_len, sizeof(value_len) },
+            { CKA_ID, id, sizeof(id) },
+            { CKA_LABEL, label, sizeof(label) },
+            { CKA_EXTRACTABLE, &extractable, sizeof(extractable) },
+            { CKA_WRAP, &wrap, sizeof(wrap) },
+            { CKA_TRUSTED, &trusted, sizeof(trusted) },
+            { CKA_WRAP_WITH_TRUSTED, &wrap_with_trusted,
+                    sizeof(wrap_with_trusted) },
+            /* key material, at least one is required */
+            { CKA_MODULUS, modulus, sizeof(modulus) },
+            { CKA_EC_POINT, ec_point, sizeof(ec_point) },
+            { CKA_CHECK_VALUE, check_value, sizeof(check_value) } };
+    const unsigned int material = 9;
+    const unsigned int weak_material = 11;
+    unsigned int i;
+    int cacheable = 0;
+    uint64_t h;
     CK_RV rv;
 
-    if (self->p11 == NULL)
-        return Py_None;
+    if (!_token_id(self, shard, token, sizeof(token)))
+        return 0;
+    rv = self->p11->C_GetAttributeValue(shard->session, object, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE));
+    if (rv != CKR_OK && rv != CKR_ATTRIBUTE_TYPE_INVALID
+            && rv != CKR_ATTRIBUTE_SENSITIVE && rv != CKR_BUFFER_TOO_SMALL)
+        return 0;
 
-    /*
-     * Logout
-     */
-    rv = self->p11->C_Logout(self->session);
-    if (rv != CKR_USER_NOT_LOGGED_IN) {
-        if (!check_return_value(rv, "log out"))
-            return NULL;
+    h = fnv1a64(token, strlen(token));
+    for (i = 0; i < sizeof(template) / sizeof(CK_ATTRIBUTE); i++) {
+        if (template[i].ulValueLen == (CK_ULONG) -1)
+            continue;
+        if (i >= material && template[i].ulValueLen > 0
+                && cacheable < 2)
+            cacheable = i >= weak_material ? 1 : 2;
+        h = fnv1a64_update(h, &template[i].type, sizeof(template[i].type));
+        h = fnv1a64_update(h, &template[i].ulValueLen,
+                sizeof(template[i].ulValueLen));
+        h = fnv1a64_update(h, template[i].pValue, template[i].ulValueLen);
     }
+    if (!cacheable)
+        return 0;
+    *fp = h;
+    return cacheable;
+}
 
-    /*
-     * End session
-     */
-    rv = self->p11->C_CloseSession(self->session);
-    if (!check_return_value(rv, "close session"))
-        return NULL;
+/**
+ * Drop cached blobs of key which is about to change, call before the change
+ */
+static void _wrap_cache_invalidate(P11_Helper* self, const p11_shard_t *shard,
+        CK_OBJECT_HANDLE object) {
+    uint64_t fp;
 
-    /*
-     * Finalize
-     */
-    self->p11->C_Finalize(NULL);
+    if (self->wrap_cache != NULL
+            && _key_fingerprint(self, shard, object, &fp))
+        wrapcache_invalidate(self->wrap_cache, fp);
+}
 
-    self->p11 = NULL;
-    self->session = 0;
-    self->slot = 0;
+/**
+ * Drop cached check values of key which is about to change or be deleted
+ */
+static void _kcv_invalidate(P11_Helper* self, const p11_shard_t *shard,
+        CK_OBJECT_HANDLE object) {
+    PyObject *key;
+    int cmac;
 
-    return Py_None;
+    if (self->kcv_cache == NULL)
+        return;
+    object = _shard_handle(self, shard - self->shards, object);
+    for (cmac = 0; cmac <= 1; cmac++) {
+        key = Py_BuildValue("(ki)", object, cmac);
+        if (key == NULL || PyDict_DelItem(self->kcv_cache, key) != 0)
+            PyErr_Clear();
+        Py_XDECREF(key);
+    }
 }
 
-/********************************************************************
- * Methods working with keys
+/**
+ * Take exclusive lock of index file, serializes rebuilds with changes
+ *
+ * :return: descriptor to close, -1 if locking is not possible
  */
+static int _objindex_lock(P11_Helper* self) {
+    char path[PATH_MAX];
+    int fd;
+
+    if (snprintf(path, sizeof(path), "%s.lock", self->objindex_path)
+            >= (int) sizeof(path))
+        return -1;
+    fd = open(path, O_RDWR | O_CREAT, 0600);
+    if (fd >= 0 && flock(fd, LOCK_EX) != 0) {
+        close(fd);
+        fd = -1;
+    }
+    return fd;
+}
 
 /**
- * Generate master key
+ * Mark indexes stale, call after every change of token objects
  *
- *:return: master key handle
+ * Index file is kept: each handle it returns is checked and objects it
+ * lacks are searched for in the token, so it is rewritten only after
+ * enough misses (see _objindex_refresh()) rather than on every change.
  */
-static PyObject *
-P11_Helper_generate_master_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+static void _index_invalidate(P11_Helper* self) {
+    if (self->index != NULL)
+        shmindex_invalidate(self->index);
+}
+
+/**
+ * Check that handle from index file refers to object with given class,
+ * CKA_ID and CKA_LABEL in this process
+ *
+ * NULL id or label matches any value. No exception is set.
+ *
+ * :return: 1 if the object matches
+ */
+static int _objindex_handle_matches(P11_Helper* self, CK_OBJECT_HANDLE object,
+        CK_OBJECT_CLASS key_class, const CK_BYTE *id, CK_ULONG id_len,
+        const CK_BYTE *label, CK_ULONG label_len) {
+    CK_OBJECT_CLASS object_class;
+    CK_BYTE object_id[OBJINDEX_MAX_ID];
+    CK_BYTE object_label[OBJINDEX_MAX_LABEL];
+    p11_shard_t *shard;
+    CK_RV rv;
+
+    if ((object >> SHARD_HANDLE_SHIFT) >= self->shard_count)
+        return 0;
+    shard = _shard_of(self, &object);
+
+    CK_ATTRIBUTE template[] = {
+            { CKA_CLASS, &object_class, sizeof(object_class) },
+            { CKA_ID, object_id, sizeof(object_id) },
+            { CKA_LABEL, object_label, sizeof(object_label) } };
+    rv = self->p11->C_GetAttributeValue(shard->session, object, template, 3);
+    return rv == CKR_OK
+            && (key_class == OBJINDEX_ANY_CLASS || object_class == key_class)
+            && (id == NULL || (template[1].ulValueLen == id_len
+                    && memcmp(object_id, id, id_len) == 0))
+            && (label == NULL || (template[2].ulValueLen == label_len
+                    && memcmp(object_label, label, label_len) == 0));
+}
+
+/**
+ * Spot check of mapped index file
+ *
+ * Handles are valid only in the process which got them; modules which keep
+ * them stable across processes pass, the others fail here. Passing says
+ * little about the other handles, find_keys() checks each one it returns.
+ *
+ * :return: 1 if sampled handles still refer to indexed objects
+ */
+static int _objindex_verify(P11_Helper* self) {
+    const objindex_entry_t *e;
+    unsigned int i;
+
+    for (i = 0; i < OBJINDEX_SPOT_CHECKS; i++) {
+        e = objindex_sample(self->objindex, i, OBJINDEX_SPOT_CHECKS);
+        if (e == NULL)
+            break;
+        if (!_objindex_handle_matches(self, e->handle, e->key_class, e->id,
+                e->id_len, e->label, e->label_len))
+            return 0;
+    }
+    return 1;
+}
+
+/**
+ * Make sure index file is mapped and up to date
+ *
+ * Current file is kept until it is replaced or removed, then it is loaded
+ * again and spot checked. When that fails, or when too many lookups missed
+ * objects the token has, tokens are scanned and the file is written again.
+ * If writing fails the file is not used any more by this helper.
+ *
+ * :return: 0 if the index cannot be used, no exception is set
+ */
+static int _objindex_refresh(P11_Helper* self) {
+    manifest_t m;
+    unsigned int i;
+    int lock;
+    int rescan = 0;
+    CK_RV rv = CKR_OK;
+
+    if (self->objindex_failed)
+        return 0;
+    if (self->objindex != NULL) {
+        rescan = self->objindex_misses >= OBJINDEX_MIN_MISSES
+                + self->objindex->count / OBJINDEX_MISS_RATIO;
+        if (!rescan && !objindex_stale(self->objindex, self->objindex_path))
+            return 1;
+        objindex_close(self->objindex);
+    } else {
+        self->objindex = malloc(sizeof(objindex_t));
+        if (self->objindex == NULL)
+            return 0;
+    }
+
+    self->objindex_misses = 0;
+    if (!rescan && objindex_load(self->objindex, self->objindex_path,
+            self->index_tokens) == CKR_OK && _objindex_verify(self))
+        return 1;
+    objindex_close(self->objindex);
+
+    lock = _objindex_lock(self);
+    manifest_init(&m);
+    for (i = 0; rv == CKR_OK && i < self->shard_count; i++)
+        rv = manifest_add_session(&m, self->p11, self->shards[i].session,
+                _shard_handle(self, i, 0));
+    if (rv == CKR_OK) {
+        manifest_sort(&m);
+        rv = objindex_write(self->objindex_path, self->index_tokens, &m);
+    }
+    if (rv == CKR_OK)
+        rv = objindex_load(self->objindex, self->objindex_path,
+                self->index_tokens);
+    if (lock >= 0)
+        close(lock);
+    manifest_free(&m);
+
+    if (rv != CKR_OK) {
+        free(self->objindex);
+        self->objindex = NULL;
+        self->objindex_failed = 1;
+        return 0;
+    }
+    return 1;
+}
+
+/**
+ * Test if calibration file line belongs to token with given ID
+ */
+static int _token_line(const char *line, const char *id) {
+    size_t len = strlen(id);
+
+    return strncmp(line, id, len) == 0 && line[len] == '\t';
+}
+
+/**
+ * Load C_WrapKey durations of tokens used by helper from calibration file
+ *
+ * Lines are "model<TAB>serial<TAB>mechanism<TAB>nanoseconds", missing
+ * file means that nothing was calibrated yet.
+ */
+static void _wrap_calibration_load(P11_Helper* self) {
+    char line[256];
+    char id[64];
+    char *end;
+    FILE *f;
+    unsigned int i, m;
+    CK_MECHANISM_TYPE mech;
+    unsigned long long ns;
+
+    if (self->calibration == NULL)
+        return;
+    f = fopen(self->calibration, "r");
+    if (f == NULL)
+        return;
+
+    while (fgets(line, sizeof(line), f) != NULL) {
+        if (line[0] == '#')
+            continue;
+        for (i = 0; i < self->shard_count; i++) {
+            if (!_token_id(self, &self->shards[i], id, sizeof(id))
+                    || !_token_line(line, id))
+                continue;
+            mech = strtoul(line + strlen(id) + 1, &end, 0);
+            ns = strtoull(end, NULL, 10);
+            for (m = 0; m < WRAP_MECH_COUNT; m++) {
+                if (wrap_mechs[m].mech == mech)
+                    self->shards[i].wrap_ns[m] = ns;
+            }
+        }
+    }
+    fclose(f);
+}
+
+/**
+ * Write C_WrapKey durations to calibration file
+ *
+ * Results of tokens not used by this helper are preserved. The file is
+ * replaced atomically.
+ *
+ * :return: 1 on success, 0 if an error occurs and set the error message
+ */
+static int _wrap_calibration_save(P11_Helper* self) {
+    char line[256];
+    char id[64];
+    char *tmp = NULL;
+    FILE *in;
+    FILE *out;
+    int keep;
+    int err = 0;
+    unsigned int i, j, m;
+
+    if (asprintf(&tmp, "%s.tmp", self->calibration) == -1) {
+        PyErr_NoMemory();
+        return 0;
+    }
+    out = fopen(tmp, "w");
+    if (out == NULL) {
+        err = errno;
+        goto cleanup;
+    }
+    fprintf(out, "# model\tserial\tmechanism\tC_WrapKey ns\n");
+
+    in = fopen(self->calibration, "r");
+    while (in != NULL && fgets(line, sizeof(line), in) != NULL) {
+        if (line[0] == '#')
+            continue;
+        keep = 1;
+        for (i = 0; i < self->shard_count; i++) {
+            if (_token_id(self, &self->shards[i], id, sizeof(id))
+                    && _token_line(line, id))
+                keep = 0;
+        }
+        if (keep)
+            fputs(line, out);
+    }
+    if (in != NULL)
+        fclose(in);
+
+    for (i = 0; i < self->shard_count; i++) {
+        /* the same slot can be listed more than once */
+        for (j = 0; j < i; j++) {
+            if (self->shards[j].slot == self->shards[i].slot)
+                break;
+        }
+        if (j < i || !_token_id(self, &self->shards[i], id, sizeof(id)))
+            continue;
+        for (m = 0; m < WRAP_MECH_COUNT; m++) {
+            if (self->shards[i].wrap_ns[m] != 0)
+                fprintf(out, "%s\t0x%lx\t%llu\n", id, wrap_mechs[m].mech,
+                        (unsigned long long) self->shards[i].wrap_ns[m]);
+        }
+    }
+
+    if (fclose(out) != 0 || rename(tmp, self->calibration) != 0) {
+        err = errno;
+        remove(tmp);
+    }
+
+cleanup:
+    free(tmp);
+    if (err != 0) {
+        errno = err;
+        PyErr_SetFromErrnoWithFilename(PyExc_IOError, self->calibration);
+        return 0;
+    }
+    return 1;
+}
+
+static uint64_t _now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * Measure C_WrapKey of all wrapping mechanisms on token of one shard
+ *
+ * Temporary session keys are generated and destroyed, mechanisms which
+ * the token does not support or refuses to use are left at 0.
+ * Does not touch Python objects.
+ *
+ * :return: CKR_OK or error from generation of the key to be wrapped
+ */
+static CK_RV _wrap_calibrate_shard(P11_Helper* self, p11_shard_t *shard,
+        unsigned long iterations) {
+    const p11caps_slot_t *slot = p11caps_slot(&self->caps, shard->slot);
+    CK_FUNCTION_LIST_PTR p11 = self->p11;
+    CK_SESSION_HANDLE session = shard->session;
+    CK_OBJECT_HANDLE target = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE aes = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE pub = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE priv = CK_INVALID_HANDLE;
+    CK_OBJECT_HANDLE wrapping;
+    CK_ULONG target_len = 16;
+    CK_ULONG aes_len = 32;
+    CK_ULONG modulus_bits = 2048;
+    CK_BYTE exponent[] = { 1, 0, 1 };
+    CK_MECHANISM aes_gen = { CKM_AES_KEY_GEN, NULL, 0 };
+    CK_MECHANISM rsa_gen = { CKM_RSA_PKCS_KEY_PAIR_GEN, NULL, 0 };
+    CK_MECHANISM mech = { 0, NULL, 0 };
+    CK_BYTE out[1024];
+    CK_ULONG out_len;
+    CK_RV rv;
+    unsigned long n;
+    unsigned int m;
+    uint64_t start;
+
+    CK_ATTRIBUTE target_template[] = {
+        { CKA_TOKEN, &false, sizeof(CK_BBOOL) },
+        { CKA_VALUE_LEN, &target_len, sizeof(target_len) },
+        { CKA_EXTRACTABLE, &true, sizeof(CK_BBOOL) }
+    };
+    CK_ATTRIBUTE aes_template[] = {
+        { CKA_TOKEN, &false, sizeof(CK_BBOOL) },
+        { CKA_VALUE_LEN, &aes_len, sizeof(aes_len) },
+        { CKA_WRAP, &true, sizeof(CK_BBOOL) }
+    };
+    CK_ATTRIBUTE pub_template[] = {
+        { CKA_TOKEN, &false, sizeof(CK_BBOOL) },
+        { CKA_MODULUS_BITS, &modulus_bits, sizeof(modulus_bits) },
+        { CKA_PUBLIC_EXPONENT, exponent, sizeof(exponent) },
+        { CKA_WRAP, &true, sizeof(CK_BBOOL) }
+    };
+    CK_ATTRIBUTE priv_template[] = {
+        { CKA_TOKEN, &false, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, &true, sizeof(CK_BBOOL) },
+        { CKA_SENSITIVE, &true, sizeof(CK_BBOOL) }
+    };
+
+    memset(shard->wrap_ns, 0, sizeof(shard->wrap_ns));
+    rv = p11->C_GenerateKey(session, &aes_gen, target_template,
+            sizeof(target_template) / sizeof(CK_ATTRIBUTE), &target);
+    if (rv != CKR_OK)
+        return rv;
+
+    for (m = 0; m < WRAP_MECH_COUNT; m++) {
+        if (p11caps_check(slot, wrap_mechs[m].mech, CKF_WRAP, 0) != CKR_OK)
+            continue;
+
+        /* wrapping keys are generated only when some mechanism needs them */
+        if (wrap_mechs[m].key_type == CKK_AES && aes == CK_INVALID_HANDLE
+                && p11->C_GenerateKey(session, &aes_gen, aes_template,
+                        sizeof(aes_template) / sizeof(CK_ATTRIBUTE), &aes)
+                        != CKR_OK)
+            aes = CK_INVALID_HANDLE;
+        if (wrap_mechs[m].key_type == CKK_RSA && pub == CK_INVALID_HANDLE
+                && p11->C_GenerateKeyPair(session, &rsa_gen, pub_template,
+                        sizeof(pub_template) / sizeof(CK_ATTRIBUTE),
+                        priv_template,
+                        sizeof(priv_template) / sizeof(CK_ATTRIBUTE), &pub,
+                        &priv) != CKR_OK)
+            pub = priv = CK_INVALID_HANDLE;
+        wrapping = wrap_mechs[m].key_type == CKK_AES ? aes : pub;
+        if (wrapping == CK_INVALID_HANDLE)
+            continue;
+
+        /* warm up, this also skips mechanisms the token refuses */
+        mech.mechanism = wrap_mechs[m].mech;
+        _wrap_mech_params(&mech);
+        out_len = sizeof(out);
+        if (p11->C_WrapKey(session, &mech, wrapping, target, out, &out_len)
+                != CKR_OK)
+            continue;
+
+        start = _now_ns();
+        for (n = 0; n < iterations; n++) {
+            out_len = sizeof(out);
+            if (p11->C_WrapKey(session, &mech, wrapping, target, out,
+                    &out_len) != CKR_OK)
+                break;
+        }
+        if (n == iterations)
+            shard->wrap_ns[m] = (_now_ns() - start) / iterations + 1;
+    }
+
+    p11->C_DestroyObject(session, target);
+    if (aes != CK_INVALID_HANDLE)
+        p11->C_DestroyObject(session, aes);
+    if (pub != CK_INVALID_HANDLE) {
+        p11->C_DestroyObject(session, pub);
+        p11->C_DestroyObject(session, priv);
+    }
+    return CKR_OK;
+}
+
+/**
+ * Pick wrapping mechanism for export_wrapped_key(wrapping_mech=MECH_AUTO)
+ *
+ * Candidates have to match type of wrapping key, be able to wrap the key
+ * (AES key wrap without padding and RSA cannot wrap private keys), be
+ * allowed by policy and supported by token. The fastest calibrated one
+ * wins, without calibration the first one from wrap_mechs.
+ *
+ * :param allowed: sequence of allowed mechanisms or NULL for default policy
+ * :return: 1 and set mech, 0 if an error occurs and set the error message
+ */
+static int _wrap_mech_auto(P11_Helper* self, const p11_shard_t *shard,
+        CK_OBJECT_HANDLE key, CK_OBJECT_HANDLE wrapping_key,
+        PyObject *allowed, CK_MECHANISM_TYPE *mech) {
+    const p11caps_slot_t *slot = p11caps_slot(&self->caps, shard->slot);
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+    CK_KEY_TYPE wrapping_type = CKK_AES;
+    CK_BBOOL allow[WRAP_MECH_COUNT];
+    PyObject *seq;
+    CK_MECHANISM_TYPE type;
+    CK_RV rv;
+    Py_ssize_t i;
+    unsigned int m;
+    int best = -1;
+
+    CK_ATTRIBUTE class_template[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) } };
+    CK_ATTRIBUTE type_template[] = {
+        { CKA_KEY_TYPE, &wrapping_type, sizeof(wrapping_type) } };
+
+    for (m = 0; m < WRAP_MECH_COUNT; m++)
+        allow[m] = allowed == NULL ? wrap_mechs[m].default_allowed : CK_FALSE;
+    if (allowed != NULL) {
+        seq = PySequence_Fast(allowed, "allowed_mechs must be a sequence");
+        if (seq == NULL)
+            return 0;
+        for (i = 0; i < PySequence_Fast_GET_SIZE(seq); i++) {
+            type = PyInt_AsUnsignedLongMask(PySequence_Fast_GET_ITEM(seq, i));
+            for (m = 0; m < WRAP_MECH_COUNT; m++) {
+                if (wrap_mechs[m].mech == type)
+                    allow[m] = CK_TRUE;
+            }
+        }
+        Py_DECREF(seq);
+        if (PyErr_Occurred())
+            return 0;
+    }
+
+    rv = self->p11->C_GetAttributeValue(shard->session, key, class_template,
+            1);
+    if (!check_return_value(rv, "key wrapping: get key class"))
+        return 0;
+    rv = self->p11->C_GetAttributeValue(shard->session, wrapping_key,
+            type_template, 1);
+    if (!check_return_value(rv, "key wrapping: get wrapping key type"))
+        return 0;
+
+    for (m = 0; m < WRAP_MECH_COUNT; m++) {
+        if (!allow[m] || wrap_mechs[m].key_type != wrapping_type
+                || (key_class == CKO_PRIVATE_KEY
+                    && !wrap_mechs[m].wraps_private)
+                || p11caps_check(slot, wrap_mechs[m].mech, CKF_WRAP, 0)
+                    != CKR_OK)
+            continue;
+        if (best < 0 || (shard->wrap_ns[m] != 0
+                && (shard->wrap_ns[best] == 0
+                    || shard->wrap_ns[m] < shard->wrap_ns[best])))
+            best = m;
+    }
+    if (best < 0) {
+        PyErr_SetString(ipap11helperError,
+                "key wrapping: no allowed mechanism can wrap the key");
+        return 0;
+    }
+    *mech = wrap_mechs[best].mech;
+    return 1;
+}
+
+/***********************************************************************
+ * P11_Helper object
+ */
+
+static void P11_Helper_dealloc(P11_Helper* self) {
+    free(self->shards);
+    free(self->calibration);
+    if (self->wrap_cache != NULL) {
+        wrapcache_free(self->wrap_cache);
+        free(self->wrap_cache);
+    }
+    free(self->wrap_cache_path);
+    if (self->index != NULL) {
+        shmindex_close(self->index);
+        free(self->index);
+    }
+    if (self->objindex != NULL) {
+        objindex_close(self->objindex);
+        free(self->objindex);
+    }
+    free(self->objindex_path);
+    free(self->id_pool);
+    Py_XDECREF(self->issued_ids);
+    Py_XDECREF(self->kcv_cache);
+    p11caps_free(&self->caps);
+    self->ob_type->tp_free((PyObject*) self);
+}
+
+static PyObject *
+P11_Helper_new(PyTypeObject *type, PyObject *args, PyObject *kwds) {
+    P11_Helper *self;
+
+    self = (P11_Helper *) type->tp_alloc(type, 0);
+    if (self != NULL) {
+
+        self->slot = 0;
+        self->session = 0;
+        self->p11 = NULL;
+        self->shards = NULL;
+        self->shard_count = 0;
+        self->routing = SHARD_ROUTING_HASH;
+        self->next_shard = 0;
+        memset(&self->caps, 0, sizeof(self->caps));
+        self->calibration = NULL;
+        self->wrap_cache = NULL;
+        self->wrap_cache_path = NULL;
+        self->index = NULL;
+        self->index_tokens = 0;
+        self->index_negative_ns = 0;
+        self->objindex = NULL;
+        self->objindex_path = NULL;
+        self->objindex_misses = 0;
+        self->objindex_failed = 0;
+        self->id_pool = NULL;
+        self->id_pool_len = 0;
+        self->id_pool_used = 0;
+        self->issued_ids = NULL;
+        self->kcv_cache = NULL;
+    }
+
+    return (PyObject *) self;
+}
+
+static int P11_Helper_init(P11_Helper *self, PyObject *args, PyObject *kwds) {
+    const char* user_pin = NULL;
+    const char* library_path = NULL;
+    PyObject *stats = NULL;
+    const char *trace = NULL;
+    PyObject *slots = NULL;
+    PyObject *slots_seq = NULL;
+    const char *routing = NULL;
+    const char *calibration = NULL;
+    PyObject *wrap_cache = NULL;
+    const char *shared_index = NULL;
+    const char *index_file = NULL;
+    double index_negative_ttl = 0;
+    char token[64];
+    unsigned int shard_count = 1;
+    unsigned int i;
+    CK_RV rv;
+    void *module_handle = NULL;
+    /* bulk operations call the library from threads without GIL */
+    CK_C_INITIALIZE_ARGS init_args = { NULL, NULL, NULL, NULL,
+            CKF_OS_LOCKING_OK, NULL };
+
+    /* Parse method args*/
+    static char *kwlist[] = { "slot", "user_pin", "library_path", "stats",
+            "trace", "slots", "routing", "calibration", "wrap_cache",
+            "shared_index", "index_file", "index_negative_ttl", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "iss|OzOzzOzzd", kwlist,
+            &self->slot, &user_pin, &library_path, &stats, &trace, &slots,
+            &routing, &calibration, &wrap_cache, &shared_index, &index_file,
+            &index_negative_ttl))
+        return -1;
+
+    /*
+     * Wrap cache: True keeps blobs in memory, file name also persists them
+     */
+    if (self->wrap_cache != NULL) {
+        wrapcache_free(self->wrap_cache);
+        free(self->wrap_cache);
+        self->wrap_cache = NULL;
+    }
+    free(self->wrap_cache_path);
+    self->wrap_cache_path = NULL;
+    if (wrap_cache != NULL && PyString_Check(wrap_cache)) {
+        self->wrap_cache_path = strdup(PyString_AsString(wrap_cache));
+        if (self->wrap_cache_path == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    } else if (wrap_cache != NULL && wrap_cache != Py_None
+            && !PyBool_Check(wrap_cache)) {
+        PyErr_SetString(PyExc_TypeError,
+                "wrap_cache must be bool or file name");
+        return -1;
+    }
+    if (self->wrap_cache_path != NULL || wrap_cache == Py_True) {
+        self->wrap_cache = malloc(sizeof(wrapcache_t));
+        if (self->wrap_cache == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        wrapcache_init(self->wrap_cache);
+        if (self->wrap_cache_path != NULL) {
+            rv = wrapcache_load(self->wrap_cache, self->wrap_cache_path);
+            if (!check_return_value(rv, "load wrap cache"))
+                return -1;
+        }
+    }
+
+    free(self->calibration);
+    self->calibration = NULL;
+    if (calibration != NULL) {
+        self->calibration = strdup(calibration);
+        if (self->calibration == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+    }
+
+    /*
+     * Shards: keys are spread over all slots in the list, slot is ignored
+     */
+    if (routing == NULL || strcmp(routing, "hash") == 0) {
+        self->routing = SHARD_ROUTING_HASH;
+    } else if (strcmp(routing, "round_robin") == 0) {
+        self->routing = SHARD_ROUTING_ROUND_ROBIN;
+    } else {
+        PyErr_SetString(PyExc_ValueError,
+                "routing must be 'hash' or 'round_robin'");
+        return -1;
+    }
+    if (slots != NULL && slots != Py_None) {
+        slots_seq = PySequence_Fast(slots, "slots must be a sequence");
+        if (slots_seq == NULL)
+            return -1;
+        if (PySequence_Fast_GET_SIZE(slots_seq) < 1
+                || PySequence_Fast_GET_SIZE(slots_seq) > SHARD_MAX) {
+            PyErr_SetString(PyExc_ValueError,
+                    "slots must contain 1 to 256 slot IDs");
+            Py_DECREF(slots_seq);
+            return -1;
+        }
+        shard_count = (unsigned int) PySequence_Fast_GET_SIZE(slots_seq);
+    }
+    free(self->shards);
+    self->shards = calloc(shard_count, sizeof(p11_shard_t));
+    if (self->shards == NULL) {
+        Py_XDECREF(slots_seq);
+        PyErr_NoMemory();
+        return -1;
+    }
+    self->shard_count = shard_count;
+    self->shards[0].slot = self->slot;
+    for (i = 0; slots_seq != NULL && i < shard_count; i++) {
+        self->shards[i].slot = PyInt_AsUnsignedLongMask(
+                PySequence_Fast_GET_ITEM(slots_seq, i));
+    }
+    Py_XDECREF(slots_seq);
+    if (PyErr_Occurred())
+        return -1;
+    self->slot = self->shards[0].slot;
+
+    CK_C_GetFunctionList pGetFunctionList = loadLibrary(library_path,
+            &module_handle);
+    if (!pGetFunctionList) {
+        PyErr_SetString(ipap11helperError, "Could not load the library.");
+        return -1;
+    }
+
+    /*
+     * Load the function list
+     */
+    (*pGetFunctionList)(&self->p11);
+
+    /*
+     * Record calls to binary trace for p11replay if requested
+     */
+    if (trace == NULL)
+        trace = getenv("P11_TRACE");
+    if (trace != NULL)
+        self->p11 = p11trace_wrap(self->p11, trace);
+
+    /*
+     * Collect call statistics if requested, see P11_Helper.stats()
+     */
+    if ((stats != NULL && PyObject_IsTrue(stats) == 1)
+            || getenv("P11_STATS") != NULL)
+        self->p11 = p11stats_wrap(self->p11);
+
+    /*
+     * Initialize
+     */
+    rv = self->p11->C_Initialize(&init_args);
+    if (!check_return_value(rv, "initialize"))
+        return -1;
+
+    /*
+     * Discover slots and mechanisms once, failure only disables the checks
+     */
+    p11caps_free(&self->caps);
+    p11caps_load(self->p11, &self->caps);
+    _wrap_calibration_load(self);
+
+    for (i = 0; i < self->shard_count; i++) {
+        /*
+         *Start session
+         */
+        rv = _open_session(self, &self->shards[i], &self->shards[i].session);
+        if (!check_return_value(rv, "open session"))
+            return -1;
+
+        /*
+         * Login, the same token can be listed more than once
+         */
+        rv = self->p11->C_Login(self->shards[i].session, CKU_USER,
+                (CK_BYTE*) user_pin, strlen((char *) user_pin));
+        if (rv == CKR_USER_ALREADY_LOGGED_IN && i > 0)
+            rv = CKR_OK;
+        if (!check_return_value(rv, "log in"))
+            return -1;
+    }
+    self->session = self->shards[0].session;
+
+    /*
+     * Indexes are used only by helpers with the same tokens
+     */
+    self->index_tokens = FNV64_OFFSET_BASIS;
+    for (i = 0; i < self->shard_count; i++) {
+        if (!_token_id(self, &self->shards[i], token, sizeof(token)))
+            token[0] = '\0';
+        self->index_tokens = fnv1a64_update(self->index_tokens, token,
+                strlen(token) + 1);
+    }
+    if (self->index != NULL) {
+        shmindex_close(self->index);
+        free(self->index);
+        self->index = NULL;
+    }
+    /*
+     * Other PKCS#11 applications do not invalidate the shared index, so a
+     * missing object is believed only with explicit index_negative_ttl
+     * (seconds). Lookups of missing objects never rebuild the index, they
+     * search the token when it is older; index_lookup() rebuilds it.
+     */
+    if (index_negative_ttl < 0) {
+        PyErr_SetString(PyExc_ValueError,
+                "index_negative_ttl must not be negative");
+        return -1;
+    }
+    self->index_negative_ns = (uint64_t) (index_negative_ttl * 1e9);
+    if (shared_index != NULL) {
+        self->index = malloc(sizeof(shmindex_t));
+        if (self->index == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        if (shmindex_open(self->index, shared_index) != CKR_OK) {
+            free(self->index);
+            self->index = NULL;
+            PyErr_SetString(ipap11helperError,
+                    "Could not open shared index");
+            return -1;
+        }
+    }
+
+    /*
+     * Index file from previous run, scan tokens if it does not match
+     */
+    if (self->objindex != NULL) {
+        objindex_close(self->objindex);
+        free(self->objindex);
+        self->objindex = NULL;
+    }
+    free(self->objindex_path);
+    self->objindex_path = NULL;
+    self->objindex_misses = 0;
+    self->objindex_failed = 0;
+    if (index_file != NULL) {
+        self->objindex_path = strdup(index_file);
+        if (self->objindex_path == NULL) {
+            PyErr_NoMemory();
+            return -1;
+        }
+        _objindex_refresh(self);
+    }
+
+    return 0;
+}
+
+static PyMemberDef P11_Helper_members[] = { { NULL } /* Sentinel */
+};
+
+/*
+ * Finalize operations with pkcs11 library
+ */
+static PyObject *
+P11_Helper_finalize(P11_Helper* self) {
+    CK_RV rv;
+    unsigned int i;
+
+    if (self->p11 == NULL)
+        return Py_None;
+
+    /*
+     * Persist wrap cache, failure only costs re-wrapping next time
+     */
+    if (self->wrap_cache != NULL && self->wrap_cache_path != NULL
+            && self->wrap_cache->dirty)
+        wrapcache_save(self->wrap_cache, self->wrap_cache_path);
+    _pool_close(self);
+
+    for (i = 0; i < self->shard_count; i++) {
+        /*
+         * Logout
+         */
+        rv = self->p11->C_Logout(self->shards[i].session);
+        if (rv != CKR_USER_NOT_LOGGED_IN) {
+            if (!check_return_value(rv, "log out"))
+                return NULL;
+        }
+
+        /*
+         * End session
+         */
+        rv = self->p11->C_CloseSession(self->shards[i].session);
+        if (!check_return_value(rv, "close session"))
+            return NULL;
+    }
+
+    /*
+     * Finalize
+     */
+    self->p11->C_Finalize(NULL);
+
+    self->p11 = NULL;
+    self->session = 0;
+    self->slot = 0;
+
+    return Py_None;
+}
+
+/********************************************************************
+ * Methods working with keys
+ */
+
+/**
+ * Generate master key
+ *
+ *:return: master key handle
+ */
+static PyObject *
+P11_Helper_generate_master_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+
+    PyObj2Bool_mapping_t attrs[] = { { NULL, &true }, //sec_en_cka_copyable
+            { NULL, &false }, //sec_en_cka_decrypt
+            { NULL, &false }, //sec_en_cka_derive
+            { NULL, &false }, //sec_en_cka_encrypt
+            { NULL, &true }, //sec_en_cka_extractable
+            { NULL, &true }, //sec_en_cka_modifiable
+            { NULL, &true }, //sec_en_cka_private
+            { NULL, &true }, //sec_en_cka_sensitive
+            { NULL, &false }, //sec_en_cka_sign
+            { NULL, &true }, //sec_en_cka_unwrap
+            { NULL, &false }, //sec_en_cka_verify
+            { NULL, &true }, //sec_en_cka_wrap
+            { NULL, &false } //sec_en_cka_wrap_with_trusted
+    };
+
+    CK_ULONG key_length = 16;
+    CK_RV rv;
+    CK_OBJECT_HANDLE master_key;
+    CK_BYTE *id = NULL;
+    int id_length = 0;
+    unsigned int shard;
+
+    PyObject *label_unicode = NULL;
+    PyObject *profile = NULL;
+    Py_ssize_t label_length = 0;
+    int r;
+    static char *kwlist[] = { "subject", "id", "key_length", "cka_copyable",
+            "cka_decrypt", "cka_derive", "cka_encrypt", "cka_extractable",
+            "cka_modifiable", "cka_private", "cka_sensitive", "cka_sign",
+            "cka_unwrap", "cka_verify", "cka_wrap", "cka_wrap_with_trusted",
+            "profile", NULL };
+    //TODO check long overflow
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#|kOOOOOOOOOOOOOO", kwlist,
+            &label_unicode, &id, &id_length, &key_length,
+            &attrs[sec_en_cka_copyable].py_obj,
+            &attrs[sec_en_cka_decrypt].py_obj, &attrs[sec_en_cka_derive].py_obj,
+            &attrs[sec_en_cka_encrypt].py_obj,
+            &attrs[sec_en_cka_extractable].py_obj,
+            &attrs[sec_en_cka_modifiable].py_obj,
+            &attrs[sec_en_cka_private].py_obj,
+            &attrs[sec_en_cka_sensitive].py_obj, &attrs[sec_en_cka_sign].py_obj,
+            &attrs[sec_en_cka_unwrap].py_obj, &attrs[sec_en_cka_verify].py_obj,
+            &attrs[sec_en_cka_wrap].py_obj,
+            &attrs[sec_en_cka_wrap_with_trusted].py_obj, &profile)) {
+        return NULL;
+    }
+
+    Py_XINCREF(label_unicode);
+    CK_BYTE *label = (unsigned char*) unicode_to_char_array(label_unicode,
+            &label_length);
+    Py_XDECREF(label_unicode);
+    CK_MECHANISM mechanism = { //TODO param?
+            CKM_AES_KEY_GEN, NULL_PTR, 0 };
+
+    if ((key_length != 16) && (key_length != 24) && (key_length != 32)) {
+        PyErr_SetString(ipap11helperError,
+                "generate_master_key: key length allowed values are: 16, 24 and 32");
+        return NULL;
+    }
+
+    shard = _shard_route(self, id, id_length);
+    if (!_check_mechanism(self, &self->shards[shard], CKM_AES_KEY_GEN,
+            CKF_GENERATE, key_length, "generate_master_key"))
+        return NULL;
+
+    //TODO free label if check failed
+    //TODO is label freed inside???? dont we use freed value later
+    r = _id_issued(self, id, id_length) ? 0 :
+            _id_exists(self, id, id_length, CKO_SECRET_KEY);
+    if (r == 1) {
+        PyErr_SetString(ipap11helperDuplicationError,
+                "Master key with same ID already exists");
+        return NULL;
+    } else if (r == -1) {
+        return NULL;
+    }
+
+    /* Process keyword boolean arguments */
+    if (!_apply_profile(profile, CKO_SECRET_KEY, attrs,
+            sizeof(attrs) / sizeof(PyObj2Bool_mapping_t)))
+        return NULL;
+    convert_py2bool(attrs, sizeof(attrs) / sizeof(PyObj2Bool_mapping_t));
+
+    CK_ATTRIBUTE symKeyTemplate[] = {
+        { CKA_ID, id, id_length },
+        { CKA_LABEL, label, label_length },
+        { CKA_TOKEN, &true, sizeof(CK_BBOOL) },
+        { CKA_VALUE_LEN, &key_length, sizeof(key_length) },
+        //{CKA_COPYABLE, attrs[sec_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
+        { CKA_DECRYPT, attrs[sec_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
+        { CKA_DERIVE, attrs[sec_en_cka_derive].bool, sizeof(CK_BBOOL) },
+        { CKA_ENCRYPT, attrs[sec_en_cka_encrypt].bool, sizeof(CK_BBOOL) },
+        { CKA_EXTRACTABLE, attrs[sec_en_cka_extractable].bool, sizeof(CK_BBOOL) },
+        { CKA_MODIFIABLE, attrs[sec_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, attrs[sec_en_cka_private].bool, sizeof(CK_BBOOL) },
+        { CKA_SENSITIVE, attrs[sec_en_cka_sensitive].bool, sizeof(CK_BBOOL) },
+        { CKA_SIGN, attrs[sec_en_cka_sign].bool, sizeof(CK_BBOOL) },
+        { CKA_UNWRAP, attrs[sec_en_cka_unwrap].bool, sizeof(CK_BBOOL) },
+        { CKA_VERIFY, attrs[sec_en_cka_verify].bool, sizeof(CK_BBOOL) },
+        { CKA_WRAP, attrs[sec_en_cka_wrap].bool, sizeof(CK_BBOOL) },
+        { CKA_WRAP_WITH_TRUSTED, attrs[sec_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
+    };
+
+    rv = self->p11->C_GenerateKey(self->shards[shard].session, &mechanism,
+            symKeyTemplate, sizeof(symKeyTemplate) / sizeof(CK_ATTRIBUTE),
+            &master_key);
+    if (!check_return_value(rv, "generate master key"))
+        return NULL;
+    _index_invalidate(self);
+
+    return Py_BuildValue("k", _shard_handle(self, shard, master_key));
+}
+
+/**
+ * Generate replica keys
+ *
+ * RSA key pair by default, key_type=KEY_TYPE_EC generates key pair on curve
+ * "P-256" or "P-384". EC public key cannot wrap, master keys are
+ * distributed through derive_wrapping_key() instead, so EC defaults are
+ * pub_cka_wrap=False, priv_cka_unwrap=False and priv_cka_derive=True.
+ *
+ * :returns: tuple (public_key_handle, private_key_handle)
+ */
+static PyObject *
+P11_Helper_generate_replica_key_pair(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_RV rv;
+    int r;
+    int issued;
+    unsigned int shard;
+    CK_ULONG modulus_bits = 2048;
+    CK_KEY_TYPE key_type = CKK_RSA;
+    const char *curve = "P-256";
+    CK_ULONG curve_bits = 0;
+    const CK_BYTE *ec_params = NULL;
+    CK_ULONG ec_params_len = 0;
+    CK_BYTE *id = NULL;
+    int id_length = 0;
+    PyObject* label_unicode = NULL;
+    PyObject *pub_profile = NULL;
+    PyObject *priv_profile = NULL;
+    Py_ssize_t label_length = 0;
+
+    PyObj2Bool_mapping_t attrs_pub[] = { { NULL, &true }, //pub_en_cka_copyable
+            { NULL, &false }, //pub_en_cka_derive
+            { NULL, &false }, //pub_en_cka_encrypt
+            { NULL, &true }, //pub_en_cka_modifiable
+            { NULL, &true }, //pub_en_cka_private
+            { NULL, &false }, //pub_en_cka_trusted
+            { NULL, &false }, //pub_en_cka_verify
+            { NULL, &false }, //pub_en_cka_verify_recover
+            { NULL, &true }, //pub_en_cka_wrap
+            };
+
+    PyObj2Bool_mapping_t attrs_priv[] = { { NULL, &false }, //priv_en_cka_always_authenticate
+            { NULL, &true }, //priv_en_cka_copyable
+            { NULL, &false }, //priv_en_cka_decrypt
+            { NULL, &false }, //priv_en_cka_derive
+            { NULL, &false }, //priv_en_cka_extractable
+            { NULL, &true }, //priv_en_cka_modifiable
+            { NULL, &true }, //priv_en_cka_private
+            { NULL, &true }, //priv_en_cka_sensitive
+            { NULL, &false }, //priv_en_cka_sign
+            { NULL, &false }, //priv_en_cka_sign_recover
+            { NULL, &true }, //priv_en_cka_unwrap
+            { NULL, &false } //priv_en_cka_wrap_with_trusted
+    };
+
+    static char *kwlist[] = { "label", "id", "modulus_bits",
+    /* public key kw */
+    "pub_cka_copyable", "pub_cka_derive", "pub_cka_encrypt",
+            "pub_cka_modifiable", "pub_cka_private", "pub_cka_trusted",
+            "pub_cka_verify", "pub_cka_verify_recover", "pub_cka_wrap",
+            /* private key kw*/
+            "priv_cka_always_authenticate", "priv_cka_copyable",
+            "priv_cka_decrypt", "priv_cka_derive", "priv_cka_extractable",
+            "priv_cka_modifiable", "priv_cka_private", "priv_cka_sensitive",
+            "priv_cka_sign", "priv_cka_sign_recover", "priv_cka_unwrap",
+            "priv_cka_wrap_with_trusted", "key_type", "curve", "pub_profile",
+            "priv_profile", NULL };
+
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#|kOOOOOOOOOOOOOOOOOOOOOksOO",
+            kwlist, &label_unicode, &id, &id_length, &modulus_bits,
+            /* public key kw */
+            &attrs_pub[pub_en_cka_copyable].py_obj,
+            &attrs_pub[pub_en_cka_derive].py_obj,
+            &attrs_pub[pub_en_cka_encrypt].py_obj,
+            &attrs_pub[pub_en_cka_modifiable].py_obj,
+            &attrs_pub[pub_en_cka_private].py_obj,
+            &attrs_pub[pub_en_cka_trusted].py_obj,
+            &attrs_pub[pub_en_cka_verify].py_obj,
+            &attrs_pub[pub_en_cka_verify_recover].py_obj,
+            &attrs_pub[pub_en_cka_wrap].py_obj,
+            /* private key kw*/
+            &attrs_priv[priv_en_cka_always_authenticate].py_obj,
+            &attrs_priv[priv_en_cka_copyable].py_obj,
+            &attrs_priv[priv_en_cka_decrypt].py_obj,
+            &attrs_priv[priv_en_cka_derive].py_obj,
+            &attrs_priv[priv_en_cka_extractable].py_obj,
+            &attrs_priv[priv_en_cka_modifiable].py_obj,
+            &attrs_priv[priv_en_cka_private].py_obj,
+            &attrs_priv[priv_en_cka_sensitive].py_obj,
+            &attrs_priv[priv_en_cka_sign].py_obj,
+            &attrs_priv[priv_en_cka_sign_recover].py_obj,
+            &attrs_priv[priv_en_cka_unwrap].py_obj,
+            &attrs_priv[priv_en_cka_wrap_with_trusted].py_obj, &key_type,
+            &curve, &pub_profile, &priv_profile)) {
+        return NULL;
+    }
+
+    if (key_type == CKK_EC) {
+        if (strcmp(curve, "P-256") == 0)
+            curve_bits = 256;
+        else if (strcmp(curve, "P-384") == 0)
+            curve_bits = 384;
+        if (spki_ec_params(curve_bits, &ec_params, &ec_params_len)
+                != CKR_OK) {
+            PyErr_SetString(ipap11helperError,
+                    "generate_replica_key_pair: curve must be P-256 or P-384");
+            return NULL;
+        }
+    } else if (key_type != CKK_RSA) {
+        PyErr_SetString(ipap11helperError,
+                "generate_replica_key_pair: unsupported key type");
+        return NULL;
+    }
+
+    Py_XINCREF(label_unicode);
+    CK_BYTE *label = unicode_to_char_array(label_unicode, &label_length);
+    Py_XDECREF(label_unicode);
+
+    CK_OBJECT_HANDLE public_key, private_key;
+    CK_MECHANISM mechanism = {
+    CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0 };
+    if (key_type == CKK_EC)
+        mechanism.mechanism = CKM_EC_KEY_PAIR_GEN;
+
+    //TODO free variables
+
+    shard = _shard_route(self, id, id_length);
+    if (!_check_mechanism(self, &self->shards[shard], mechanism.mechanism,
+            CKF_GENERATE_KEY_PAIR, key_type == CKK_EC ? curve_bits :
+                    modulus_bits, "generate_replica_key_pair"))
+        return NULL;
+
+    issued = _id_issued(self, id, id_length);
+    r = issued ? 0 : _id_exists(self, id, id_length, CKO_PRIVATE_KEY);
+    if (r == 1) {
+        PyErr_SetString(ipap11helperDuplicationError,
+                "Private key with same ID already exists");
+        return NULL;
+    } else if (r == -1) {
+        return NULL;
+    }
+
+    r = issued ? 0 : _id_exists(self, id, id_length, CKO_PUBLIC_KEY);
+    if (r == 1) {
+        PyErr_SetString(ipap11helperDuplicationError,
+                "Public key with same ID already exists");
+        return NULL;
+    } else if (r == -1) {
+        return NULL;
+    }
+
+    /* Process keyword boolean arguments */
+    if (key_type == CKK_EC) {
+        attrs_pub[pub_en_cka_wrap].bool = &false;
+        attrs_priv[priv_en_cka_unwrap].bool = &false;
+        attrs_priv[priv_en_cka_derive].bool = &true;
+    }
+    if (!_apply_profile(pub_profile, CKO_PUBLIC_KEY, attrs_pub,
+            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t))
+            || !_apply_profile(priv_profile, CKO_PRIVATE_KEY, attrs_priv,
+                    sizeof(attrs_priv) / sizeof(PyObj2Bool_mapping_t)))
+        return NULL;
+    convert_py2bool(attrs_pub,
+            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t));
+    convert_py2bool(attrs_priv,
+            sizeof(attrs_priv) / sizeof(PyObj2Bool_mapping_t));
+
+    CK_BYTE public_exponent[] = { 1, 0, 1 }; /* 65537 (RFC 6376 section 3.3.1)*/
+    /* key type specific attributes are at the end */
+    CK_ATTRIBUTE publicKeyTemplate[] = {
+        { CKA_ID, id, id_length },
+        { CKA_LABEL, label, label_length },
+        { CKA_TOKEN, &true, sizeof(true) },
+        //{CKA_COPYABLE, attrs_pub[pub_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
+        { CKA_DERIVE, attrs_pub[pub_en_cka_derive].bool, sizeof(CK_BBOOL) },
+        { CKA_ENCRYPT, attrs_pub[pub_en_cka_encrypt].bool, sizeof(CK_BBOOL) },
+        { CKA_MODIFIABLE, attrs_pub[pub_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, attrs_pub[pub_en_cka_private].bool, sizeof(CK_BBOOL) },
+        { CKA_TRUSTED, attrs_pub[pub_en_cka_trusted].bool, sizeof(CK_BBOOL) },
+        { CKA_VERIFY, attrs_pub[pub_en_cka_verify].bool, sizeof(CK_BBOOL) },
+        { CKA_VERIFY_RECOVER, attrs_pub[pub_en_cka_verify_recover].bool, sizeof(CK_BBOOL) },
+        { CKA_WRAP, attrs_pub[pub_en_cka_wrap].bool, sizeof(CK_BBOOL) },
+        { CKA_MODULUS_BITS, &modulus_bits, sizeof(modulus_bits) },
+        { CKA_PUBLIC_EXPONENT, public_exponent, 3 }, };
+    CK_ULONG public_template_len = sizeof(publicKeyTemplate)
+            / sizeof(CK_ATTRIBUTE);
+
+    if (key_type == CKK_EC) {
+        publicKeyTemplate[public_template_len - 2].type = CKA_EC_PARAMS;
+        publicKeyTemplate[public_template_len - 2].pValue =
+                (CK_BYTE_PTR) ec_params;
+        publicKeyTemplate[public_template_len - 2].ulValueLen = ec_params_len;
+        public_template_len--;
+    }
+
+    CK_ATTRIBUTE privateKeyTemplate[] = {
+        { CKA_ID, id, id_length },
+        { CKA_LABEL, label, label_length },
+        { CKA_TOKEN, &true, sizeof(true) },
+        { CKA_ALWAYS_AUTHENTICATE, attrs_priv[priv_en_cka_always_authenticate].bool, sizeof(CK_BBOOL) },
+        //{CKA_COPYABLE, attrs_priv[priv_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
+        { CKA_DECRYPT, attrs_priv[priv_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
+        { CKA_DERIVE,  attrs_priv[priv_en_cka_derive].bool, sizeof(CK_BBOOL) },
+        { CKA_EXTRACTABLE, attrs_priv[priv_en_cka_extractable].bool, sizeof(CK_BBOOL) },
+        { CKA_MODIFIABLE, attrs_priv[priv_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, attrs_priv[priv_en_cka_private].bool, sizeof(CK_BBOOL) },
+        { CKA_SENSITIVE, attrs_priv[priv_en_cka_sensitive].bool, sizeof(CK_BBOOL) },
+        { CKA_SIGN, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
+        { CKA_SIGN_RECOVER, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
+        { CKA_UNWRAP, attrs_priv[priv_en_cka_unwrap].bool, sizeof(CK_BBOOL) },
+        { CKA_WRAP_WITH_TRUSTED, attrs_priv[priv_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
+    };
+
+    rv = self->p11->C_GenerateKeyPair(self->shards[shard].session, &mechanism,
+            publicKeyTemplate, public_template_len, privateKeyTemplate,
+            sizeof(privateKeyTemplate) / sizeof(CK_ATTRIBUTE), &public_key,
+            &private_key);
+    if (!check_return_value(rv, "generate key pair"))
+        return NULL;
+    _index_invalidate(self);
+
+    return Py_BuildValue("(kk)", _shard_handle(self, shard, public_key),
+            _shard_handle(self, shard, private_key));
+}
+
+/**
+ * Build sorted manifest of objects on all tokens of the helper
+ *
+ * :return: 0 and set the exception on failure
+ */
+static int _token_manifest(P11_Helper* self, manifest_t *m) {
+    unsigned int i;
+    CK_RV rv;
+
+    manifest_init(m);
+    for (i = 0; i < self->shard_count; i++) {
+        rv = manifest_add_session(m, self->p11, self->shards[i].session,
+                _shard_handle(self, i, 0));
+        if (!check_return_value(rv, "token manifest")) {
+            manifest_free(m);
+            return 0;
+        }
+    }
+    manifest_sort(m);
+    return 1;
+}
+
+/**
+ * SubjectPublicKeyInfo of RSA or EC public key object
+ *
+ * :param len: size of out on input, length of SPKI on output
+ */
+static CK_RV _public_key_spki(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object, CK_KEY_TYPE key_type, CK_BYTE_PTR out,
+        CK_ULONG_PTR len) {
+    CK_BYTE value[SPKI_RSA_MAX_MODULUS_LEN];
+    CK_BYTE value2[SPKI_EC_MAX_POINT_LEN + 4];
+    const CK_BYTE *point;
+    CK_ULONG point_len;
+    CK_ATTRIBUTE template[] = {
+            { CKA_MODULUS, value, sizeof(value) },
+            { CKA_PUBLIC_EXPONENT, value2, SPKI_RSA_MAX_EXPONENT_LEN } };
+    CK_RV rv;
+
+    if (key_type == CKK_EC) {
+        template[0].type = CKA_EC_PARAMS;
+        template[0].ulValueLen = SPKI_EC_MAX_PARAMS_LEN;
+        template[1].type = CKA_EC_POINT;
+        template[1].ulValueLen = sizeof(value2);
+    } else if (key_type != CKK_RSA) {
+        return CKR_KEY_TYPE_INCONSISTENT;
+    }
+    rv = self->p11->C_GetAttributeValue(session, object, template, 2);
+    if (rv != CKR_OK)
+        return rv;
+    if (key_type == CKK_RSA)
+        return spki_rsa_encode(value, template[0].ulValueLen, value2,
+                template[1].ulValueLen, out, len);
+    rv = spki_ec_point(value2, template[1].ulValueLen, &point, &point_len);
+    if (rv != CKR_OK)
+        return rv;
+    return spki_ec_encode(value, template[0].ulValueLen, point, point_len,
+            out, len);
+}
+
+/**
+ * Rebuild shared index from tokens
+ *
+ * Objects with ID or label too long for the index are left out and the
+ * index is marked incomplete, so that its misses are not trusted.
+ *
+ * :return: CKR_OK, or reason why index was not published; no exception is
+ *          set, callers fall back to the HSM
+ */
+static CK_RV _index_rebuild(P11_Helper* self) {
+    manifest_t m;
+    shmindex_entry_t *entries;
+    shmindex_entry_t *e;
+    const manifest_entry_t *me;
+    CK_OBJECT_HANDLE object;
+    p11_shard_t *shard;
+    CK_ULONG len;
+    uint64_t generation;
+    size_t i;
+    uint32_t count = 0;
+    CK_RV rv = CKR_OK;
+
+    generation = shmindex_generation(self->index);
+    manifest_init(&m);
+    for (i = 0; rv == CKR_OK && i < self->shard_count; i++)
+        rv = manifest_add_session(&m, self->p11, self->shards[i].session,
+                _shard_handle(self, i, 0));
+    if (rv != CKR_OK)
+        goto final;
+    if (m.count > SHMINDEX_CAPACITY) {
+        rv = CKR_BUFFER_TOO_SMALL;
+        goto final;
+    }
+    entries = calloc(m.count ? m.count : 1, sizeof(shmindex_entry_t));
+    if (entries == NULL) {
+        rv = CKR_HOST_MEMORY;
+        goto final;
+    }
+    for (i = 0; i < m.count; i++) {
+        me = &m.entries[i];
+        if (me->id_len > SHMINDEX_MAX_ID || me->label_len > SHMINDEX_MAX_LABEL)
+            continue;
+        e = &entries[count++];
+        e->key_class = me->key_class;
+        e->key_type = me->key_type;
+        e->id_len = me->id_len;
+        memcpy(e->id, me->id, me->id_len);
+        e->label_len = me->label_len;
+        memcpy(e->label, me->label, me->label_len);
+        if (me->key_class != CKO_PUBLIC_KEY)
+            continue;
+        object = me->handle;
+        shard = _shard_of(self, &object);
+        len = sizeof(e->public_data);
+        if (_public_key_spki(self, shard->session, object, me->key_type,
+                e->public_data, &len) == CKR_OK)
+            e->public_len = len;
+    }
+    rv = shmindex_publish(self->index, generation, self->index_tokens,
+            entries, count, count == m.count);
+    free(entries);
+
+final:
+    manifest_free(&m);
+    return rv;
+}
+
+/**
+ * Look up objects in shared index
+ *
+ * Rebuild scans whole tokens, so callers which could do with one search
+ * of the token instead do not ask for it.
+ *
+ * :param max_age_ns: index published longer ago or incomplete is not used,
+ *                    0 means any age; nonzero is for trusting misses
+ * :param rebuild: rebuild index which is stale or too old
+ * :return: number of matching objects, -1 if index cannot be used
+ */
+static int _index_find(P11_Helper* self, uint64_t max_age_ns, int rebuild,
+        CK_OBJECT_CLASS key_class, const CK_BYTE *id, CK_ULONG id_len,
+        const CK_BYTE *label, CK_ULONG label_len, shmindex_entry_t *out,
+        int max) {
+    unsigned int attempt;
+    int found = -1;
+    CK_RV rv;
+
+    /* rebuild is canceled when another process changes the token */
+    for (attempt = 0; found < 0 && attempt < (rebuild ? 3 : 1); attempt++) {
+        if (attempt > 0) {
+            rv = _index_rebuild(self);
+            if (rv != CKR_OK && rv != CKR_FUNCTION_CANCELED)
+                break;
+        }
+        found = shmindex_find(self->index, self->index_tokens, max_age_ns,
+                key_class, id, id_len, label, label_len, out, max);
+    }
+    return found;
+}
+
+/**
+ * Find key
+ */
+static PyObject *
+P11_Helper_find_keys(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_OBJECT_CLASS class = CKO_VENDOR_DEFINED;
+    CK_OBJECT_CLASS *class_ptr = &class;
+    CK_BYTE *id = NULL; //TODO free
+    CK_BBOOL *ckawrap = NULL;
+    CK_BBOOL *ckaunwrap = NULL;
+    int id_length = 0;
+    PyObject *label_unicode = NULL;
+    PyObject *cka_wrap_bool = NULL;
+    PyObject *cka_unwrap_bool = NULL;
+    Py_ssize_t label_length = 0;
+    CK_OBJECT_HANDLE *objects = NULL;
+    unsigned int objects_len = 0;
+    unsigned int i;
+    int indexed = 0;
+    PyObject *result_list = NULL;
+    const char *uri_str = NULL; //TODO free?
+    P11KitUri *uri = NULL;
+    CK_BYTE *label = NULL; //TODO free
+    CK_ATTRIBUTE template_static[MAX_TEMPLATE_LEN];
+    CK_ATTRIBUTE_PTR template = template_static;
+    CK_ULONG template_len = MAX_TEMPLATE_LEN;
+
+    static char *kwlist[] = { "objclass", "label", "id", "cka_wrap",
+            "cka_unwrap", "uri", NULL };
+    //TODO check long overflow
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iUz#OOs", kwlist, &class,
+            &label_unicode, &id, &id_length, &cka_wrap_bool, &cka_unwrap_bool,
+            &uri_str)) {
+        return NULL;
+    }
+
+    if (label_unicode != NULL) {
+        Py_INCREF(label_unicode);
+        label = (unsigned char*) unicode_to_char_array(label_unicode,
+                &label_length); //TODO verify signed/unsigned
+        Py_DECREF(label_unicode);
+    }
+
+    if (cka_wrap_bool != NULL) {
+        Py_INCREF(cka_wrap_bool);
+        if (PyObject_IsTrue(cka_wrap_bool)) {
+            ckawrap = &true;
+        } else {
+            ckawrap = &false;
+        }
+        Py_DECREF(cka_wrap_bool);
+    }
+
+    if (cka_unwrap_bool != NULL) {
+        Py_INCREF(cka_unwrap_bool);
+        if (PyObject_IsTrue(cka_unwrap_bool)) {
+            ckaunwrap = &true;
+        } else {
+            ckaunwrap = &false;
+        }
+        Py_DECREF(cka_unwrap_bool);
+    }
+
+    if (class == CKO_VENDOR_DEFINED)
+        class_ptr = NULL;
+
+    /*
+     * Objects missing in recent enough shared index need no HSM search,
+     * found ones still do as the index has no handles
+     */
+    if (self->index != NULL && self->index_negative_ns != 0
+            && uri_str == NULL && ckawrap == NULL && ckaunwrap == NULL
+            && (id != NULL || label != NULL)
+            && _index_find(self, self->index_negative_ns, 0,
+                    class_ptr != NULL ? class : SHMINDEX_ANY_CLASS, id,
+                    id_length, label, label_length, NULL, 0) == 0)
+        return PyList_New(0);
+
+    /*
+     * Index file answers lookups by class and CKA_ID without searching the
+     * token when every handle it has still refers to a matching object in
+     * this process. Keys have unique ID within their class, so objects
+     * created since the file was written (by other processes or as session
+     * objects) cannot be missing from a non-empty answer; that does not
+     * hold for labels. Misses and mismatches are searched for in the token.
+     */
+    if (self->objindex_path != NULL && uri_str == NULL && ckawrap == NULL
+            && ckaunwrap == NULL && class_ptr != NULL && id != NULL
+            && label == NULL && _objindex_refresh(self)) {
+        indexed = 1;
+        objects_len = objindex_find(self->objindex, class, id, id_length,
+                NULL, 0, NULL, 0);
+        if (objects_len > 0) {
+            objects = malloc(objects_len * sizeof(CK_OBJECT_HANDLE));
+            if (objects == NULL)
+                return PyErr_NoMemory();
+            objindex_find(self->objindex, class, id, id_length, NULL, 0,
+                    objects, objects_len);
+            for (i = 0; i < objects_len; i++) {
+                if (!_objindex_handle_matches(self, objects[i], class, id,
+                        id_length, NULL, 0))
+                    break;
+            }
+            if (i == objects_len)
+                goto results;
+            free(objects);
+            objects = NULL;
+        }
+        objects_len = 0;
+    }
+
+    if (uri_str == NULL)
+        _fill_template_from_parts(template, &template_len, id, id_length, label,
+                label_length, class_ptr, ckawrap, ckaunwrap);
+    else {
+        if (!_parse_uri(uri_str, &uri))
+            return 0;
+        template = p11_kit_uri_get_attributes(uri, &template_len);
+        /* Do not deallocate URI while you are using the template.
+         * Template contains pointers to values inside URI! */
+    }
+
+    if (!_find_key(self, template, template_len, &objects, &objects_len))
+        return NULL;
+    /* file is out of date, it is rescanned after enough of these */
+    if (indexed && objects_len > 0)
+        self->objindex_misses++;
+
+    if (uri != NULL)
+        p11_kit_uri_free(uri);
+
+results:
+    result_list = PyList_New(objects_len);
+    if (result_list == NULL) {
+        PyErr_SetString(ipap11helperError,
+                "Unable to create list with results");
+        if (objects != NULL) {
+            free(objects);
+        }
+        return NULL;
+    }
+    Py_INCREF(result_list);
+    for (int i = 0; i < objects_len; ++i) {
+        if (PyList_SetItem(result_list, i, Py_BuildValue("k", objects[i]))
+                == -1) {
+            PyErr_SetString(ipap11helperError,
+                    "Unable to add to value to result list");
+            if (objects != NULL) {
+                free(objects);
+            }
+            return NULL;
+        }
+    }
+    free(objects);
+
+    return result_list;
+}
+
+/**
+ * Test if any object or issued ID uses the ID
+ *
+ * IDs in index file are taken as used, shared index answers with opt-in
+ * index_negative_ttl, the token is searched otherwise.
+ *
+ * :return: 1 if used, 0 if free, -1 on error and set the exception
+ */
+static int _id_in_use(P11_Helper* self, CK_BYTE_PTR id, CK_ULONG id_len,
+        PyObject *key) {
+    int r;
+
+    r = PySet_Contains(self->issued_ids, key);
+    if (r != 0)
+        return r;
+    /* indexed ID stays reserved, missing one may be new in the token */
+    if (self->objindex_path != NULL && _objindex_refresh(self)
+            && objindex_find(self->objindex, OBJINDEX_ANY_CLASS, id, id_len,
+                    NULL, 0, NULL, 0) > 0)
+        return 1;
+    if (self->index != NULL && self->index_negative_ns != 0) {
+        r = _index_find(self, self->index_negative_ns, 0, SHMINDEX_ANY_CLASS,
+                id, id_len, NULL, 0, NULL, 0);
+        if (r >= 0)
+            return r > 0;
+    }
+    /* secret key check finds objects of all classes */
+    return _id_exists(self, id, id_len, CKO_SECRET_KEY);
+}
+
+/**
+ * Allocate unique random IDs
+ *
+ * Randomness comes from the token in C_GenerateRandom calls of ID_POOL_SIZE
+ * bytes. Returned IDs were not returned before and were not in use when
+ * checked by _id_in_use(); key creation with such ID skips the search for
+ * duplicate ID (once per ID).
+ *
+ * Uniqueness is only as strong as the configured index. Without index_file
+ * or index_negative_ttl every candidate is searched on every shard, so the
+ * search is moved here, not saved. With index_negative_ttl an ID missing
+ * from the shared index is taken as free, object created by another process
+ * within the TTL is not seen.
+ */
+static PyObject *
+P11_Helper_allocate_ids(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    unsigned int n = 0;
+    unsigned int length = 16;
+    unsigned int i;
+    unsigned long attempts = 0;
+    CK_BYTE_PTR id;
+    PyObject *ret = NULL;
+    PyObject *key;
+    CK_RV rv;
+    int r;
+
+    static char *kwlist[] = { "n", "length", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "I|I", kwlist, &n,
+            &length)) {
+        return NULL;
+    }
+    if (length < 1 || length > ID_MAX_LENGTH) {
+        PyErr_SetString(PyExc_ValueError, "length must be 1 to 128 bytes");
+        return NULL;
+    }
+    if (n > ID_MAX_COUNT) {
+        PyErr_SetString(PyExc_ValueError, "n must be at most 65536");
+        return NULL;
+    }
+    if (self->id_pool == NULL) {
+        self->id_pool = malloc(ID_POOL_SIZE);
+        if (self->id_pool == NULL) {
+            PyErr_NoMemory();
+            return NULL;
+        }
+    }
+    if (self->issued_ids == NULL) {
+        self->issued_ids = PySet_New(NULL);
+        if (self->issued_ids == NULL)
+            return NULL;
+    }
+
+    ret = PyList_New(0);
+    if (ret == NULL)
+        return NULL;
+    for (i = 0; i < n;) {
+        /* bound the search when short IDs are running out */
+        if (++attempts > 100UL * n + 1000) {
+            PyErr_SetString(ipap11helperError, "No unique ID available");
+            goto error;
+        }
+
+        if (self->id_pool_len - self->id_pool_used < length) {
+            self->id_pool_len = 0;
+            self->id_pool_used = 0;
+            rv = self->p11->C_GenerateRandom(self->session, self->id_pool,
+                    ID_POOL_SIZE);
+            if (!check_return_value(rv, "allocate_ids: generate random"))
+                goto error;
+            self->id_pool_len = ID_POOL_SIZE;
+        }
+        id = self->id_pool + self->id_pool_used;
+        self->id_pool_used += length;
+
+        key = PyString_FromStringAndSize((const char *) id, length);
+        if (key == NULL)
+            goto error;
+        r = _id_in_use(self, id, length, key);
+        if (r == 0)
+            r = PySet_Add(self->issued_ids, key) == 0
+                    && PyList_Append(ret, key) == 0 ? 0 : -1;
+        Py_DECREF(key);
+        if (r < 0)
+            goto error;
+        if (r == 0)
+            i++;
+    }
+    return ret;
+
+error:
+    Py_DECREF(ret);
+    return NULL;
+}
+
+/**
+ * delete key
+ */
+static PyObject *
+P11_Helper_delete_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE key_handle = 0;
+    p11_shard_t *shard;
+    static char *kwlist[] = { "key_handle", NULL };
+    //TODO check long overflow
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|", kwlist, &key_handle)) {
+        return NULL;
+    }
+    shard = _shard_of(self, &key_handle);
+    if (shard == NULL)
+        return NULL;
+    _wrap_cache_invalidate(self, shard, key_handle);
+    _kcv_invalidate(self, shard, key_handle);
+    rv = self->p11->C_DestroyObject(shard->session, key_handle);
+    if (!check_return_value(rv, "object deletion")) {
+        return NULL;
+    }
+    _index_invalidate(self);
+
+    return Py_None;
+}
+
+/**
+ * Delete objects given by handles or by search criteria
+ *
+ * Objects are either listed in handles, or found with one search using
+ * objclass/label/id or PKCS#11 uri (at least one criterion is required).
+ * With dry_run=True the number of objects which would be deleted is
+ * returned. Otherwise objects are destroyed with GIL released, in own
+ * sessions, and tuple (deleted, failed) is returned: list of deleted
+ * handles and list of (handle, Error) for objects which could not be
+ * deleted.
+ */
+static PyObject *
+P11_Helper_delete_keys(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *handles = NULL;
+    PyObject *seq = NULL;
+    CK_OBJECT_CLASS class = CKO_VENDOR_DEFINED;
+    PyObject *label_unicode = NULL;
+    CK_BYTE *label = NULL;
+    Py_ssize_t label_length = 0;
+    CK_BYTE *id = NULL;
+    int id_length = 0;
+    const char *uri_str = NULL;
+    P11KitUri *uri = NULL;
+    PyObject *dry_run = NULL;
+    CK_ATTRIBUTE template_static[MAX_TEMPLATE_LEN];
+    CK_ATTRIBUTE_PTR template = template_static;
+    CK_ULONG template_len = MAX_TEMPLATE_LEN;
+    CK_OBJECT_HANDLE *objects = NULL;
+    unsigned int objects_len = 0;
+    CK_OBJECT_HANDLE *token_objects = NULL;
+    const p11_shard_t **shards = NULL;
+    CK_SESSION_HANDLE *sessions = NULL;
+    CK_SESSION_HANDLE session;
+    CK_RV *results = NULL;
+    p11_shard_t *shard;
+    PyObject *deleted = NULL;
+    PyObject *failed = NULL;
+    PyObject *ret = NULL;
+    PyObject *value;
+    PyObject *msg;
+    unsigned int i;
+
+    static char *kwlist[] = { "handles", "objclass", "label", "id", "uri",
+            "dry_run", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|OkUz#zO", kwlist,
+            &handles, &class, &label_unicode, &id, &id_length, &uri_str,
+            &dry_run)) {
+        return NULL;
+    }
+
+    if (handles != NULL && handles != Py_None) {
+        seq = PySequence_Fast(handles, "handles must be a sequence");
+        if (seq == NULL)
+            return NULL;
+        objects_len = (unsigned int) PySequence_Fast_GET_SIZE(seq);
+        objects = malloc((objects_len ? objects_len : 1)
+                * sizeof(CK_OBJECT_HANDLE));
+        if (objects == NULL) {
+            PyErr_NoMemory();
+            goto final;
+        }
+        for (i = 0; i < objects_len; i++)
+            objects[i] = PyInt_AsUnsignedLongMask(
+                    PySequence_Fast_GET_ITEM(seq, i));
+        if (PyErr_Occurred())
+            goto final;
+    } else {
+        if (label_unicode != NULL) {
+            label = (CK_BYTE *) unicode_to_char_array(label_unicode,
+                    &label_length);
+            if (label == NULL)
+                goto final;
+        }
+        if (uri_str != NULL) {
+            if (!_parse_uri(uri_str, &uri))
+                goto final;
+            template = p11_kit_uri_get_attributes(uri, &template_len);
+        } else {
+            _fill_template_from_parts(template, &template_len, id, id_length,
+                    label, label_length,
+                    class != CKO_VENDOR_DEFINED ? &class : NULL, NULL, NULL);
+        }
+        /* empty template would match every object on the token */
+        if (template_len == 0) {
+            PyErr_SetString(PyExc_ValueError,
+                    "delete_keys: handles or search criteria required");
+            goto final;
+        }
+        if (!_find_key(self, template, template_len, &objects, &objects_len))
+            goto final;
+    }
+
+    if (dry_run != NULL && PyObject_IsTrue(dry_run)) {
+        ret = PyInt_FromLong(objects_len);
+        goto final;
+    }
+
+    token_objects = calloc(objects_len ? objects_len : 1,
+            sizeof(CK_OBJECT_HANDLE));
+    shards = calloc(objects_len ? objects_len : 1, sizeof(p11_shard_t *));
+    sessions = calloc(self->shard_count, sizeof(CK_SESSION_HANDLE));
+    results = calloc(objects_len ? objects_len : 1, sizeof(CK_RV));
+    deleted = PyList_New(0);
+    failed = PyList_New(0);
+    if (token_objects == NULL || shards == NULL || sessions == NULL
+            || results == NULL) {
+        PyErr_NoMemory();
+        goto final;
+    }
+    if (deleted == NULL || failed == NULL)
+        goto final;
+
+    /* routing and wrap cache need Python objects and the helper state */
+    for (i = 0; i < objects_len; i++) {
+        token_objects[i] = objects[i];
+        shard = _shard_of(self, &token_objects[i]);
+        if (shard == NULL) {
+            PyErr_Clear();
+            results[i] = CKR_OBJECT_HANDLE_INVALID;
+            continue;
+        }
+        _wrap_cache_invalidate(self, shard, token_objects[i]);
+        _kcv_invalidate(self, shard, token_objects[i]);
+        shards[i] = shard;
+        results[i] = CKR_OK;
+    }
+    for (i = 0; i < self->shard_count; i++)
+        sessions[i] = CK_INVALID_HANDLE;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < objects_len; i++) {
+        if (results[i] == CKR_OK)
+            results[i] = _batch_session(self, sessions, shards[i], &session);
+        if (results[i] == CKR_OK)
+            results[i] = self->p11->C_DestroyObject(session,
+                    token_objects[i]);
+    }
+    _close_batch_sessions(self, sessions);
+    Py_END_ALLOW_THREADS
+
+    _index_invalidate(self);
+    for (i = 0; i < objects_len; i++) {
+        if (results[i] == CKR_OK) {
+            value = Py_BuildValue("k", objects[i]);
+            if (value == NULL || PyList_Append(deleted, value) != 0) {
+                Py_XDECREF(value);
+                goto final;
+            }
+            Py_DECREF(value);
+            continue;
+        }
+        msg = PyString_FromFormat("Error at object deletion: 0x%x",
+                (unsigned int) results[i]);
+        value = msg == NULL ? NULL : PyObject_CallFunctionObjArgs(
+                ipap11helperError, msg, NULL);
+        Py_XDECREF(msg);
+        if (value == NULL)
+            goto final;
+        msg = Py_BuildValue("(kN)", objects[i], value);
+        if (msg == NULL || PyList_Append(failed, msg) != 0) {
+            Py_XDECREF(msg);
+            goto final;
+        }
+        Py_DECREF(msg);
+    }
+    ret = Py_BuildValue("(OO)", deleted, failed);
+
+final:
+    if (uri != NULL)
+        p11_kit_uri_free(uri);
+    free(objects);
+    free(token_objects);
+    free(shards);
+    free(sessions);
+    free(results);
+    Py_XDECREF(deleted);
+    Py_XDECREF(failed);
+    Py_XDECREF(seq);
+    return ret;
+}
+
+/**
+ * export secret key
+ */
+//TODO remove, we don't want to export secret key
+static PyObject *
+P11_Helper_export_secret_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_RV rv;
+    CK_UTF8CHAR_PTR value = NULL;
+    CK_OBJECT_HANDLE key_handle = 0;
+    PyObject *ret = NULL;
+    p11_shard_t *shard;
+    static char *kwlist[] = { "key_handle", NULL };
+    //TODO check long overflow
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|", kwlist, &key_handle)) {
+        return NULL;
+    }
+    shard = _shard_of(self, &key_handle);
+    if (shard == NULL)
+        return NULL;
+
+    //TODO which attributes should be returned ????
+    CK_ATTRIBUTE obj_template[] = { { CKA_VALUE, NULL_PTR, 0 } };
+
+    rv = self->p11->C_GetAttributeValue(shard->session, key_handle,
+            obj_template, 1);
+    if (!check_return_value(rv, "get attribute value - prepare")) {
+        return NULL;
+    }
+
+    /* Set proper size for attributes*/
+    value = (CK_UTF8CHAR_PTR) secmem_alloc(
+            obj_template[0].ulValueLen * sizeof(CK_BYTE));
+    if (value == NULL)
+        return PyErr_NoMemory();
+    obj_template[0].pValue = value;
+
+    rv = self->p11->C_GetAttributeValue(shard->session, key_handle,
+            obj_template, 1);
+    if (!check_return_value(rv, "get attribute value")) {
+        secmem_free(value);
+        return NULL;
+    }
+
+    if (obj_template[0].ulValueLen <= 0) {
+        PyErr_SetString(ipap11helperNotFound, "Value not found");
+        secmem_free(value);
+        return NULL;
+    }
+    ret = Py_BuildValue("{s:s#}", "value", obj_template[0].pValue,
+            obj_template[0].ulValueLen);
+    secmem_free(value);
+    return ret;
+}
+
+/**
+ * export RSA public key
+ *
+ * SubjectPublicKeyInfo is encoded directly from CKA_MODULUS and
+ * CKA_PUBLIC_EXPONENT into the result string, without OpenSSL round trip.
+ */
+static PyObject *
+P11_Helper_export_RSA_public_key(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object) {
+    CK_RV rv;
+    PyObject *ret = NULL;
+
+    CK_BYTE modulus[SPKI_RSA_MAX_MODULUS_LEN];
+    CK_BYTE exponent[SPKI_RSA_MAX_EXPONENT_LEN];
+    CK_ULONG spki_len = 0;
+    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
+
+    CK_ATTRIBUTE obj_template[] = { { CKA_MODULUS, modulus, sizeof(modulus) },
+            { CKA_PUBLIC_EXPONENT, exponent, sizeof(exponent) }, { CKA_CLASS,
+            &class, sizeof(class) }, { CKA_KEY_TYPE, &key_type,
+            sizeof(key_type) } };
+
+    /* buffers are big enough for any sane key so one call is sufficient */
+    rv = self->p11->C_GetAttributeValue(session, object, obj_template, 4);
+    if (rv == CKR_BUFFER_TOO_SMALL) {
+        PyErr_SetString(ipap11helperError,
+                "export_RSA_public_key: key is too large");
+        return NULL;
+    }
+    if (!check_return_value(rv, "get RSA public key values"))
+        return NULL;
+
+    /* Check if the key is RSA public key */
+    if (class != CKO_PUBLIC_KEY) {
+        PyErr_SetString(ipap11helperError,
+                "export_RSA_public_key: required public key class");
+        return NULL;
+    }
+
+    if (key_type != CKK_RSA) {
+        PyErr_SetString(ipap11helperError,
+                "export_RSA_public_key: required RSA key type");
+        return NULL;
+    }
+
+    rv = spki_rsa_encode(modulus, obj_template[0].ulValueLen, exponent,
+            obj_template[1].ulValueLen, NULL, &spki_len);
+    if (!check_return_value(rv, "export_RSA_public_key: DER encoding"))
+        return NULL;
+
+    ret = PyString_FromStringAndSize(NULL, spki_len);
+    if (ret == NULL)
+        return NULL;
+
+    rv = spki_rsa_encode(modulus, obj_template[0].ulValueLen, exponent,
+            obj_template[1].ulValueLen,
+            (CK_BYTE_PTR) PyString_AS_STRING(ret), &spki_len);
+    if (!check_return_value(rv, "export_RSA_public_key: DER encoding")) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * export EC public key
+ *
+ * SubjectPublicKeyInfo (RFC 5480) is encoded from CKA_EC_PARAMS and
+ * CKA_EC_POINT.
+ */
+static PyObject *
+P11_Helper_export_EC_public_key(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object) {
+    CK_RV rv;
+    PyObject *ret = NULL;
+
+    CK_BYTE params[SPKI_EC_MAX_PARAMS_LEN];
+    CK_BYTE ec_point[SPKI_EC_MAX_POINT_LEN + 4];
+    const CK_BYTE *point = NULL;
+    CK_ULONG point_len = 0;
+    CK_ULONG spki_len = 0;
+
+    CK_ATTRIBUTE obj_template[] = {
+        { CKA_EC_PARAMS, params, sizeof(params) },
+        { CKA_EC_POINT, ec_point, sizeof(ec_point) } };
+
+    rv = self->p11->C_GetAttributeValue(session, object, obj_template, 2);
+    if (rv == CKR_BUFFER_TOO_SMALL) {
+        PyErr_SetString(ipap11helperError,
+                "export_EC_public_key: unsupported curve");
+        return NULL;
+    }
+    if (!check_return_value(rv, "get EC public key values"))
+        return NULL;
+
+    rv = spki_ec_point(ec_point, obj_template[1].ulValueLen, &point,
+            &point_len);
+    if (rv == CKR_OK)
+        rv = spki_ec_encode(params, obj_template[0].ulValueLen, point,
+                point_len, NULL, &spki_len);
+    if (!check_return_value(rv, "export_EC_public_key: DER encoding"))
+        return NULL;
+
+    ret = PyString_FromStringAndSize(NULL, spki_len);
+    if (ret == NULL)
+        return NULL;
+
+    rv = spki_ec_encode(params, obj_template[0].ulValueLen, point, point_len,
+            (CK_BYTE_PTR) PyString_AS_STRING(ret), &spki_len);
+    if (!check_return_value(rv, "export_EC_public_key: DER encoding")) {
+        Py_DECREF(ret);
+        return NULL;
+    }
+
+    return ret;
+}
+
+/**
+ * Export public key
+ *
+ * Export public key in SubjectPublicKeyInfo (RFC5280) DER encoded format
+ */
+static PyObject *
+P11_Helper_export_public_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE object = 0;
+    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
+    p11_shard_t *shard;
+    static char *kwlist[] = { "key_handle", NULL };
+    //TODO check long overflow
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|", kwlist, &object)) {
+        return NULL;
+    }
+    shard = _shard_of(self, &object);
+    if (shard == NULL)
+        return NULL;
+
+    CK_ATTRIBUTE obj_template[] = { { CKA_CLASS, &class, sizeof(class) }, {
+            CKA_KEY_TYPE, &key_type, sizeof(key_type) } };
+
+    rv = self->p11->C_GetAttributeValue(shard->session, object, obj_template,
+            2);
+    if (!check_return_value(rv, "export_public_key: get public key type"))
+        return NULL;
+
+    if (class != CKO_PUBLIC_KEY) {
+        PyErr_SetString(ipap11helperError,
+                "export_public_key: required public key class");
+        return NULL;
+    }
+
+    switch (key_type) {
+        case CKK_RSA:
+            return P11_Helper_export_RSA_public_key(self, shard->session,
+                    object);
+            break;
+        case CKK_EC:
+            return P11_Helper_export_EC_public_key(self, shard->session,
+                    object);
+            break;
+        default:
+            PyErr_SetString(ipap11helperError,
+                    "export_public_key: unsupported key type");
+    }
+
+    return NULL;
+}
+
+/**
+ * Create RSA public key object
+ *
+ * Modulus and exponent are taken in place from DER buffer referenced by spki.
+ * Python objects are not touched so it can be called with GIL released.
+ *
+ * :param attrs_pub: converted boolean attributes, see convert_py2bool()
+ * :return: CKR_DATA_INVALID if spki does not contain valid RSA key,
+ *          otherwise return value of C_CreateObject
+ */
+static CK_RV
+_create_RSA_public_key(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_UTF8CHAR *label, CK_ULONG label_length, CK_BYTE *id,
+        CK_ULONG id_length, const spki_t *spki,
+        PyObj2Bool_mapping_t *attrs_pub, CK_OBJECT_HANDLE *object) {
+    CK_RV rv;
+    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
+    CK_KEY_TYPE keyType = CKK_RSA;
+    CK_BBOOL *cka_token = &true;
+    const CK_BYTE *modulus = NULL;
+    CK_ULONG modulus_len = 0;
+    const CK_BYTE *exponent = NULL;
+    CK_ULONG exponent_len = 0;
+
+    rv = spki_rsa_decode(spki, &modulus, &modulus_len, &exponent,
+            &exponent_len);
+    if (rv != CKR_OK)
+        return CKR_DATA_INVALID;
+
+    CK_ATTRIBUTE template[] = {
+        { CKA_ID, id, id_length },
+        { CKA_CLASS, &class, sizeof(class) },
+        { CKA_KEY_TYPE, &keyType, sizeof(keyType) },
+        { CKA_TOKEN, cka_token, sizeof(CK_BBOOL) },
+        { CKA_LABEL, label, label_length },
+        { CKA_MODULUS, (CK_BYTE_PTR) modulus, modulus_len },
+        { CKA_PUBLIC_EXPONENT, (CK_BYTE_PTR) exponent, exponent_len },
+        //{CKA_COPYABLE, attrs_pub[pub_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
+        { CKA_DERIVE, attrs_pub[pub_en_cka_derive].bool, sizeof(CK_BBOOL) },
+        { CKA_ENCRYPT, attrs_pub[pub_en_cka_encrypt].bool, sizeof(CK_BBOOL) },
+        { CKA_MODIFIABLE, attrs_pub[pub_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, attrs_pub[pub_en_cka_private].bool, sizeof(CK_BBOOL) },
+        { CKA_TRUSTED, attrs_pub[pub_en_cka_trusted].bool, sizeof(CK_BBOOL) },
+        { CKA_VERIFY, attrs_pub[pub_en_cka_verify].bool, sizeof(CK_BBOOL) },
+        { CKA_VERIFY_RECOVER, attrs_pub[pub_en_cka_verify_recover].bool, sizeof(CK_BBOOL) },
+        { CKA_WRAP, attrs_pub[pub_en_cka_wrap].bool, sizeof(CK_BBOOL) }, };
+
+    return self->p11->C_CreateObject(session, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE), object);
+}
+
+/**
+ * Create EC public key object
+ *
+ * Same as _create_RSA_public_key(), curve OID goes to CKA_EC_PARAMS and the
+ * point is wrapped in OCTET STRING for CKA_EC_POINT.
+ *
+ * :return: CKR_DATA_INVALID if spki does not contain valid EC key,
+ *          otherwise return value of C_CreateObject
+ */
+static CK_RV
+_create_EC_public_key(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_UTF8CHAR *label, CK_ULONG label_length, CK_BYTE *id,
+        CK_ULONG id_length, const spki_t *spki,
+        PyObj2Bool_mapping_t *attrs_pub, CK_OBJECT_HANDLE *object) {
+    CK_RV rv;
+    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
+    CK_KEY_TYPE keyType = CKK_EC;
+    CK_BBOOL *cka_token = &true;
+    const CK_BYTE *params = NULL;
+    CK_ULONG params_len = 0;
+    const CK_BYTE *point = NULL;
+    CK_ULONG point_len = 0;
+    CK_BYTE ec_point[SPKI_EC_MAX_POINT_LEN + 4];
+    CK_ULONG ec_point_len = sizeof(ec_point);
+
+    rv = spki_ec_decode(spki, &params, &params_len, &point, &point_len);
+    if (rv == CKR_OK)
+        rv = spki_ec_point_encode(point, point_len, ec_point, &ec_point_len);
+    if (rv != CKR_OK)
+        return CKR_DATA_INVALID;
+
+    CK_ATTRIBUTE template[] = {
+        { CKA_ID, id, id_length },
+        { CKA_CLASS, &class, sizeof(class) },
+        { CKA_KEY_TYPE, &keyType, sizeof(keyType) },
+        { CKA_TOKEN, cka_token, sizeof(CK_BBOOL) },
+        { CKA_LABEL, label, label_length },
+        { CKA_EC_PARAMS, (CK_BYTE_PTR) params, params_len },
+        { CKA_EC_POINT, ec_point, ec_point_len },
+        //{CKA_COPYABLE, attrs_pub[pub_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
+        { CKA_DERIVE, attrs_pub[pub_en_cka_derive].bool, sizeof(CK_BBOOL) },
+        { CKA_MODIFIABLE, attrs_pub[pub_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, attrs_pub[pub_en_cka_private].bool, sizeof(CK_BBOOL) },
+        { CKA_TRUSTED, attrs_pub[pub_en_cka_trusted].bool, sizeof(CK_BBOOL) },
+        { CKA_VERIFY, attrs_pub[pub_en_cka_verify].bool, sizeof(CK_BBOOL) }, };
+
+    return self->p11->C_CreateObject(session, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE), object);
+}
+
+/**
+ * Create public key object of any supported type
+ *
+ * :return: CKR_KEY_TYPE_INCONSISTENT for unsupported algorithms, otherwise
+ *          see _create_RSA_public_key()
+ */
+static CK_RV
+_create_public_key(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_UTF8CHAR *label, CK_ULONG label_length, CK_BYTE *id,
+        CK_ULONG id_length, const spki_t *spki,
+        PyObj2Bool_mapping_t *attrs_pub, CK_OBJECT_HANDLE *object) {
+    switch (spki->algorithm) {
+        case SPKI_ALG_RSA:
+            return _create_RSA_public_key(self, session, label, label_length,
+                    id, id_length, spki, attrs_pub, object);
+        case SPKI_ALG_EC:
+            return _create_EC_public_key(self, session, label, label_length,
+                    id, id_length, spki, attrs_pub, object);
+        default:
+            return CKR_KEY_TYPE_INCONSISTENT;
+    }
+}
+
+/**
+ * Import RSA public key
+ *
+ */
+static PyObject *
+P11_Helper_import_RSA_public_key(P11_Helper* self, CK_UTF8CHAR *label,
+        Py_ssize_t label_length, CK_BYTE *id, Py_ssize_t id_length,
+        const spki_t *spki, PyObj2Bool_mapping_t *attrs_pub) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE object;
+    unsigned int shard = _shard_route(self, id, id_length);
+
+    rv = _create_RSA_public_key(self, self->shards[shard].session, label,
+            label_length, id, id_length, spki, attrs_pub, &object);
+    if (rv == CKR_DATA_INVALID) {
+        PyErr_SetString(ipap11helperError,
+                "import_RSA_public_key: invalid RSA public key");
+        return NULL;
+    }
+    if (!check_return_value(rv, "create public key object"))
+        return NULL;
+    _index_invalidate(self);
+
+    return Py_BuildValue("k", _shard_handle(self, shard, object));
+}
+
+/**
+ * Import EC public key
+ *
+ */
+static PyObject *
+P11_Helper_import_EC_public_key(P11_Helper* self, CK_UTF8CHAR *label,
+        Py_ssize_t label_length, CK_BYTE *id, Py_ssize_t id_length,
+        const spki_t *spki, PyObj2Bool_mapping_t *attrs_pub) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE object;
+    unsigned int shard = _shard_route(self, id, id_length);
+
+    rv = _create_EC_public_key(self, self->shards[shard].session, label,
+            label_length, id, id_length, spki, attrs_pub, &object);
+    if (rv == CKR_DATA_INVALID) {
+        PyErr_SetString(ipap11helperError,
+                "import_EC_public_key: invalid EC public key");
+        return NULL;
+    }
+    if (!check_return_value(rv, "create public key object"))
+        return NULL;
+    _index_invalidate(self);
+
+    return Py_BuildValue("k", _shard_handle(self, shard, object));
+}
+
+/**
+ * Import RSA or EC public key
+ *
+ */
+static PyObject *
+P11_Helper_import_public_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    int r;
+    PyObject *ret = NULL;
+    PyObject *label_unicode = NULL;
+    PyObject *profile = NULL;
+    CK_BYTE *id = NULL;
+    CK_BYTE *data = NULL;
+    CK_UTF8CHAR *label = NULL;
+    Py_ssize_t id_length = 0;
+    Py_ssize_t data_length = 0;
+    Py_ssize_t label_length = 0;
+    spki_t spki;
+
+    PyObj2Bool_mapping_t attrs_pub[] = { { NULL, &true }, //pub_en_cka_copyable
+            { NULL, &false }, //pub_en_cka_derive
+            { NULL, &false }, //pub_en_cka_encrypt
+            { NULL, &true }, //pub_en_cka_modifiable
+            { NULL, &true }, //pub_en_cka_private
+            { NULL, &false }, //pub_en_cka_trusted
+            { NULL, &true }, //pub_en_cka_verify
+            { NULL, &true }, //pub_en_cka_verify_recover
+            { NULL, &false }, //pub_en_cka_wrap
+            };
+
+    static char *kwlist[] = { "label", "id", "data",
+    /* public key attributes */
+    "cka_copyable", "cka_derive", "cka_encrypt", "cka_modifiable",
+            "cka_private", "cka_trusted", "cka_verify", "cka_verify_recover",
+            "cka_wrap", "profile", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#s#|OOOOOOOOOO", kwlist,
+            &label_unicode, &id, &id_length, &data, &data_length,
+            /* public key attributes */
+            &attrs_pub[pub_en_cka_copyable].py_obj,
+            &attrs_pub[pub_en_cka_derive].py_obj,
+            &attrs_pub[pub_en_cka_encrypt].py_obj,
+            &attrs_pub[pub_en_cka_modifiable].py_obj,
+            &attrs_pub[pub_en_cka_private].py_obj,
+            &attrs_pub[pub_en_cka_trusted].py_obj,
+            &attrs_pub[pub_en_cka_verify].py_obj,
+            &attrs_pub[pub_en_cka_verify_recover].py_obj,
+            &attrs_pub[pub_en_cka_wrap].py_obj, &profile)) {
+        return NULL;
+    }
+    Py_XINCREF(label_unicode);
+    label = (unsigned char*) unicode_to_char_array(label_unicode,
+            &label_length);
+    Py_XDECREF(label_unicode);
+
+    r = _id_issued(self, id, id_length) ? 0 :
+            _id_exists(self, id, id_length, CKO_PUBLIC_KEY);
+    if (r == 1) {
+        PyErr_SetString(ipap11helperDuplicationError,
+                "Public key with same ID already exists");
+        return NULL;
+    } else if (r == -1) {
+        return NULL;
+    }
+
+    /* Process keyword boolean arguments */
+    if (!_apply_profile(profile, CKO_PUBLIC_KEY, attrs_pub,
+            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t)))
+        return NULL;
+    convert_py2bool(attrs_pub,
+            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t));
+
+    /* decode from ASN1 DER */
+    if (spki_decode(data, data_length, &spki) != CKR_OK) {
+        PyErr_SetString(ipap11helperError,
+                "import_public_key: invalid SubjectPublicKeyInfo");
+        return NULL;
+    }
+    switch (spki.algorithm) {
+        case SPKI_ALG_RSA:
+            ret = P11_Helper_import_RSA_public_key(self, label, label_length,
+                    id, id_length, &spki, attrs_pub);
+            break;
+        case SPKI_ALG_DSA:
+            ret = NULL;
+            PyErr_SetString(ipap11helperError, "DSA is not supported");
+            break;
+        case SPKI_ALG_EC:
+            ret = P11_Helper_import_EC_public_key(self, label, label_length,
+                    id, id_length, &spki, attrs_pub);
+            break;
+        default:
+            ret = NULL;
+            PyErr_SetString(ipap11helperError, "Unsupported key type");
+    }
+    return ret;
+}
+
+/**
+ * One item of bulk public key import
+ *
+ * Label, ID and DER data point to memory owned by Python objects or by
+ * scratch buffer of P11_Helper_import_public_keys(), so items can be
+ * processed with GIL released.
+ */
+typedef struct {
+    CK_UTF8CHAR *label;
+    CK_ULONG label_length;
+    CK_BYTE *id;
+    CK_ULONG id_length;
+    spki_t spki;
+    CK_OBJECT_HANDLE object;
+    unsigned int shard;
+    PyObject *error_type;   /* borrowed exception type, NULL on success */
+    const char *error;
+    CK_RV rv;
+} pubkey_import_t;
+
+/**
+ * Keys of bulk public key import which go to one shard
+ */
+typedef struct {
+    P11_Helper *self;
+    unsigned int shard;
+    CK_SESSION_HANDLE session;
+    pubkey_import_t *items;
+    Py_ssize_t count;
+    PyObj2Bool_mapping_t *attrs_pub;
+} pubkey_import_shard_t;
+
+static int _pubkey_import_id_cmp(const void *a, const void *b) {
+    const pubkey_import_t *x = *(const pubkey_import_t **) a;
+    const pubkey_import_t *y = *(const pubkey_import_t **) b;
+
+    if (x->id_length != y->id_length)
+        return x->id_length < y->id_length ? -1 : 1;
+    return memcmp(x->id, y->id, x->id_length);
+}
+
+/**
+ * Mark items which use ID of some existing object with given class
+ *
+ * Items have to be sorted by ID. Each distinct ID is searched for once, so
+ * the cost depends on the batch, not on the number of objects on the token.
+ */
+static CK_RV _pubkey_import_mark_existing(P11_Helper* self,
+        CK_SESSION_HANDLE session, CK_OBJECT_CLASS class,
+        pubkey_import_t **sorted, CK_ULONG count) {
+    CK_RV rv = CKR_OK;
+    CK_RV rv_final;
+    CK_OBJECT_HANDLE object;
+    CK_ULONG object_count;
+    CK_ULONG i, j;
+    CK_ATTRIBUTE template[] = {
+        { CKA_CLASS, &class, sizeof(class) },
+        { CKA_ID, NULL, 0 } };
+
+    for (i = 0; rv == CKR_OK && i < count; i = j) {
+        /* run of items with the same ID */
+        for (j = i + 1; j < count
+                && _pubkey_import_id_cmp(&sorted[i], &sorted[j]) == 0; j++)
+            ;
+        template[1].pValue = sorted[i]->id;
+        template[1].ulValueLen = sorted[i]->id_length;
+        rv = self->p11->C_FindObjectsInit(session, template, 2);
+        if (rv != CKR_OK)
+            break;
+        rv = self->p11->C_FindObjects(session, &object, 1, &object_count);
+        rv_final = self->p11->C_FindObjectsFinal(session);
+        if (rv == CKR_OK)
+            rv = rv_final;
+        if (rv != CKR_OK || object_count == 0)
+            continue;
+        for (; i < j; i++) {
+            sorted[i]->error_type = ipap11helperDuplicationError;
+            sorted[i]->error = "Public key with same ID already exists";
+        }
+    }
+    return rv;
+}
+
+/**
+ * Parse one (label, id, data) tuple into pubkey_import_t
+ *
+ * Data can be DER or single PEM block, PEM is decoded to scratch.
+ * UTF-8 encoded label is appended to keep list which owns it.
+ *
+ * :return: 1 on success, 0 if exception was raised
+ */
+static int _pubkey_import_parse_tuple(PyObject *tuple, PyObject *keep,
+        CK_BYTE_PTR *scratch, CK_ULONG_PTR scratch_len,
+        pubkey_import_t *item) {
+    PyObject *label_unicode = NULL;
+    PyObject *label_utf8 = NULL;
+    char *id = NULL;
+    char *data = NULL;
+    Py_ssize_t id_length = 0;
+    Py_ssize_t data_length = 0;
+    CK_ULONG offset = 0;
+    spki_record_t rec;
+
+    if (!PyArg_ParseTuple(tuple, "Us#s#", &label_unicode, &id, &id_length,
+            &data, &data_length))
+        return 0;
+
+    label_utf8 = PyUnicode_AsUTF8String(label_unicode);
+    if (label_utf8 == NULL)
+        return 0;
+    if (PyList_Append(keep, label_utf8) != 0) {
+        Py_DECREF(label_utf8);
+        return 0;
+    }
+    Py_DECREF(label_utf8); /* owned by keep list */
+
+    item->label = (CK_UTF8CHAR *) PyString_AS_STRING(label_utf8);
+    item->label_length = PyString_GET_SIZE(label_utf8);
+    item->id = (CK_BYTE *) id;
+    item->id_length = id_length;
+
+    if (spki_bundle_next((CK_BYTE *) data, data_length, &offset, scratch,
+            scratch_len, &rec) != CKR_OK || rec.der == NULL
+            || spki_decode(rec.der, rec.der_len, &item->spki) != CKR_OK) {
+        item->error_type = ipap11helperError;
+        item->error = "import_public_keys: invalid SubjectPublicKeyInfo";
+        return 1;
+    }
+
+    /* one tuple is one key, more records would be silently lost */
+    while (offset < (CK_ULONG) data_length && (data[offset] == ' '
+            || data[offset] == '\t' || data[offset] == '\r'
+            || data[offset] == '\n'))
+        offset++;
+    if (offset < (CK_ULONG) data_length) {
+        item->error_type = PyExc_ValueError;
+        item->error = "import_public_keys: data contains more than one key";
+    }
+    return 1;
+}
+
+/**
+ * Parse PEM bundle with Label and Id headers into pubkey_import_t array
+ *
+ * Id header is hex encoded, decoded ID and DER are stored to scratch.
+ *
+ * :return: number of items or -1 if exception was raised
+ */
+static Py_ssize_t _pubkey_import_parse_bundle(const CK_BYTE *bundle,
+        CK_ULONG bundle_len, CK_BYTE_PTR scratch, CK_ULONG scratch_len,
+        pubkey_import_t **itemsp) {
+    CK_ULONG offset = 0;
+    Py_ssize_t count = 0;
+    Py_ssize_t allocated = 0;
+    pubkey_import_t *items = NULL;
+    pubkey_import_t *tmp;
+    pubkey_import_t *item;
+    spki_record_t rec;
+    const char *value;
+    CK_ULONG value_len;
+    CK_ULONG i;
+    int hi, lo;
+
+    while (1) {
+        if (spki_bundle_next(bundle, bundle_len, &offset, &scratch,
+                &scratch_len, &rec) != CKR_OK) {
+            PyErr_SetString(ipap11helperError,
+                    "import_public_keys: malformed bundle");
+            goto error;
+        }
+        if (rec.der == NULL)
+            break;
+
+        if (count == allocated) {
+            allocated = allocated ? 2 * allocated : 16;
+            tmp = realloc(items, allocated * sizeof(pubkey_import_t));
+            if (tmp == NULL) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            items = tmp;
+        }
+        item = &items[count++];
+        memset(item, 0, sizeof(pubkey_import_t));
+
+        if (spki_decode(rec.der, rec.der_len, &item->spki) != CKR_OK) {
+            item->error_type = ipap11helperError;
+            item->error = "import_public_keys: invalid SubjectPublicKeyInfo";
+            continue;
+        }
+
+        if (!spki_record_header(&rec, "Label", &value, &value_len)) {
+            item->error_type = ipap11helperError;
+            item->error = "import_public_keys: missing Label header";
+            continue;
+        }
+        item->label = (CK_UTF8CHAR *) value;
+        item->label_length = value_len;
+
+        if (!spki_record_header(&rec, "Id", &value, &value_len)
+                || value_len % 2 != 0 || value_len / 2 > scratch_len) {
+            item->error_type = ipap11helperError;
+            item->error = "import_public_keys: missing or invalid Id header";
+            continue;
+        }
+        item->id = scratch;
+        item->id_length = value_len / 2;
+        for (i = 0; i < item->id_length; i++) {
+            hi = hex_value(value[2 * i]);
+            lo = hex_value(value[2 * i + 1]);
+            if (hi < 0 || lo < 0)
+                break;
+            scratch[i] = (hi << 4) | lo;
+        }
+        if (i < item->id_length) {
+            item->error_type = ipap11helperError;
+            item->error = "import_public_keys: missing or invalid Id header";
+            continue;
+        }
+        scratch += item->id_length;
+        scratch_len -= item->id_length;
+    }
+
+    *itemsp = items;
+    return count;
+
+error:
+    free(items);
+    return -1;
+}
+
+/**
+ * Create public key objects routed to one shard
+ *
+ * Runs in its own thread when keys are spread over several shards, so the
+ * tokens work in parallel. Does not touch Python objects.
+ */
+static void *_pubkey_import_create(void *arg) {
+    pubkey_import_shard_t *w = arg;
+    pubkey_import_t *item;
+    Py_ssize_t i;
+
+    for (i = 0; i < w->count; i++) {
+        item = &w->items[i];
+        if (item->error_type != NULL || item->shard != w->shard)
+            continue;
+        item->rv = _create_public_key(w->self, w->session, item->label,
+                item->label_length, item->id, item->id_length, &item->spki,
+                w->attrs_pub, &item->object);
+        if (item->rv != CKR_OK) {
+            item->error_type = ipap11helperError;
+            item->error = "create public key object";
+        } else {
+            item->object = _shard_handle(w->self, w->shard, item->object);
+        }
+    }
+    return NULL;
+}
+
+/**
+ * Import many public keys at once
+ *
+ * Keys are given as sequence of (label, id, data) tuples with DER or PEM
+ * data, or as one string with PEM bundle where each block carries Label
+ * and hex encoded Id header.
+ *
+ * Duplicate IDs are checked once for the whole set and objects are created
+ * in a loop with GIL released, using separate session. With several shards
+ * every shard is filled by its own thread.
+ *
+ * :return: list with object handle or exception instance for each key,
+ *          in the input order
+ */
+static PyObject *
+P11_Helper_import_public_keys(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_RV rv = CKR_OK;
+    PyObject *keys = NULL;
+    PyObject *seq = NULL;
+    PyObject *keep = NULL;
+    PyObject *profile = NULL;
+    PyObject *ret = NULL;
+    PyObject *value;
+    PyObject *msg;
+    CK_BYTE_PTR scratch = NULL;
+    CK_BYTE_PTR scratch_pos;
+    CK_ULONG scratch_len = 0;
+    pubkey_import_t *items = NULL;
+    pubkey_import_t **sorted = NULL;
+    Py_ssize_t count = 0;
+    Py_ssize_t i;
+    CK_ULONG valid = 0;
+    pubkey_import_shard_t *shards = NULL;
+    pthread_t *threads = NULL;
+    unsigned int s;
+    const char *error_msg = NULL;
+
+    PyObj2Bool_mapping_t attrs_pub[] = { { NULL, &true }, //pub_en_cka_copyable
+            { NULL, &false }, //pub_en_cka_derive
+            { NULL, &false }, //pub_en_cka_encrypt
+            { NULL, &true }, //pub_en_cka_modifiable
+            { NULL, &true }, //pub_en_cka_private
+            { NULL, &false }, //pub_en_cka_trusted
+            { NULL, &true }, //pub_en_cka_verify
+            { NULL, &true }, //pub_en_cka_verify_recover
+            { NULL, &false }, //pub_en_cka_wrap
+            };
+
+    static char *kwlist[] = { "keys",
+    /* public key attributes */
+    "cka_copyable", "cka_derive", "cka_encrypt", "cka_modifiable",
+            "cka_private", "cka_trusted", "cka_verify", "cka_verify_recover",
+            "cka_wrap", "profile", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OOOOOOOOOO", kwlist,
+            &keys,
+            /* public key attributes */
+            &attrs_pub[pub_en_cka_copyable].py_obj,
+            &attrs_pub[pub_en_cka_derive].py_obj,
+            &attrs_pub[pub_en_cka_encrypt].py_obj,
+            &attrs_pub[pub_en_cka_modifiable].py_obj,
+            &attrs_pub[pub_en_cka_private].py_obj,
+            &attrs_pub[pub_en_cka_trusted].py_obj,
+            &attrs_pub[pub_en_cka_verify].py_obj,
+            &attrs_pub[pub_en_cka_verify_recover].py_obj,
+            &attrs_pub[pub_en_cka_wrap].py_obj, &profile)) {
+        return NULL;
+    }
+
+    /* Process keyword boolean arguments */
+    if (!_apply_profile(profile, CKO_PUBLIC_KEY, attrs_pub,
+            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t)))
+        return NULL;
+    convert_py2bool(attrs_pub,
+            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t));
+
+    /*
+     * Decoded PEM data and IDs are never longer than the input,
+     * so one scratch buffer of input size is enough.
+     */
+    if (PyString_Check(keys)) {
+        scratch_len = PyString_GET_SIZE(keys);
+        scratch = malloc(scratch_len ? scratch_len : 1);
+        if (scratch == NULL) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        count = _pubkey_import_parse_bundle(
+                (CK_BYTE *) PyString_AS_STRING(keys), scratch_len, scratch,
+                scratch_len, &items);
+        if (count < 0)
+            goto cleanup;
+    } else {
+        /* private copy, caller must not change the list under our hands */
+        seq = PySequence_List(keys);
+        keep = PyList_New(0);
+        if (seq == NULL || keep == NULL)
+            goto cleanup;
+        count = PyList_GET_SIZE(seq);
+
+        for (i = 0; i < count; i++) {
+            value = PyList_GET_ITEM(seq, i);
+            if (!PyTuple_Check(value) || PyTuple_GET_SIZE(value) != 3) {
+                PyErr_SetString(PyExc_TypeError,
+                        "keys must be a PEM bundle or a sequence of "
+                        "(label, id, data) tuples");
+                goto cleanup;
+            }
+            scratch_len += PyString_Check(PyTuple_GET_ITEM(value, 2)) ?
+                    PyString_GET_SIZE(PyTuple_GET_ITEM(value, 2)) : 0;
+        }
+
+        scratch = malloc(scratch_len ? scratch_len : 1);
+        items = calloc(count > 0 ? (size_t) count : 1,
+                sizeof(pubkey_import_t));
+        if (scratch == NULL || items == NULL) {
+            PyErr_NoMemory();
+            goto cleanup;
+        }
+        scratch_pos = scratch;
+        for (i = 0; i < count; i++) {
+            if (!_pubkey_import_parse_tuple(PyList_GET_ITEM(seq, i), keep,
+                    &scratch_pos, &scratch_len, &items[i]))
+                goto cleanup;
+        }
+    }
+
+    /* sort candidates by ID, duplicates within the batch are neighbours */
+    sorted = malloc((count > 0 ? (size_t) count : 1)
+            * sizeof(pubkey_import_t *));
+    if (sorted == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (i = 0; i < count; i++) {
+        if (items[i].error_type != NULL)
+            continue;
+        if (items[i].spki.algorithm != SPKI_ALG_RSA
+                && items[i].spki.algorithm != SPKI_ALG_EC) {
+            items[i].error_type = ipap11helperError;
+            items[i].error = items[i].spki.algorithm == SPKI_ALG_DSA ?
+                    "DSA is not supported" : "Unsupported key type";
+            continue;
+        }
+        sorted[valid++] = &items[i];
+        items[i].shard = _shard_route(self, items[i].id, items[i].id_length);
+    }
+    qsort(sorted, valid, sizeof(pubkey_import_t *), _pubkey_import_id_cmp);
+    for (i = 1; i < (Py_ssize_t) valid; i++) {
+        if (_pubkey_import_id_cmp(&sorted[i - 1], &sorted[i]) == 0) {
+            sorted[i]->error_type = ipap11helperDuplicationError;
+            sorted[i]->error = "Public key with same ID already exists";
+        }
+    }
+
+    shards = calloc(self->shard_count, sizeof(pubkey_import_shard_t));
+    threads = calloc(self->shard_count, sizeof(pthread_t));
+    if (shards == NULL || threads == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (s = 0; s < self->shard_count; s++) {
+        shards[s].self = self;
+        shards[s].shard = s;
+        shards[s].session = CK_INVALID_HANDLE;
+        shards[s].items = items;
+        shards[s].count = count;
+        shards[s].attrs_pub = attrs_pub;
+    }
+
+    Py_BEGIN_ALLOW_THREADS
+
+    /* ID has to be unique across all shards */
+    for (s = 0; rv == CKR_OK && s < self->shard_count; s++) {
+        rv = _open_session(self, &self->shards[s], &shards[s].session);
+        if (rv != CKR_OK) {
+            error_msg = "open session";
+            break;
+        }
+        if (valid == 0)
+            continue;
+        rv = _pubkey_import_mark_existing(self, shards[s].session,
+                CKO_SECRET_KEY, sorted, valid);
+        if (rv == CKR_OK)
+            rv = _pubkey_import_mark_existing(self, shards[s].session,
+                    CKO_PUBLIC_KEY, sorted, valid);
+        if (rv != CKR_OK)
+            error_msg = "id, label exists";
+    }
+
+    if (rv == CKR_OK && self->shard_count == 1) {
+        _pubkey_import_create(&shards[0]);
+    } else if (rv == CKR_OK) {
+        for (s = 0; s < self->shard_count; s++) {
+            if (pthread_create(&threads[s], NULL, _pubkey_import_create,
+                    &shards[s]) != 0) {
+                threads[s] = pthread_self();
+                _pubkey_import_create(&shards[s]);
+            }
+        }
+        for (s = 0; s < self->shard_count; s++) {
+            if (!pthread_equal(threads[s], pthread_self()))
+                pthread_join(threads[s], NULL);
+        }
+    }
+
+    for (s = 0; s < self->shard_count; s++) {
+        if (shards[s].session != CK_INVALID_HANDLE)
+            self->p11->C_CloseSession(shards[s].session);
+    }
+
+    Py_END_ALLOW_THREADS
+
+    _index_invalidate(self);
+    if (error_msg != NULL) {
+        check_return_value(rv, error_msg);
+        goto cleanup;
+    }
+
+    ret = PyList_New(count);
+    if (ret == NULL)
+        goto cleanup;
+    for (i = 0; i < count; i++) {
+        if (items[i].error_type == NULL) {
+            value = Py_BuildValue("k", items[i].object);
+        } else {
+            if (items[i].rv != CKR_OK)
+                msg = PyString_FromFormat("Error at %s: 0x%x", items[i].error,
+                        (unsigned int) items[i].rv);
+            else
+                msg = PyString_FromString(items[i].error);
+            value = msg == NULL ? NULL : PyObject_CallFunctionObjArgs(
+                    items[i].error_type, msg, NULL);
+            Py_XDECREF(msg);
+        }
+        if (value == NULL) {
+            Py_CLEAR(ret);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(ret, i, value);
+    }
+
+cleanup:
+    free(threads);
+    free(shards);
+    free(sorted);
+    free(items);
+    free(scratch);
+    Py_XDECREF(keep);
+    Py_XDECREF(seq);
+    return ret;
+}
+
+/**
+ * Export wrapped key
+ *
+ * With wrapping_mech=MECH_AUTO the mechanism is chosen by _wrap_mech_auto()
+ * from allowed_mechs (default: all but MECH_RSA_PKCS) and tuple
+ * (mechanism, data) is returned instead of data. MECH_RSA_PKCS_OAEP always
+ * uses SHA-1 with MGF1-SHA-1 and no label, import_wrapped_*_key() expect
+ * the same.
+ *
+ * With wrap_cache enabled, blob wrapped earlier with the same keys and
+ * mechanism is returned without calling C_WrapKey. Blobs are saved to the
+ * cache file only if both keys have public material, see _key_fingerprint().
+ */
+static PyObject *
+P11_Helper_export_wrapped_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE object_key = 0;
+    CK_OBJECT_HANDLE object_wrapping_key = 0;
+    CK_BYTE_PTR wrapped_key = NULL;
+    CK_ULONG wrapped_key_len = 0;
+    CK_MECHANISM wrapping_mech = { CKM_RSA_PKCS, NULL, 0 };
+    CK_MECHANISM_TYPE wrapping_mech_type = CKM_RSA_PKCS;
+    p11_shard_t *shard;
+    p11_shard_t *wrapping_shard;
+    PyObject *allowed_mechs = NULL;
+    PyObject *ret;
+    int automatic;
+    int cacheable = 0;
+    int key_strength;
+    int wrapping_key_strength;
+    uint64_t key_fp = 0;
+    uint64_t wrapping_key_fp = 0;
+
+    static char *kwlist[] = { "key", "wrapping_key", "wrapping_mech",
+            "allowed_mechs", NULL };
+    //TODO check long overflow
+    //TODO export method
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkk|O", kwlist, &object_key,
+            &object_wrapping_key, &wrapping_mech_type, &allowed_mechs)) {
+        return NULL;
+    }
+    automatic = (wrapping_mech_type == MECH_AUTO);
+
+    /* keys cannot be wrapped across tokens */
+    shard = _shard_of(self, &object_key);
+    wrapping_shard = _shard_of(self, &object_wrapping_key);
+    if (shard == NULL || wrapping_shard == NULL)
+        return NULL;
+    if (shard != wrapping_shard) {
+        PyErr_SetString(ipap11helperError,
+                "Key and wrapping key are on different tokens");
+        return NULL;
+    }
+    if (automatic && !_wrap_mech_auto(self, shard, object_key,
+            object_wrapping_key, allowed_mechs, &wrapping_mech_type))
+        return NULL;
+    wrapping_mech.mechanism = wrapping_mech_type;
+    _wrap_mech_params(&wrapping_mech);
+    if (!_check_mechanism(self, shard, wrapping_mech_type, CKF_WRAP, 0,
+            "key wrapping"))
+        return NULL;
+
+    if (self->wrap_cache != NULL
+            && (key_strength = _key_fingerprint(self, shard, object_key,
+                    &key_fp)) != 0
+            && (wrapping_key_strength = _key_fingerprint(self, shard,
+                    object_wrapping_key, &wrapping_key_fp)) != 0) {
+        const CK_BYTE *blob = wrapcache_get(self->wrap_cache, key_fp,
+                wrapping_key_fp, wrapping_mech_type, &wrapped_key_len);
+
+        if (blob != NULL) {
+            if (automatic)
+                return Py_BuildValue("(ks#)", wrapping_mech_type, blob,
+                        wrapped_key_len);
+            return Py_BuildValue("s#", blob, wrapped_key_len);
+        }
+        cacheable = 1;
+    }
+
+    rv = self->p11->C_WrapKey(shard->session, &wrapping_mech,
+            object_wrapping_key, object_key, NULL, &wrapped_key_len);
+    if (!check_return_value(rv, "key wrapping: get buffer length"))
+        return 0;
+    wrapped_key = secmem_alloc(wrapped_key_len);
+    if (wrapped_key == NULL) {
+        rv = CKR_HOST_MEMORY;
+        check_return_value(rv, "key wrapping: buffer allocation");
+        return 0;
+    }
+    rv = self->p11->C_WrapKey(shard->session, &wrapping_mech,
+            object_wrapping_key, object_key, wrapped_key, &wrapped_key_len);
+    if (!check_return_value(rv, "key wrapping: wrapping")) {
+        secmem_free(wrapped_key);
+        return NULL;
+    }
+    /* blob stays valid without the cache, so failure is ignored */
+    if (cacheable)
+        wrapcache_put(self->wrap_cache, key_fp, wrapping_key_fp,
+                wrapping_mech_type, wrapped_key, wrapped_key_len,
+                key_strength == 2 && wrapping_key_strength == 2);
+
+    /* mechanism has to be stored with the blob to unwrap it later */
+    if (automatic)
+        ret = Py_BuildValue("(ks#)", wrapping_mech_type, wrapped_key,
+                wrapped_key_len);
+    else
+        ret = Py_BuildValue("s#", wrapped_key, wrapped_key_len);
+    secmem_free(wrapped_key);
+    return ret;
+}
+
+/**
+ * Wrap cache counters
+ *
+ * Return None if wrap_cache was not enabled, otherwise dictionary
+ * { "entries": ..., "hits": ..., "misses": ... }.
+ */
+static PyObject *
+P11_Helper_wrap_cache_info(P11_Helper* self) {
+    if (self->wrap_cache == NULL) {
+        Py_RETURN_NONE;
+    }
+    return Py_BuildValue("{sKsKsK}",
+            "entries", (unsigned PY_LONG_LONG) self->wrap_cache->count,
+            "hits", (unsigned PY_LONG_LONG) self->wrap_cache->hits,
+            "misses", (unsigned PY_LONG_LONG) self->wrap_cache->misses);
+}
+
+/**
+ * Import wrapped secret key
+ *
+ */
+static PyObject *
+P11_Helper_import_wrapped_secret_key(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_RV rv;
+    int r;
+    CK_BYTE_PTR wrapped_key = NULL;
+    CK_ULONG wrapped_key_len = 0;
+    CK_ULONG unwrapping_key_object = 0;
+    CK_OBJECT_HANDLE unwrapped_key_object = 0;
+    p11_shard_t *shard;
+    PyObject *label_unicode = NULL;
+    PyObject *profile = NULL;
+    CK_BYTE *id = NULL;
+    CK_UTF8CHAR *label = NULL;
+    Py_ssize_t id_length = 0;
+    Py_ssize_t label_length = 0;
+    CK_MECHANISM wrapping_mech = { CKM_RSA_PKCS, NULL, 0 };
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
 
     PyObj2Bool_mapping_t attrs[] = { { NULL, &true }, //sec_en_cka_copyable
             { NULL, &false }, //sec_en_cka_decrypt
@@ -593,23 +4063,18 @@ P11_Helper_generate_master_key(P11_Helper* self, PyObject *args, PyObject *kwds)
             { NULL, &false } //sec_en_cka_wrap_with_trusted
     };
 
-    CK_ULONG key_length = 16;
-    CK_RV rv;
-    CK_OBJECT_HANDLE master_key;
-    CK_BYTE *id = NULL;
-    int id_length = 0;
-
-    PyObject *label_unicode = NULL;
-    Py_ssize_t label_length = 0;
-    int r;
-    static char *kwlist[] = { "subject", "id", "key_length", "cka_copyable",
-            "cka_decrypt", "cka_derive", "cka_encrypt", "cka_extractable",
-            "cka_modifiable", "cka_private", "cka_sensitive", "cka_sign",
-            "cka_unwrap", "cka_verify", "cka_wrap", "cka_wrap_with_trusted",
-            NULL };
-    //TODO check long overflow
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#|kOOOOOOOOOOOOO", kwlist,
-            &label_unicode, &id, &id_length, &key_length,
+    static char *kwlist[] = { "label", "id", "data", "unwrapping_key",
+            "wrapping_mech", "key_type",
+            // secret key attrs
+            "cka_copyable", "cka_decrypt", "cka_derive", "cka_encrypt",
+            "cka_extractable", "cka_modifiable", "cka_private", "cka_sensitive",
+            "cka_sign", "cka_unwrap", "cka_verify", "cka_wrap",
+            "cka_wrap_with_trusted", "profile", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#s#kkk|OOOOOOOOOOOOOO",
+            kwlist, &label_unicode, &id, &id_length, &wrapped_key,
+            &wrapped_key_len, &unwrapping_key_object, &wrapping_mech.mechanism,
+            &key_type,
+            // secret key attrs
             &attrs[sec_en_cka_copyable].py_obj,
             &attrs[sec_en_cka_decrypt].py_obj, &attrs[sec_en_cka_derive].py_obj,
             &attrs[sec_en_cka_encrypt].py_obj,
@@ -619,42 +4084,45 @@ P11_Helper_generate_master_key(P11_Helper* self, PyObject *args, PyObject *kwds)
             &attrs[sec_en_cka_sensitive].py_obj, &attrs[sec_en_cka_sign].py_obj,
             &attrs[sec_en_cka_unwrap].py_obj, &attrs[sec_en_cka_verify].py_obj,
             &attrs[sec_en_cka_wrap].py_obj,
-            &attrs[sec_en_cka_wrap_with_trusted].py_obj)) {
+            &attrs[sec_en_cka_wrap_with_trusted].py_obj, &profile)) {
         return NULL;
     }
-
     Py_XINCREF(label_unicode);
-    CK_BYTE *label = (unsigned char*) unicode_to_char_array(label_unicode,
-            &label_length);
+    label = (unsigned char*) unicode_to_char_array(label_unicode,
+            &label_length); //TODO verify signed/unsigned
     Py_XDECREF(label_unicode);
-    CK_MECHANISM mechanism = { //TODO param?
-            CKM_AES_KEY_GEN, NULL_PTR, 0 };
 
-    if ((key_length != 16) && (key_length != 24) && (key_length != 32)) {
-        PyErr_SetString(ipap11helperError,
-                "generate_master_key: key length allowed values are: 16, 24 and 32");
+    /* unwrapped key is created on the token of unwrapping key */
+    shard = _shard_of(self, &unwrapping_key_object);
+    if (shard == NULL)
         return NULL;
-    }
+    if (!_check_mechanism(self, shard, wrapping_mech.mechanism, CKF_UNWRAP, 0,
+            "import_wrapped_key"))
+        return NULL;
+    _wrap_mech_params(&wrapping_mech);
 
-    //TODO free label if check failed
-    //TODO is label freed inside???? dont we use freed value later
-    r = _id_exists(self, id, id_length, CKO_SECRET_KEY);
+    r = _id_issued(self, id, id_length) ? 0 :
+            _id_exists(self, id, id_length, key_class);
     if (r == 1) {
         PyErr_SetString(ipap11helperDuplicationError,
-                "Master key with same ID already exists");
+                "Secret key with same ID already exists");
         return NULL;
     } else if (r == -1) {
         return NULL;
     }
 
     /* Process keyword boolean arguments */
+    if (!_apply_profile(profile, CKO_SECRET_KEY, attrs,
+            sizeof(attrs) / sizeof(PyObj2Bool_mapping_t)))
+        return NULL;
     convert_py2bool(attrs, sizeof(attrs) / sizeof(PyObj2Bool_mapping_t));
 
-    CK_ATTRIBUTE symKeyTemplate[] = {
+    CK_ATTRIBUTE template[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
         { CKA_ID, id, id_length },
         { CKA_LABEL, label, label_length },
         { CKA_TOKEN, &true, sizeof(CK_BBOOL) },
-        { CKA_VALUE_LEN, &key_length, sizeof(key_length) },
         //{CKA_COPYABLE, attrs[sec_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
         { CKA_DECRYPT, attrs[sec_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
         { CKA_DERIVE, attrs[sec_en_cka_derive].bool, sizeof(CK_BBOOL) },
@@ -670,80 +4138,69 @@ P11_Helper_generate_master_key(P11_Helper* self, PyObject *args, PyObject *kwds)
         { CKA_WRAP_WITH_TRUSTED, attrs[sec_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
     };
 
-    rv = self->p11->C_GenerateKey(self->session, &mechanism, symKeyTemplate,
-            sizeof(symKeyTemplate) / sizeof(CK_ATTRIBUTE), &master_key);
-    if (!check_return_value(rv, "generate master key"))
+    rv = self->p11->C_UnwrapKey(shard->session, &wrapping_mech,
+            unwrapping_key_object, wrapped_key, wrapped_key_len, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE), &unwrapped_key_object);
+    if (!check_return_value(rv, "import_wrapped_key: key unwrapping")) {
         return NULL;
+    }
+    _index_invalidate(self);
+
+    return Py_BuildValue("k", _shard_handle(self,
+            (unsigned int) (shard - self->shards), unwrapped_key_object));
 
-    return Py_BuildValue("k", master_key);;
 }
 
 /**
- * Generate replica keys
+ * Import wrapped private key
  *
- * :returns: tuple (public_key_handle, private_key_handle)
  */
 static PyObject *
-P11_Helper_generate_replica_key_pair(P11_Helper* self, PyObject *args,
+P11_Helper_import_wrapped_private_key(P11_Helper* self, PyObject *args,
         PyObject *kwds) {
     CK_RV rv;
     int r;
-    CK_ULONG modulus_bits = 2048;
+    CK_BYTE_PTR wrapped_key = NULL;
+    CK_ULONG wrapped_key_len = 0;
+    CK_ULONG unwrapping_key_object = 0;
+    CK_OBJECT_HANDLE unwrapped_key_object = 0;
+    p11_shard_t *shard;
+    PyObject *label_unicode = NULL;
+    PyObject *profile = NULL;
     CK_BYTE *id = NULL;
-    int id_length = 0;
-    PyObject* label_unicode = NULL;
+    CK_UTF8CHAR *label = NULL;
+    Py_ssize_t id_length = 0;
     Py_ssize_t label_length = 0;
-
-    PyObj2Bool_mapping_t attrs_pub[] = { { NULL, &true }, //pub_en_cka_copyable
-            { NULL, &false }, //pub_en_cka_derive
-            { NULL, &false }, //pub_en_cka_encrypt
-            { NULL, &true }, //pub_en_cka_modifiable
-            { NULL, &true }, //pub_en_cka_private
-            { NULL, &false }, //pub_en_cka_trusted
-            { NULL, &false }, //pub_en_cka_verify
-            { NULL, &false }, //pub_en_cka_verify_recover
-            { NULL, &true }, //pub_en_cka_wrap
-            };
+    CK_MECHANISM wrapping_mech = { CKM_RSA_PKCS, NULL, 0 };
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
 
     PyObj2Bool_mapping_t attrs_priv[] = { { NULL, &false }, //priv_en_cka_always_authenticate
             { NULL, &true }, //priv_en_cka_copyable
             { NULL, &false }, //priv_en_cka_decrypt
             { NULL, &false }, //priv_en_cka_derive
-            { NULL, &false }, //priv_en_cka_extractable
+            { NULL, &true }, //priv_en_cka_extractable
             { NULL, &true }, //priv_en_cka_modifiable
             { NULL, &true }, //priv_en_cka_private
             { NULL, &true }, //priv_en_cka_sensitive
-            { NULL, &false }, //priv_en_cka_sign
-            { NULL, &false }, //priv_en_cka_sign_recover
-            { NULL, &true }, //priv_en_cka_unwrap
+            { NULL, &true }, //priv_en_cka_sign
+            { NULL, &true }, //priv_en_cka_sign_recover
+            { NULL, &false }, //priv_en_cka_unwrap
             { NULL, &false } //priv_en_cka_wrap_with_trusted
     };
 
-    static char *kwlist[] = { "label", "id", "modulus_bits",
-    /* public key kw */
-    "pub_cka_copyable", "pub_cka_derive", "pub_cka_encrypt",
-            "pub_cka_modifiable", "pub_cka_private", "pub_cka_trusted",
-            "pub_cka_verify", "pub_cka_verify_recover", "pub_cka_wrap",
-            /* private key kw*/
-            "priv_cka_always_authenticate", "priv_cka_copyable",
-            "priv_cka_decrypt", "priv_cka_derive", "priv_cka_extractable",
-            "priv_cka_modifiable", "priv_cka_private", "priv_cka_sensitive",
-            "priv_cka_sign", "priv_cka_sign_recover", "priv_cka_unwrap",
-            "priv_cka_wrap_with_trusted", NULL };
-
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#|kOOOOOOOOOOOOOOOOOOOOO",
-            kwlist, &label_unicode, &id, &id_length, &modulus_bits,
-            /* public key kw */
-            &attrs_pub[pub_en_cka_copyable].py_obj,
-            &attrs_pub[pub_en_cka_derive].py_obj,
-            &attrs_pub[pub_en_cka_encrypt].py_obj,
-            &attrs_pub[pub_en_cka_modifiable].py_obj,
-            &attrs_pub[pub_en_cka_private].py_obj,
-            &attrs_pub[pub_en_cka_trusted].py_obj,
-            &attrs_pub[pub_en_cka_verify].py_obj,
-            &attrs_pub[pub_en_cka_verify_recover].py_obj,
-            &attrs_pub[pub_en_cka_wrap].py_obj,
-            /* private key kw*/
+    static char *kwlist[] = { "label", "id", "data", "unwrapping_key",
+            "wrapping_mech", "key_type",
+            // private key attrs
+            "cka_always_authenticate", "cka_copyable", "cka_decrypt",
+            "cka_derive", "cka_extractable", "cka_modifiable", "cka_private",
+            "cka_sensitive", "cka_sign", "cka_sign_recover", "cka_unwrap",
+            "cka_wrap_with_trusted", "profile", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#s#kkk|OOOOOOOOOOOOO",
+            kwlist, &label_unicode, &id, &id_length, &wrapped_key,
+            &wrapped_key_len, &unwrapping_key_object, &wrapping_mech.mechanism,
+            &key_type,
+            // private key attrs
             &attrs_priv[priv_en_cka_always_authenticate].py_obj,
             &attrs_priv[priv_en_cka_copyable].py_obj,
             &attrs_priv[priv_en_cka_decrypt].py_obj,
@@ -755,852 +4212,1794 @@ P11_Helper_generate_replica_key_pair(P11_Helper* self, PyObject *args,
             &attrs_priv[priv_en_cka_sign].py_obj,
             &attrs_priv[priv_en_cka_sign_recover].py_obj,
             &attrs_priv[priv_en_cka_unwrap].py_obj,
-            &attrs_priv[priv_en_cka_wrap_with_trusted].py_obj)) {
+            &attrs_priv[priv_en_cka_wrap_with_trusted].py_obj, &profile)) {
         return NULL;
     }
-
     Py_XINCREF(label_unicode);
-    CK_BYTE *label = unicode_to_char_array(label_unicode, &label_length);
-    Py_XDECREF(label_unicode);
-
-    CK_OBJECT_HANDLE public_key, private_key;
-    CK_MECHANISM mechanism = {
-    CKM_RSA_PKCS_KEY_PAIR_GEN, NULL_PTR, 0 };
-
-    //TODO free variables
+    label = (unsigned char*) unicode_to_char_array(label_unicode,
+            &label_length); //TODO verify signed/unsigned
+    Py_XDECREF(label_unicode);
 
-    r = _id_exists(self, id, id_length, CKO_PRIVATE_KEY);
-    if (r == 1) {
-        PyErr_SetString(ipap11helperDuplicationError,
-                "Private key with same ID already exists");
+    /* unwrapped key is created on the token of unwrapping key */
+    shard = _shard_of(self, &unwrapping_key_object);
+    if (shard == NULL)
         return NULL;
-    } else if (r == -1) {
+    if (!_check_mechanism(self, shard, wrapping_mech.mechanism, CKF_UNWRAP, 0,
+            "import_wrapped_key"))
         return NULL;
-    }
+    _wrap_mech_params(&wrapping_mech);
 
-    r = _id_exists(self, id, id_length, CKO_PUBLIC_KEY);
+    r = _id_issued(self, id, id_length) ? 0 :
+            _id_exists(self, id, id_length, CKO_SECRET_KEY);
     if (r == 1) {
         PyErr_SetString(ipap11helperDuplicationError,
-                "Public key with same ID already exists");
+                "Secret key with same ID already exists");
         return NULL;
     } else if (r == -1) {
         return NULL;
     }
 
     /* Process keyword boolean arguments */
-    convert_py2bool(attrs_pub,
-            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t));
+    if (!_apply_profile(profile, CKO_PRIVATE_KEY, attrs_priv,
+            sizeof(attrs_priv) / sizeof(PyObj2Bool_mapping_t)))
+        return NULL;
     convert_py2bool(attrs_priv,
             sizeof(attrs_priv) / sizeof(PyObj2Bool_mapping_t));
 
-    CK_BYTE public_exponent[] = { 1, 0, 1 }; /* 65537 (RFC 6376 section 3.3.1)*/
-    CK_ATTRIBUTE publicKeyTemplate[] = {
-        { CKA_ID, id, id_length },
-        { CKA_LABEL, label, label_length },
-        { CKA_TOKEN, &true, sizeof(true) },
-        { CKA_MODULUS_BITS, &modulus_bits, sizeof(modulus_bits) },
-        { CKA_PUBLIC_EXPONENT, public_exponent, 3 },
-        //{CKA_COPYABLE, attrs_pub[pub_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
-        { CKA_DERIVE, attrs_pub[pub_en_cka_derive].bool, sizeof(CK_BBOOL) },
-        { CKA_ENCRYPT, attrs_pub[pub_en_cka_encrypt].bool, sizeof(CK_BBOOL) },
-        { CKA_MODIFIABLE, attrs_pub[pub_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
-        { CKA_PRIVATE, attrs_pub[pub_en_cka_private].bool, sizeof(CK_BBOOL) },
-        { CKA_TRUSTED, attrs_pub[pub_en_cka_trusted].bool, sizeof(CK_BBOOL) },
-        { CKA_VERIFY, attrs_pub[pub_en_cka_verify].bool, sizeof(CK_BBOOL) },
-        { CKA_VERIFY_RECOVER, attrs_pub[pub_en_cka_verify_recover].bool, sizeof(CK_BBOOL) },
-        { CKA_WRAP, attrs_pub[pub_en_cka_wrap].bool, sizeof(CK_BBOOL) }, };
-
-    CK_ATTRIBUTE privateKeyTemplate[] = {
-        { CKA_ID, id, id_length },
-        { CKA_LABEL, label, label_length },
-        { CKA_TOKEN, &true, sizeof(true) },
-        { CKA_ALWAYS_AUTHENTICATE, attrs_priv[priv_en_cka_always_authenticate].bool, sizeof(CK_BBOOL) },
-        //{CKA_COPYABLE, attrs_priv[priv_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
-        { CKA_DECRYPT, attrs_priv[priv_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
-        { CKA_DERIVE,  attrs_priv[priv_en_cka_derive].bool, sizeof(CK_BBOOL) },
-        { CKA_EXTRACTABLE, attrs_priv[priv_en_cka_extractable].bool, sizeof(CK_BBOOL) },
-        { CKA_MODIFIABLE, attrs_priv[priv_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
-        { CKA_PRIVATE, attrs_priv[priv_en_cka_private].bool, sizeof(CK_BBOOL) },
-        { CKA_SENSITIVE, attrs_priv[priv_en_cka_sensitive].bool, sizeof(CK_BBOOL) },
-        { CKA_SIGN, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
-        { CKA_SIGN_RECOVER, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
-        { CKA_UNWRAP, attrs_priv[priv_en_cka_unwrap].bool, sizeof(CK_BBOOL) },
-        { CKA_WRAP_WITH_TRUSTED, attrs_priv[priv_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
+    CK_ATTRIBUTE template[] = {
+            { CKA_CLASS, &key_class, sizeof(key_class) },
+            { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+            { CKA_ID, id, id_length },
+            { CKA_LABEL, label, label_length },
+            { CKA_TOKEN, &true, sizeof(CK_BBOOL) },
+            { CKA_ALWAYS_AUTHENTICATE, attrs_priv[priv_en_cka_always_authenticate].bool, sizeof(CK_BBOOL) },
+            //{CKA_COPYABLE, attrs_priv[priv_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
+            { CKA_DECRYPT, attrs_priv[priv_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
+            { CKA_DERIVE, attrs_priv[priv_en_cka_derive].bool, sizeof(CK_BBOOL) },
+            { CKA_EXTRACTABLE, attrs_priv[priv_en_cka_extractable].bool, sizeof(CK_BBOOL) },
+            { CKA_MODIFIABLE,  attrs_priv[priv_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
+            { CKA_PRIVATE, attrs_priv[priv_en_cka_private].bool, sizeof(CK_BBOOL) },
+            { CKA_SENSITIVE, attrs_priv[priv_en_cka_sensitive].bool, sizeof(CK_BBOOL) },
+            { CKA_SIGN, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
+            { CKA_SIGN_RECOVER, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
+            { CKA_UNWRAP, attrs_priv[priv_en_cka_unwrap].bool, sizeof(CK_BBOOL) },
+            { CKA_WRAP_WITH_TRUSTED, attrs_priv[priv_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
     };
 
-    rv = self->p11->C_GenerateKeyPair(self->session, &mechanism,
-            publicKeyTemplate, sizeof(publicKeyTemplate) / sizeof(CK_ATTRIBUTE),
-            privateKeyTemplate,
-            sizeof(privateKeyTemplate) / sizeof(CK_ATTRIBUTE), &public_key,
-            &private_key);
-    if (!check_return_value(rv, "generate key pair"))
+    rv = self->p11->C_UnwrapKey(shard->session, &wrapping_mech,
+            unwrapping_key_object, wrapped_key, wrapped_key_len, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE), &unwrapped_key_object);
+    if (!check_return_value(rv, "import_wrapped_key: key unwrapping")) {
         return NULL;
+    }
+    _index_invalidate(self);
+
+    return PyLong_FromUnsignedLong(_shard_handle(self,
+            (unsigned int) (shard - self->shards), unwrapped_key_object));
 
-    return Py_BuildValue("(kk)", public_key, private_key);
 }
 
 /**
- * Find key
+ * Derive AES wrapping key with ECDH on the shard of private key
+ *
+ * Peer public key has to be on the same shard. ID and label are not set
+ * when NULL. Does not touch Python objects.
+ *
+ * :return: 1 if success, otherwise return 0 and set the exception
+ */
+static int _derive_wrapping_key(P11_Helper* self, p11_shard_t *shard,
+        CK_OBJECT_HANDLE private_key, CK_OBJECT_HANDLE peer_key,
+        CK_ULONG key_length, CK_ULONG kdf, CK_BBOOL *token, CK_BYTE *id,
+        CK_ULONG id_length, CK_UTF8CHAR *label, CK_ULONG label_length,
+        CK_OBJECT_HANDLE *derived_key) {
+    CK_RV rv;
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+    CK_KEY_TYPE key_type = CKK_AES;
+    CK_BYTE ec_point[SPKI_EC_MAX_POINT_LEN + 4];
+    const CK_BYTE *point = NULL;
+    CK_ULONG point_len = 0;
+
+    if (!_check_mechanism(self, shard, CKM_ECDH1_DERIVE, CKF_DERIVE, 0,
+            "derive_wrapping_key"))
+        return 0;
+
+    CK_ATTRIBUTE point_template[] = {
+        { CKA_EC_POINT, ec_point, sizeof(ec_point) } };
+    rv = self->p11->C_GetAttributeValue(shard->session, peer_key,
+            point_template, 1);
+    if (!check_return_value(rv, "derive_wrapping_key: get peer EC point"))
+        return 0;
+    rv = spki_ec_point(ec_point, point_template[0].ulValueLen, &point,
+            &point_len);
+    if (!check_return_value(rv, "derive_wrapping_key: peer EC point"))
+        return 0;
+
+    CK_ECDH1_DERIVE_PARAMS params = { kdf, 0, NULL, point_len,
+            (CK_BYTE_PTR) point };
+    CK_MECHANISM mechanism = { CKM_ECDH1_DERIVE, &params, sizeof(params) };
+    CK_ATTRIBUTE template[11] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+        { CKA_VALUE_LEN, &key_length, sizeof(key_length) },
+        { CKA_TOKEN, token, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, &true, sizeof(CK_BBOOL) },
+        { CKA_SENSITIVE, &true, sizeof(CK_BBOOL) },
+        { CKA_EXTRACTABLE, &false, sizeof(CK_BBOOL) },
+        { CKA_WRAP, &true, sizeof(CK_BBOOL) },
+        { CKA_UNWRAP, &true, sizeof(CK_BBOOL) } };
+    CK_ULONG template_len = 9;
+
+    if (id != NULL) {
+        template[template_len].type = CKA_ID;
+        template[template_len].pValue = id;
+        template[template_len++].ulValueLen = id_length;
+    }
+    if (label != NULL) {
+        template[template_len].type = CKA_LABEL;
+        template[template_len].pValue = label;
+        template[template_len++].ulValueLen = label_length;
+    }
+
+    rv = self->p11->C_DeriveKey(shard->session, &mechanism, private_key,
+            template, template_len, derived_key);
+    if (!check_return_value(rv, "derive_wrapping_key: key derivation"))
+        return 0;
+    if (*token)
+        _index_invalidate(self);
+    return 1;
+}
+
+/**
+ * Shard of private key if peer public key is on the same one
+ *
+ * Both handles are replaced with handles of the token.
+ *
+ * :return: shard, NULL if handles are invalid and set the exception
+ */
+static p11_shard_t *_ecdh_shard(P11_Helper* self,
+        CK_OBJECT_HANDLE *private_key, CK_OBJECT_HANDLE *peer_key) {
+    p11_shard_t *shard;
+    p11_shard_t *peer_shard;
+
+    shard = _shard_of(self, private_key);
+    peer_shard = _shard_of(self, peer_key);
+    if (shard == NULL || peer_shard == NULL)
+        return NULL;
+    if (shard != peer_shard) {
+        PyErr_SetString(ipap11helperError,
+                "Private key and peer public key are on different tokens");
+        return NULL;
+    }
+    return shard;
+}
+
+/**
+ * Derive AES wrapping key from EC key pair and public key of the peer
+ *
+ * Both replicas derive the same key with ECDH (CKM_ECDH1_DERIVE) from own
+ * private key and the other replica's public key, so master key can be
+ * exchanged with AES key wrapping instead of RSA. The raw shared secret is
+ * used unless kdf is given (KDF_SHA256); tokens differ in KDFs they support.
+ *
+ * :returns: handle of session (or token, token=True) secret key
  */
 static PyObject *
-P11_Helper_find_keys(P11_Helper* self, PyObject *args, PyObject *kwds) {
-    CK_OBJECT_CLASS class = CKO_VENDOR_DEFINED;
-    CK_OBJECT_CLASS *class_ptr = &class;
-    CK_BYTE *id = NULL; //TODO free
-    CK_BBOOL *ckawrap = NULL;
-    CK_BBOOL *ckaunwrap = NULL;
-    int id_length = 0;
+P11_Helper_derive_wrapping_key(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_OBJECT_HANDLE private_key = 0;
+    CK_OBJECT_HANDLE peer_key = 0;
+    CK_OBJECT_HANDLE derived_key = 0;
+    CK_ULONG key_length = 32;
+    CK_ULONG kdf = CKD_NULL;
+    p11_shard_t *shard;
     PyObject *label_unicode = NULL;
-    PyObject *cka_wrap_bool = NULL;
-    PyObject *cka_unwrap_bool = NULL;
+    PyObject *token_obj = NULL;
+    CK_UTF8CHAR *label = NULL;
     Py_ssize_t label_length = 0;
-    CK_OBJECT_HANDLE *objects = NULL;
-    unsigned int objects_len = 0;
-    PyObject *result_list = NULL;
-    const char *uri_str = NULL; //TODO free?
-    P11KitUri *uri = NULL;
-    CK_BYTE *label = NULL; //TODO free
-    CK_ATTRIBUTE template_static[MAX_TEMPLATE_LEN];
-    CK_ATTRIBUTE_PTR template = template_static;
-    CK_ULONG template_len = MAX_TEMPLATE_LEN;
+    CK_BYTE *id = NULL;
+    Py_ssize_t id_length = 0;
+    CK_BBOOL *token = &false;
 
-    static char *kwlist[] = { "objclass", "label", "id", "cka_wrap",
-            "cka_unwrap", "uri", NULL };
-    //TODO check long overflow
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|iUz#OOs", kwlist, &class,
-            &label_unicode, &id, &id_length, &cka_wrap_bool, &cka_unwrap_bool,
-            &uri_str)) {
+    static char *kwlist[] = { "private_key", "peer_public_key", "key_length",
+            "kdf", "label", "id", "token", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kk|kkUs#O", kwlist,
+            &private_key, &peer_key, &key_length, &kdf, &label_unicode, &id,
+            &id_length, &token_obj)) {
         return NULL;
     }
 
+    /* peer public key has to be imported to the same token */
+    shard = _ecdh_shard(self, &private_key, &peer_key);
+    if (shard == NULL)
+        return NULL;
+
+    if (token_obj != NULL) {
+        Py_INCREF(token_obj);
+        token = pyobj_to_bool(token_obj);
+        Py_DECREF(token_obj);
+    }
     if (label_unicode != NULL) {
         Py_INCREF(label_unicode);
-        label = (unsigned char*) unicode_to_char_array(label_unicode,
-                &label_length); //TODO verify signed/unsigned
+        label = unicode_to_char_array(label_unicode, &label_length);
         Py_DECREF(label_unicode);
+        if (label == NULL)
+            return NULL;
     }
 
-    if (cka_wrap_bool != NULL) {
-        Py_INCREF(cka_wrap_bool);
-        if (PyObject_IsTrue(cka_wrap_bool)) {
-            ckawrap = &true;
-        } else {
-            ckawrap = &false;
-        }
-        Py_DECREF(cka_wrap_bool);
-    }
+    if (!_derive_wrapping_key(self, shard, private_key, peer_key, key_length,
+            kdf, token, id, id_length, label, label_length, &derived_key))
+        return NULL;
 
-    if (cka_unwrap_bool != NULL) {
-        Py_INCREF(cka_unwrap_bool);
-        if (PyObject_IsTrue(cka_unwrap_bool)) {
-            ckaunwrap = &true;
-        } else {
-            ckaunwrap = &false;
-        }
-        Py_DECREF(cka_unwrap_bool);
-    }
+    return Py_BuildValue("k", _shard_handle(self,
+            (unsigned int) (shard - self->shards), derived_key));
+}
 
-    if (class == CKO_VENDOR_DEFINED)
-        class_ptr = NULL;
+/**
+ * Check that existing secret key looks like KEK from establish_replica_kek()
+ *
+ * Derived KEKs are non-extractable AES wrapping keys with the requested
+ * label and length; tokens which report CKA_KEY_GEN_MECHANISM have to
+ * report ECDH. Anything else with the same ID, e.g. the master key, must
+ * not be used as KEK.
+ *
+ * :return: 1 if it is KEK, 0 if not, -1 if an error occurs and set the
+ *          exception
+ */
+static int _is_replica_kek(P11_Helper* self, const p11_shard_t *shard,
+        CK_OBJECT_HANDLE kek, const CK_UTF8CHAR *label,
+        CK_ULONG label_length, CK_ULONG key_length) {
+    CK_RV rv;
+    CK_KEY_TYPE key_type = CKK_VENDOR_DEFINED;
+    CK_ULONG value_len = 0;
+    CK_BBOOL wrap = CK_FALSE;
+    CK_BBOOL unwrap = CK_FALSE;
+    CK_BBOOL extractable = CK_TRUE;
+    CK_MECHANISM_TYPE gen_mech = CK_UNAVAILABLE_INFORMATION;
+    CK_UTF8CHAR kek_label[256];
 
-    if (uri_str == NULL)
-        _fill_template_from_parts(template, &template_len, id, id_length, label,
-                label_length, class_ptr, ckawrap, ckaunwrap);
-    else {
-        if (!_parse_uri(uri_str, &uri))
-            return 0;
-        template = p11_kit_uri_get_attributes(uri, &template_len);
-        /* Do not deallocate URI while you are using the template.
-         * Template contains pointers to values inside URI! */
+    CK_ATTRIBUTE template[] = {
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+        { CKA_VALUE_LEN, &value_len, sizeof(value_len) },
+        { CKA_WRAP, &wrap, sizeof(wrap) },
+        { CKA_UNWRAP, &unwrap, sizeof(unwrap) },
+        { CKA_EXTRACTABLE, &extractable, sizeof(extractable) },
+        { CKA_LABEL, kek_label, sizeof(kek_label) } };
+    CK_ATTRIBUTE gen_template[] = {
+        { CKA_KEY_GEN_MECHANISM, &gen_mech, sizeof(gen_mech) } };
+
+    rv = self->p11->C_GetAttributeValue(shard->session, kek, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE));
+    if (rv == CKR_BUFFER_TOO_SMALL)
+        return 0; /* label longer than any label we create */
+    if (!check_return_value(rv, "establish_replica_kek: get KEK attributes"))
+        return -1;
+    if (key_type != CKK_AES || value_len != key_length || !wrap || !unwrap
+            || extractable || template[5].ulValueLen != label_length
+            || memcmp(kek_label, label, label_length) != 0)
+        return 0;
+
+    /* optional attribute, failure means nothing is known */
+    if (self->p11->C_GetAttributeValue(shard->session, kek, gen_template, 1)
+            == CKR_OK && gen_mech != CK_UNAVAILABLE_INFORMATION
+            && gen_mech != CKM_ECDH1_DERIVE)
+        return 0;
+    return 1;
+}
+
+/**
+ * Get key encryption key for replica, derive it on first use
+ *
+ * KEK is a token object identified by id on the token of private_key. When
+ * it does not exist yet, it is derived by ECDH from private_key and the
+ * replica's peer_public_key, see derive_wrapping_key(). Master key rotations
+ * then cost one AES key wrap per replica instead of one RSA operation, see
+ * wrap_key_for_replicas(). DuplicationError is raised when another secret
+ * key, e.g. the master key, has the id.
+ *
+ * :returns: tuple (kek_handle, created)
+ */
+static PyObject *
+P11_Helper_establish_replica_kek(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE private_key = 0;
+    CK_OBJECT_HANDLE peer_key = 0;
+    CK_OBJECT_HANDLE kek = 0;
+    CK_OBJECT_HANDLE found[2];
+    CK_ULONG key_length = 32;
+    CK_ULONG kdf = CKD_NULL;
+    CK_ULONG count = 0;
+    p11_shard_t *shard;
+    PyObject *label_unicode = NULL;
+    CK_UTF8CHAR *label = NULL;
+    Py_ssize_t label_length = 0;
+    CK_BYTE *id = NULL;
+    Py_ssize_t id_length = 0;
+    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
+
+    static char *kwlist[] = { "private_key", "peer_public_key", "label", "id",
+            "key_length", "kdf", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkUs#|kk", kwlist,
+            &private_key, &peer_key, &label_unicode, &id, &id_length,
+            &key_length, &kdf)) {
+        return NULL;
     }
 
-    if (!_find_key(self, template, template_len, &objects, &objects_len))
+    shard = _ecdh_shard(self, &private_key, &peer_key);
+    if (shard == NULL)
+        return NULL;
+    Py_XINCREF(label_unicode);
+    label = unicode_to_char_array(label_unicode, &label_length);
+    Py_XDECREF(label_unicode);
+    if (label == NULL)
         return NULL;
 
-    if (uri != NULL)
-        p11_kit_uri_free(uri);
+    /* all secret keys with the id, so that other keys are not taken as KEK */
+    CK_ATTRIBUTE find_template[] = {
+        { CKA_CLASS, &key_class, sizeof(key_class) },
+        { CKA_ID, id, id_length } };
+    rv = self->p11->C_FindObjectsInit(shard->session, find_template, 2);
+    if (!check_return_value(rv, "establish_replica_kek: find KEK init"))
+        return NULL;
+    rv = self->p11->C_FindObjects(shard->session, found, 2, &count);
+    if (!check_return_value(rv, "establish_replica_kek: find KEK"))
+        return NULL;
+    rv = self->p11->C_FindObjectsFinal(shard->session);
+    if (!check_return_value(rv, "establish_replica_kek: find KEK final"))
+        return NULL;
 
-    result_list = PyList_New(objects_len);
-    if (result_list == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "Unable to create list with results");
-        if (objects != NULL) {
-            free(objects);
+    if (count > 1) {
+        PyErr_SetString(ipap11helperDuplicationError,
+                "More secret keys with KEK ID exist");
+        return NULL;
+    }
+    if (count == 1) {
+        switch (_is_replica_kek(self, shard, found[0], label, label_length,
+                key_length)) {
+        case 1:
+            kek = found[0];
+            break;
+        case 0:
+            PyErr_SetString(ipap11helperDuplicationError,
+                    "Secret key with KEK ID exists and is not a replica KEK");
+            return NULL;
+        default:
+            return NULL;
         }
+    } else {
+        if (!_derive_wrapping_key(self, shard, private_key, peer_key,
+                key_length, kdf, &true, id, id_length, label, label_length,
+                &kek))
+            return NULL;
+    }
+
+    return Py_BuildValue("(kO)", _shard_handle(self,
+            (unsigned int) (shard - self->shards), kek),
+            count == 0 ? Py_True : Py_False);
+}
+
+/**
+ * Wrap one key with key encryption keys of several replicas
+ *
+ * All KEKs have to be on the token of the key. The wrapping buffer is
+ * sized once and reused, so each replica costs one C_WrapKey call.
+ *
+ * :returns: list of wrapped keys in the order of keks
+ */
+static PyObject *
+P11_Helper_wrap_key_for_replicas(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_RV rv;
+    CK_OBJECT_HANDLE object_key = 0;
+    CK_OBJECT_HANDLE kek;
+    CK_MECHANISM wrapping_mech = { CKM_AES_KEY_WRAP, NULL, 0 };
+    CK_BYTE_PTR buffer = NULL;
+    CK_BYTE_PTR tmp;
+    CK_ULONG buffer_len = 0;
+    CK_ULONG wrapped_len;
+    p11_shard_t *shard;
+    p11_shard_t *kek_shard;
+    PyObject *keks = NULL;
+    PyObject *seq = NULL;
+    PyObject *ret = NULL;
+    PyObject *blob;
+    Py_ssize_t count;
+    Py_ssize_t i;
+
+    static char *kwlist[] = { "key", "keks", "wrapping_mech", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kO|k", kwlist, &object_key,
+            &keks, &wrapping_mech.mechanism)) {
         return NULL;
     }
-    Py_INCREF(result_list);
-    for (int i = 0; i < objects_len; ++i) {
-        if (PyList_SetItem(result_list, i, Py_BuildValue("k", objects[i]))
-                == -1) {
+
+    shard = _shard_of(self, &object_key);
+    if (shard == NULL)
+        return NULL;
+    if (!_check_mechanism(self, shard, wrapping_mech.mechanism, CKF_WRAP, 0,
+            "wrap_key_for_replicas"))
+        return NULL;
+    _wrap_mech_params(&wrapping_mech);
+
+    seq = PySequence_Fast(keks, "keks must be a sequence of key handles");
+    if (seq == NULL)
+        return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+    ret = PyList_New(count);
+    if (ret == NULL)
+        goto error;
+
+    for (i = 0; i < count; i++) {
+        kek = PyInt_AsUnsignedLongMask(PySequence_Fast_GET_ITEM(seq, i));
+        if (PyErr_Occurred())
+            goto error;
+        kek_shard = _shard_of(self, &kek);
+        if (kek_shard == NULL)
+            goto error;
+        if (kek_shard != shard) {
             PyErr_SetString(ipap11helperError,
-                    "Unable to add to value to result list");
-            if (objects != NULL) {
-                free(objects);
+                    "Key and wrapping key are on different tokens");
+            goto error;
+        }
+
+        wrapped_len = buffer_len;
+        rv = self->p11->C_WrapKey(shard->session, &wrapping_mech, kek,
+                object_key, buffer, &wrapped_len);
+        if (rv == CKR_BUFFER_TOO_SMALL || (rv == CKR_OK && buffer == NULL)) {
+            /* first KEK or longer output: size the buffer and wrap again */
+            if (rv == CKR_BUFFER_TOO_SMALL) {
+                rv = self->p11->C_WrapKey(shard->session, &wrapping_mech,
+                        kek, object_key, NULL, &wrapped_len);
+                if (!check_return_value(rv,
+                        "wrap_key_for_replicas: get buffer length"))
+                    goto error;
             }
-            return NULL;
+            tmp = secmem_realloc(buffer, wrapped_len);
+            if (tmp == NULL) {
+                PyErr_NoMemory();
+                goto error;
+            }
+            buffer = tmp;
+            buffer_len = wrapped_len;
+            rv = self->p11->C_WrapKey(shard->session, &wrapping_mech, kek,
+                    object_key, buffer, &wrapped_len);
         }
+        if (!check_return_value(rv, "wrap_key_for_replicas: wrapping"))
+            goto error;
+
+        blob = PyString_FromStringAndSize((char *) buffer, wrapped_len);
+        if (blob == NULL)
+            goto error;
+        PyList_SET_ITEM(ret, i, blob);
     }
 
-    return result_list;
+    secmem_free(buffer);
+    Py_DECREF(seq);
+    return ret;
+
+error:
+    secmem_free(buffer);
+    Py_XDECREF(ret);
+    Py_DECREF(seq);
+    return NULL;
 }
 
 /**
- * delete key
+ * One key of rewrap
+ *
+ * blob points to string owned by rewrap()'s tuple copy of blobs, the
+ * result is in locked memory, see secmem.h.
  */
-static PyObject *
-P11_Helper_delete_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
+typedef struct {
+    CK_BYTE_PTR blob;
+    CK_ULONG blob_len;
+    CK_BYTE_PTR out;
+    CK_ULONG out_len;
+    const char *error;      /* NULL on success */
     CK_RV rv;
-    CK_OBJECT_HANDLE key_handle = 0;
-    static char *kwlist[] = { "key_handle", NULL };
-    //TODO check long overflow
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|", kwlist, &key_handle)) {
-        return NULL;
-    }
-    rv = self->p11->C_DestroyObject(self->session, key_handle);
-    if (!check_return_value(rv, "object deletion")) {
-        return NULL;
+} rewrap_item_t;
+
+/**
+ * Contiguous part of rewrap batch handled by one session
+ */
+typedef struct {
+    P11_Helper *self;
+    const p11_shard_t *shard;
+    CK_SESSION_HANDLE session;
+    rewrap_item_t *items;
+    Py_ssize_t count;
+    CK_MECHANISM_PTR mech_in;
+    CK_MECHANISM_PTR mech_out;
+    CK_OBJECT_HANDLE old_kek;
+    CK_OBJECT_HANDLE new_kek;
+    CK_OBJECT_CLASS key_class;
+    CK_KEY_TYPE key_type;
+} rewrap_worker_t;
+
+/**
+ * Unwrap keys to session objects, wrap them with new KEK and destroy them
+ *
+ * Runs with GIL released, in own session.
+ */
+static void *_rewrap_worker(void *arg) {
+    rewrap_worker_t *w = arg;
+    CK_FUNCTION_LIST_PTR p11 = w->self->p11;
+    CK_OBJECT_HANDLE object;
+    rewrap_item_t *item;
+    Py_ssize_t i;
+    CK_RV rv;
+
+    /* plaintext key exists only as session object of this worker */
+    CK_ATTRIBUTE template[] = {
+        { CKA_CLASS, &w->key_class, sizeof(w->key_class) },
+        { CKA_KEY_TYPE, &w->key_type, sizeof(w->key_type) },
+        { CKA_TOKEN, &false, sizeof(CK_BBOOL) },
+        { CKA_PRIVATE, &true, sizeof(CK_BBOOL) },
+        { CKA_SENSITIVE, &true, sizeof(CK_BBOOL) },
+        { CKA_EXTRACTABLE, &true, sizeof(CK_BBOOL) } };
+
+    if (w->count > 0) {
+        rv = _open_session(w->self, w->shard, &w->session);
+        if (rv != CKR_OK) {
+            w->session = CK_INVALID_HANDLE;
+            for (i = 0; i < w->count; i++) {
+                w->items[i].rv = rv;
+                w->items[i].error = "open session";
+            }
+            return NULL;
+        }
     }
 
-    return Py_None;
+    for (i = 0; i < w->count; i++) {
+        item = &w->items[i];
+        object = CK_INVALID_HANDLE;
+        rv = p11->C_UnwrapKey(w->session, w->mech_in, w->old_kek, item->blob,
+                item->blob_len, template,
+                sizeof(template) / sizeof(CK_ATTRIBUTE), &object);
+        if (rv != CKR_OK) {
+            item->error = "key unwrapping";
+            item->rv = rv;
+            continue;
+        }
+
+        rv = p11->C_WrapKey(w->session, w->mech_out, w->new_kek, object, NULL,
+                &item->out_len);
+        if (rv == CKR_OK) {
+            item->out = secmem_alloc(item->out_len);
+            if (item->out == NULL)
+                rv = CKR_HOST_MEMORY;
+        }
+        if (rv == CKR_OK)
+            rv = p11->C_WrapKey(w->session, w->mech_out, w->new_kek, object,
+                    item->out, &item->out_len);
+        if (rv != CKR_OK) {
+            item->error = "key wrapping";
+            item->rv = rv;
+        }
+
+        rv = p11->C_DestroyObject(w->session, object);
+        if (rv != CKR_OK && item->error == NULL) {
+            item->error = "destroy temporary key";
+            item->rv = rv;
+        }
+    }
+    return NULL;
 }
 
 /**
- * export secret key
+ * Re-wrap keys from old KEK to new KEK
+ *
+ * Each blob is unwrapped with old_kek into a session object (CKA_TOKEN
+ * false), wrapped with new_kek and destroyed, nothing is written to token
+ * storage. The batch is split among up to `threads' sessions processed in
+ * parallel with GIL released. Both KEKs have to be on the same token.
+ *
+ * :return: list with new blob or exception instance for each blob, in the
+ *          input order
  */
-//TODO remove, we don't want to export secret key
 static PyObject *
-P11_Helper_export_secret_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
-    CK_RV rv;
-    CK_UTF8CHAR_PTR value = NULL;
-    CK_OBJECT_HANDLE key_handle = 0;
+P11_Helper_rewrap(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *blobs = NULL;
+    PyObject *seq = NULL;
     PyObject *ret = NULL;
-    static char *kwlist[] = { "key_handle", NULL };
-    //TODO check long overflow
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|", kwlist, &key_handle)) {
+    PyObject *value;
+    PyObject *msg;
+    CK_OBJECT_HANDLE old_kek = 0;
+    CK_OBJECT_HANDLE new_kek = 0;
+    CK_MECHANISM mech_in = { CKM_AES_KEY_WRAP_PAD, NULL, 0 };
+    CK_MECHANISM mech_out = { CKM_AES_KEY_WRAP_PAD, NULL, 0 };
+    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
+    CK_KEY_TYPE key_type = CKK_RSA;
+    unsigned int thread_count = 4;
+    p11_shard_t *shard;
+    p11_shard_t *new_shard;
+    rewrap_item_t *items = NULL;
+    rewrap_worker_t *workers = NULL;
+    pthread_t *threads = NULL;
+    Py_ssize_t count;
+    Py_ssize_t i;
+    Py_ssize_t first;
+    char *data;
+    Py_ssize_t data_len;
+    unsigned int t;
+
+    static char *kwlist[] = { "blobs", "old_kek", "new_kek", "mech_in",
+            "mech_out", "key_class", "key_type", "threads", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Okkkk|kkI", kwlist, &blobs,
+            &old_kek, &new_kek, &mech_in.mechanism, &mech_out.mechanism,
+            &key_class, &key_type, &thread_count)) {
         return NULL;
     }
 
-    //TODO which attributes should be returned ????
-    CK_ATTRIBUTE obj_template[] = { { CKA_VALUE, NULL_PTR, 0 } };
+    shard = _shard_of(self, &old_kek);
+    new_shard = _shard_of(self, &new_kek);
+    if (shard == NULL || new_shard == NULL)
+        return NULL;
+    if (shard != new_shard) {
+        PyErr_SetString(ipap11helperError,
+                "Old and new wrapping key are on different tokens");
+        return NULL;
+    }
+    if (!_check_mechanism(self, shard, mech_in.mechanism, CKF_UNWRAP, 0,
+            "rewrap") || !_check_mechanism(self, shard, mech_out.mechanism,
+            CKF_WRAP, 0, "rewrap"))
+        return NULL;
+    _wrap_mech_params(&mech_in);
+    _wrap_mech_params(&mech_out);
 
-    rv = self->p11->C_GetAttributeValue(self->session, key_handle, obj_template,
-            1);
-    if (!check_return_value(rv, "get attribute value - prepare")) {
+    /* own copy, strings are used with GIL released */
+    seq = PySequence_Tuple(blobs);
+    if (seq == NULL)
         return NULL;
+    count = PyTuple_GET_SIZE(seq);
+    if (thread_count == 0)
+        thread_count = 1;
+    if ((Py_ssize_t) thread_count > count)
+        thread_count = count > 0 ? (unsigned int) count : 1;
+
+    items = calloc(count > 0 ? (size_t) count : 1, sizeof(rewrap_item_t));
+    workers = calloc(thread_count, sizeof(rewrap_worker_t));
+    threads = calloc(thread_count, sizeof(pthread_t));
+    if (items == NULL || workers == NULL || threads == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (i = 0; i < count; i++) {
+        if (PyString_AsStringAndSize(PyTuple_GET_ITEM(seq, i), &data,
+                &data_len) < 0)
+            goto cleanup;
+        items[i].blob = (CK_BYTE_PTR) data;
+        items[i].blob_len = data_len;
     }
 
-    /* Set proper size for attributes*/
-    value = (CK_UTF8CHAR_PTR) malloc(
-            obj_template[0].ulValueLen * sizeof(CK_BYTE));
-    obj_template[0].pValue = value;
+    /*
+     * Workers have own sessions, the main one can be used by other Python
+     * threads while GIL is released. Session objects are visible to all
+     * sessions, so KEKs can be session keys too.
+     */
+    first = 0;
+    for (t = 0; t < thread_count; t++) {
+        Py_ssize_t n = count / thread_count
+                + ((Py_ssize_t) t < count % thread_count);
+
+        workers[t].self = self;
+        workers[t].shard = shard;
+        workers[t].session = CK_INVALID_HANDLE;
+        workers[t].items = items + first;
+        workers[t].count = n;
+        workers[t].mech_in = &mech_in;
+        workers[t].mech_out = &mech_out;
+        workers[t].old_kek = old_kek;
+        workers[t].new_kek = new_kek;
+        workers[t].key_class = key_class;
+        workers[t].key_type = key_type;
+        first += n;
+    }
 
-    rv = self->p11->C_GetAttributeValue(self->session, key_handle, obj_template,
-            1);
-    if (!check_return_value(rv, "get attribute value")) {
-        free(value);
-        return NULL;
+    Py_BEGIN_ALLOW_THREADS
+
+    for (t = 1; t < thread_count; t++) {
+        if (pthread_create(&threads[t], NULL, _rewrap_worker, &workers[t])
+                != 0) {
+            threads[t] = pthread_self();
+            _rewrap_worker(&workers[t]);
+        }
+    }
+    _rewrap_worker(&workers[0]);
+    if (workers[0].session != CK_INVALID_HANDLE)
+        self->p11->C_CloseSession(workers[0].session);
+    for (t = 1; t < thread_count; t++) {
+        if (!pthread_equal(threads[t], pthread_self()))
+            pthread_join(threads[t], NULL);
+        if (workers[t].session != CK_INVALID_HANDLE)
+            self->p11->C_CloseSession(workers[t].session);
     }
 
-    if (obj_template[0].ulValueLen <= 0) {
-        PyErr_SetString(ipap11helperNotFound, "Value not found");
-        free(value);
-        return NULL;
+    Py_END_ALLOW_THREADS
+
+    ret = PyList_New(count);
+    if (ret == NULL)
+        goto cleanup;
+    for (i = 0; i < count; i++) {
+        if (items[i].error == NULL) {
+            value = PyString_FromStringAndSize((char *) items[i].out,
+                    items[i].out_len);
+        } else {
+            msg = PyString_FromFormat("Error at %s: 0x%x", items[i].error,
+                    (unsigned int) items[i].rv);
+            value = msg == NULL ? NULL : PyObject_CallFunctionObjArgs(
+                    ipap11helperError, msg, NULL);
+            Py_XDECREF(msg);
+        }
+        if (value == NULL) {
+            Py_CLEAR(ret);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(ret, i, value);
     }
-    ret = Py_BuildValue("{s:s#}", "value", obj_template[0].pValue,
-            obj_template[0].ulValueLen);
-    free(value);
+
+cleanup:
+    if (items != NULL) {
+        for (i = 0; i < count; i++)
+            secmem_free(items[i].out);
+    }
+    free(threads);
+    free(workers);
+    free(items);
+    Py_DECREF(seq);
     return ret;
 }
 
 /**
- * export RSA public key
+ * One message of sign_many() or verify_many()
+ *
+ * data and sig point to strings owned by the sequences passed in. The
+ * signature made is in the output buffer of the worker unless the token
+ * returned a longer one than for the first message, then it is in own
+ * allocation (own_out).
  */
-static PyObject *
-P11_Helper_export_RSA_public_key(P11_Helper* self, CK_OBJECT_HANDLE object) {
+typedef struct {
+    CK_BYTE_PTR data;
+    CK_ULONG data_len;
+    CK_BYTE_PTR sig;        /* signature to verify */
+    CK_ULONG sig_len;
+    CK_BYTE_PTR out;        /* signature made */
+    CK_ULONG out_len;
+    int own_out;
+    const char *error;      /* NULL on success */
     CK_RV rv;
-    PyObject *ret = NULL;
+} sign_item_t;
 
-    int pp_len;
-    unsigned char *pp = NULL;
-    EVP_PKEY *pkey = NULL;
-    BIGNUM *e = NULL;
-    BIGNUM *n = NULL;
-    RSA *rsa = NULL;
-    CK_BYTE_PTR modulus = NULL;
-    CK_BYTE_PTR exponent = NULL;
-    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
-    CK_KEY_TYPE key_type = CKK_RSA;
+/**
+ * Contiguous part of sign_many() or verify_many() batch handled by one
+ * session
+ */
+typedef struct {
+    P11_Helper *self;
+    const p11_shard_t *shard;
+    CK_SESSION_HANDLE session;
+    sign_item_t *items;
+    Py_ssize_t count;
+    CK_MECHANISM_PTR mech;
+    CK_OBJECT_HANDLE key;
+    int verify;
+    int active;             /* operation left active, session not reusable */
+    CK_BYTE_PTR buf;        /* count slots of stride bytes */
+    CK_ULONG stride;
+} sign_worker_t;
 
-    CK_ATTRIBUTE obj_template[] = { { CKA_MODULUS, NULL_PTR, 0 }, {
-            CKA_PUBLIC_EXPONENT, NULL_PTR, 0 }, { CKA_CLASS, &class,
-            sizeof(class) }, { CKA_KEY_TYPE, &key_type, sizeof(key_type) } };
+/**
+ * Sign or verify messages of one worker
+ *
+ * Runs with GIL released, in own session which is opened unless one from
+ * the pool is given. Signature length is fixed for a key and mechanism,
+ * so it is asked for once and the signatures of the whole part go to one
+ * buffer.
+ */
+static void *_sign_worker(void *arg) {
+    sign_worker_t *w = arg;
+    CK_FUNCTION_LIST_PTR p11 = w->self->p11;
+    sign_item_t *item;
+    Py_ssize_t i;
+    CK_RV rv;
 
-    rv = self->p11->C_GetAttributeValue(self->session, object, obj_template, 4);
-    if (!check_return_value(rv, "get RSA public key values - prepare"))
+    if (w->count == 0)
+        return NULL;
+    rv = CKR_OK;
+    if (w->session == CK_INVALID_HANDLE)
+        rv = _open_session(w->self, w->shard, &w->session);
+    if (rv != CKR_OK) {
+        w->session = CK_INVALID_HANDLE;
+        for (i = 0; i < w->count; i++) {
+            w->items[i].rv = rv;
+            w->items[i].error = "open session";
+        }
         return NULL;
+    }
 
-    /* Set proper size for attributes*/
-    modulus = (CK_BYTE_PTR) malloc(
-            obj_template[0].ulValueLen * sizeof(CK_BYTE));
-    obj_template[0].pValue = modulus;
-    exponent = (CK_BYTE_PTR) malloc(
-            obj_template[1].ulValueLen * sizeof(CK_BYTE));
-    obj_template[1].pValue = exponent;
+    for (i = 0; i < w->count; i++) {
+        item = &w->items[i];
+        if (w->verify) {
+            rv = p11->C_VerifyInit(w->session, w->mech, w->key);
+            if (rv != CKR_OK) {
+                item->error = "verify init";
+                item->rv = rv;
+                continue;
+            }
+            /* invalid signature is a result, not an error */
+            rv = p11->C_Verify(w->session, item->data, item->data_len,
+                    item->sig, item->sig_len);
+            item->rv = rv;
+            if (rv != CKR_OK && rv != CKR_SIGNATURE_INVALID
+                    && rv != CKR_SIGNATURE_LEN_RANGE)
+                item->error = "verify";
+            continue;
+        }
 
-    rv = self->p11->C_GetAttributeValue(self->session, object, obj_template, 4);
-    if (!check_return_value(rv, "get RSA public key values"))
-        return NULL;
+        rv = p11->C_SignInit(w->session, w->mech, w->key);
+        if (rv != CKR_OK) {
+            item->error = "sign init";
+            item->rv = rv;
+            continue;
+        }
+        if (w->buf == NULL) {
+            rv = p11->C_Sign(w->session, item->data, item->data_len, NULL,
+                    &w->stride);
+            if (rv == CKR_OK) {
+                w->buf = malloc(w->stride * w->count);
+                if (w->buf == NULL)
+                    rv = CKR_HOST_MEMORY;
+            }
+            if (rv != CKR_OK) {
+                /* operation may be still active, closing session ends it */
+                w->active = 1;
+                for (; i < w->count; i++) {
+                    w->items[i].error = "sign";
+                    w->items[i].rv = rv;
+                }
+                break;
+            }
+        }
+        item->out = w->buf + i * w->stride;
+        item->out_len = w->stride;
+        rv = p11->C_Sign(w->session, item->data, item->data_len, item->out,
+                &item->out_len);
+        if (rv == CKR_BUFFER_TOO_SMALL) {
+            item->out = malloc(item->out_len);
+            if (item->out == NULL) {
+                /* operation is still active, the rest cannot be signed */
+                w->active = 1;
+                for (; i < w->count; i++) {
+                    w->items[i].error = "sign";
+                    w->items[i].rv = CKR_HOST_MEMORY;
+                }
+                break;
+            }
+            item->own_out = 1;
+            rv = p11->C_Sign(w->session, item->data, item->data_len,
+                    item->out, &item->out_len);
+        }
+        if (rv != CKR_OK) {
+            item->error = "sign";
+            item->rv = rv;
+        }
+    }
+    return NULL;
+}
 
-    /* Check if the key is RSA public key */
-    if (class != CKO_PUBLIC_KEY) {
-        PyErr_SetString(ipap11helperError,
-                "export_RSA_public_key: required public key class");
+/**
+ * Sign messages or verify signatures with one key
+ *
+ * Common part of sign_many() and verify_many(), signatures is NULL for
+ * signing. The batch is split among up to thread_count (at most
+ * SIGN_MAX_THREADS) sessions processed in parallel with GIL released;
+ * the sessions are kept in the pool of the shard for next calls.
+ */
+static PyObject *_sign_many(P11_Helper* self, CK_OBJECT_HANDLE key,
+        CK_MECHANISM_TYPE mechanism, PyObject *messages, PyObject *signatures,
+        unsigned int thread_count) {
+    PyObject *seq = NULL;
+    PyObject *sig_seq = NULL;
+    PyObject *ret = NULL;
+    PyObject *value;
+    PyObject *msg;
+    CK_MECHANISM mech = { mechanism, NULL, 0 };
+    int verify = signatures != NULL;
+    p11_shard_t *shard;
+    sign_item_t *items = NULL;
+    sign_worker_t *workers = NULL;
+    pthread_t *threads = NULL;
+    Py_ssize_t count;
+    Py_ssize_t i;
+    Py_ssize_t first;
+    char *data;
+    Py_ssize_t data_len;
+    unsigned int t;
+
+    shard = _shard_of(self, &key);
+    if (shard == NULL)
+        return NULL;
+    if (!_check_mechanism(self, shard, mechanism,
+            verify ? CKF_VERIFY : CKF_SIGN, 0,
+            verify ? "verify_many" : "sign_many"))
         return NULL;
-    }
 
-    if (key_type != CKK_RSA) {
-        PyErr_SetString(ipap11helperError,
-                "export_RSA_public_key: required RSA key type");
+    /* own copies, strings are used with GIL released */
+    seq = PySequence_Tuple(messages);
+    if (seq == NULL)
         return NULL;
+    count = PyTuple_GET_SIZE(seq);
+    if (verify) {
+        sig_seq = PySequence_Tuple(signatures);
+        if (sig_seq == NULL)
+            goto cleanup;
+        if (PyTuple_GET_SIZE(sig_seq) != count) {
+            PyErr_SetString(PyExc_ValueError,
+                    "messages and signatures differ in length");
+            goto cleanup;
+        }
     }
-
-    rsa = RSA_new();
-    pkey = EVP_PKEY_new();
-    n = BN_bin2bn((const unsigned char *) modulus,
-            obj_template[0].ulValueLen * sizeof(CK_BYTE), NULL);
-    if (n == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "export_RSA_public_key: internal error: unable to convert modulus");
-        goto final;
+    if (thread_count == 0)
+        thread_count = 1;
+    if (thread_count > SIGN_MAX_THREADS)
+        thread_count = SIGN_MAX_THREADS;
+    if ((Py_ssize_t) thread_count > count)
+        thread_count = count > 0 ? (unsigned int) count : 1;
+
+    items = calloc(count > 0 ? (size_t) count : 1, sizeof(sign_item_t));
+    workers = calloc(thread_count, sizeof(sign_worker_t));
+    threads = calloc(thread_count, sizeof(pthread_t));
+    if (items == NULL || workers == NULL || threads == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (i = 0; i < count; i++) {
+        if (PyString_AsStringAndSize(PyTuple_GET_ITEM(seq, i), &data,
+                &data_len) < 0)
+            goto cleanup;
+        items[i].data = (CK_BYTE_PTR) data;
+        items[i].data_len = data_len;
+        if (!verify)
+            continue;
+        if (PyString_AsStringAndSize(PyTuple_GET_ITEM(sig_seq, i),
+                &data, &data_len) < 0)
+            goto cleanup;
+        items[i].sig = (CK_BYTE_PTR) data;
+        items[i].sig_len = data_len;
     }
 
-    e = BN_bin2bn((const unsigned char *) exponent,
-            obj_template[1].ulValueLen * sizeof(CK_BYTE), NULL);
-    if (e == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "export_RSA_public_key: internal error: unable to convert exponent");
-        goto final;
+    first = 0;
+    for (t = 0; t < thread_count; t++) {
+        Py_ssize_t n = count / thread_count
+                + ((Py_ssize_t) t < count % thread_count);
+
+        workers[t].self = self;
+        workers[t].shard = shard;
+        workers[t].session = _pool_get(shard);
+        workers[t].items = items + first;
+        workers[t].count = n;
+        workers[t].mech = &mech;
+        workers[t].key = key;
+        workers[t].verify = verify;
+        first += n;
     }
 
-    /* set modulus and exponent */
-    rsa->n = n;
-    rsa->e = e;
+    Py_BEGIN_ALLOW_THREADS
 
-    if (EVP_PKEY_set1_RSA(pkey, rsa) == 0) {
-        PyErr_SetString(ipap11helperError,
-                "export_RSA_public_key: internal error: EVP_PKEY_set1_RSA failed");
-        goto final;
+    for (t = 1; t < thread_count; t++) {
+        if (pthread_create(&threads[t], NULL, _sign_worker, &workers[t])
+                != 0) {
+            threads[t] = pthread_self();
+            _sign_worker(&workers[t]);
+        }
+    }
+    _sign_worker(&workers[0]);
+    for (t = 1; t < thread_count; t++) {
+        if (!pthread_equal(threads[t], pthread_self()))
+            pthread_join(threads[t], NULL);
     }
 
-    pp_len = i2d_PUBKEY(pkey, &pp);
-    ret = Py_BuildValue("s#", pp, pp_len);
+    Py_END_ALLOW_THREADS
 
-    final: if (rsa != NULL) {
-        RSA_free(rsa); // this free also 'n' and 'e'
-    } else {
-        if (n != NULL)
-            BN_free(n);
-        if (e != NULL)
-            BN_free(e);
+    for (t = 0; t < thread_count; t++) {
+        if (workers[t].active)
+            self->p11->C_CloseSession(workers[t].session);
+        else
+            _pool_put(self, shard, workers[t].session);
+    }
+
+    ret = PyList_New(count);
+    if (ret == NULL)
+        goto cleanup;
+    for (i = 0; i < count; i++) {
+        if (items[i].error != NULL) {
+            msg = PyString_FromFormat("Error at %s: 0x%x", items[i].error,
+                    (unsigned int) items[i].rv);
+            value = msg == NULL ? NULL : PyObject_CallFunctionObjArgs(
+                    ipap11helperError, msg, NULL);
+            Py_XDECREF(msg);
+        } else if (verify) {
+            value = PyBool_FromLong(items[i].rv == CKR_OK);
+        } else {
+            value = PyString_FromStringAndSize((char *) items[i].out,
+                    items[i].out_len);
+        }
+        if (value == NULL) {
+            Py_CLEAR(ret);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(ret, i, value);
     }
 
-    if (pkey != NULL)
-        EVP_PKEY_free(pkey);
-    if (pp != NULL)
-        free(pp);
+cleanup:
+    if (items != NULL) {
+        for (i = 0; i < count; i++) {
+            if (items[i].own_out)
+                free(items[i].out);
+        }
+    }
+    if (workers != NULL) {
+        for (t = 0; t < thread_count; t++)
+            free(workers[t].buf);
+    }
+    free(threads);
+    free(workers);
+    free(items);
+    Py_XDECREF(sig_seq);
+    Py_DECREF(seq);
     return ret;
 }
 
 /**
- * Export public key
+ * Sign many messages with one key
  *
- * Export public key in SubjectPublicKeyInfo (RFC5280) DER encoded format
+ * Each message is signed by single-part C_SignInit/C_Sign, e.g. RRsets
+ * for DNSSEC with CKM_SHA256_RSA_PKCS. With threads > 1 the batch is
+ * spread over that many sessions, at most 16.
+ *
+ * :return: list with signature or exception instance for each message,
+ *          in the input order
  */
 static PyObject *
-P11_Helper_export_public_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
-    CK_RV rv;
-    CK_OBJECT_HANDLE object = 0;
-    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
-    CK_KEY_TYPE key_type = CKK_RSA;
-    static char *kwlist[] = { "key_handle", NULL };
-    //TODO check long overflow
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "k|", kwlist, &object)) {
-        return NULL;
-    }
-
-    CK_ATTRIBUTE obj_template[] = { { CKA_CLASS, &class, sizeof(class) }, {
-            CKA_KEY_TYPE, &key_type, sizeof(key_type) } };
+P11_Helper_sign_many(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *messages = NULL;
+    CK_OBJECT_HANDLE key = 0;
+    CK_MECHANISM_TYPE mechanism = 0;
+    unsigned int thread_count = 1;
 
-    rv = self->p11->C_GetAttributeValue(self->session, object, obj_template, 2);
-    if (!check_return_value(rv, "export_public_key: get RSA public key values"))
-        return NULL;
-
-    if (class != CKO_PUBLIC_KEY) {
-        PyErr_SetString(ipap11helperError,
-                "export_public_key: required public key class");
+    static char *kwlist[] = { "key", "mechanism", "messages", "threads",
+            NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkO|I", kwlist, &key,
+            &mechanism, &messages, &thread_count)) {
         return NULL;
     }
+    return _sign_many(self, key, mechanism, messages, NULL, thread_count);
+}
 
-    switch (key_type) {
-        case CKK_RSA:
-            return P11_Helper_export_RSA_public_key(self, object);
-            break;
-        default:
-            PyErr_SetString(ipap11helperError,
-                    "export_public_key: unsupported key type");
+/**
+ * Verify many signatures with one key
+ *
+ * :return: list with True, False or exception instance for each message,
+ *          in the input order
+ */
+static PyObject *
+P11_Helper_verify_many(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *messages = NULL;
+    PyObject *signatures = NULL;
+    CK_OBJECT_HANDLE key = 0;
+    CK_MECHANISM_TYPE mechanism = 0;
+    unsigned int thread_count = 1;
+
+    static char *kwlist[] = { "key", "mechanism", "messages", "signatures",
+            "threads", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkOO|I", kwlist, &key,
+            &mechanism, &messages, &signatures, &thread_count)) {
+        return NULL;
     }
-
-    return NULL;
+    return _sign_many(self, key, mechanism, messages, signatures,
+            thread_count);
 }
 
 /**
- * Import RSA public key
+ * DNSKEY of one key for export_dnskey()
+ */
+typedef struct {
+    CK_OBJECT_HANDLE object;
+    const p11_shard_t *shard;
+    CK_SESSION_HANDLE session;
+    CK_BYTE rdata[DNSKEY_RDATA_MAX];
+    size_t rdata_len;
+    uint16_t key_tag;
+    CK_BYTE ds_sha256[32];
+    CK_BYTE ds_sha384[48];
+    const char *error;      /* NULL on success */
+    CK_RV rv;
+} dnskey_item_t;
+
+/**
+ * Read RSA public key of one object and compute RDATA, key tag and DS
+ * digests; runs with GIL released
  *
+ * :param msg: buffer for owner name in wire format followed by RDATA,
+ *             the name is already there
  */
-static PyObject *
-P11_Helper_import_RSA_public_key(P11_Helper* self, CK_UTF8CHAR *label,
-        Py_ssize_t label_length, CK_BYTE *id, Py_ssize_t id_length,
-        EVP_PKEY *pkey, CK_BBOOL* cka_copyable, CK_BBOOL* cka_derive,
-        CK_BBOOL* cka_encrypt, CK_BBOOL* cka_modifiable, CK_BBOOL* cka_private,
-        CK_BBOOL* cka_trusted, CK_BBOOL* cka_verify,
-        CK_BBOOL* cka_verify_recover, CK_BBOOL* cka_wrap) {
+static void _dnskey_item(P11_Helper* self, dnskey_item_t *item,
+        uint16_t flags, uint8_t algorithm, CK_BYTE *msg, size_t owner_len) {
+    CK_FUNCTION_LIST_PTR p11 = self->p11;
+    CK_KEY_TYPE key_type = CKK_VENDOR_DEFINED;
+    CK_BYTE modulus[DNSKEY_MODULUS_MAX];
+    CK_BYTE exponent[DNSKEY_EXPONENT_MAX];
+    CK_MECHANISM sha256 = { CKM_SHA256, NULL, 0 };
+    CK_MECHANISM sha384 = { CKM_SHA384, NULL, 0 };
+    CK_ULONG len;
     CK_RV rv;
-    CK_OBJECT_CLASS class = CKO_PUBLIC_KEY;
-    CK_KEY_TYPE keyType = CKK_RSA;
-    CK_BBOOL *cka_token = &true;
-    RSA *rsa = NULL;
-    CK_BYTE_PTR modulus = NULL;
-    int modulus_len = 0;
-    CK_BYTE_PTR exponent = NULL;
-    int exponent_len = 0;
 
-    if (pkey->type != EVP_PKEY_RSA) {
-        PyErr_SetString(ipap11helperError, "Required RSA public key");
-        return NULL;
+    CK_ATTRIBUTE template[] = {
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+        { CKA_MODULUS, modulus, sizeof(modulus) },
+        { CKA_PUBLIC_EXPONENT, exponent, sizeof(exponent) } };
+
+    rv = p11->C_GetAttributeValue(item->session, item->object, template,
+            sizeof(template) / sizeof(CK_ATTRIBUTE));
+    if (rv == CKR_OK && key_type != CKK_RSA)
+        rv = CKR_KEY_TYPE_INCONSISTENT;
+    if (rv != CKR_OK) {
+        item->error = "public key reading";
+        item->rv = rv;
+        return;
+    }
+    item->rdata_len = dnskey_rsa_rdata(flags, algorithm, exponent,
+            template[2].ulValueLen, modulus, template[1].ulValueLen,
+            item->rdata);
+    item->key_tag = dnskey_key_tag(item->rdata, item->rdata_len);
+
+    memcpy(msg + owner_len, item->rdata, item->rdata_len);
+    len = sizeof(item->ds_sha256);
+    rv = p11->C_DigestInit(item->session, &sha256);
+    if (rv == CKR_OK)
+        rv = p11->C_Digest(item->session, msg, owner_len + item->rdata_len,
+                item->ds_sha256, &len);
+    if (rv == CKR_OK) {
+        len = sizeof(item->ds_sha384);
+        rv = p11->C_DigestInit(item->session, &sha384);
     }
+    if (rv == CKR_OK)
+        rv = p11->C_Digest(item->session, msg, owner_len + item->rdata_len,
+                item->ds_sha384, &len);
+    if (rv != CKR_OK) {
+        item->error = "DS digest";
+        item->rv = rv;
+    }
+}
 
-    rsa = EVP_PKEY_get1_RSA(pkey);
-    if (rsa == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "import_RSA_public_key: EVP_PKEY_get1_RSA error");
-        free(pkey);
+/**
+ * Export RSA public keys as DNSKEY records
+ *
+ * RDATA (RFC 3110) is built from CKA_MODULUS and CKA_PUBLIC_EXPONENT read
+ * from the token; DS digests (SHA-256 and SHA-384, digest types 2 and 4)
+ * are computed by the token over owner name and RDATA. All keys are
+ * processed with GIL released, in own sessions. Only RSA algorithms 5, 7,
+ * 8 and 10 are supported.
+ *
+ * :param handles: sequence of public or private RSA key handles
+ * :param owner: zone name the keys are published in
+ * :param flags: DNSKEY flags, 256 for ZSK, 257 for KSK
+ * :param algorithm: DNSSEC algorithm number, 8 = RSASHA256
+ * :return: list with (rdata, key_tag, ds_sha256, ds_sha384) or exception
+ *          instance for each key, in the input order
+ */
+static PyObject *
+P11_Helper_export_dnskey(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *handles = NULL;
+    PyObject *seq = NULL;
+    PyObject *ret = NULL;
+    PyObject *value;
+    PyObject *msg;
+    const char *owner = NULL;
+    int owner_len = 0;
+    unsigned int flags = DNSKEY_FLAG_ZONE;
+    unsigned int algorithm = 8;
+    CK_BYTE *buf = NULL;
+    size_t wire_len = 0;
+    dnskey_item_t *items = NULL;
+    CK_SESSION_HANDLE *sessions = NULL;
+    p11_shard_t *shard;
+    Py_ssize_t count;
+    Py_ssize_t i;
+
+    static char *kwlist[] = { "handles", "owner", "flags", "algorithm",
+            NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Os#|II", kwlist, &handles,
+            &owner, &owner_len, &flags, &algorithm)) {
         return NULL;
     }
-
-    /* convert BIGNUM to binary array */
-    modulus = (CK_BYTE_PTR) malloc(BN_num_bytes(rsa->n));
-    modulus_len = BN_bn2bin(rsa->n, (unsigned char *) modulus);
-    if (modulus == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "import_RSA_public_key: BN_bn2bin modulus error");
-        //TODO free
+    if (flags > 0xffff) {
+        PyErr_SetString(PyExc_ValueError, "Invalid flags");
         return NULL;
     }
-
-    exponent = (CK_BYTE_PTR) malloc(BN_num_bytes(rsa->e));
-    exponent_len = BN_bn2bin(rsa->e, (unsigned char *) exponent);
-    if (exponent == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "import_RSA_public_key: BN_bn2bin exponent error");
-        //TODO free
+    /* RDATA is built from RSA key, RSA/MD5 is deprecated */
+    if (algorithm != 5 && algorithm != 7 && algorithm != 8
+            && algorithm != 10) {
+        PyErr_SetString(PyExc_ValueError,
+                "Algorithm must be RSA: 5, 7, 8 or 10");
         return NULL;
     }
 
-    CK_ATTRIBUTE template[] = {
-        { CKA_ID, id, id_length },
-        { CKA_CLASS, &class, sizeof(class) },
-        { CKA_KEY_TYPE, &keyType, sizeof(keyType) },
-        { CKA_TOKEN, cka_token, sizeof(CK_BBOOL) },
-        { CKA_LABEL, label, label_length },
-        { CKA_MODULUS, modulus, modulus_len },
-        { CKA_PUBLIC_EXPONENT, exponent, exponent_len },
-        //{CKA_COPYABLE, cka_copyable, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
-        { CKA_DERIVE, cka_derive, sizeof(CK_BBOOL) },
-        { CKA_ENCRYPT, cka_encrypt, sizeof(CK_BBOOL) },
-        { CKA_MODIFIABLE, cka_modifiable, sizeof(CK_BBOOL) },
-        { CKA_PRIVATE, cka_private, sizeof(CK_BBOOL) },
-        { CKA_TRUSTED, cka_trusted, sizeof(CK_BBOOL) },
-        { CKA_VERIFY, cka_verify, sizeof(CK_BBOOL) },
-        { CKA_VERIFY_RECOVER, cka_verify_recover, sizeof(CK_BBOOL) },
-        { CKA_WRAP, cka_wrap, sizeof(CK_BBOOL) }, };
-    CK_OBJECT_HANDLE object;
+    buf = malloc(DNSKEY_NAME_MAX + DNSKEY_RDATA_MAX);
+    if (buf == NULL)
+        return PyErr_NoMemory();
+    if (dnskey_name_to_wire(owner, owner_len, buf, &wire_len) != 0) {
+        PyErr_SetString(PyExc_ValueError, "Invalid owner name");
+        goto cleanup;
+    }
 
-    rv = self->p11->C_CreateObject(self->session, template,
-            sizeof(template) / sizeof(CK_ATTRIBUTE), &object);
-    if (!check_return_value(rv, "create public key object"))
-        return NULL;
+    seq = PySequence_Fast(handles, "handles must be a sequence");
+    if (seq == NULL)
+        goto cleanup;
+    count = PySequence_Fast_GET_SIZE(seq);
+    items = calloc(count > 0 ? (size_t) count : 1, sizeof(dnskey_item_t));
+    sessions = calloc(self->shard_count, sizeof(CK_SESSION_HANDLE));
+    if (items == NULL || sessions == NULL) {
+        PyErr_NoMemory();
+        goto cleanup;
+    }
+    for (i = 0; i < count; i++) {
+        items[i].object = PyInt_AsUnsignedLongMask(
+                PySequence_Fast_GET_ITEM(seq, i));
+        if (PyErr_Occurred())
+            goto cleanup;
+        shard = _shard_of(self, &items[i].object);
+        if (shard == NULL
+                || !_check_mechanism(self, shard, CKM_SHA256, CKF_DIGEST, 0,
+                        "DS digest")
+                || !_check_mechanism(self, shard, CKM_SHA384, CKF_DIGEST, 0,
+                        "DS digest"))
+            goto cleanup;
+        items[i].shard = shard;
+    }
+    for (i = 0; i < (Py_ssize_t) self->shard_count; i++)
+        sessions[i] = CK_INVALID_HANDLE;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < count; i++) {
+        items[i].rv = _batch_session(self, sessions, items[i].shard,
+                &items[i].session);
+        if (items[i].rv != CKR_OK)
+            items[i].error = "open session";
+        else
+            _dnskey_item(self, &items[i], flags, algorithm, buf, wire_len);
+    }
+    _close_batch_sessions(self, sessions);
+    Py_END_ALLOW_THREADS
 
-    if (rsa != NULL)
-        RSA_free(rsa);
+    ret = PyList_New(count);
+    if (ret == NULL)
+        goto cleanup;
+    for (i = 0; i < count; i++) {
+        if (items[i].error == NULL) {
+            value = Py_BuildValue("(s#Hs#s#)", (char *) items[i].rdata,
+                    (int) items[i].rdata_len, items[i].key_tag,
+                    (char *) items[i].ds_sha256,
+                    (int) sizeof(items[i].ds_sha256),
+                    (char *) items[i].ds_sha384,
+                    (int) sizeof(items[i].ds_sha384));
+        } else {
+            msg = PyString_FromFormat("Error at %s: 0x%x", items[i].error,
+                    (unsigned int) items[i].rv);
+            value = msg == NULL ? NULL : PyObject_CallFunctionObjArgs(
+                    ipap11helperError, msg, NULL);
+            Py_XDECREF(msg);
+        }
+        if (value == NULL) {
+            Py_CLEAR(ret);
+            goto cleanup;
+        }
+        PyList_SET_ITEM(ret, i, value);
+    }
 
-    return Py_BuildValue("k", object);
+cleanup:
+    free(items);
+    free(sessions);
+    free(buf);
+    Py_XDECREF(seq);
+    return ret;
 }
 
 /**
- * Import RSA public key
+ * Compute key check value of AES key on the token
  *
+ * Without cmac the standard KCV is used: first bytes of zero block
+ * encrypted with CKM_AES_ECB. Tokens which keep it in CKA_CHECK_VALUE
+ * answer without any encryption. With cmac, first bytes of CKM_AES_CMAC
+ * of zero block. Encryption needs CKA_ENCRYPT and CMAC needs CKA_SIGN,
+ * keys without them fail with CKR_KEY_FUNCTION_NOT_PERMITTED and an error
+ * saying so. Does not touch Python objects.
+ *
+ * :param kcv: buffer of KCV_LENGTH bytes
  */
-static PyObject *
-P11_Helper_import_public_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
-    int r;
-    PyObject *ret = NULL;
-    PyObject *label_unicode = NULL;
-    CK_BYTE *id = NULL;
-    CK_BYTE *data = NULL;
-    CK_UTF8CHAR *label = NULL;
-    Py_ssize_t id_length = 0;
-    Py_ssize_t data_length = 0;
-    Py_ssize_t label_length = 0;
-    EVP_PKEY *pkey = NULL;
-
-    PyObj2Bool_mapping_t attrs_pub[] = { { NULL, &true }, //pub_en_cka_copyable
-            { NULL, &false }, //pub_en_cka_derive
-            { NULL, &false }, //pub_en_cka_encrypt
-            { NULL, &true }, //pub_en_cka_modifiable
-            { NULL, &true }, //pub_en_cka_private
-            { NULL, &false }, //pub_en_cka_trusted
-            { NULL, &true }, //pub_en_cka_verify
-            { NULL, &true }, //pub_en_cka_verify_recover
-            { NULL, &false }, //pub_en_cka_wrap
-            };
+static CK_RV _kcv_compute(P11_Helper* self, CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object, int cmac, CK_BYTE *kcv, const char **error) {
+    CK_FUNCTION_LIST_PTR p11 = self->p11;
+    CK_KEY_TYPE key_type = CKK_VENDOR_DEFINED;
+    CK_BBOOL permitted = CK_FALSE;
+    CK_BYTE check_value[KCV_LENGTH];
+    CK_BYTE zero[16];
+    CK_BYTE out[16];
+    CK_ULONG out_len = sizeof(out);
+    CK_MECHANISM mech = { cmac ? CKM_AES_CMAC : CKM_AES_ECB, NULL, 0 };
+    CK_RV rv;
 
-    static char *kwlist[] = { "label", "id", "data",
-    /* public key attributes */
-    "cka_copyable", "cka_derive", "cka_encrypt", "cka_modifiable",
-            "cka_private", "cka_trusted", "cka_verify", "cka_verify_recover",
-            "cka_wrap", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#s#|OOOOOOOOO", kwlist,
-            &label_unicode, &id, &id_length, &data, &data_length,
-            /* public key attributes */
-            &attrs_pub[pub_en_cka_copyable].py_obj,
-            &attrs_pub[pub_en_cka_derive].py_obj,
-            &attrs_pub[pub_en_cka_encrypt].py_obj,
-            &attrs_pub[pub_en_cka_modifiable].py_obj,
-            &attrs_pub[pub_en_cka_private].py_obj,
-            &attrs_pub[pub_en_cka_trusted].py_obj,
-            &attrs_pub[pub_en_cka_verify].py_obj,
-            &attrs_pub[pub_en_cka_verify_recover].py_obj,
-            &attrs_pub[pub_en_cka_wrap].py_obj)) {
-        return NULL;
+    CK_ATTRIBUTE template[] = {
+        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
+        { cmac ? CKA_SIGN : CKA_ENCRYPT, &permitted, sizeof(permitted) },
+        { CKA_CHECK_VALUE, check_value, sizeof(check_value) } };
+
+    /* CKA_CHECK_VALUE is optional, the rest is read even if it is missing */
+    *error = "key attributes reading";
+    rv = p11->C_GetAttributeValue(session, object, template, cmac ? 2 : 3);
+    if (rv != CKR_OK && (rv != CKR_ATTRIBUTE_TYPE_INVALID || cmac))
+        return rv;
+    if (template[0].ulValueLen != sizeof(key_type) || key_type != CKK_AES)
+        return CKR_KEY_TYPE_INCONSISTENT;
+    if (!cmac && template[2].ulValueLen == KCV_LENGTH) {
+        memcpy(kcv, check_value, KCV_LENGTH);
+        return CKR_OK;
     }
-    Py_XINCREF(label_unicode);
-    label = (unsigned char*) unicode_to_char_array(label_unicode,
-            &label_length);
-    Py_XDECREF(label_unicode);
 
-    r = _id_exists(self, id, id_length, CKO_PUBLIC_KEY);
-    if (r == 1) {
-        PyErr_SetString(ipap11helperDuplicationError,
-                "Public key with same ID already exists");
-        return NULL;
-    } else if (r == -1) {
-        return NULL;
+    /* e.g. master keys, they are generated with both false by default */
+    if (template[1].ulValueLen != sizeof(permitted) || permitted != CK_TRUE) {
+        *error = cmac ? "CMAC, key has CKA_SIGN false"
+                : "zero block encryption, key has CKA_ENCRYPT false and "
+                  "token provides no CKA_CHECK_VALUE";
+        return CKR_KEY_FUNCTION_NOT_PERMITTED;
     }
 
-    /* Process keyword boolean arguments */
-    convert_py2bool(attrs_pub,
-            sizeof(attrs_pub) / sizeof(PyObj2Bool_mapping_t));
+    memset(zero, 0, sizeof(zero));
+    if (cmac) {
+        *error = "CMAC";
+        rv = p11->C_SignInit(session, &mech, object);
+        if (rv == CKR_OK)
+            rv = p11->C_Sign(session, zero, sizeof(zero), out, &out_len);
+    } else {
+        *error = "zero block encryption";
+        rv = p11->C_EncryptInit(session, &mech, object);
+        if (rv == CKR_OK)
+            rv = p11->C_Encrypt(session, zero, sizeof(zero), out, &out_len);
+    }
+    if (rv == CKR_OK && out_len < KCV_LENGTH)
+        rv = CKR_DATA_LEN_RANGE;
+    if (rv == CKR_OK)
+        memcpy(kcv, out, KCV_LENGTH);
+    return rv;
+}
 
-    /* decode from ASN1 DER */
-    pkey = d2i_PUBKEY(NULL, (const unsigned char **) &data, data_length);
-    if (pkey == NULL) {
-        PyErr_SetString(ipap11helperError,
-                "import_public_key: d2i_PUBKEY error");
+/**
+ * Key check values of AES keys, e.g. to compare master keys of replicas
+ * without transferring them
+ *
+ * Values are cached per handle until the key is deleted or changed by
+ * this helper; refresh=True bypasses the cache. Keys are processed with
+ * GIL released, in own sessions.
+ *
+ * Master keys are generated with CKA_ENCRYPT and CKA_SIGN false, so with
+ * default attributes only tokens which provide CKA_CHECK_VALUE give their
+ * KCV; cmac=True needs CKA_SIGN true even there.
+ *
+ * :return: list with KCV or exception instance for each key, in the
+ *          input order
+ */
+static PyObject *_key_check_values(P11_Helper* self, PyObject *handles,
+        int cmac, int refresh) {
+    PyObject *seq = NULL;
+    PyObject *ret = NULL;
+    PyObject **keys = NULL;
+    PyObject *value;
+    PyObject *msg;
+    CK_OBJECT_HANDLE *objects = NULL;
+    const p11_shard_t **shards = NULL;  /* NULL for cached values */
+    CK_SESSION_HANDLE *sessions = NULL;
+    CK_SESSION_HANDLE session;
+    CK_BYTE *kcvs = NULL;
+    CK_RV *results = NULL;
+    const char **errors = NULL;
+    p11_shard_t *shard;
+    Py_ssize_t count = 0;
+    Py_ssize_t i;
+
+    if (self->kcv_cache == NULL) {
+        self->kcv_cache = PyDict_New();
+        if (self->kcv_cache == NULL)
+            return NULL;
+    }
+    seq = PySequence_Fast(handles, "handles must be a sequence");
+    if (seq == NULL)
         return NULL;
+    count = PySequence_Fast_GET_SIZE(seq);
+    keys = calloc(count > 0 ? (size_t) count : 1, sizeof(PyObject *));
+    objects = calloc(count > 0 ? (size_t) count : 1, sizeof(CK_OBJECT_HANDLE));
+    shards = calloc(count > 0 ? (size_t) count : 1, sizeof(p11_shard_t *));
+    sessions = calloc(self->shard_count, sizeof(CK_SESSION_HANDLE));
+    kcvs = calloc(count > 0 ? (size_t) count : 1, KCV_LENGTH);
+    results = calloc(count > 0 ? (size_t) count : 1, sizeof(CK_RV));
+    errors = calloc(count > 0 ? (size_t) count : 1, sizeof(char *));
+    ret = PyList_New(count);
+    if (keys == NULL || objects == NULL || shards == NULL || sessions == NULL
+            || kcvs == NULL || results == NULL || errors == NULL) {
+        PyErr_NoMemory();
+        Py_CLEAR(ret);
     }
-    switch (pkey->type) {
-        case EVP_PKEY_RSA:
-            ret = P11_Helper_import_RSA_public_key(self, label, label_length,
-                    id, id_length, pkey, attrs_pub[pub_en_cka_copyable].bool,
-                    attrs_pub[pub_en_cka_derive].bool,
-                    attrs_pub[pub_en_cka_encrypt].bool,
-                    attrs_pub[pub_en_cka_modifiable].bool,
-                    attrs_pub[pub_en_cka_private].bool,
-                    attrs_pub[pub_en_cka_trusted].bool,
-                    attrs_pub[pub_en_cka_verify].bool,
-                    attrs_pub[pub_en_cka_verify_recover].bool,
-                    attrs_pub[pub_en_cka_wrap].bool);
-            break;
-        case EVP_PKEY_DSA:
-            ret = NULL;
-            PyErr_SetString(ipap11helperError, "DSA is not supported");
-            break;
-        case EVP_PKEY_EC:
-            ret = NULL;
-            PyErr_SetString(ipap11helperError, "EC is not supported");
-            break;
-        default:
-            ret = NULL;
-            PyErr_SetString(ipap11helperError, "Unsupported key type");
+    if (ret == NULL)
+        goto cleanup;
+
+    /* cached values go straight to the result */
+    for (i = 0; i < count; i++) {
+        objects[i] = PyInt_AsUnsignedLongMask(PySequence_Fast_GET_ITEM(seq,
+                i));
+        if (PyErr_Occurred())
+            goto error;
+        keys[i] = Py_BuildValue("(ki)", objects[i], cmac);
+        if (keys[i] == NULL)
+            goto error;
+        value = refresh ? NULL : PyDict_GetItem(self->kcv_cache, keys[i]);
+        if (value != NULL) {
+            Py_INCREF(value);
+            PyList_SET_ITEM(ret, i, value);
+            continue;
+        }
+        shard = _shard_of(self, &objects[i]);
+        if (shard == NULL)
+            goto error;
+        shards[i] = shard;
+    }
+    for (i = 0; i < (Py_ssize_t) self->shard_count; i++)
+        sessions[i] = CK_INVALID_HANDLE;
+
+    Py_BEGIN_ALLOW_THREADS
+    for (i = 0; i < count; i++) {
+        if (shards[i] == NULL)
+            continue;
+        results[i] = _batch_session(self, sessions, shards[i], &session);
+        errors[i] = "open session";
+        if (results[i] == CKR_OK)
+            results[i] = _kcv_compute(self, session, objects[i], cmac,
+                    kcvs + i * KCV_LENGTH, &errors[i]);
+    }
+    _close_batch_sessions(self, sessions);
+    Py_END_ALLOW_THREADS
+
+    for (i = 0; i < count; i++) {
+        if (shards[i] == NULL)
+            continue;
+        if (results[i] == CKR_OK) {
+            value = PyString_FromStringAndSize(
+                    (char *) kcvs + i * KCV_LENGTH, KCV_LENGTH);
+            if (value != NULL
+                    && PyDict_SetItem(self->kcv_cache, keys[i], value) != 0)
+                Py_CLEAR(value);
+        } else {
+            msg = PyString_FromFormat("Error at %s: 0x%x", errors[i],
+                    (unsigned int) results[i]);
+            value = msg == NULL ? NULL : PyObject_CallFunctionObjArgs(
+                    ipap11helperError, msg, NULL);
+            Py_XDECREF(msg);
+        }
+        if (value == NULL)
+            goto error;
+        PyList_SET_ITEM(ret, i, value);
+    }
+    goto cleanup;
+
+error:
+    Py_CLEAR(ret);
+cleanup:
+    if (keys != NULL) {
+        for (i = 0; i < count; i++)
+            Py_XDECREF(keys[i]);
     }
-    if (pkey != NULL)
-        EVP_PKEY_free(pkey);
+    free(keys);
+    free(objects);
+    free(shards);
+    free(sessions);
+    free(kcvs);
+    free(results);
+    free(errors);
+    Py_DECREF(seq);
     return ret;
 }
 
 /**
- * Export wrapped key
- *
+ * Key check value of one AES key
  */
 static PyObject *
-P11_Helper_export_wrapped_key(P11_Helper* self, PyObject *args, PyObject *kwds) {
-    CK_RV rv;
-    CK_OBJECT_HANDLE object_key = 0;
-    CK_OBJECT_HANDLE object_wrapping_key = 0;
-    CK_BYTE_PTR wrapped_key = NULL;
-    CK_ULONG wrapped_key_len = 0;
-    CK_MECHANISM wrapping_mech = { CKM_RSA_PKCS, NULL, 0 };
-    CK_MECHANISM_TYPE wrapping_mech_type = CKM_RSA_PKCS;
-    /* currently we don't support parameter in mechanism */
+P11_Helper_key_check_value(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *handle = NULL;
+    PyObject *cmac = NULL;
+    PyObject *refresh = NULL;
+    PyObject *handles;
+    PyObject *values;
+    PyObject *ret = NULL;
 
-    static char *kwlist[] = { "key", "wrapping_key", "wrapping_mech", NULL };
-    //TODO check long overflow
-    //TODO export method
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkk|", kwlist, &object_key,
-            &object_wrapping_key, &wrapping_mech_type)) {
+    static char *kwlist[] = { "handle", "cmac", "refresh", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist, &handle,
+            &cmac, &refresh)) {
         return NULL;
     }
-    wrapping_mech.mechanism = wrapping_mech_type;
-
-    rv = self->p11->C_WrapKey(self->session, &wrapping_mech,
-            object_wrapping_key, object_key, NULL, &wrapped_key_len);
-    if (!check_return_value(rv, "key wrapping: get buffer length"))
-        return 0;
-    wrapped_key = malloc(wrapped_key_len);
-    if (wrapped_key == NULL) {
-        rv = CKR_HOST_MEMORY;
-        check_return_value(rv, "key wrapping: buffer allocation");
-        return 0;
-    }
-    rv = self->p11->C_WrapKey(self->session, &wrapping_mech,
-            object_wrapping_key, object_key, wrapped_key, &wrapped_key_len);
-    if (!check_return_value(rv, "key wrapping: wrapping"))
+    handles = PyTuple_Pack(1, handle);
+    if (handles == NULL)
+        return NULL;
+    values = _key_check_values(self, handles,
+            cmac != NULL && PyObject_IsTrue(cmac),
+            refresh != NULL && PyObject_IsTrue(refresh));
+    Py_DECREF(handles);
+    if (values == NULL)
         return NULL;
 
-    return Py_BuildValue("s#", wrapped_key, wrapped_key_len);
-
+    ret = PyList_GET_ITEM(values, 0);
+    if (PyObject_IsInstance(ret, ipap11helperError)) {
+        PyErr_SetObject(ipap11helperError, ret);
+        ret = NULL;
+    } else {
+        Py_INCREF(ret);
+    }
+    Py_DECREF(values);
+    return ret;
 }
 
 /**
- * Import wrapped secret key
- *
+ * Key check values of many AES keys
  */
 static PyObject *
-P11_Helper_import_wrapped_secret_key(P11_Helper* self, PyObject *args,
+P11_Helper_key_check_values(P11_Helper* self, PyObject *args,
         PyObject *kwds) {
-    CK_RV rv;
-    int r;
-    CK_BYTE_PTR wrapped_key = NULL;
-    CK_ULONG wrapped_key_len = 0;
-    CK_ULONG unwrapping_key_object = 0;
-    CK_OBJECT_HANDLE unwrapped_key_object = 0;
-    PyObject *label_unicode = NULL;
-    CK_BYTE *id = NULL;
-    CK_UTF8CHAR *label = NULL;
-    Py_ssize_t id_length = 0;
-    Py_ssize_t label_length = 0;
-    CK_MECHANISM wrapping_mech = { CKM_RSA_PKCS, NULL, 0 };
-    CK_OBJECT_CLASS key_class = CKO_SECRET_KEY;
-    CK_KEY_TYPE key_type = CKK_RSA;
-
-    PyObj2Bool_mapping_t attrs[] = { { NULL, &true }, //sec_en_cka_copyable
-            { NULL, &false }, //sec_en_cka_decrypt
-            { NULL, &false }, //sec_en_cka_derive
-            { NULL, &false }, //sec_en_cka_encrypt
-            { NULL, &true }, //sec_en_cka_extractable
-            { NULL, &true }, //sec_en_cka_modifiable
-            { NULL, &true }, //sec_en_cka_private
-            { NULL, &true }, //sec_en_cka_sensitive
-            { NULL, &false }, //sec_en_cka_sign
-            { NULL, &true }, //sec_en_cka_unwrap
-            { NULL, &false }, //sec_en_cka_verify
-            { NULL, &true }, //sec_en_cka_wrap
-            { NULL, &false } //sec_en_cka_wrap_with_trusted
-    };
+    PyObject *handles = NULL;
+    PyObject *cmac = NULL;
+    PyObject *refresh = NULL;
 
-    static char *kwlist[] = { "label", "id", "data", "unwrapping_key",
-            "wrapping_mech", "key_type",
-            // secret key attrs
-            "cka_copyable", "cka_decrypt", "cka_derive", "cka_encrypt",
-            "cka_extractable", "cka_modifiable", "cka_private", "cka_sensitive",
-            "cka_sign", "cka_unwrap", "cka_verify", "cka_wrap",
-            "cka_wrap_with_trusted", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#s#kkk|OOOOOOOOOOOOO",
-            kwlist, &label_unicode, &id, &id_length, &wrapped_key,
-            &wrapped_key_len, &unwrapping_key_object, &wrapping_mech.mechanism,
-            &key_type,
-            // secret key attrs
-            &attrs[sec_en_cka_copyable].py_obj,
-            &attrs[sec_en_cka_decrypt].py_obj, &attrs[sec_en_cka_derive].py_obj,
-            &attrs[sec_en_cka_encrypt].py_obj,
-            &attrs[sec_en_cka_extractable].py_obj,
-            &attrs[sec_en_cka_modifiable].py_obj,
-            &attrs[sec_en_cka_private].py_obj,
-            &attrs[sec_en_cka_sensitive].py_obj, &attrs[sec_en_cka_sign].py_obj,
-            &attrs[sec_en_cka_unwrap].py_obj, &attrs[sec_en_cka_verify].py_obj,
-            &attrs[sec_en_cka_wrap].py_obj,
-            &attrs[sec_en_cka_wrap_with_trusted].py_obj)) {
+    static char *kwlist[] = { "handles", "cmac", "refresh", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "O|OO", kwlist, &handles,
+            &cmac, &refresh)) {
         return NULL;
     }
-    Py_XINCREF(label_unicode);
-    label = (unsigned char*) unicode_to_char_array(label_unicode,
-            &label_length); //TODO verify signed/unsigned
-    Py_XDECREF(label_unicode);
+    return _key_check_values(self, handles,
+            cmac != NULL && PyObject_IsTrue(cmac),
+            refresh != NULL && PyObject_IsTrue(refresh));
+}
 
-    r = _id_exists(self, id, id_length, key_class);
-    if (r == 1) {
-        PyErr_SetString(ipap11helperDuplicationError,
-                "Secret key with same ID already exists");
-        return NULL;
-    } else if (r == -1) {
+/**
+ * Manifest entry as (handle, class, key_type, id, label, digest)
+ *
+ * key_type is None for objects which are not keys.
+ */
+static PyObject *_manifest_entry(const manifest_entry_t *e) {
+    PyObject *key_type;
+    PyObject *label;
+
+    if (e->key_type == MANIFEST_NO_KEY_TYPE) {
+        Py_INCREF(Py_None);
+        key_type = Py_None;
+    } else {
+        key_type = Py_BuildValue("k", e->key_type);
+        if (key_type == NULL)
+            return NULL;
+    }
+    /* manifest must not fail because of one odd label */
+    label = PyUnicode_DecodeUTF8((const char *) e->label, e->label_len,
+            "replace");
+    if (label == NULL) {
+        Py_DECREF(key_type);
         return NULL;
     }
+    return Py_BuildValue("(kkNs#NK)", e->handle, e->key_class, key_type,
+            e->id, e->id_len, label, (unsigned PY_LONG_LONG) e->digest);
+}
 
-    /* Process keyword boolean arguments */
-    convert_py2bool(attrs, sizeof(attrs) / sizeof(PyObj2Bool_mapping_t));
-
-    CK_ATTRIBUTE template[] = {
-        { CKA_CLASS, &key_class, sizeof(key_class) },
-        { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
-        { CKA_ID, id, id_length },
-        { CKA_LABEL, label, label_length },
-        { CKA_TOKEN, &true, sizeof(CK_BBOOL) },
-        //{CKA_COPYABLE, attrs[sec_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
-        { CKA_DECRYPT, attrs[sec_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
-        { CKA_DERIVE, attrs[sec_en_cka_derive].bool, sizeof(CK_BBOOL) },
-        { CKA_ENCRYPT, attrs[sec_en_cka_encrypt].bool, sizeof(CK_BBOOL) },
-        { CKA_EXTRACTABLE, attrs[sec_en_cka_extractable].bool, sizeof(CK_BBOOL) },
-        { CKA_MODIFIABLE, attrs[sec_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
-        { CKA_PRIVATE, attrs[sec_en_cka_private].bool, sizeof(CK_BBOOL) },
-        { CKA_SENSITIVE, attrs[sec_en_cka_sensitive].bool, sizeof(CK_BBOOL) },
-        { CKA_SIGN, attrs[sec_en_cka_sign].bool, sizeof(CK_BBOOL) },
-        { CKA_UNWRAP, attrs[sec_en_cka_unwrap].bool, sizeof(CK_BBOOL) },
-        { CKA_VERIFY, attrs[sec_en_cka_verify].bool, sizeof(CK_BBOOL) },
-        { CKA_WRAP, attrs[sec_en_cka_wrap].bool, sizeof(CK_BBOOL) },
-        { CKA_WRAP_WITH_TRUSTED, attrs[sec_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
-    };
+/**
+ * Manifest of all objects on token
+ *
+ * Return list of (handle, class, key_type, id, label, digest) sorted by
+ * class, id and handle. digest is 64-bit hash of public attributes, it
+ * changes when any of them changes.
+ */
+static PyObject *
+P11_Helper_token_manifest(P11_Helper* self) {
+    manifest_t m;
+    PyObject *ret;
+    PyObject *item;
+    size_t i;
 
-    rv = self->p11->C_UnwrapKey(self->session, &wrapping_mech,
-            unwrapping_key_object, wrapped_key, wrapped_key_len, template,
-            sizeof(template) / sizeof(CK_ATTRIBUTE), &unwrapped_key_object);
-    if (!check_return_value(rv, "import_wrapped_key: key unwrapping")) {
+    if (!_token_manifest(self, &m))
         return NULL;
+    ret = PyList_New(m.count);
+    for (i = 0; ret != NULL && i < m.count; i++) {
+        item = _manifest_entry(&m.entries[i]);
+        if (item == NULL) {
+            Py_CLEAR(ret);
+            break;
+        }
+        PyList_SET_ITEM(ret, i, item);
     }
+    manifest_free(&m);
+    return ret;
+}
 
-    return Py_BuildValue("k", unwrapped_key_object);
+static int _token_changes_cb(manifest_change_t change,
+        const manifest_entry_t *old_entry, const manifest_entry_t *new_entry,
+        void *ctx) {
+    PyObject **lists = ctx;
+    PyObject *item;
+    int r;
 
+    item = _manifest_entry(new_entry != NULL ? new_entry : old_entry);
+    if (item == NULL)
+        return -1;
+    r = PyList_Append(lists[change], item);
+    Py_DECREF(item);
+    return r;
 }
 
 /**
- * Import wrapped private key
+ * Objects changed since the previous call
  *
+ * Manifest of tokens is compared with the one stored in file manifest_path
+ * and replaces it. Return (added, removed, changed), lists of manifest
+ * entries as returned by token_manifest(); changed objects are reported
+ * with their current entry. Without previous manifest all objects are
+ * added. Objects are matched by class and CKA_ID.
  */
 static PyObject *
-P11_Helper_import_wrapped_private_key(P11_Helper* self, PyObject *args,
-        PyObject *kwds) {
-    CK_RV rv;
-    int r;
-    CK_BYTE_PTR wrapped_key = NULL;
-    CK_ULONG wrapped_key_len = 0;
-    CK_ULONG unwrapping_key_object = 0;
-    CK_OBJECT_HANDLE unwrapped_key_object = 0;
-    PyObject *label_unicode = NULL;
-    CK_BYTE *id = NULL;
-    CK_UTF8CHAR *label = NULL;
-    Py_ssize_t id_length = 0;
-    Py_ssize_t label_length = 0;
-    CK_MECHANISM wrapping_mech = { CKM_RSA_PKCS, NULL, 0 };
-    CK_OBJECT_CLASS key_class = CKO_PRIVATE_KEY;
-    CK_KEY_TYPE key_type = CKK_RSA;
-
-    PyObj2Bool_mapping_t attrs_priv[] = { { NULL, &false }, //priv_en_cka_always_authenticate
-            { NULL, &true }, //priv_en_cka_copyable
-            { NULL, &false }, //priv_en_cka_decrypt
-            { NULL, &false }, //priv_en_cka_derive
-            { NULL, &true }, //priv_en_cka_extractable
-            { NULL, &true }, //priv_en_cka_modifiable
-            { NULL, &true }, //priv_en_cka_private
-            { NULL, &true }, //priv_en_cka_sensitive
-            { NULL, &true }, //priv_en_cka_sign
-            { NULL, &true }, //priv_en_cka_sign_recover
-            { NULL, &false }, //priv_en_cka_unwrap
-            { NULL, &false } //priv_en_cka_wrap_with_trusted
-    };
+P11_Helper_token_changes(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    const char *path = NULL;
+    manifest_t old_m;
+    manifest_t new_m;
+    PyObject *lists[3] = { NULL, NULL, NULL };
+    PyObject *ret = NULL;
+    unsigned int i;
+    CK_RV rv;
 
-    static char *kwlist[] = { "label", "id", "data", "unwrapping_key",
-            "wrapping_mech", "key_type",
-            // private key attrs
-            "cka_always_authenticate", "cka_copyable", "cka_decrypt",
-            "cka_derive", "cka_extractable", "cka_modifiable", "cka_private",
-            "cka_sensitive", "cka_sign", "cka_sign_recover", "cka_unwrap",
-            "cka_wrap_with_trusted", NULL };
-    if (!PyArg_ParseTupleAndKeywords(args, kwds, "Us#s#kkk|OOOOOOOOOOOO",
-            kwlist, &label_unicode, &id, &id_length, &wrapped_key,
-            &wrapped_key_len, &unwrapping_key_object, &wrapping_mech.mechanism,
-            &key_type,
-            // private key attrs
-            &attrs_priv[priv_en_cka_always_authenticate].py_obj,
-            &attrs_priv[priv_en_cka_copyable].py_obj,
-            &attrs_priv[priv_en_cka_decrypt].py_obj,
-            &attrs_priv[priv_en_cka_derive].py_obj,
-            &attrs_priv[priv_en_cka_extractable].py_obj,
-            &attrs_priv[priv_en_cka_modifiable].py_obj,
-            &attrs_priv[priv_en_cka_private].py_obj,
-            &attrs_priv[priv_en_cka_sensitive].py_obj,
-            &attrs_priv[priv_en_cka_sign].py_obj,
-            &attrs_priv[priv_en_cka_sign_recover].py_obj,
-            &attrs_priv[priv_en_cka_unwrap].py_obj,
-            &attrs_priv[priv_en_cka_wrap_with_trusted].py_obj)) {
+    static char *kwlist[] = { "manifest_path", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "s|", kwlist, &path)) {
         return NULL;
     }
-    Py_XINCREF(label_unicode);
-    label = (unsigned char*) unicode_to_char_array(label_unicode,
-            &label_length); //TODO verify signed/unsigned
-    Py_XDECREF(label_unicode);
 
-    r = _id_exists(self, id, id_length, CKO_SECRET_KEY);
-    if (r == 1) {
-        PyErr_SetString(ipap11helperDuplicationError,
-                "Secret key with same ID already exists");
+    rv = manifest_load(&old_m, path);
+    if (!check_return_value(rv, "load token manifest"))
         return NULL;
-    } else if (r == -1) {
+    if (!_token_manifest(self, &new_m)) {
+        manifest_free(&old_m);
         return NULL;
     }
 
-    /* Process keyword boolean arguments */
-    convert_py2bool(attrs_priv,
-            sizeof(attrs_priv) / sizeof(PyObj2Bool_mapping_t));
+    for (i = 0; i < 3; i++) {
+        lists[i] = PyList_New(0);
+        if (lists[i] == NULL)
+            goto final;
+    }
+    if (manifest_diff(&old_m, &new_m, _token_changes_cb, lists) != 0)
+        goto final;
 
-    CK_ATTRIBUTE template[] = {
-            { CKA_CLASS, &key_class, sizeof(key_class) },
-            { CKA_KEY_TYPE, &key_type, sizeof(key_type) },
-            { CKA_ID, id, id_length },
-            { CKA_LABEL, label, label_length },
-            { CKA_TOKEN, &true, sizeof(CK_BBOOL) },
-            { CKA_ALWAYS_AUTHENTICATE, attrs_priv[priv_en_cka_always_authenticate].bool, sizeof(CK_BBOOL) },
-            //{CKA_COPYABLE, attrs_priv[priv_en_cka_copyable].bool, sizeof(CK_BBOOL)}, //TODO Softhsm doesn't support it
-            { CKA_DECRYPT, attrs_priv[priv_en_cka_decrypt].bool, sizeof(CK_BBOOL) },
-            { CKA_DERIVE, attrs_priv[priv_en_cka_derive].bool, sizeof(CK_BBOOL) },
-            { CKA_EXTRACTABLE, attrs_priv[priv_en_cka_extractable].bool, sizeof(CK_BBOOL) },
-            { CKA_MODIFIABLE,  attrs_priv[priv_en_cka_modifiable].bool, sizeof(CK_BBOOL) },
-            { CKA_PRIVATE, attrs_priv[priv_en_cka_private].bool, sizeof(CK_BBOOL) },
-            { CKA_SENSITIVE, attrs_priv[priv_en_cka_sensitive].bool, sizeof(CK_BBOOL) },
-            { CKA_SIGN, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
-            { CKA_SIGN_RECOVER, attrs_priv[priv_en_cka_sign].bool, sizeof(CK_BBOOL) },
-            { CKA_UNWRAP, attrs_priv[priv_en_cka_unwrap].bool, sizeof(CK_BBOOL) },
-            { CKA_WRAP_WITH_TRUSTED, attrs_priv[priv_en_cka_wrap_with_trusted].bool, sizeof(CK_BBOOL) }
-    };
+    /* store new manifest only when the caller gets the changes */
+    rv = manifest_save(&new_m, path);
+    if (!check_return_value(rv, "save token manifest"))
+        goto final;
+    ret = Py_BuildValue("(OOO)", lists[MANIFEST_ADDED],
+            lists[MANIFEST_REMOVED], lists[MANIFEST_CHANGED]);
+
+final:
+    for (i = 0; i < 3; i++)
+        Py_XDECREF(lists[i]);
+    manifest_free(&old_m);
+    manifest_free(&new_m);
+    return ret;
+}
 
-    rv = self->p11->C_UnwrapKey(self->session, &wrapping_mech,
-            unwrapping_key_object, wrapped_key, wrapped_key_len, template,
-            sizeof(template) / sizeof(CK_ATTRIBUTE), &unwrapped_key_object);
-    if (!check_return_value(rv, "import_wrapped_key: key unwrapping")) {
+/**
+ * Shared index entry as (class, key_type, id, label, spki)
+ */
+static PyObject *_index_entry(const shmindex_entry_t *e) {
+    PyObject *key_type;
+    PyObject *label;
+    PyObject *spki;
+
+    if (e->key_type == MANIFEST_NO_KEY_TYPE) {
+        Py_INCREF(Py_None);
+        key_type = Py_None;
+    } else {
+        key_type = Py_BuildValue("k", e->key_type);
+        if (key_type == NULL)
+            return NULL;
+    }
+    if (e->public_len == 0) {
+        Py_INCREF(Py_None);
+        spki = Py_None;
+    } else {
+        spki = PyString_FromStringAndSize((const char *) e->public_data,
+                e->public_len);
+        if (spki == NULL) {
+            Py_DECREF(key_type);
+            return NULL;
+        }
+    }
+    label = PyUnicode_DecodeUTF8((const char *) e->label, e->label_len,
+            "replace");
+    if (label == NULL) {
+        Py_DECREF(key_type);
+        Py_DECREF(spki);
+        return NULL;
+    }
+    return Py_BuildValue("(kNs#NN)", e->key_class, key_type, e->id,
+            (int) e->id_len, label, spki);
+}
+
+/**
+ * Look up objects in shared index without asking the HSM
+ *
+ * Return list of (class, key_type, id, label, spki) for objects matching
+ * all given criteria; spki is DER SubjectPublicKeyInfo of public keys and
+ * None for other objects. Handles are not known, use find_keys() to get
+ * them.
+ */
+static PyObject *
+P11_Helper_index_lookup(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_OBJECT_CLASS class = CKO_VENDOR_DEFINED;
+    PyObject *label_unicode = NULL;
+    CK_BYTE *label = NULL;
+    Py_ssize_t label_length = 0;
+    CK_BYTE *id = NULL;
+    int id_length = 0;
+    shmindex_entry_t found_static[16];
+    shmindex_entry_t *found = found_static;
+    int max = sizeof(found_static) / sizeof(shmindex_entry_t);
+    int count;
+    int i;
+    PyObject *ret = NULL;
+    PyObject *item;
+
+    static char *kwlist[] = { "objclass", "label", "id", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|kUz#", kwlist, &class,
+            &label_unicode, &id, &id_length)) {
+        return NULL;
+    }
+    if (self->index == NULL) {
+        PyErr_SetString(ipap11helperError, "Shared index is not enabled");
         return NULL;
     }
+    if (label_unicode != NULL) {
+        label = (CK_BYTE *) unicode_to_char_array(label_unicode,
+                &label_length);
+        if (label == NULL)
+            return NULL;
+    }
+    if (class == CKO_VENDOR_DEFINED)
+        class = SHMINDEX_ANY_CLASS;
+
+    /* matches can be added between the calls */
+    while ((count = _index_find(self, 0, 1, class, id, id_length, label,
+            label_length, found, max)) > max) {
+        if (found != found_static)
+            free(found);
+        max = count;
+        found = malloc(max * sizeof(shmindex_entry_t));
+        if (found == NULL)
+            return PyErr_NoMemory();
+    }
+    if (count < 0) {
+        PyErr_SetString(ipap11helperError, "Shared index is not available");
+        goto final;
+    }
 
-    return PyLong_FromUnsignedLong(unwrapped_key_object);
+    ret = PyList_New(count);
+    for (i = 0; ret != NULL && i < count; i++) {
+        item = _index_entry(&found[i]);
+        if (item == NULL) {
+            Py_CLEAR(ret);
+            break;
+        }
+        PyList_SET_ITEM(ret, i, item);
+    }
 
+final:
+    if (found != found_static)
+        free(found);
+    return ret;
 }
 
 /*
@@ -1615,6 +6014,7 @@ P11_Helper_set_attribute(P11_Helper* self, PyObject *args, PyObject *kwds) {
     CK_ATTRIBUTE attribute;
     CK_RV rv;
     Py_ssize_t len = 0;
+    p11_shard_t *shard;
 
     static char *kwlist[] = { "key_object", "attr", "value", NULL };
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "kkO|", kwlist, &object, &attr,
@@ -1692,9 +6092,18 @@ P11_Helper_set_attribute(P11_Helper* self, PyObject *args, PyObject *kwds) {
 
     CK_ATTRIBUTE template[] = { attribute };
 
-    rv = self->p11->C_SetAttributeValue(self->session, object, template, 1);
+    shard = _shard_of(self, &object);
+    if (shard == NULL) {
+        ret = NULL;
+        goto final;
+    }
+    _wrap_cache_invalidate(self, shard, object);
+    _kcv_invalidate(self, shard, object);
+    rv = self->p11->C_SetAttributeValue(shard->session, object, template, 1);
     if (!check_return_value(rv, "set_attribute"))
         ret = NULL;
+    else
+        _index_invalidate(self);
     final:
     Py_XDECREF(value);
     return ret;
@@ -1711,6 +6120,7 @@ P11_Helper_get_attribute(P11_Helper* self, PyObject *args, PyObject *kwds) {
     unsigned long attr = 0;
     CK_ATTRIBUTE attribute;
     CK_RV rv;
+    p11_shard_t *shard;
 
     static char *kwlist[] = { "key_object", "attr", NULL };
     if (!PyArg_ParseTupleAndKeywords(args, kwds, "kk|", kwlist, &object,
@@ -1718,12 +6128,16 @@ P11_Helper_get_attribute(P11_Helper* self, PyObject *args, PyObject *kwds) {
         return NULL;
     }
 
+    shard = _shard_of(self, &object);
+    if (shard == NULL)
+        return NULL;
+
     attribute.type = attr;
     attribute.pValue = NULL_PTR;
     attribute.ulValueLen = 0;
     CK_ATTRIBUTE template[] = { attribute };
 
-    rv = self->p11->C_GetAttributeValue(self->session, object, template, 1);
+    rv = self->p11->C_GetAttributeValue(shard->session, object, template, 1);
     // attribute doesn't exists
     if (rv == CKR_ATTRIBUTE_TYPE_INVALID
             || template[0].ulValueLen == (unsigned long) -1) {
@@ -1735,10 +6149,14 @@ P11_Helper_get_attribute(P11_Helper* self, PyObject *args, PyObject *kwds) {
         ret = NULL;
         goto final;
     }
-    value = malloc(template[0].ulValueLen);
+    value = secmem_alloc(template[0].ulValueLen);
+    if (value == NULL) {
+        ret = PyErr_NoMemory();
+        goto final;
+    }
     template[0].pValue = value;
 
-    rv = self->p11->C_GetAttributeValue(self->session, object, template, 1);
+    rv = self->p11->C_GetAttributeValue(shard->session, object, template, 1);
     if (!check_return_value(rv, "get_attribute")) {
         ret = NULL;
         goto final;
@@ -1789,9 +6207,371 @@ P11_Helper_get_attribute(P11_Helper* self, PyObject *args, PyObject *kwds) {
             goto final;
     }
 
-    final: if (value != NULL)
-        free(value);
+    final: secmem_free(value);
+    return ret;
+}
+
+/**
+ * Per-function statistics of PKCS#11 calls
+ *
+ * Return None if statistics were not enabled, otherwise dictionary
+ * { "C_FunctionName": { "calls": ..., "errors": ..., "bytes": ...,
+ *   "total_ns": ..., "max_ns": ..., "p50_ns": ..., "p90_ns": ...,
+ *   "p99_ns": ..., "histogram": [(upper_ns, count), ...] } }
+ * with functions which were called at least once. Counters are shared by all
+ * P11_Helper instances in the process.
+ */
+static PyObject *
+P11_Helper_stats(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    PyObject *reset = NULL;
+    PyObject *ret = NULL;
+    PyObject *entry = NULL;
+    PyObject *histogram = NULL;
+    p11stats_bucket_t buckets[P11STATS_BUCKETS];
+    p11stats_t st;
+    unsigned int fn, n, i;
+
+    static char *kwlist[] = { "reset", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|O", kwlist, &reset)) {
+        return NULL;
+    }
+
+    if (!p11stats_enabled()) {
+        Py_RETURN_NONE;
+    }
+
+    ret = PyDict_New();
+    if (ret == NULL)
+        return NULL;
+
+    for (fn = 0; fn < p11stats_count(); fn++) {
+        if (!p11stats_get(fn, &st))
+            continue;
+        n = p11stats_histogram(fn, buckets, P11STATS_BUCKETS);
+        histogram = PyList_New(n);
+        if (histogram == NULL)
+            goto error;
+        for (i = 0; i < n; i++) {
+            PyObject *item = Py_BuildValue("(KK)",
+                    (unsigned PY_LONG_LONG) buckets[i].upper_ns,
+                    (unsigned PY_LONG_LONG) buckets[i].count);
+            if (item == NULL)
+                goto error;
+            PyList_SET_ITEM(histogram, i, item);
+        }
+        entry = Py_BuildValue("{sKsKsKsKsKsKsKsKsO}",
+                "calls", (unsigned PY_LONG_LONG) st.calls,
+                "errors", (unsigned PY_LONG_LONG) st.errors,
+                "bytes", (unsigned PY_LONG_LONG) st.bytes,
+                "total_ns", (unsigned PY_LONG_LONG) st.total_ns,
+                "max_ns", (unsigned PY_LONG_LONG) st.max_ns,
+                "p50_ns", (unsigned PY_LONG_LONG) st.p50_ns,
+                "p90_ns", (unsigned PY_LONG_LONG) st.p90_ns,
+                "p99_ns", (unsigned PY_LONG_LONG) st.p99_ns,
+                "histogram", histogram);
+        Py_CLEAR(histogram);
+        if (entry == NULL
+                || PyDict_SetItemString(ret, p11stats_name(fn), entry) != 0)
+            goto error;
+        Py_CLEAR(entry);
+    }
+
+    if (reset != NULL && PyObject_IsTrue(reset) == 1)
+        p11stats_reset();
+    return ret;
+
+error:
+    Py_XDECREF(histogram);
+    Py_XDECREF(entry);
+    Py_DECREF(ret);
+    return NULL;
+}
+
+/**
+ * Measure wrapping mechanisms on all tokens
+ *
+ * :param iterations: number of C_WrapKey calls per mechanism
+ *
+ * Only temporary session keys are used. Results are used by
+ * export_wrapped_key(wrapping_mech=MECH_AUTO) and stored to the calibration
+ * file given to P11_Helper, if any, so later instances do not need to
+ * calibrate again.
+ *
+ * Return dictionary { slot: { mechanism: nanoseconds per C_WrapKey } }.
+ */
+static PyObject *
+P11_Helper_calibrate_wrap(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    unsigned long iterations = 20;
+    PyObject *ret = NULL;
+    PyObject *slot = NULL;
+    PyObject *key = NULL;
+    PyObject *value = NULL;
+    CK_RV rv;
+    unsigned int i, m;
+
+    static char *kwlist[] = { "iterations", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k", kwlist, &iterations)) {
+        return NULL;
+    }
+    if (iterations == 0) {
+        PyErr_SetString(PyExc_ValueError, "iterations must be positive");
+        return NULL;
+    }
+
+    for (i = 0; i < self->shard_count; i++) {
+        rv = _wrap_calibrate_shard(self, &self->shards[i], iterations);
+        if (!check_return_value(rv, "calibrate_wrap: key generation"))
+            return NULL;
+    }
+    if (self->calibration != NULL && !_wrap_calibration_save(self))
+        return NULL;
+
+    ret = PyDict_New();
+    if (ret == NULL)
+        return NULL;
+    for (i = 0; i < self->shard_count; i++) {
+        slot = PyDict_New();
+        if (slot == NULL)
+            goto error;
+        for (m = 0; m < WRAP_MECH_COUNT; m++) {
+            if (self->shards[i].wrap_ns[m] == 0)
+                continue;
+            key = PyLong_FromUnsignedLong(wrap_mechs[m].mech);
+            value = PyLong_FromUnsignedLongLong(self->shards[i].wrap_ns[m]);
+            if (key == NULL || value == NULL
+                    || PyDict_SetItem(slot, key, value) != 0)
+                goto error;
+            Py_CLEAR(key);
+            Py_CLEAR(value);
+        }
+        key = PyLong_FromUnsignedLong(self->shards[i].slot);
+        if (key == NULL || PyDict_SetItem(ret, key, slot) != 0)
+            goto error;
+        Py_CLEAR(key);
+        Py_CLEAR(slot);
+    }
+    return ret;
+
+error:
+    Py_XDECREF(key);
+    Py_XDECREF(value);
+    Py_XDECREF(slot);
+    Py_DECREF(ret);
+    return NULL;
+}
+
+/**
+ * Create attribute profile
+ *
+ * Boolean attributes of key_class (KEY_CLASS_*) are given as cka_* keyword
+ * arguments, with the names used by the generate and import methods. The
+ * profile is checked once against mechanisms of all tokens, e.g. cka_wrap
+ * of secret key needs AES key wrapping, so the methods taking profile=
+ * only fill in label and ID.
+ *
+ * :returns: AttributeProfile
+ */
+static PyObject *
+P11_Helper_attribute_profile(P11_Helper* self, PyObject *args,
+        PyObject *kwds) {
+    CK_OBJECT_CLASS key_class = 0;
+    AttributeProfile *profile;
+    const char **names;
+    unsigned int count;
+    unsigned int i;
+    unsigned int shard;
+    unsigned int r;
+    Py_ssize_t pos = 0;
+    PyObject *key;
+    PyObject *value;
+    const char *name;
+    int ok;
+
+    if (!PyArg_ParseTuple(args, "k", &key_class))
+        return NULL;
+    names = _profile_names(key_class, &count);
+    if (names == NULL) {
+        PyErr_SetString(ipap11helperError,
+                "attribute_profile: unsupported key class");
+        return NULL;
+    }
+
+    profile = PyObject_New(AttributeProfile, &AttributeProfileType);
+    if (profile == NULL)
+        return NULL;
+    profile->key_class = key_class;
+    memset(profile->values, 0, sizeof(profile->values));
+    memset(profile->set, 0, sizeof(profile->set));
+
+    while (kwds != NULL && PyDict_Next(kwds, &pos, &key, &value)) {
+        name = PyString_AsString(key);
+        if (name == NULL)
+            goto error;
+        for (i = 0; i < count && strcmp(names[i], name) != 0; i++)
+            ;
+        if (i == count) {
+            PyErr_Format(PyExc_TypeError,
+                    "'%s' is not an attribute of the key class", name);
+            goto error;
+        }
+        profile->values[i] = PyObject_IsTrue(value) ? CK_TRUE : CK_FALSE;
+        profile->set[i] = CK_TRUE;
+    }
+
+    for (r = 0; r < sizeof(profile_rules) / sizeof(profile_rules[0]); r++) {
+        const profile_rule_t *rule = &profile_rules[r];
+
+        if (rule->key_class != key_class || !profile->values[rule->attr])
+            continue;
+        for (shard = 0; shard < self->shard_count; shard++) {
+            const p11caps_slot_t *slot = p11caps_slot(&self->caps,
+                    self->shards[shard].slot);
+
+            ok = p11caps_check(slot, rule->mechs[0], rule->flags, 0) == CKR_OK
+                    || p11caps_check(slot, rule->mechs[1], rule->flags, 0)
+                            == CKR_OK;
+            if (!ok) {
+                PyErr_Format(ipap11helperError,
+                        "attribute_profile: token in slot %lu does not "
+                        "support %s", self->shards[shard].slot,
+                        names[rule->attr]);
+                goto error;
+            }
+        }
+    }
+    return (PyObject *) profile;
+
+error:
+    Py_DECREF(profile);
+    return NULL;
+}
+
+/**
+ * Convert blank padded string from CK_SLOT_INFO/CK_TOKEN_INFO to unicode
+ */
+static PyObject *_padded_to_unicode(const CK_UTF8CHAR *str, size_t len) {
+    return char_array_to_unicode((const char *) str, _padded_len(str, len));
+}
+
+/**
+ * Slots and tokens discovered at initialization
+ *
+ * Return list of dictionaries
+ * { "slot": ..., "description": u"...", "manufacturer": u"...",
+ *   "flags": ..., "token": None or { "label": u"...", "manufacturer": u"...",
+ *   "model": u"...", "serial": u"...", "flags": ... } }
+ * for all slots of the module, including slots without token.
+ */
+static PyObject *
+P11_Helper_slots(P11_Helper* self) {
+    PyObject *ret = NULL;
+    PyObject *token = NULL;
+    PyObject *entry = NULL;
+    CK_ULONG i;
+
+    ret = PyList_New(self->caps.slot_count);
+    if (ret == NULL)
+        return NULL;
+
+    for (i = 0; i < self->caps.slot_count; i++) {
+        const p11caps_slot_t *slot = &self->caps.slots[i];
+        const CK_TOKEN_INFO *ti = &slot->token_info;
+
+        if (slot->slot_info.flags & CKF_TOKEN_PRESENT) {
+            token = Py_BuildValue("{sNsNsNsNsk}",
+                    "label", _padded_to_unicode(ti->label,
+                            sizeof(ti->label)),
+                    "manufacturer", _padded_to_unicode(ti->manufacturerID,
+                            sizeof(ti->manufacturerID)),
+                    "model", _padded_to_unicode(ti->model,
+                            sizeof(ti->model)),
+                    "serial", _padded_to_unicode(ti->serialNumber,
+                            sizeof(ti->serialNumber)),
+                    "flags", ti->flags);
+        } else {
+            Py_INCREF(Py_None);
+            token = Py_None;
+        }
+        if (token == NULL)
+            goto error;
+        entry = Py_BuildValue("{sksNsNsksN}", "slot", slot->id,
+                "description", _padded_to_unicode(
+                        slot->slot_info.slotDescription,
+                        sizeof(slot->slot_info.slotDescription)),
+                "manufacturer", _padded_to_unicode(
+                        slot->slot_info.manufacturerID,
+                        sizeof(slot->slot_info.manufacturerID)),
+                "flags", slot->slot_info.flags, "token", token);
+        token = NULL; /* reference stolen by N */
+        if (entry == NULL)
+            goto error;
+        PyList_SET_ITEM(ret, i, entry);
+    }
+    return ret;
+
+error:
+    Py_DECREF(ret);
+    return NULL;
+}
+
+/**
+ * Mechanisms supported by token
+ *
+ * :param slot: slot ID, default is the slot given to P11_Helper
+ *
+ * Return dictionary { mechanism: { "min_key_size": ..., "max_key_size": ...,
+ * "flags": ... } } from cache filled at initialization or None if the module
+ * did not list mechanisms of the slot. Key sizes are in bits or bytes
+ * depending on mechanism.
+ */
+static PyObject *
+P11_Helper_mechanisms(P11_Helper* self, PyObject *args, PyObject *kwds) {
+    CK_SLOT_ID slot_id = self->slot;
+    const p11caps_slot_t *slot;
+    PyObject *ret = NULL;
+    PyObject *key = NULL;
+    PyObject *entry = NULL;
+    CK_ULONG i;
+
+    static char *kwlist[] = { "slot", NULL };
+    if (!PyArg_ParseTupleAndKeywords(args, kwds, "|k", kwlist, &slot_id)) {
+        return NULL;
+    }
+
+    slot = p11caps_slot(&self->caps, slot_id);
+    if (slot == NULL) {
+        PyErr_SetString(ipap11helperNotFound, "Slot not found");
+        return NULL;
+    }
+    if (!slot->mechs_known) {
+        Py_RETURN_NONE;
+    }
+
+    ret = PyDict_New();
+    if (ret == NULL)
+        return NULL;
+
+    for (i = 0; i < slot->mech_count; i++) {
+        const p11caps_mech_t *m = &slot->mechs[i];
+
+        key = PyLong_FromUnsignedLong(m->type);
+        entry = Py_BuildValue("{sksksk}",
+                "min_key_size", m->info.ulMinKeySize,
+                "max_key_size", m->info.ulMaxKeySize,
+                "flags", m->info.flags);
+        if (key == NULL || entry == NULL
+                || PyDict_SetItem(ret, key, entry) != 0)
+            goto error;
+        Py_CLEAR(key);
+        Py_CLEAR(entry);
+    }
     return ret;
+
+error:
+    Py_XDECREF(key);
+    Py_XDECREF(entry);
+    Py_DECREF(ret);
+    return NULL;
 }
 
 static PyMethodDef P11_Helper_methods[] = { { "finalize",
@@ -1812,6 +6592,8 @@ static PyMethodDef P11_Helper_methods[] = { { "finalize",
         METH_VARARGS | METH_KEYWORDS, "Export public key" }, {
         "import_public_key", (PyCFunction) P11_Helper_import_public_key,
         METH_VARARGS | METH_KEYWORDS, "Import public key" }, {
+        "import_public_keys", (PyCFunction) P11_Helper_import_public_keys,
+        METH_VARARGS | METH_KEYWORDS, "Import public keys in bulk" }, {
         "export_wrapped_key", (PyCFunction) P11_Helper_export_wrapped_key,
         METH_VARARGS | METH_KEYWORDS, "Export wrapped private key" }, {
         "import_wrapped_secret_key",
@@ -1823,7 +6605,48 @@ static PyMethodDef P11_Helper_methods[] = { { "finalize",
         "set_attribute", (PyCFunction) P11_Helper_set_attribute, METH_VARARGS
                 | METH_KEYWORDS, "Set attribute" }, { "get_attribute",
         (PyCFunction) P11_Helper_get_attribute, METH_VARARGS | METH_KEYWORDS,
-        "Get attribute" }, { NULL } /* Sentinel */
+        "Get attribute" }, { "stats", (PyCFunction) P11_Helper_stats,
+        METH_VARARGS | METH_KEYWORDS, "Statistics of PKCS#11 calls" }, {
+        "slots", (PyCFunction) P11_Helper_slots, METH_NOARGS,
+        "List slots and tokens" }, { "mechanisms",
+        (PyCFunction) P11_Helper_mechanisms, METH_VARARGS | METH_KEYWORDS,
+        "List mechanisms supported by token" }, { "calibrate_wrap",
+        (PyCFunction) P11_Helper_calibrate_wrap, METH_VARARGS | METH_KEYWORDS,
+        "Measure wrapping mechanisms" }, { "derive_wrapping_key",
+        (PyCFunction) P11_Helper_derive_wrapping_key,
+        METH_VARARGS | METH_KEYWORDS, "Derive AES wrapping key with ECDH" }, {
+        "establish_replica_kek", (PyCFunction) P11_Helper_establish_replica_kek,
+        METH_VARARGS | METH_KEYWORDS,
+        "Get or derive key encryption key for replica" }, {
+        "wrap_key_for_replicas", (PyCFunction) P11_Helper_wrap_key_for_replicas,
+        METH_VARARGS | METH_KEYWORDS, "Wrap key with KEKs of replicas" }, {
+        "attribute_profile", (PyCFunction) P11_Helper_attribute_profile,
+        METH_VARARGS | METH_KEYWORDS, "Create attribute profile" }, {
+        "rewrap", (PyCFunction) P11_Helper_rewrap, METH_VARARGS | METH_KEYWORDS,
+        "Re-wrap keys from old to new wrapping key" }, {
+        "wrap_cache_info", (PyCFunction) P11_Helper_wrap_cache_info,
+        METH_NOARGS, "Wrap cache counters" }, {
+        "token_manifest", (PyCFunction) P11_Helper_token_manifest,
+        METH_NOARGS, "List objects with digests of attributes" }, {
+        "token_changes", (PyCFunction) P11_Helper_token_changes,
+        METH_VARARGS | METH_KEYWORDS, "Objects changed since last call" }, {
+        "index_lookup", (PyCFunction) P11_Helper_index_lookup,
+        METH_VARARGS | METH_KEYWORDS, "Find objects in shared index" }, {
+        "allocate_ids", (PyCFunction) P11_Helper_allocate_ids,
+        METH_VARARGS | METH_KEYWORDS, "Allocate unused random IDs" }, {
+        "delete_keys", (PyCFunction) P11_Helper_delete_keys,
+        METH_VARARGS | METH_KEYWORDS, "Delete objects by handles or filter" }, {
+        "sign_many", (PyCFunction) P11_Helper_sign_many,
+        METH_VARARGS | METH_KEYWORDS, "Sign many messages with one key" }, {
+        "verify_many", (PyCFunction) P11_Helper_verify_many,
+        METH_VARARGS | METH_KEYWORDS, "Verify many signatures with one key" }, {
+        "export_dnskey", (PyCFunction) P11_Helper_export_dnskey,
+        METH_VARARGS | METH_KEYWORDS, "Export RSA public keys as DNSKEY" }, {
+        "key_check_value", (PyCFunction) P11_Helper_key_check_value,
+        METH_VARARGS | METH_KEYWORDS, "Key check value of AES key" }, {
+        "key_check_values", (PyCFunction) P11_Helper_key_check_values,
+        METH_VARARGS | METH_KEYWORDS, "Key check values of AES keys" }, {
+        NULL } /* Sentinel */
 };
 
 static PyTypeObject P11_HelperType = { PyObject_HEAD_INIT(NULL) 0, /*ob_size*/
@@ -1866,6 +6689,51 @@ P11_Helper_members, /* tp_members */
 P11_Helper_new, /* tp_new */
 };
 
+static PyMemberDef AttributeProfile_members[] = { { "key_class", T_ULONG,
+        offsetof(AttributeProfile, key_class), READONLY, "Key class" }, {
+        NULL } /* Sentinel */
+};
+
+static PyTypeObject AttributeProfileType = { PyObject_HEAD_INIT(NULL) 0, /*ob_size*/
+"_ipap11helper.AttributeProfile", /*tp_name*/
+sizeof(AttributeProfile), /*tp_basicsize*/
+0, /*tp_itemsize*/
+0, /*tp_dealloc*/
+0, /*tp_print*/
+0, /*tp_getattr*/
+0, /*tp_setattr*/
+0, /*tp_compare*/
+0, /*tp_repr*/
+0, /*tp_as_number*/
+0, /*tp_as_sequence*/
+0, /*tp_as_mapping*/
+0, /*tp_hash */
+0, /*tp_call*/
+0, /*tp_str*/
+0, /*tp_getattro*/
+0, /*tp_setattro*/
+0, /*tp_as_buffer*/
+Py_TPFLAGS_DEFAULT, /*tp_flags*/
+"Key attributes, see P11_Helper.attribute_profile()", /* tp_doc */
+0, /* tp_traverse */
+0, /* tp_clear */
+0, /* tp_richcompare */
+0, /* tp_weaklistoffset */
+0, /* tp_iter */
+0, /* tp_iternext */
+0, /* tp_methods */
+AttributeProfile_members, /* tp_members */
+0, /* tp_getset */
+0, /* tp_base */
+0, /* tp_dict */
+0, /* tp_descr_get */
+0, /* tp_descr_set */
+0, /* tp_dictoffset */
+0, /* tp_init */
+0, /* tp_alloc */
+0, /* tp_new */
+};
+
 static PyMethodDef module_methods[] = { { NULL } /* Sentinel */
 };
 
@@ -1877,6 +6745,8 @@ PyMODINIT_FUNC init_ipap11helper(void) {
 
     if (PyType_Ready(&P11_HelperType) < 0)
         return;
+    if (PyType_Ready(&AttributeProfileType) < 0)
+        return;
 
     /*
      * Setting up P11_Helper module
@@ -1893,6 +6763,10 @@ PyMODINIT_FUNC init_ipap11helper(void) {
     Py_INCREF(&P11_HelperType);
     PyModule_AddObject(m, "P11_Helper", (PyObject *) &P11_HelperType);
 
+    Py_INCREF(&AttributeProfileType);
+    PyModule_AddObject(m, "AttributeProfile",
+            (PyObject *) &AttributeProfileType);
+
     /*
      * Setting up P11_Helper Exceptions
      */
@@ -1945,6 +6819,19 @@ PyMODINIT_FUNC init_ipap11helper(void) {
     PyObject_SetAttrString(m, "KEY_TYPE_AES", P11_Helper_KEY_TYPE_AES_obj);
     Py_XDECREF(P11_Helper_KEY_TYPE_AES_obj);
 
+    PyObject *P11_Helper_KEY_TYPE_EC_obj = PyInt_FromLong(CKK_EC);
+    PyObject_SetAttrString(m, "KEY_TYPE_EC", P11_Helper_KEY_TYPE_EC_obj);
+    Py_XDECREF(P11_Helper_KEY_TYPE_EC_obj);
+
+    /* Key derivation functions for derive_wrapping_key() */
+    PyObject *P11_Helper_KDF_NULL_obj = PyInt_FromLong(CKD_NULL);
+    PyObject_SetAttrString(m, "KDF_NULL", P11_Helper_KDF_NULL_obj);
+    Py_XDECREF(P11_Helper_KDF_NULL_obj);
+
+    PyObject *P11_Helper_KDF_SHA256_obj = PyInt_FromLong(CKD_SHA256_KDF);
+    PyObject_SetAttrString(m, "KDF_SHA256", P11_Helper_KDF_SHA256_obj);
+    Py_XDECREF(P11_Helper_KDF_SHA256_obj);
+
     /* Wrapping mech type*/
     PyObject *P11_Helper_MECH_RSA_PKCS_obj = PyInt_FromLong(CKM_RSA_PKCS);
     PyObject_SetAttrString(m, "MECH_RSA_PKCS", P11_Helper_MECH_RSA_PKCS_obj);
@@ -1968,6 +6855,32 @@ PyMODINIT_FUNC init_ipap11helper(void) {
             P11_Helper_MECH_AES_KEY_WRAP_PAD_obj);
     Py_XDECREF(P11_Helper_MECH_AES_KEY_WRAP_PAD_obj);
 
+    PyObject *P11_Helper_MECH_AUTO_obj = PyLong_FromUnsignedLong(MECH_AUTO);
+    PyObject_SetAttrString(m, "MECH_AUTO", P11_Helper_MECH_AUTO_obj);
+    Py_XDECREF(P11_Helper_MECH_AUTO_obj);
+
+    /* Mechanism flags, see P11_Helper.mechanisms() */
+    PyObject *P11_Helper_MECH_FLAG_CKF_WRAP_obj = PyInt_FromLong(CKF_WRAP);
+    PyObject_SetAttrString(m, "CKF_WRAP", P11_Helper_MECH_FLAG_CKF_WRAP_obj);
+    Py_XDECREF(P11_Helper_MECH_FLAG_CKF_WRAP_obj);
+
+    PyObject *P11_Helper_MECH_FLAG_CKF_UNWRAP_obj = PyInt_FromLong(CKF_UNWRAP);
+    PyObject_SetAttrString(m, "CKF_UNWRAP",
+            P11_Helper_MECH_FLAG_CKF_UNWRAP_obj);
+    Py_XDECREF(P11_Helper_MECH_FLAG_CKF_UNWRAP_obj);
+
+    PyObject *P11_Helper_MECH_FLAG_CKF_GENERATE_obj = PyInt_FromLong(
+            CKF_GENERATE);
+    PyObject_SetAttrString(m, "CKF_GENERATE",
+            P11_Helper_MECH_FLAG_CKF_GENERATE_obj);
+    Py_XDECREF(P11_Helper_MECH_FLAG_CKF_GENERATE_obj);
+
+    PyObject *P11_Helper_MECH_FLAG_CKF_GENERATE_KEY_PAIR_obj = PyInt_FromLong(
+            CKF_GENERATE_KEY_PAIR);
+    PyObject_SetAttrString(m, "CKF_GENERATE_KEY_PAIR",
+            P11_Helper_MECH_FLAG_CKF_GENERATE_KEY_PAIR_obj);
+    Py_XDECREF(P11_Helper_MECH_FLAG_CKF_GENERATE_KEY_PAIR_obj);
+
     /* Key attributes */
     PyObject *P11_Helper_ATTR_CKA_ALWAYS_AUTHENTICATE_obj = PyInt_FromLong(
             CKA_ALWAYS_AUTHENTICATE);
@@ -0,0 +1,110 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ p11stats.h
+
+ Optional interposition layer over CK_FUNCTION_LIST which counts calls,
+ errors and transferred bytes per C_* function and keeps log-linear
+ (HDR-style) latency histograms.
+
+ Nothing is measured unless p11stats_wrap() is called, so there is no
+ overhead when statistics are not requested.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_STATS_H
+#define _IPA_P11_STATS_H
+
+#include <stdint.h>
+#include <stdio.h>
+
+#include <p11-kit/pkcs11.h>
+
+/* histogram has 2^P11STATS_SUB_BITS linear sub-buckets per power of two */
+#define P11STATS_SUB_BITS  3
+#define P11STATS_BUCKETS   ((64 - P11STATS_SUB_BITS + 1) << P11STATS_SUB_BITS)
+
+/* all members of CK_FUNCTION_LIST in structure order */
+#define P11STATS_FUNCTIONS(X) \
+    X(C_Initialize) X(C_Finalize) X(C_GetInfo) X(C_GetFunctionList) \
+    X(C_GetSlotList) X(C_GetSlotInfo) X(C_GetTokenInfo) \
+    X(C_GetMechanismList) X(C_GetMechanismInfo) X(C_InitToken) X(C_InitPIN) \
+    X(C_SetPIN) X(C_OpenSession) X(C_CloseSession) X(C_CloseAllSessions) \
+    X(C_GetSessionInfo) X(C_GetOperationState) X(C_SetOperationState) \
+    X(C_Login) X(C_Logout) X(C_CreateObject) X(C_CopyObject) \
+    X(C_DestroyObject) X(C_GetObjectSize) X(C_GetAttributeValue) \
+    X(C_SetAttributeValue) X(C_FindObjectsInit) X(C_FindObjects) \
+    X(C_FindObjectsFinal) X(C_EncryptInit) X(C_Encrypt) X(C_EncryptUpdate) \
+    X(C_EncryptFinal) X(C_DecryptInit) X(C_Decrypt) X(C_DecryptUpdate) \
+    X(C_DecryptFinal) X(C_DigestInit) X(C_Digest) X(C_DigestUpdate) \
+    X(C_DigestKey) X(C_DigestFinal) X(C_SignInit) X(C_Sign) X(C_SignUpdate) \
+    X(C_SignFinal) X(C_SignRecoverInit) X(C_SignRecover) X(C_VerifyInit) \
+    X(C_Verify) X(C_VerifyUpdate) X(C_VerifyFinal) X(C_VerifyRecoverInit) \
+    X(C_VerifyRecover) X(C_DigestEncryptUpdate) X(C_DecryptDigestUpdate) \
+    X(C_SignEncryptUpdate) X(C_DecryptVerifyUpdate) X(C_GenerateKey) \
+    X(C_GenerateKeyPair) X(C_WrapKey) X(C_UnwrapKey) X(C_DeriveKey) \
+    X(C_SeedRandom) X(C_GenerateRandom) X(C_GetFunctionStatus) \
+    X(C_CancelFunction) X(C_WaitForSlotEvent)
+
+/**
+ * Snapshot of counters for one function
+ *
+ * Latencies are in nanoseconds, percentiles are upper bounds of the
+ * histogram bucket (relative error is below 1/2^P11STATS_SUB_BITS).
+ * Bytes are counted only for successful calls: lengths of input buffers
+ * (PINs excluded), lengths of returned output buffers and sizes of attribute
+ * values passed to C_GetAttributeValue/C_SetAttributeValue.
+ */
+typedef struct {
+    uint64_t calls;
+    uint64_t errors;
+    uint64_t bytes;
+    uint64_t total_ns;
+    uint64_t max_ns;
+    uint64_t p50_ns;
+    uint64_t p90_ns;
+    uint64_t p99_ns;
+} p11stats_t;
+
+/**
+ * One non-empty histogram bucket
+ */
+typedef struct {
+    uint64_t upper_ns;
+    uint64_t count;
+} p11stats_bucket_t;
+
+CK_FUNCTION_LIST_PTR p11stats_wrap(CK_FUNCTION_LIST_PTR module);
+
+int p11stats_enabled(void);
+
+void p11stats_reset(void);
+
+unsigned int p11stats_count(void);
+
+const char *p11stats_name(unsigned int fn);
+
+int p11stats_get(unsigned int fn, p11stats_t *st);
+
+unsigned int p11stats_histogram(unsigned int fn, p11stats_bucket_t *buckets,
+        unsigned int max);
+
+void p11stats_print(FILE *out);
+
+#endif // !_IPA_P11_STATS_H
@@ -0,0 +1,748 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ p11trace.c
+
+ Wrapper of CK_FUNCTION_LIST which appends every call of functions used by
+ FreeIPA (sessions, objects, key generation, wrapping, digest, signatures
+ and random) to a binary trace, see p11trace.h for the format. Other
+ functions are passed to the module unchanged and are not recorded.
+
+ Input arguments are encoded before the call so that the recorded duration
+ covers only the module. Records are built in a local buffer and appended
+ to the trace under a mutex, so wrapped module can be used from multiple
+ threads.
+ *****************************************************************************/
+
+#define _POSIX_C_SOURCE 200809L
+
+#include "p11trace.h"
+#include "fnv.h"
+
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#define RECORD_HEADER_LEN  32
+
+static CK_FUNCTION_LIST orig;
+static CK_FUNCTION_LIST wrapped;
+static CK_FUNCTION_LIST_PTR wrapped_module = NULL;
+static FILE *trace = NULL;
+static uint64_t trace_start;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/**
+ * Record being built, small records stay in the inline storage
+ */
+typedef struct {
+    unsigned char *p;
+    size_t len;
+    size_t size;
+    int failed;
+    unsigned char inline_buf[512];
+} trace_buf_t;
+
+static uint64_t now(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000U + (uint64_t) ts.tv_nsec;
+}
+
+static void buf_init(trace_buf_t *b) {
+    b->p = b->inline_buf;
+    b->len = RECORD_HEADER_LEN;
+    b->size = sizeof(b->inline_buf);
+    b->failed = 0;
+}
+
+static unsigned char *buf_reserve(trace_buf_t *b, size_t len) {
+    unsigned char *p;
+    size_t size = b->size;
+
+    if (b->failed)
+        return NULL;
+    if (b->len + len > size) {
+        while (b->len + len > size)
+            size *= 2;
+        p = malloc(size);
+        if (p == NULL) {
+            b->failed = 1;
+            return NULL;
+        }
+        memcpy(p, b->p, b->len);
+        if (b->p != b->inline_buf)
+            free(b->p);
+        b->p = p;
+        b->size = size;
+    }
+    p = b->p + b->len;
+    b->len += len;
+    return p;
+}
+
+static void le_put(unsigned char *p, uint64_t value, unsigned int octets) {
+    unsigned int i;
+
+    for (i = 0; i < octets; i++) {
+        p[i] = (unsigned char) (value & 0xff);
+        value >>= 8;
+    }
+}
+
+static uint64_t le_get(const unsigned char *p, unsigned int octets) {
+    uint64_t value = 0;
+
+    while (octets-- > 0)
+        value = (value << 8) | p[octets];
+    return value;
+}
+
+static void put_uint(trace_buf_t *b, uint64_t value, unsigned int octets) {
+    unsigned char *p = buf_reserve(b, octets);
+
+    if (p != NULL)
+        le_put(p, value, octets);
+}
+
+static void put_bytes(trace_buf_t *b, const void *data, size_t len) {
+    unsigned char *p = buf_reserve(b, len);
+
+    if (p != NULL && len > 0)
+        memcpy(p, data, len);
+}
+
+static void arg_ulong(trace_buf_t *b, CK_ULONG value) {
+    put_uint(b, P11TRACE_ARG_ULONG, 1);
+    put_uint(b, value, 8);
+}
+
+static void arg_redacted(trace_buf_t *b, CK_ULONG len) {
+    put_uint(b, P11TRACE_ARG_REDACTED, 1);
+    put_uint(b, len, 8);
+}
+
+static void arg_blob(trace_buf_t *b, const CK_BYTE *data, CK_ULONG len) {
+    put_uint(b, P11TRACE_ARG_BLOB, 1);
+    put_uint(b, len, 8);
+    put_uint(b, data != NULL ? fnv1a64(data, len) : 0, 8);
+}
+
+static void arg_output(trace_buf_t *b, const void *buf, CK_ULONG_PTR len) {
+    put_uint(b, P11TRACE_ARG_OUTPUT, 1);
+    put_uint(b, buf != NULL, 1);
+    put_uint(b, len != NULL ? *len : 0, 8);
+}
+
+static void arg_handles(trace_buf_t *b, const CK_ULONG *handles,
+        CK_ULONG count) {
+    CK_ULONG i;
+
+    put_uint(b, P11TRACE_ARG_HANDLES, 1);
+    put_uint(b, count, 4);
+    for (i = 0; i < count; i++)
+        put_uint(b, handles[i], 8);
+}
+
+static void arg_mechanism(trace_buf_t *b, CK_MECHANISM_PTR mech) {
+    CK_RSA_PKCS_OAEP_PARAMS oaep;
+    const void *param = NULL;
+    CK_ULONG param_len = 0;
+
+    if (mech == NULL) {
+        put_uint(b, P11TRACE_ARG_ULONG, 1);
+        put_uint(b, 0, 8);
+        return;
+    }
+    if (mech->pParameter != NULL) {
+        param = mech->pParameter;
+        param_len = mech->ulParameterLen;
+    }
+    /* pointer inside of OAEP parameters would be meaningless in the trace */
+    if (mech->mechanism == CKM_RSA_PKCS_OAEP && param != NULL
+            && param_len == sizeof(oaep)) {
+        memcpy(&oaep, param, sizeof(oaep));
+        oaep.pSourceData = NULL;
+        oaep.ulSourceDataLen = 0;
+        param = &oaep;
+    }
+    put_uint(b, P11TRACE_ARG_MECHANISM, 1);
+    put_uint(b, mech->mechanism, 8);
+    put_uint(b, param_len, 4);
+    put_bytes(b, param, param_len);
+}
+
+static int is_sensitive(CK_ATTRIBUTE_TYPE type) {
+    switch (type) {
+    case CKA_VALUE:
+    case CKA_PRIVATE_EXPONENT:
+    case CKA_PRIME_1:
+    case CKA_PRIME_2:
+    case CKA_EXPONENT_1:
+    case CKA_EXPONENT_2:
+    case CKA_COEFFICIENT:
+        return 1;
+    default:
+        return 0;
+    }
+}
+
+/**
+ * Encode template, values of output templates are never stored
+ */
+static void arg_template(trace_buf_t *b, CK_ATTRIBUTE_PTR templ,
+        CK_ULONG count, int output) {
+    p11trace_attr_kind_t kind;
+    CK_ULONG i;
+
+    if (templ == NULL)
+        count = 0;
+    put_uint(b, P11TRACE_ARG_TEMPLATE, 1);
+    put_uint(b, count, 4);
+    for (i = 0; i < count; i++) {
+        if (templ[i].pValue == NULL)
+            kind = P11TRACE_ATTR_NO_BUFFER;
+        else if (output || is_sensitive(templ[i].type)
+                 || templ[i].ulValueLen == (CK_ULONG) -1)
+            kind = P11TRACE_ATTR_LENGTH;
+        else
+            kind = P11TRACE_ATTR_VALUE;
+        put_uint(b, templ[i].type, 8);
+        put_uint(b, kind, 1);
+        put_uint(b, templ[i].ulValueLen, 8);
+        if (kind == P11TRACE_ATTR_VALUE)
+            put_bytes(b, templ[i].pValue, templ[i].ulValueLen);
+    }
+}
+
+static void trace_write(unsigned int fn, CK_RV rv, uint64_t start,
+        uint64_t end, trace_buf_t *b) {
+    if (!b->failed) {
+        le_put(b->p, b->len - RECORD_HEADER_LEN, 4);
+        le_put(b->p + 4, fn, 2);
+        le_put(b->p + 6, 0, 2);
+        le_put(b->p + 8, rv, 8);
+        le_put(b->p + 16, start - trace_start, 8);
+        le_put(b->p + 24, end - start, 8);
+        pthread_mutex_lock(&trace_lock);
+        if (trace != NULL)
+            fwrite(b->p, b->len, 1, trace);
+        pthread_mutex_unlock(&trace_lock);
+    }
+    if (b->p != b->inline_buf)
+        free(b->p);
+}
+
+#define TRACE_BEGIN \
+    CK_RV rv; \
+    trace_buf_t b; \
+    uint64_t start, end; \
+    buf_init(&b)
+
+#define TRACE_CALL(call) \
+    start = now(); \
+    rv = call; \
+    end = now()
+
+#define TRACE_END(name) \
+    trace_write(P11TRACE_ ## name, rv, start, end, &b); \
+    return rv
+
+/* handles returned through pointer, none if the call failed */
+#define OUT_HANDLE(ptr) (ptr), (rv == CKR_OK && (ptr) != NULL ? 1 : 0)
+
+static CK_RV trace_C_Initialize(CK_VOID_PTR init_args) {
+    TRACE_BEGIN;
+    TRACE_CALL(orig.C_Initialize(init_args));
+    TRACE_END(C_Initialize);
+}
+
+static CK_RV trace_C_Finalize(CK_VOID_PTR reserved) {
+    TRACE_BEGIN;
+    TRACE_CALL(orig.C_Finalize(reserved));
+    trace_write(P11TRACE_C_Finalize, rv, start, end, &b);
+    pthread_mutex_lock(&trace_lock);
+    if (trace != NULL)
+        fflush(trace);
+    pthread_mutex_unlock(&trace_lock);
+    return rv;
+}
+
+static CK_RV trace_C_OpenSession(CK_SLOT_ID slot_id, CK_FLAGS flags,
+        CK_VOID_PTR application, CK_NOTIFY notify,
+        CK_SESSION_HANDLE_PTR session) {
+    TRACE_BEGIN;
+    arg_ulong(&b, slot_id);
+    arg_ulong(&b, flags);
+    TRACE_CALL(orig.C_OpenSession(slot_id, flags, application, notify,
+            session));
+    arg_handles(&b, OUT_HANDLE(session));
+    TRACE_END(C_OpenSession);
+}
+
+static CK_RV trace_C_CloseSession(CK_SESSION_HANDLE session) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    TRACE_CALL(orig.C_CloseSession(session));
+    TRACE_END(C_CloseSession);
+}
+
+static CK_RV trace_C_Login(CK_SESSION_HANDLE session, CK_USER_TYPE user_type,
+        CK_UTF8CHAR_PTR pin, CK_ULONG pin_len) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_ulong(&b, user_type);
+    arg_redacted(&b, pin_len);
+    TRACE_CALL(orig.C_Login(session, user_type, pin, pin_len));
+    TRACE_END(C_Login);
+}
+
+static CK_RV trace_C_Logout(CK_SESSION_HANDLE session) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    TRACE_CALL(orig.C_Logout(session));
+    TRACE_END(C_Logout);
+}
+
+static CK_RV trace_C_CreateObject(CK_SESSION_HANDLE session,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count, CK_OBJECT_HANDLE_PTR object) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_template(&b, templ, count, 0);
+    TRACE_CALL(orig.C_CreateObject(session, templ, count, object));
+    arg_handles(&b, OUT_HANDLE(object));
+    TRACE_END(C_CreateObject);
+}
+
+static CK_RV trace_C_DestroyObject(CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_ulong(&b, object);
+    TRACE_CALL(orig.C_DestroyObject(session, object));
+    TRACE_END(C_DestroyObject);
+}
+
+static CK_RV trace_C_GetAttributeValue(CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_ulong(&b, object);
+    arg_template(&b, templ, count, 1);
+    TRACE_CALL(orig.C_GetAttributeValue(session, object, templ, count));
+    TRACE_END(C_GetAttributeValue);
+}
+
+static CK_RV trace_C_SetAttributeValue(CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE object, CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_ulong(&b, object);
+    arg_template(&b, templ, count, 0);
+    TRACE_CALL(orig.C_SetAttributeValue(session, object, templ, count));
+    TRACE_END(C_SetAttributeValue);
+}
+
+static CK_RV trace_C_FindObjectsInit(CK_SESSION_HANDLE session,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG count) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_template(&b, templ, count, 0);
+    TRACE_CALL(orig.C_FindObjectsInit(session, templ, count));
+    TRACE_END(C_FindObjectsInit);
+}
+
+static CK_RV trace_C_FindObjects(CK_SESSION_HANDLE session,
+        CK_OBJECT_HANDLE_PTR object, CK_ULONG max_object_count,
+        CK_ULONG_PTR object_count) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_ulong(&b, max_object_count);
+    TRACE_CALL(orig.C_FindObjects(session, object, max_object_count,
+            object_count));
+    arg_handles(&b, object, rv == CKR_OK && object_count != NULL
+                ? *object_count : 0);
+    TRACE_END(C_FindObjects);
+}
+
+static CK_RV trace_C_FindObjectsFinal(CK_SESSION_HANDLE session) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    TRACE_CALL(orig.C_FindObjectsFinal(session));
+    TRACE_END(C_FindObjectsFinal);
+}
+
+static CK_RV trace_C_DigestInit(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    TRACE_CALL(orig.C_DigestInit(session, mechanism));
+    TRACE_END(C_DigestInit);
+}
+
+static CK_RV trace_C_Digest(CK_SESSION_HANDLE session, CK_BYTE_PTR data,
+        CK_ULONG data_len, CK_BYTE_PTR digest, CK_ULONG_PTR digest_len) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_redacted(&b, data_len);
+    TRACE_CALL(orig.C_Digest(session, data, data_len, digest, digest_len));
+    arg_output(&b, digest, digest_len);
+    TRACE_END(C_Digest);
+}
+
+static CK_RV trace_C_SignInit(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    arg_ulong(&b, key);
+    TRACE_CALL(orig.C_SignInit(session, mechanism, key));
+    TRACE_END(C_SignInit);
+}
+
+static CK_RV trace_C_Sign(CK_SESSION_HANDLE session, CK_BYTE_PTR data,
+        CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG_PTR signature_len) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_redacted(&b, data_len);
+    TRACE_CALL(orig.C_Sign(session, data, data_len, signature,
+            signature_len));
+    arg_output(&b, signature, signature_len);
+    TRACE_END(C_Sign);
+}
+
+static CK_RV trace_C_VerifyInit(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE key) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    arg_ulong(&b, key);
+    TRACE_CALL(orig.C_VerifyInit(session, mechanism, key));
+    TRACE_END(C_VerifyInit);
+}
+
+static CK_RV trace_C_Verify(CK_SESSION_HANDLE session, CK_BYTE_PTR data,
+        CK_ULONG data_len, CK_BYTE_PTR signature, CK_ULONG signature_len) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_redacted(&b, data_len);
+    arg_redacted(&b, signature_len);
+    TRACE_CALL(orig.C_Verify(session, data, data_len, signature,
+            signature_len));
+    TRACE_END(C_Verify);
+}
+
+static CK_RV trace_C_GenerateKey(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_ATTRIBUTE_PTR templ, CK_ULONG count,
+        CK_OBJECT_HANDLE_PTR key) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    arg_template(&b, templ, count, 0);
+    TRACE_CALL(orig.C_GenerateKey(session, mechanism, templ, count, key));
+    arg_handles(&b, OUT_HANDLE(key));
+    TRACE_END(C_GenerateKey);
+}
+
+static CK_RV trace_C_GenerateKeyPair(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_ATTRIBUTE_PTR public_key_template,
+        CK_ULONG public_key_attribute_count,
+        CK_ATTRIBUTE_PTR private_key_template,
+        CK_ULONG private_key_attribute_count, CK_OBJECT_HANDLE_PTR public_key,
+        CK_OBJECT_HANDLE_PTR private_key) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    arg_template(&b, public_key_template, public_key_attribute_count, 0);
+    arg_template(&b, private_key_template, private_key_attribute_count, 0);
+    TRACE_CALL(orig.C_GenerateKeyPair(session, mechanism,
+            public_key_template, public_key_attribute_count,
+            private_key_template, private_key_attribute_count, public_key,
+            private_key));
+    arg_handles(&b, OUT_HANDLE(public_key));
+    arg_handles(&b, OUT_HANDLE(private_key));
+    TRACE_END(C_GenerateKeyPair);
+}
+
+static CK_RV trace_C_WrapKey(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE wrapping_key,
+        CK_OBJECT_HANDLE key, CK_BYTE_PTR wrapped_key,
+        CK_ULONG_PTR wrapped_key_len) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    arg_ulong(&b, wrapping_key);
+    arg_ulong(&b, key);
+    TRACE_CALL(orig.C_WrapKey(session, mechanism, wrapping_key, key,
+            wrapped_key, wrapped_key_len));
+    arg_output(&b, wrapped_key, wrapped_key_len);
+    /* lets replay match the blob with later C_UnwrapKey */
+    if (rv == CKR_OK && wrapped_key != NULL)
+        arg_blob(&b, wrapped_key, *wrapped_key_len);
+    TRACE_END(C_WrapKey);
+}
+
+static CK_RV trace_C_UnwrapKey(CK_SESSION_HANDLE session,
+        CK_MECHANISM_PTR mechanism, CK_OBJECT_HANDLE unwrapping_key,
+        CK_BYTE_PTR wrapped_key, CK_ULONG wrapped_key_len,
+        CK_ATTRIBUTE_PTR templ, CK_ULONG attribute_count,
+        CK_OBJECT_HANDLE_PTR key) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_mechanism(&b, mechanism);
+    arg_ulong(&b, unwrapping_key);
+    arg_blob(&b, wrapped_key, wrapped_key_len);
+    arg_template(&b, templ, attribute_count, 0);
+    TRACE_CALL(orig.C_UnwrapKey(session, mechanism, unwrapping_key,
+            wrapped_key, wrapped_key_len, templ, attribute_count, key));
+    arg_handles(&b, OUT_HANDLE(key));
+    TRACE_END(C_UnwrapKey);
+}
+
+static CK_RV trace_C_GenerateRandom(CK_SESSION_HANDLE session,
+        CK_BYTE_PTR random_data, CK_ULONG random_len) {
+    TRACE_BEGIN;
+    arg_ulong(&b, session);
+    arg_redacted(&b, random_len);
+    TRACE_CALL(orig.C_GenerateRandom(session, random_data, random_len));
+    TRACE_END(C_GenerateRandom);
+}
+
+/* functions which are recorded, the rest is passed through */
+#define P11TRACE_RECORDED(X) \
+    X(C_Initialize) X(C_Finalize) X(C_OpenSession) X(C_CloseSession) \
+    X(C_Login) X(C_Logout) X(C_CreateObject) X(C_DestroyObject) \
+    X(C_GetAttributeValue) X(C_SetAttributeValue) X(C_FindObjectsInit) \
+    X(C_FindObjects) X(C_FindObjectsFinal) X(C_DigestInit) X(C_Digest) \
+    X(C_SignInit) X(C_Sign) X(C_VerifyInit) X(C_Verify) X(C_GenerateKey) \
+    X(C_GenerateKeyPair) X(C_WrapKey) X(C_UnwrapKey) X(C_GenerateRandom)
+
+/**
+ * Return function list which records calls to trace file at path
+ *
+ * Only one module can be traced, other modules and failure to open the
+ * trace file return module unchanged.
+ */
+CK_FUNCTION_LIST_PTR p11trace_wrap(CK_FUNCTION_LIST_PTR module,
+        const char *path) {
+    unsigned char header[12];
+
+    if (module == NULL || module == &wrapped)
+        return module;
+    if (wrapped_module != NULL)
+        return wrapped_module == module ? &wrapped : module;
+
+    trace = fopen(path, "wb");
+    if (trace == NULL)
+        return module;
+    memcpy(header, P11TRACE_MAGIC, 8);
+    le_put(header + 8, P11TRACE_VERSION, 4);
+    fwrite(header, sizeof(header), 1, trace);
+
+    orig = *module;
+    wrapped = *module;
+#define X(name) wrapped.name = trace_ ## name;
+    P11TRACE_RECORDED(X)
+#undef X
+    trace_start = now();
+    wrapped_module = module;
+    return &wrapped;
+}
+
+int p11trace_enabled(void) {
+    return trace != NULL;
+}
+
+/**
+ * Stop recording, wrapped module keeps forwarding calls
+ */
+void p11trace_close(void) {
+    pthread_mutex_lock(&trace_lock);
+    if (trace != NULL)
+        fclose(trace);
+    trace = NULL;
+    pthread_mutex_unlock(&trace_lock);
+}
+
+/**
+ * Check trace file header, return 1 if the trace can be read
+ */
+int p11trace_open(FILE *in) {
+    unsigned char header[12];
+
+    if (fread(header, sizeof(header), 1, in) != 1)
+        return 0;
+    return memcmp(header, P11TRACE_MAGIC, 8) == 0
+           && le_get(header + 8, 4) == P11TRACE_VERSION;
+}
+
+/**
+ * Decode one argument at *offset, return 0 if payload is malformed
+ */
+static int decode_arg(const unsigned char *p, size_t len, size_t *offset,
+        p11trace_arg_t *arg) {
+    size_t off = *offset;
+    size_t need;
+
+    memset(arg, 0, sizeof(*arg));
+    if (off >= len)
+        return 0;
+    arg->type = (p11trace_arg_type_t) p[off++];
+    switch (arg->type) {
+    case P11TRACE_ARG_ULONG:
+    case P11TRACE_ARG_REDACTED:
+        if (len - off < 8)
+            return 0;
+        arg->value = arg->length = le_get(p + off, 8);
+        off += 8;
+        break;
+    case P11TRACE_ARG_BLOB:
+        if (len - off < 16)
+            return 0;
+        arg->length = le_get(p + off, 8);
+        arg->hash = le_get(p + off + 8, 8);
+        off += 16;
+        break;
+    case P11TRACE_ARG_OUTPUT:
+        if (len - off < 9)
+            return 0;
+        arg->present = p[off] != 0;
+        arg->length = le_get(p + off + 1, 8);
+        off += 9;
+        break;
+    case P11TRACE_ARG_HANDLES:
+        if (len - off < 4)
+            return 0;
+        arg->value = le_get(p + off, 4);
+        off += 4;
+        if ((len - off) / 8 < arg->value)
+            return 0;
+        arg->data = p + off;
+        arg->data_len = (uint32_t) (arg->value * 8);
+        off += arg->data_len;
+        break;
+    case P11TRACE_ARG_MECHANISM:
+        if (len - off < 12)
+            return 0;
+        arg->value = le_get(p + off, 8);
+        arg->data_len = (uint32_t) le_get(p + off + 8, 4);
+        off += 12;
+        if (len - off < arg->data_len)
+            return 0;
+        arg->data = p + off;
+        off += arg->data_len;
+        break;
+    case P11TRACE_ARG_TEMPLATE:
+        if (len - off < 4)
+            return 0;
+        arg->value = le_get(p + off, 4);
+        off += 4;
+        arg->data = p + off;
+        for (need = 0; need < arg->value; need++) {
+            if (len - off < 17)
+                return 0;
+            if (p[off + 8] == P11TRACE_ATTR_VALUE) {
+                if (len - off - 17 < le_get(p + off + 9, 8))
+                    return 0;
+                off += le_get(p + off + 9, 8);
+            }
+            off += 17;
+        }
+        arg->data_len = (uint32_t) (p + off - arg->data);
+        break;
+    default:
+        return 0;
+    }
+    *offset = off;
+    return 1;
+}
+
+/**
+ * Read next record from trace
+ *
+ * Return 1 if record was read, 0 at the end of trace and -1 if the trace is
+ * malformed. Buffer in rec is reused, free(rec->buf) when done.
+ */
+int p11trace_read(FILE *in, p11trace_record_t *rec) {
+    unsigned char header[RECORD_HEADER_LEN];
+    size_t len, off = 0;
+    unsigned char *p;
+
+    if (fread(header, sizeof(header), 1, in) != 1)
+        return feof(in) ? 0 : -1;
+    len = (size_t) le_get(header, 4);
+    rec->function = (unsigned int) le_get(header + 4, 2);
+    rec->rv = (CK_RV) le_get(header + 8, 8);
+    rec->start_ns = le_get(header + 16, 8);
+    rec->duration_ns = le_get(header + 24, 8);
+    rec->arg_count = 0;
+    if (rec->function >= P11TRACE_FUNCTION_COUNT)
+        return -1;
+
+    if (len > rec->buf_size) {
+        p = realloc(rec->buf, len);
+        if (p == NULL)
+            return -1;
+        rec->buf = p;
+        rec->buf_size = len;
+    }
+    if (len > 0 && fread(rec->buf, len, 1, in) != 1)
+        return -1;
+
+    while (off < len) {
+        if (rec->arg_count == P11TRACE_MAX_ARGS
+                || !decode_arg(rec->buf, len, &off,
+                               &rec->args[rec->arg_count]))
+            return -1;
+        rec->arg_count++;
+    }
+    return 1;
+}
+
+/**
+ * Handle number idx from P11TRACE_ARG_HANDLES argument
+ */
+uint64_t p11trace_handle(const p11trace_arg_t *arg, uint32_t idx) {
+    return le_get(arg->data + 8 * (size_t) idx, 8);
+}
+
+/**
+ * Decode attribute at *offset of P11TRACE_ARG_TEMPLATE argument
+ *
+ * Start with *offset = 0, return 0 when there are no more attributes.
+ */
+int p11trace_attr_next(const p11trace_arg_t *arg, uint32_t *offset,
+        p11trace_attr_t *attr) {
+    const unsigned char *p = arg->data + *offset;
+
+    if (*offset >= arg->data_len)
+        return 0;
+    attr->type = (CK_ATTRIBUTE_TYPE) le_get(p, 8);
+    attr->kind = (p11trace_attr_kind_t) p[8];
+    attr->length = (CK_ULONG) le_get(p + 9, 8);
+    attr->value = attr->kind == P11TRACE_ATTR_VALUE ? p + 17 : NULL;
+    *offset += 17;
+    if (attr->kind == P11TRACE_ATTR_VALUE)
+        *offset += attr->length;
+    return 1;
+}
@@ -0,0 +1,48 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ secmem.h
+
+ Locked memory for key material
+
+ Wrapped keys, secret values and other sensitive buffers are taken from
+ size-class pools carved out of mlock()ed pages, so they are never swapped
+ out nor included in core dumps. Released buffers are zeroized and kept in
+ the pool for reuse, which also avoids malloc churn on hot paths. Buffers
+ larger than the biggest class get their own locked mapping.
+
+ If the pages cannot be locked (RLIMIT_MEMLOCK), allocation still succeeds
+ and buffers are zeroized on release anyway.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_SECMEM_H
+#define _IPA_P11_SECMEM_H
+
+#include <stddef.h>
+
+void *secmem_alloc(size_t size);
+
+void *secmem_realloc(void *ptr, size_t size);
+
+void secmem_free(void *ptr);
+
+void secmem_zeroize(void *ptr, size_t size);
+
+#endif // !_IPA_P11_SECMEM_H
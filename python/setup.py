@@ -10,7 +10,7 @@ if not os.path.exists(python_header):
 module = Extension('_ipap11helper',
                    define_macros = [],
                    include_dirs = [],
-                   libraries = ['dl', 'crypto', 'p11-kit'],
+                   libraries = ['dl', 'p11-kit', 'rt'],
                    library_dirs = [],
                    extra_compile_args = [
                        '-std=c99',
@@ -24,7 +24,10 @@ module = Extension('_ipap11helper',
                        '-Wbad-function-cast',
                        '-Wextra',
                    ],
-                   sources = ['p11helper.c', 'library.c'])
+                   sources = ['p11helper.c', 'library.c', 'spki.c',
+                              'p11caps.c', 'p11stats.c', 'p11trace.c',
+                              'secmem.c', 'wrapcache.c', 'manifest.c',
+                              'shmindex.c', 'objindex.c', 'dnskey.c'])
 
 setup(name='_ipap11helper',
       version = '0.1',
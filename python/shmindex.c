@@ -0,0 +1,268 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ shmindex.c
+
+ Object index shared by processes
+
+ Segment layout: header followed by SHMINDEX_CAPACITY entries. Writers
+ hold flock(LOCK_EX) and make the sequence number odd for the time they
+ modify the segment. A writer which dies in the middle leaves the number
+ odd; the next writer notices it under the lock and repairs it.
+ *****************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include "shmindex.h"
+
+#include <fcntl.h>
+#include <sched.h>
+#include <string.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+
+#define SHMINDEX_MAGIC          "IPASHI03"
+#define SHMINDEX_READ_RETRIES   1000
+
+struct shmindex_header {
+    char magic[8];
+    uint32_t capacity;
+    uint32_t seq;           /* odd while writer modifies the segment */
+    uint32_t valid;         /* entries reflect the token */
+    uint32_t count;
+    uint32_t complete;      /* entries list all objects of the tokens */
+    uint32_t reserved;
+    uint64_t generation;    /* incremented by every write */
+    uint64_t tokens;        /* hash of tokens the entries come from */
+    uint64_t published_ns;  /* CLOCK_MONOTONIC of the last publish */
+};
+
+static uint64_t now_ns(void) {
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static size_t segment_len(void) {
+    return sizeof(shmindex_header_t)
+            + SHMINDEX_CAPACITY * sizeof(shmindex_entry_t);
+}
+
+/**
+ * Attach segment, create it if it does not exist
+ *
+ * :param name: POSIX shared memory name, e.g. "/ipa-p11-index"
+ */
+CK_RV shmindex_open(shmindex_t *idx, const char *name) {
+    struct stat st;
+    size_t len = segment_len();
+    void *map;
+
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = shm_open(name, O_RDWR | O_CREAT, 0600);
+    if (idx->fd < 0)
+        return CKR_GENERAL_ERROR;
+    if (flock(idx->fd, LOCK_EX) != 0 || fstat(idx->fd, &st) != 0)
+        goto error;
+    /* new segment is zero filled, magic is written below */
+    if (st.st_size == 0 && ftruncate(idx->fd, len) != 0)
+        goto error;
+    if (st.st_size != 0 && (size_t) st.st_size != len)
+        goto error;
+
+    map = mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED, idx->fd, 0);
+    if (map == MAP_FAILED)
+        goto error;
+    idx->header = map;
+    idx->entries = (shmindex_entry_t *) (idx->header + 1);
+    idx->map_len = len;
+
+    if (st.st_size == 0) {
+        memcpy(idx->header->magic, SHMINDEX_MAGIC, sizeof(idx->header->magic));
+        idx->header->capacity = SHMINDEX_CAPACITY;
+    } else if (memcmp(idx->header->magic, SHMINDEX_MAGIC,
+            sizeof(idx->header->magic)) != 0
+            || idx->header->capacity != SHMINDEX_CAPACITY) {
+        goto error;
+    }
+    flock(idx->fd, LOCK_UN);
+    return CKR_OK;
+
+error:
+    shmindex_close(idx);
+    return CKR_GENERAL_ERROR;
+}
+
+void shmindex_close(shmindex_t *idx) {
+    if (idx->header != NULL)
+        munmap(idx->header, idx->map_len);
+    if (idx->fd >= 0)
+        close(idx->fd);
+    memset(idx, 0, sizeof(*idx));
+    idx->fd = -1;
+}
+
+/**
+ * Lock segment for writing and make sequence number odd
+ */
+static uint32_t write_begin(shmindex_t *idx) {
+    uint32_t seq;
+
+    flock(idx->fd, LOCK_EX);
+    seq = __atomic_load_n(&idx->header->seq, __ATOMIC_RELAXED);
+    if (seq & 1) {
+        /* previous writer died, its entries cannot be trusted */
+        idx->header->valid = 0;
+        seq++;
+    }
+    __atomic_store_n(&idx->header->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    return seq;
+}
+
+static void write_end(shmindex_t *idx, uint32_t seq) {
+    idx->header->generation++;
+    __atomic_store_n(&idx->header->seq, seq + 2, __ATOMIC_RELEASE);
+    flock(idx->fd, LOCK_UN);
+}
+
+/**
+ * Generation of the segment, pass it to shmindex_publish() to detect
+ * changes made while the entries were collected
+ */
+uint64_t shmindex_generation(shmindex_t *idx) {
+    uint64_t generation;
+
+    flock(idx->fd, LOCK_SH);
+    generation = idx->header->generation;
+    flock(idx->fd, LOCK_UN);
+    return generation;
+}
+
+/**
+ * Mark index as stale, call after every change of the token
+ */
+void shmindex_invalidate(shmindex_t *idx) {
+    uint32_t seq = write_begin(idx);
+
+    idx->header->valid = 0;
+    write_end(idx, seq);
+}
+
+/**
+ * Replace entries and mark index valid
+ *
+ * :param generation: value of shmindex_generation() before the entries were
+ *                    read from the token
+ * :param complete: 0 if some objects could not be indexed
+ * :return: CKR_OK, CKR_FUNCTION_CANCELED if the index changed since
+ *          generation (entries may be stale and are dropped),
+ *          CKR_BUFFER_TOO_SMALL if there are too many entries
+ */
+CK_RV shmindex_publish(shmindex_t *idx, uint64_t generation, uint64_t tokens,
+        const shmindex_entry_t *entries, uint32_t count, int complete) {
+    uint32_t seq;
+
+    if (count > SHMINDEX_CAPACITY)
+        return CKR_BUFFER_TOO_SMALL;
+    seq = write_begin(idx);
+    /* write_begin() itself does not change generation */
+    if (idx->header->generation != generation) {
+        write_end(idx, seq);
+        return CKR_FUNCTION_CANCELED;
+    }
+    memcpy(idx->entries, entries, count * sizeof(shmindex_entry_t));
+    idx->header->count = count;
+    idx->header->tokens = tokens;
+    idx->header->complete = complete != 0;
+    idx->header->published_ns = now_ns();
+    idx->header->valid = 1;
+    write_end(idx, seq);
+    return CKR_OK;
+}
+
+static int entry_matches(const shmindex_entry_t *e, CK_OBJECT_CLASS key_class,
+        const CK_BYTE *id, CK_ULONG id_len, const CK_BYTE *label,
+        CK_ULONG label_len) {
+    return (key_class == SHMINDEX_ANY_CLASS || e->key_class == key_class)
+            && (id == NULL || (e->id_len == id_len
+                    && memcmp(e->id, id, id_len) == 0))
+            && (label == NULL || (e->label_len == label_len
+                    && memcmp(e->label, label, label_len) == 0));
+}
+
+/**
+ * Find objects by class, CKA_ID and CKA_LABEL
+ *
+ * NULL id or label matches any value.
+ *
+ * :param max_age_ns: entries published longer ago are not used, 0 means
+ *                    any age; nonzero is for callers which trust misses,
+ *                    so it also rejects index with objects left out
+ * :param out: up to max matching entries are copied here
+ * :return: number of matching entries (can be more than max), -1 if the
+ *          index is not valid for tokens or too old and the HSM has to be
+ *          asked
+ */
+int shmindex_find(shmindex_t *idx, uint64_t tokens, uint64_t max_age_ns,
+        CK_OBJECT_CLASS key_class, const CK_BYTE *id, CK_ULONG id_len,
+        const CK_BYTE *label, CK_ULONG label_len, shmindex_entry_t *out,
+        int max) {
+    const shmindex_header_t *h = idx->header;
+    uint64_t now = max_age_ns != 0 ? now_ns() : 0;
+    uint32_t seq;
+    uint32_t i, count;
+    unsigned int retries;
+    int found;
+
+    for (retries = 0; retries < SHMINDEX_READ_RETRIES; retries++) {
+        seq = __atomic_load_n(&h->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+
+        found = -1;
+        if (h->valid && h->tokens == tokens
+                && (max_age_ns == 0 || (h->complete
+                        && now - h->published_ns <= max_age_ns))) {
+            found = 0;
+            count = h->count;
+            for (i = 0; i < count && i < SHMINDEX_CAPACITY; i++) {
+                if (!entry_matches(&idx->entries[i], key_class, id, id_len,
+                        label, label_len))
+                    continue;
+                if (found < max)
+                    memcpy(&out[found], &idx->entries[i],
+                            sizeof(shmindex_entry_t));
+                found++;
+            }
+        }
+
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&h->seq, __ATOMIC_RELAXED) == seq)
+            return found;
+    }
+    return -1;
+}
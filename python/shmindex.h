@@ -0,0 +1,95 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ shmindex.h
+
+ Object index shared by processes
+
+ Fixed size table of token objects (class, key type, CKA_ID, CKA_LABEL and
+ public key in SubjectPublicKeyInfo) in POSIX shared memory, so all helpers
+ on the host answer lookups without asking the HSM. Object handles are not
+ stored: PKCS#11 handles are valid only in the process which got them.
+
+ Readers never block: the table is protected by a sequence lock, readers
+ retry when the sequence number is odd (writer active) or changed while
+ they were reading. Writers are serialized with flock() on the segment.
+
+ Every change of the token made through a helper bumps the generation and
+ clears the valid flag; the next helper which needs the index rebuilds it.
+ Changes made by other tools are not seen until the index is invalidated,
+ so absence of an object is trusted only for entries younger than a limit
+ given by the caller, and only if no object was left out for too long ID
+ or label.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_SHMINDEX_H
+#define _IPA_P11_SHMINDEX_H
+
+#include <stdint.h>
+#include <p11-kit/pkcs11.h>
+
+#define SHMINDEX_MAX_ID         128
+#define SHMINDEX_MAX_LABEL      128
+#define SHMINDEX_MAX_PUBLIC     640 /* SPKI of RSA 4096 key */
+#define SHMINDEX_CAPACITY       4096
+
+/* key_class of shmindex_find() which matches all objects */
+#define SHMINDEX_ANY_CLASS      ((CK_OBJECT_CLASS) -1)
+
+typedef struct {
+    CK_OBJECT_CLASS key_class;
+    CK_KEY_TYPE key_type;
+    uint16_t id_len;
+    uint16_t label_len;
+    uint16_t public_len;    /* 0 if not a public key */
+    CK_BYTE id[SHMINDEX_MAX_ID];
+    CK_BYTE label[SHMINDEX_MAX_LABEL];
+    CK_BYTE public_data[SHMINDEX_MAX_PUBLIC];
+} shmindex_entry_t;
+
+typedef struct shmindex_header shmindex_header_t;
+
+/**
+ * Index attached to this process
+ */
+typedef struct {
+    int fd;
+    shmindex_header_t *header;
+    shmindex_entry_t *entries;
+    size_t map_len;
+} shmindex_t;
+
+CK_RV shmindex_open(shmindex_t *idx, const char *name);
+
+void shmindex_close(shmindex_t *idx);
+
+uint64_t shmindex_generation(shmindex_t *idx);
+
+void shmindex_invalidate(shmindex_t *idx);
+
+CK_RV shmindex_publish(shmindex_t *idx, uint64_t generation, uint64_t tokens,
+        const shmindex_entry_t *entries, uint32_t count, int complete);
+
+int shmindex_find(shmindex_t *idx, uint64_t tokens, uint64_t max_age_ns,
+        CK_OBJECT_CLASS key_class, const CK_BYTE *id, CK_ULONG id_len,
+        const CK_BYTE *label, CK_ULONG label_len, shmindex_entry_t *out,
+        int max);
+
+#endif // !_IPA_P11_SHMINDEX_H
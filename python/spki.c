@@ -0,0 +1,715 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ spki.c
+
+ Minimal DER encoder and decoder for SubjectPublicKeyInfo (RFC 5280)
+
+ The structure of RSA public key is fixed so there is no need to go through
+ generic ASN.1 machinery:
+
+ SubjectPublicKeyInfo ::= SEQUENCE {
+     algorithm         AlgorithmIdentifier,  -- rsaEncryption, NULL
+     subjectPublicKey  BIT STRING            -- RSAPublicKey
+ }
+
+ RSAPublicKey ::= SEQUENCE {
+     modulus           INTEGER,  -- n
+     publicExponent    INTEGER   -- e
+ }
+
+ EC public keys (RFC 5480) use AlgorithmIdentifier { id-ecPublicKey,
+ namedCurve OID } and the uncompressed point as subjectPublicKey; the same
+ OID is the DER content of CKA_EC_PARAMS and the point is wrapped in
+ OCTET STRING in CKA_EC_POINT.
+
+ Bundles are concatenations of DER blobs and/or PEM blocks (RFC 7468)
+ with optional RFC 1421 style headers, e.g.:
+
+ -----BEGIN PUBLIC KEY-----
+ Label: replica1
+ Id: 6964310a
+
+ MIIBIjANBgkqhkiG9w0BAQEFAAOCAQ8AMIIBCgKCAQEA...
+ -----END PUBLIC KEY-----
+ *****************************************************************************/
+
+#include "spki.h"
+
+#include <string.h>
+#include <strings.h>
+
+#define DER_TAG_INTEGER     0x02
+#define DER_TAG_BIT_STRING  0x03
+#define DER_TAG_OCTET_STRING 0x04
+#define DER_TAG_NULL        0x05
+#define DER_TAG_OID         0x06
+#define DER_TAG_SEQUENCE    0x30
+
+/* algorithm OIDs (content octets only) */
+static const CK_BYTE oid_rsa_encryption[] = { /* 1.2.840.113549.1.1.1 */
+    0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01 };
+static const CK_BYTE oid_dsa[] = { /* 1.2.840.10040.4.1 */
+    0x2a, 0x86, 0x48, 0xce, 0x38, 0x04, 0x01 };
+static const CK_BYTE oid_ec_public_key[] = { /* 1.2.840.10045.2.1 */
+    0x2a, 0x86, 0x48, 0xce, 0x3d, 0x02, 0x01 };
+
+/* ECParameters namedCurve as stored in CKA_EC_PARAMS */
+static const CK_BYTE ec_params_p256[] = { /* prime256v1 1.2.840.10045.3.1.7 */
+    0x06, 0x08, 0x2a, 0x86, 0x48, 0xce, 0x3d, 0x03, 0x01, 0x07 };
+static const CK_BYTE ec_params_p384[] = { /* secp384r1 1.3.132.0.34 */
+    0x06, 0x05, 0x2b, 0x81, 0x04, 0x00, 0x22 };
+
+/* AlgorithmIdentifier { rsaEncryption (1.2.840.113549.1.1.1), NULL } */
+static const CK_BYTE rsa_algorithm_id[] = {
+    0x30, 0x0d,
+        0x06, 0x09, 0x2a, 0x86, 0x48, 0x86, 0xf7, 0x0d, 0x01, 0x01, 0x01,
+        0x05, 0x00
+};
+
+/**
+ * Number of octets needed for DER length field
+ */
+static CK_ULONG der_length_len(CK_ULONG len) {
+    CK_ULONG octets = 1;
+
+    if (len < 0x80)
+        return 1;
+    while (len > 0) {
+        ++octets;
+        len >>= 8;
+    }
+    return octets;
+}
+
+/**
+ * Write tag and length, return number of octets written
+ */
+static CK_ULONG der_put_header(CK_BYTE_PTR p, CK_BYTE tag, CK_ULONG len) {
+    CK_ULONG len_len = der_length_len(len);
+    CK_ULONG i;
+
+    p[0] = tag;
+    if (len_len == 1) {
+        p[1] = (CK_BYTE) len;
+        return 2;
+    }
+    p[1] = 0x80 | (CK_BYTE) (len_len - 1);
+    for (i = len_len - 1; i > 0; --i) {
+        p[1 + i] = (CK_BYTE) (len & 0xff);
+        len >>= 8;
+    }
+    return 1 + len_len;
+}
+
+/**
+ * Strip leading zeros from big-endian unsigned integer and compute length of
+ * INTEGER content (including 0x00 prefix for values with highest bit set).
+ */
+static CK_ULONG der_uint_content_len(const CK_BYTE **value, CK_ULONG *len) {
+    while (*len > 0 && **value == 0) {
+        ++(*value);
+        --(*len);
+    }
+    if (*len == 0)
+        return 1; /* zero is encoded as single 0x00 octet */
+    return *len + ((**value & 0x80) ? 1 : 0);
+}
+
+static CK_ULONG der_put_uint(CK_BYTE_PTR p, const CK_BYTE *value,
+        CK_ULONG value_len, CK_ULONG content_len) {
+    CK_ULONG off = der_put_header(p, DER_TAG_INTEGER, content_len);
+
+    if (content_len > value_len)
+        p[off++] = 0x00;
+    memcpy(p + off, value, value_len);
+    return off + value_len;
+}
+
+/**
+ * Encode RSA public key as DER SubjectPublicKeyInfo
+ *
+ * Modulus and exponent are big-endian unsigned integers as returned in
+ * CKA_MODULUS and CKA_PUBLIC_EXPONENT attributes.
+ *
+ * Follows PKCS#11 convention for output buffers: if out is NULL, only the
+ * required length is stored to *out_len.
+ *
+ * @retval CKR_OK               on success, *out_len contains encoded length
+ * @retval CKR_BUFFER_TOO_SMALL *out_len contains required length
+ * @retval CKR_ARGUMENTS_BAD    missing modulus or exponent
+ */
+CK_RV spki_rsa_encode(const CK_BYTE *modulus, CK_ULONG modulus_len,
+        const CK_BYTE *exponent, CK_ULONG exponent_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+    CK_ULONG n_len, e_len, rsakey_len, bitstr_len, spki_len, total;
+    CK_BYTE_PTR p = out;
+
+    if (modulus == NULL || exponent == NULL || out_len == NULL)
+        return CKR_ARGUMENTS_BAD;
+
+    n_len = der_uint_content_len(&modulus, &modulus_len);
+    e_len = der_uint_content_len(&exponent, &exponent_len);
+    if (modulus_len == 0 || exponent_len == 0)
+        return CKR_ARGUMENTS_BAD;
+
+    rsakey_len = 1 + der_length_len(n_len) + n_len
+               + 1 + der_length_len(e_len) + e_len;
+    /* unused bits octet + RSAPublicKey SEQUENCE */
+    bitstr_len = 1 + 1 + der_length_len(rsakey_len) + rsakey_len;
+    spki_len = sizeof(rsa_algorithm_id)
+             + 1 + der_length_len(bitstr_len) + bitstr_len;
+    total = 1 + der_length_len(spki_len) + spki_len;
+
+    if (out == NULL) {
+        *out_len = total;
+        return CKR_OK;
+    }
+    if (*out_len < total) {
+        *out_len = total;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    p += der_put_header(p, DER_TAG_SEQUENCE, spki_len);
+    memcpy(p, rsa_algorithm_id, sizeof(rsa_algorithm_id));
+    p += sizeof(rsa_algorithm_id);
+    p += der_put_header(p, DER_TAG_BIT_STRING, bitstr_len);
+    *p++ = 0x00; /* no unused bits */
+    p += der_put_header(p, DER_TAG_SEQUENCE, rsakey_len);
+    p += der_put_uint(p, modulus, modulus_len, n_len);
+    p += der_put_uint(p, exponent, exponent_len, e_len);
+
+    *out_len = (CK_ULONG) (p - out);
+    return CKR_OK;
+}
+
+/**
+ * Read one DER TLV with expected tag from [*p, end) and advance *p behind it.
+ *
+ * Only definite lengths up to 4 octets are accepted.
+ *
+ * @retval 1 on success, content and len point to TLV value
+ * @retval 0 on malformed input
+ */
+static int der_get(const CK_BYTE **p, const CK_BYTE *end, CK_BYTE tag,
+        const CK_BYTE **content, CK_ULONG *len) {
+    const CK_BYTE *q = *p;
+    CK_ULONG l;
+    CK_ULONG len_len;
+
+    if (end - q < 2 || q[0] != tag)
+        return 0;
+    l = q[1];
+    q += 2;
+    if (l & 0x80) {
+        len_len = l & 0x7f;
+        if (len_len == 0 || len_len > 4 || (CK_ULONG) (end - q) < len_len)
+            return 0;
+        l = 0;
+        while (len_len-- > 0)
+            l = (l << 8) | *q++;
+    }
+    if ((CK_ULONG) (end - q) < l)
+        return 0;
+
+    *content = q;
+    *len = l;
+    *p = q + l;
+    return 1;
+}
+
+/**
+ * Read non-negative INTEGER and strip leading zero octets
+ */
+static int der_get_uint(const CK_BYTE **p, const CK_BYTE *end,
+        const CK_BYTE **value, CK_ULONG *len) {
+    if (!der_get(p, end, DER_TAG_INTEGER, value, len) || *len == 0)
+        return 0;
+    if (**value & 0x80)
+        return 0; /* negative */
+    while (*len > 1 && **value == 0) {
+        ++(*value);
+        --(*len);
+    }
+    return 1;
+}
+
+/**
+ * Decode DER SubjectPublicKeyInfo in place
+ *
+ * No memory is allocated, all pointers in spki point to der buffer so it
+ * has to stay valid while spki is used. Unknown algorithms are not an error,
+ * spki->algorithm is set to SPKI_ALG_UNKNOWN.
+ *
+ * @retval CKR_OK           on success
+ * @retval CKR_DATA_INVALID if input is not DER encoded SubjectPublicKeyInfo
+ */
+CK_RV spki_decode(const CK_BYTE *der, CK_ULONG der_len, spki_t *spki) {
+    const CK_BYTE *p = der;
+    const CK_BYTE *end = der + der_len;
+    const CK_BYTE *seq, *alg, *oid, *bitstr;
+    CK_ULONG seq_len, alg_len, oid_len, bitstr_len;
+
+    if (der == NULL || spki == NULL)
+        return CKR_ARGUMENTS_BAD;
+    memset(spki, 0, sizeof(*spki));
+
+    if (!der_get(&p, end, DER_TAG_SEQUENCE, &seq, &seq_len) || p != end)
+        return CKR_DATA_INVALID;
+
+    p = seq;
+    end = seq + seq_len;
+    if (!der_get(&p, end, DER_TAG_SEQUENCE, &alg, &alg_len)
+            || !der_get(&p, end, DER_TAG_BIT_STRING, &bitstr, &bitstr_len)
+            || p != end)
+        return CKR_DATA_INVALID;
+
+    /* public key is always octet aligned */
+    if (bitstr_len < 1 || bitstr[0] != 0)
+        return CKR_DATA_INVALID;
+    spki->key = bitstr + 1;
+    spki->key_len = bitstr_len - 1;
+
+    p = alg;
+    end = alg + alg_len;
+    if (!der_get(&p, end, DER_TAG_OID, &oid, &oid_len))
+        return CKR_DATA_INVALID;
+    if (p != end) {
+        spki->params = p;
+        spki->params_len = (CK_ULONG) (end - p);
+    }
+
+    if (oid_len == sizeof(oid_rsa_encryption)
+            && memcmp(oid, oid_rsa_encryption, oid_len) == 0)
+        spki->algorithm = SPKI_ALG_RSA;
+    else if (oid_len == sizeof(oid_dsa) && memcmp(oid, oid_dsa, oid_len) == 0)
+        spki->algorithm = SPKI_ALG_DSA;
+    else if (oid_len == sizeof(oid_ec_public_key)
+            && memcmp(oid, oid_ec_public_key, oid_len) == 0)
+        spki->algorithm = SPKI_ALG_EC;
+    else
+        spki->algorithm = SPKI_ALG_UNKNOWN;
+
+    return CKR_OK;
+}
+
+/**
+ * Locate RSA modulus and public exponent inside of decoded
+ * SubjectPublicKeyInfo
+ *
+ * Returned values are big-endian unsigned integers without leading zeros,
+ * i.e. directly usable as CKA_MODULUS and CKA_PUBLIC_EXPONENT.
+ *
+ * @retval CKR_OK               on success
+ * @retval CKR_KEY_TYPE_INCONSISTENT if spki does not contain RSA key
+ * @retval CKR_DATA_INVALID     if RSAPublicKey is malformed
+ */
+CK_RV spki_rsa_decode(const spki_t *spki,
+        const CK_BYTE **modulus, CK_ULONG_PTR modulus_len,
+        const CK_BYTE **exponent, CK_ULONG_PTR exponent_len) {
+    const CK_BYTE *p;
+    const CK_BYTE *end;
+    const CK_BYTE *seq;
+    CK_ULONG seq_len;
+
+    if (spki == NULL || modulus == NULL || modulus_len == NULL
+            || exponent == NULL || exponent_len == NULL)
+        return CKR_ARGUMENTS_BAD;
+    if (spki->algorithm != SPKI_ALG_RSA)
+        return CKR_KEY_TYPE_INCONSISTENT;
+
+    /* parameters have to be absent or NULL */
+    if (spki->params != NULL && (spki->params_len != 2
+            || spki->params[0] != DER_TAG_NULL || spki->params[1] != 0))
+        return CKR_DATA_INVALID;
+
+    p = spki->key;
+    end = spki->key + spki->key_len;
+    if (!der_get(&p, end, DER_TAG_SEQUENCE, &seq, &seq_len) || p != end)
+        return CKR_DATA_INVALID;
+
+    p = seq;
+    end = seq + seq_len;
+    if (!der_get_uint(&p, end, modulus, modulus_len)
+            || !der_get_uint(&p, end, exponent, exponent_len)
+            || p != end)
+        return CKR_DATA_INVALID;
+
+    return CKR_OK;
+}
+
+/**
+ * DER of namedCurve OID for CKA_EC_PARAMS
+ *
+ * @retval CKR_OK                  P-256 and P-384 are supported
+ * @retval CKR_CURVE_NOT_SUPPORTED other sizes
+ */
+CK_RV spki_ec_params(CK_ULONG bits, const CK_BYTE **params,
+        CK_ULONG_PTR params_len) {
+    switch (bits) {
+        case 256:
+            *params = ec_params_p256;
+            *params_len = sizeof(ec_params_p256);
+            return CKR_OK;
+        case 384:
+            *params = ec_params_p384;
+            *params_len = sizeof(ec_params_p384);
+            return CKR_OK;
+        default:
+            return CKR_CURVE_NOT_SUPPORTED;
+    }
+}
+
+/**
+ * Curve size of CKA_EC_PARAMS, 0 for unknown curves
+ */
+CK_ULONG spki_ec_bits(const CK_BYTE *params, CK_ULONG params_len) {
+    if (params_len == sizeof(ec_params_p256)
+            && memcmp(params, ec_params_p256, params_len) == 0)
+        return 256;
+    if (params_len == sizeof(ec_params_p384)
+            && memcmp(params, ec_params_p384, params_len) == 0)
+        return 384;
+    return 0;
+}
+
+/**
+ * Find EC point in value of CKA_EC_POINT
+ *
+ * PKCS#11 requires DER OCTET STRING but some modules return the bare point.
+ * An uncompressed point starts with 0x04 as well, so the value is taken as
+ * OCTET STRING only if its length matches exactly.
+ */
+CK_RV spki_ec_point(const CK_BYTE *value, CK_ULONG value_len,
+        const CK_BYTE **point, CK_ULONG_PTR point_len) {
+    const CK_BYTE *p = value;
+
+    if (value == NULL || value_len == 0)
+        return CKR_ARGUMENTS_BAD;
+    if (!der_get(&p, value + value_len, DER_TAG_OCTET_STRING, point,
+            point_len) || p != value + value_len || *point_len == 0) {
+        *point = value;
+        *point_len = value_len;
+    }
+    return CKR_OK;
+}
+
+/**
+ * Wrap EC point into DER OCTET STRING for CKA_EC_POINT
+ *
+ * Same output buffer convention as spki_rsa_encode().
+ */
+CK_RV spki_ec_point_encode(const CK_BYTE *point, CK_ULONG point_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+    CK_ULONG total;
+
+    if (point == NULL || point_len == 0 || out_len == NULL)
+        return CKR_ARGUMENTS_BAD;
+
+    total = 1 + der_length_len(point_len) + point_len;
+    if (out == NULL) {
+        *out_len = total;
+        return CKR_OK;
+    }
+    if (*out_len < total) {
+        *out_len = total;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+    out += der_put_header(out, DER_TAG_OCTET_STRING, point_len);
+    memcpy(out, point, point_len);
+    *out_len = total;
+    return CKR_OK;
+}
+
+/**
+ * Encode EC public key as DER SubjectPublicKeyInfo
+ *
+ * :param params: DER namedCurve OID as in CKA_EC_PARAMS
+ * :param point: uncompressed point, see spki_ec_point()
+ *
+ * Same output buffer convention as spki_rsa_encode().
+ */
+CK_RV spki_ec_encode(const CK_BYTE *params, CK_ULONG params_len,
+        const CK_BYTE *point, CK_ULONG point_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len) {
+    CK_ULONG alg_len, bitstr_len, spki_len, total;
+    CK_BYTE_PTR p = out;
+
+    if (params == NULL || params_len == 0 || point == NULL || point_len == 0
+            || out_len == NULL)
+        return CKR_ARGUMENTS_BAD;
+
+    alg_len = 2 + sizeof(oid_ec_public_key) + params_len;
+    bitstr_len = 1 + point_len;
+    spki_len = 1 + der_length_len(alg_len) + alg_len
+             + 1 + der_length_len(bitstr_len) + bitstr_len;
+    total = 1 + der_length_len(spki_len) + spki_len;
+
+    if (out == NULL) {
+        *out_len = total;
+        return CKR_OK;
+    }
+    if (*out_len < total) {
+        *out_len = total;
+        return CKR_BUFFER_TOO_SMALL;
+    }
+
+    p += der_put_header(p, DER_TAG_SEQUENCE, spki_len);
+    p += der_put_header(p, DER_TAG_SEQUENCE, alg_len);
+    p += der_put_header(p, DER_TAG_OID, sizeof(oid_ec_public_key));
+    memcpy(p, oid_ec_public_key, sizeof(oid_ec_public_key));
+    p += sizeof(oid_ec_public_key);
+    memcpy(p, params, params_len);
+    p += params_len;
+    p += der_put_header(p, DER_TAG_BIT_STRING, bitstr_len);
+    *p++ = 0x00; /* no unused bits */
+    memcpy(p, point, point_len);
+    p += point_len;
+
+    *out_len = (CK_ULONG) (p - out);
+    return CKR_OK;
+}
+
+/**
+ * Get curve and point of EC public key from decoded SubjectPublicKeyInfo
+ *
+ * Only named curves and uncompressed points are accepted.
+ *
+ * @retval CKR_OK                    on success
+ * @retval CKR_KEY_TYPE_INCONSISTENT spki is not EC public key
+ * @retval CKR_DATA_INVALID          malformed parameters or point
+ */
+CK_RV spki_ec_decode(const spki_t *spki,
+        const CK_BYTE **params, CK_ULONG_PTR params_len,
+        const CK_BYTE **point, CK_ULONG_PTR point_len) {
+    const CK_BYTE *p;
+    const CK_BYTE *oid;
+    CK_ULONG oid_len;
+
+    if (spki == NULL || params == NULL || params_len == NULL
+            || point == NULL || point_len == NULL)
+        return CKR_ARGUMENTS_BAD;
+    if (spki->algorithm != SPKI_ALG_EC)
+        return CKR_KEY_TYPE_INCONSISTENT;
+
+    p = spki->params;
+    if (p == NULL || !der_get(&p, spki->params + spki->params_len,
+            DER_TAG_OID, &oid, &oid_len)
+            || p != spki->params + spki->params_len)
+        return CKR_DATA_INVALID;
+    if (spki->key_len < 3 || spki->key_len % 2 == 0 || spki->key[0] != 0x04
+            || spki->key_len > SPKI_EC_MAX_POINT_LEN)
+        return CKR_DATA_INVALID;
+
+    *params = spki->params;
+    *params_len = spki->params_len;
+    *point = spki->key;
+    *point_len = spki->key_len;
+    return CKR_OK;
+}
+
+#define PEM_BEGIN "-----BEGIN PUBLIC KEY-----"
+#define PEM_END   "-----END PUBLIC KEY-----"
+
+static int is_space(CK_BYTE c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static const CK_BYTE *find_str(const CK_BYTE *p, const CK_BYTE *end,
+        const char *str) {
+    size_t len = strlen(str);
+
+    while ((size_t) (end - p) >= len) {
+        if (memcmp(p, str, len) == 0)
+            return p;
+        ++p;
+    }
+    return NULL;
+}
+
+static int base64_value(CK_BYTE c) {
+    if (c >= 'A' && c <= 'Z')
+        return c - 'A';
+    if (c >= 'a' && c <= 'z')
+        return c - 'a' + 26;
+    if (c >= '0' && c <= '9')
+        return c - '0' + 52;
+    if (c == '+')
+        return 62;
+    if (c == '/')
+        return 63;
+    return -1;
+}
+
+/**
+ * Decode base64 text ignoring white space
+ *
+ * @retval length of decoded data
+ * @retval -1 on invalid input or if out is too small
+ */
+static long base64_decode(const CK_BYTE *p, const CK_BYTE *end,
+        CK_BYTE_PTR out, CK_ULONG out_len) {
+    CK_ULONG len = 0;
+    unsigned long acc = 0;
+    int bits = 0;
+    int pad = 0;
+    int v;
+
+    for (; p < end; ++p) {
+        if (is_space(*p))
+            continue;
+        if (*p == '=') {
+            ++pad;
+            continue;
+        }
+        v = base64_value(*p);
+        if (v < 0 || pad > 0)
+            return -1;
+        acc = (acc << 6) | v;
+        bits += 6;
+        if (bits >= 8) {
+            bits -= 8;
+            if (len >= out_len)
+                return -1;
+            out[len++] = (CK_BYTE) (acc >> bits);
+        }
+    }
+    if (pad > 2)
+        return -1;
+    return len;
+}
+
+/**
+ * Get next SubjectPublicKeyInfo from bundle
+ *
+ * DER records are returned in place. PEM records are decoded to *scratch
+ * which is advanced behind decoded data; scratch of buf_len octets is always
+ * sufficient for the whole bundle.
+ *
+ * @param[in,out] offset position in buf, start with 0
+ *
+ * @retval CKR_OK           rec is filled, rec->der is NULL at end of bundle
+ * @retval CKR_DATA_INVALID if the bundle is malformed
+ */
+CK_RV spki_bundle_next(const CK_BYTE *buf, CK_ULONG buf_len,
+        CK_ULONG_PTR offset, CK_BYTE_PTR *scratch, CK_ULONG_PTR scratch_len,
+        spki_record_t *rec) {
+    const CK_BYTE *p = buf + *offset;
+    const CK_BYTE *end = buf + buf_len;
+    const CK_BYTE *content;
+    const CK_BYTE *body;
+    const CK_BYTE *body_end;
+    const CK_BYTE *line_end;
+    CK_ULONG content_len;
+    long decoded;
+
+    memset(rec, 0, sizeof(*rec));
+    while (p < end && is_space(*p))
+        ++p;
+    if (p == end) {
+        *offset = buf_len;
+        return CKR_OK;
+    }
+
+    if (*p == DER_TAG_SEQUENCE) {
+        rec->der = p;
+        if (!der_get(&p, end, DER_TAG_SEQUENCE, &content, &content_len))
+            return CKR_DATA_INVALID;
+        rec->der_len = (CK_ULONG) (p - rec->der);
+        *offset = (CK_ULONG) (p - buf);
+        return CKR_OK;
+    }
+
+    if ((CK_ULONG) (end - p) < strlen(PEM_BEGIN)
+            || memcmp(p, PEM_BEGIN, strlen(PEM_BEGIN)) != 0)
+        return CKR_DATA_INVALID;
+    body = p + strlen(PEM_BEGIN);
+    body_end = find_str(body, end, PEM_END);
+    if (body_end == NULL)
+        return CKR_DATA_INVALID;
+
+    /* headers are present if the first line contains colon */
+    while (body < body_end && (*body == '\r' || *body == '\n'))
+        ++body;
+    line_end = body < body_end
+            ? memchr(body, '\n', (size_t) (body_end - body)) : NULL;
+    if (line_end != NULL && memchr(body, ':', line_end - body) != NULL) {
+        rec->headers = (const char *) body;
+        /* headers end with empty line */
+        while (line_end != NULL) {
+            p = line_end + 1;
+            while (p < body_end && (*p == ' ' || *p == '\t' || *p == '\r'))
+                ++p;
+            if (p < body_end && *p == '\n')
+                break;
+            line_end = memchr(p, '\n', body_end - p);
+        }
+        if (line_end == NULL)
+            return CKR_DATA_INVALID;
+        rec->headers_len = (CK_ULONG) (line_end - body);
+        body = p;
+    }
+
+    decoded = base64_decode(body, body_end, *scratch, *scratch_len);
+    if (decoded <= 0)
+        return CKR_DATA_INVALID;
+    rec->der = *scratch;
+    rec->der_len = decoded;
+    *scratch += decoded;
+    *scratch_len -= decoded;
+    *offset = (CK_ULONG) (body_end + strlen(PEM_END) - buf);
+    return CKR_OK;
+}
+
+/**
+ * Find PEM header value by case-insensitive name
+ *
+ * @retval 1 if header was found, value is not NUL terminated
+ * @retval 0 if header is not present
+ */
+int spki_record_header(const spki_record_t *rec, const char *name,
+        const char **value, CK_ULONG_PTR value_len) {
+    const char *p = rec->headers;
+    const char *end = rec->headers + rec->headers_len;
+    const char *line_end;
+    const char *v;
+    size_t name_len = strlen(name);
+
+    if (p == NULL)
+        return 0;
+    while (p < end) {
+        line_end = memchr(p, '\n', end - p);
+        if (line_end == NULL)
+            line_end = end;
+        if ((size_t) (line_end - p) > name_len && p[name_len] == ':'
+                && strncasecmp(p, name, name_len) == 0) {
+            v = p + name_len + 1;
+            while (v < line_end && (*v == ' ' || *v == '\t'))
+                ++v;
+            while (line_end > v && is_space(line_end[-1]))
+                --line_end;
+            *value = v;
+            *value_len = (CK_ULONG) (line_end - v);
+            return 1;
+        }
+        p = line_end + 1;
+    }
+    return 0;
+}
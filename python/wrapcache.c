@@ -0,0 +1,300 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ wrapcache.c
+
+ Cache of wrapped keys
+
+ Chained hash table with power of 2 bucket count, doubled when it has more
+ entries than buckets.
+
+ File format (native byte order, the file is local to the host):
+   "IPAWC002"
+   { u64 key | u64 wrapping_key | u64 mechanism | u64 length | blob }*
+ *****************************************************************************/
+
+#include "wrapcache.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define WRAPCACHE_MAGIC       "IPAWC002"
+#define WRAPCACHE_MAX_BLOB    (64 * 1024)
+#define WRAPCACHE_MIN_BUCKETS 64
+
+struct wrapcache_entry {
+    wrapcache_entry_t *next;
+    uint64_t key;
+    uint64_t wrapping_key;
+    CK_MECHANISM_TYPE mech;
+    CK_ULONG len;
+    int persist;
+    CK_BYTE blob[];
+};
+
+void wrapcache_init(wrapcache_t *cache) {
+    memset(cache, 0, sizeof(*cache));
+}
+
+void wrapcache_free(wrapcache_t *cache) {
+    wrapcache_entry_t *e;
+    wrapcache_entry_t *next;
+    size_t i;
+
+    for (i = 0; i < cache->bucket_count; i++) {
+        for (e = cache->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            free(e);
+        }
+    }
+    free(cache->buckets);
+    wrapcache_init(cache);
+}
+
+static size_t bucket_of(size_t bucket_count, uint64_t key,
+        uint64_t wrapping_key, CK_MECHANISM_TYPE mech) {
+    uint64_t h = key ^ (wrapping_key * 0x9e3779b97f4a7c15ULL) ^ mech;
+
+    return (size_t) (h ^ (h >> 32)) & (bucket_count - 1);
+}
+
+static int grow(wrapcache_t *cache) {
+    size_t count = cache->bucket_count ?
+            cache->bucket_count * 2 : WRAPCACHE_MIN_BUCKETS;
+    wrapcache_entry_t **buckets;
+    wrapcache_entry_t *e;
+    wrapcache_entry_t *next;
+    size_t i;
+    size_t b;
+
+    buckets = calloc(count, sizeof(wrapcache_entry_t *));
+    if (buckets == NULL)
+        return 0;
+    for (i = 0; i < cache->bucket_count; i++) {
+        for (e = cache->buckets[i]; e != NULL; e = next) {
+            next = e->next;
+            b = bucket_of(count, e->key, e->wrapping_key, e->mech);
+            e->next = buckets[b];
+            buckets[b] = e;
+        }
+    }
+    free(cache->buckets);
+    cache->buckets = buckets;
+    cache->bucket_count = count;
+    return 1;
+}
+
+/**
+ * Find wrapped key
+ *
+ * :return: blob owned by the cache, valid until next put or invalidation,
+ *          NULL if not cached
+ */
+const CK_BYTE *wrapcache_get(wrapcache_t *cache, uint64_t key,
+        uint64_t wrapping_key, CK_MECHANISM_TYPE mech, CK_ULONG_PTR len) {
+    wrapcache_entry_t *e;
+
+    if (cache->bucket_count > 0) {
+        e = cache->buckets[bucket_of(cache->bucket_count, key, wrapping_key,
+                mech)];
+        for (; e != NULL; e = e->next) {
+            if (e->key == key && e->wrapping_key == wrapping_key
+                    && e->mech == mech) {
+                cache->hits++;
+                *len = e->len;
+                return e->blob;
+            }
+        }
+    }
+    cache->misses++;
+    return NULL;
+}
+
+/**
+ * Store wrapped key, replaces previous entry with the same key
+ *
+ * :param persist: 0 keeps the entry out of wrapcache_save()
+ */
+CK_RV wrapcache_put(wrapcache_t *cache, uint64_t key, uint64_t wrapping_key,
+        CK_MECHANISM_TYPE mech, const CK_BYTE *blob, CK_ULONG len,
+        int persist) {
+    wrapcache_entry_t **link;
+    wrapcache_entry_t *e;
+
+    if (len > WRAPCACHE_MAX_BLOB)
+        return CKR_DATA_LEN_RANGE;
+    if (cache->count >= cache->bucket_count && !grow(cache))
+        return CKR_HOST_MEMORY;
+
+    e = malloc(sizeof(*e) + len);
+    if (e == NULL)
+        return CKR_HOST_MEMORY;
+    e->key = key;
+    e->wrapping_key = wrapping_key;
+    e->mech = mech;
+    e->len = len;
+    e->persist = persist;
+    memcpy(e->blob, blob, len);
+
+    link = &cache->buckets[bucket_of(cache->bucket_count, key, wrapping_key,
+            mech)];
+    e->next = *link;
+    *link = e;
+    cache->count++;
+
+    /* drop older entry with the same key */
+    for (link = &e->next; *link != NULL; link = &(*link)->next) {
+        if ((*link)->key == key && (*link)->wrapping_key == wrapping_key
+                && (*link)->mech == mech) {
+            wrapcache_entry_t *old = *link;
+
+            *link = old->next;
+            free(old);
+            cache->count--;
+            break;
+        }
+    }
+    cache->dirty = 1;
+    return CKR_OK;
+}
+
+/**
+ * Drop all entries where fingerprint is the key or the wrapping key
+ *
+ * :return: number of dropped entries
+ */
+size_t wrapcache_invalidate(wrapcache_t *cache, uint64_t fingerprint) {
+    wrapcache_entry_t **link;
+    wrapcache_entry_t *e;
+    size_t dropped = 0;
+    size_t i;
+
+    for (i = 0; i < cache->bucket_count; i++) {
+        link = &cache->buckets[i];
+        while (*link != NULL) {
+            e = *link;
+            if (e->key == fingerprint || e->wrapping_key == fingerprint) {
+                *link = e->next;
+                free(e);
+                dropped++;
+            } else {
+                link = &e->next;
+            }
+        }
+    }
+    cache->count -= dropped;
+    if (dropped > 0)
+        cache->dirty = 1;
+    return dropped;
+}
+
+/**
+ * Add entries from file
+ *
+ * Missing file is not an error. Reading stops at the first damaged record,
+ * entries before it are kept.
+ */
+CK_RV wrapcache_load(wrapcache_t *cache, const char *path) {
+    FILE *f;
+    char magic[sizeof(WRAPCACHE_MAGIC) - 1];
+    uint64_t rec[4];
+    CK_BYTE *blob;
+    CK_RV rv = CKR_OK;
+
+    f = fopen(path, "rb");
+    if (f == NULL)
+        return errno == ENOENT ? CKR_OK : CKR_GENERAL_ERROR;
+    blob = malloc(WRAPCACHE_MAX_BLOB);
+    if (blob == NULL) {
+        fclose(f);
+        return CKR_HOST_MEMORY;
+    }
+
+    if (fread(magic, sizeof(magic), 1, f) != 1
+            || memcmp(magic, WRAPCACHE_MAGIC, sizeof(magic)) != 0)
+        goto done;
+    while (fread(rec, sizeof(rec), 1, f) == 1) {
+        if (rec[3] > WRAPCACHE_MAX_BLOB
+                || fread(blob, 1, rec[3], f) != rec[3])
+            break;
+        rv = wrapcache_put(cache, rec[0], rec[1], rec[2], blob, rec[3], 1);
+        if (rv != CKR_OK)
+            break;
+    }
+
+done:
+    free(blob);
+    fclose(f);
+    cache->dirty = 0;
+    return rv;
+}
+
+/**
+ * Write all entries to file
+ *
+ * Written to temporary file first and renamed, so readers never see
+ * partial cache. Entries put with persist=0 are left out.
+ */
+CK_RV wrapcache_save(wrapcache_t *cache, const char *path) {
+    FILE *f;
+    char *tmp;
+    wrapcache_entry_t *e;
+    uint64_t rec[4];
+    size_t i;
+    int ok;
+
+    tmp = malloc(strlen(path) + sizeof(".tmp"));
+    if (tmp == NULL)
+        return CKR_HOST_MEMORY;
+    strcpy(tmp, path);
+    strcat(tmp, ".tmp");
+
+    f = fopen(tmp, "wb");
+    if (f == NULL) {
+        free(tmp);
+        return CKR_GENERAL_ERROR;
+    }
+    ok = fwrite(WRAPCACHE_MAGIC, sizeof(WRAPCACHE_MAGIC) - 1, 1, f) == 1;
+    for (i = 0; ok && i < cache->bucket_count; i++) {
+        for (e = cache->buckets[i]; ok && e != NULL; e = e->next) {
+            if (!e->persist)
+                continue;
+            rec[0] = e->key;
+            rec[1] = e->wrapping_key;
+            rec[2] = e->mech;
+            rec[3] = e->len;
+            ok = fwrite(rec, sizeof(rec), 1, f) == 1
+                    && fwrite(e->blob, 1, e->len, f) == e->len;
+        }
+    }
+    if (fclose(f) != 0)
+        ok = 0;
+    if (ok && rename(tmp, path) != 0)
+        ok = 0;
+    if (!ok)
+        remove(tmp);
+    free(tmp);
+    if (!ok)
+        return CKR_GENERAL_ERROR;
+    cache->dirty = 0;
+    return CKR_OK;
+}
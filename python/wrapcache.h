@@ -0,0 +1,72 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ wrapcache.h
+
+ Cache of wrapped keys
+
+ Wrapping the same key with the same wrapping key and mechanism again gives
+ an equivalent blob, so results of C_WrapKey are kept by
+ (key fingerprint, wrapping key fingerprint, mechanism). Fingerprints are
+ computed by the caller from token identity and key attributes; when a key
+ is deleted or modified, all entries with its fingerprint are dropped with
+ wrapcache_invalidate().
+
+ The cache can be saved to and loaded from a file, see wrapcache.c for the
+ format. Blobs are wrapped (encrypted) keys, they are not sensitive. Entries
+ put with persist=0 stay in memory only, for keys whose fingerprint is too
+ weak to be trusted after the key could have been regenerated.
+ *****************************************************************************/
+
+#ifndef _IPA_P11_WRAPCACHE_H
+#define _IPA_P11_WRAPCACHE_H
+
+#include <stdint.h>
+#include <p11-kit/pkcs11.h>
+
+typedef struct wrapcache_entry wrapcache_entry_t;
+
+typedef struct {
+    wrapcache_entry_t **buckets;
+    size_t bucket_count;    /* power of 2 or 0 */
+    size_t count;
+    uint64_t hits;
+    uint64_t misses;
+    int dirty;              /* changed since load or save */
+} wrapcache_t;
+
+void wrapcache_init(wrapcache_t *cache);
+
+void wrapcache_free(wrapcache_t *cache);
+
+const CK_BYTE *wrapcache_get(wrapcache_t *cache, uint64_t key,
+        uint64_t wrapping_key, CK_MECHANISM_TYPE mech, CK_ULONG_PTR len);
+
+CK_RV wrapcache_put(wrapcache_t *cache, uint64_t key, uint64_t wrapping_key,
+        CK_MECHANISM_TYPE mech, const CK_BYTE *blob, CK_ULONG len,
+        int persist);
+
+size_t wrapcache_invalidate(wrapcache_t *cache, uint64_t fingerprint);
+
+CK_RV wrapcache_load(wrapcache_t *cache, const char *path);
+
+CK_RV wrapcache_save(wrapcache_t *cache, const char *path);
+
+#endif // !_IPA_P11_WRAPCACHE_H
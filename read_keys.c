@@ -58,6 +58,10 @@
 #include <pkcs11.h>
 
 #include "library.h"
+#include "p11caps.h"
+#include "listing.h"
+#include "p11stats.h"
+#include "p11trace.h"
 
 
 void
@@ -81,10 +85,10 @@ get_slot(CK_FUNCTION_LIST_PTR p11)
 {
      CK_RV rv;
      CK_SLOT_ID slotId;
-     CK_ULONG slotCount = 10;
-     CK_SLOT_ID *slotIds = malloc(sizeof(CK_SLOT_ID) * slotCount);
+     CK_ULONG slotCount = 0;
+     CK_SLOT_ID *slotIds = NULL;
 
-     rv = p11->C_GetSlotList(CK_TRUE, slotIds, &slotCount);
+     rv = p11caps_slot_list(p11, CK_TRUE, &slotIds, &slotCount);
      check_return_value(rv, "get slot list");
 
      if (slotCount < 1) {
@@ -94,7 +98,7 @@ get_slot(CK_FUNCTION_LIST_PTR p11)
 
      slotId = slotIds[0];
      free(slotIds);
-     printf("slot count: %d\n", (int)slotCount);
+     fprintf(stderr, "slot count: %d\n", (int)slotCount);
      return slotId;
 }
 
@@ -147,47 +151,42 @@ finalize(CK_FUNCTION_LIST_PTR p11)
 }
 
 void
-show_key_info(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session, CK_OBJECT_HANDLE key)
+show_key_info(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+              CK_OBJECT_HANDLE key, listing_t *listing)
 {
      CK_RV rv;
-     CK_UTF8CHAR *label = (CK_UTF8CHAR *) malloc(80);
-     CK_BYTE *id = (CK_BYTE *) malloc(10);
-     size_t label_len;
-     char *label_str;
-
-     memset(id, 0, 10);
+     CK_UTF8CHAR label[256];
+     CK_BYTE id[256];
+     unsigned int i;
 
      CK_ATTRIBUTE template[] = {
-          {CKA_LABEL, label, 80},
-          {CKA_ID, id, 1}
+          {CKA_LABEL, label, sizeof(label)},
+          {CKA_ID, id, sizeof(id)}
      };
 
+     /* too long or missing attributes have length -1 */
      rv = p11->C_GetAttributeValue(session, key, template, 2);
-     check_return_value(rv, "get attribute value");
-
-     fprintf(stdout, "Found a key:\n");
-     label_len = template[0].ulValueLen;
-     if (label_len > 0) {
-          label_str = malloc(label_len + 1);
-          memcpy(label_str, label, label_len);
-          label_str[label_len] = '\0';
-          fprintf(stdout, "\tKey label: %s\n", label_str);
-          free(label_str);
-     } else {
-          fprintf(stdout, "\tKey label too large, or not found\n");
-     }
-     if (template[1].ulValueLen > 0) {
-          fprintf(stdout, "\tKey ID: %02x\n", id[0]);
-     } else {
-          fprintf(stdout, "\tKey id too large, or not found\n");
+     if (rv != CKR_BUFFER_TOO_SMALL && rv != CKR_ATTRIBUTE_TYPE_INVALID)
+          check_return_value(rv, "get attribute value");
+     for (i = 0; i < 2; i++) {
+          if (template[i].ulValueLen == (CK_ULONG) -1)
+               template[i].pValue = NULL;
      }
 
-     free(label);
-     free(id);
+     listing_begin(listing, "Found a key");
+     listing_field_str(listing, "Key label", template[0].pValue,
+                       template[0].ulValueLen);
+     listing_field_hex(listing, "Key ID", template[1].pValue,
+                       template[1].ulValueLen);
+     if (!listing_end(listing)) {
+          fprintf(stderr, "Unable to write listing\n");
+          exit(EXIT_FAILURE);
+     }
 }
 
 void
-read_private_keys(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
+read_private_keys(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session,
+                  listing_t *listing)
 {
      CK_RV rv;
      CK_OBJECT_CLASS keyClass = CKO_PRIVATE_KEY;
@@ -204,7 +203,7 @@ read_private_keys(CK_FUNCTION_LIST_PTR p11, CK_SESSION_HANDLE session)
      check_return_value(rv, "Find first object");
 
      while (objectCount > 0) {
-          show_key_info(p11, session, object);
+          show_key_info(p11, session, object, listing);
 
           rv = p11->C_FindObjects(session, &object, 1, &objectCount);
           check_return_value(rv, "Find other objects");
@@ -223,6 +222,8 @@ main(int argc, char **argv)
      CK_RV rv;
      CK_FUNCTION_LIST_PTR p11;
      void *moduleHandle = NULL;
+     listing_format_t format = LISTING_TEXT;
+     listing_t listing;
 
      if (argc > 1) {
           if (strcmp(argv[1], "null") == 0) {
@@ -232,9 +233,12 @@ main(int argc, char **argv)
           }
      }
 
-     if (argc < 2) {
+     if (argc < 3 || (argc > 3 && !listing_parse_format(argv[3], &format))) {
+	     fprintf(stderr, "Usage: %s pin|null library [text|json|tsv]\n",
+		     argv[0]);
 	     return 1;
      }
+     listing_init(&listing, format, stdout);
      // Get a pointer to the function list for PKCS#11 library (argv[2])
      CK_C_GetFunctionList pGetFunctionList = loadLibrary(argv[2], &moduleHandle);
      if (!pGetFunctionList)
@@ -245,16 +249,25 @@ main(int argc, char **argv)
      
      // Load the function list
      (*pGetFunctionList)(&p11);
+     // P11_TRACE=file records calls for p11replay
+     if (getenv("P11_TRACE") != NULL)
+          p11 = p11trace_wrap(p11, getenv("P11_TRACE"));
+     // P11_STATS=1 in environment prints per-function call statistics
+     if (getenv("P11_STATS") != NULL)
+          p11 = p11stats_wrap(p11);
      
      rv = initialize(p11);
      check_return_value(rv, "initialize");
      slot = get_slot(p11);
      session = start_session(p11, slot);
      login(p11, session, userPin);
-     read_private_keys(p11, session);
+     read_private_keys(p11, session, &listing);
+     listing_free(&listing);
      logout(p11, session);
      end_session(p11, session);
      finalize(p11);
+     if (p11stats_enabled())
+          p11stats_print(stderr);
      return EXIT_SUCCESS;
 }
 
@@ -0,0 +1,183 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ secmem.c
+
+ Locked memory for key material
+
+ Every buffer is preceded by a header with its size class and requested
+ size. Classes are powers of two from 64 B to 16 KiB; blocks of a class are
+ carved from 64 KiB locked chunks and chained in a free list. Chunks are
+ never returned to the system.
+ *****************************************************************************/
+
+#define _DEFAULT_SOURCE
+
+#include "secmem.h"
+
+#include <pthread.h>
+#include <string.h>
+#include <sys/mman.h>
+
+#define SECMEM_MIN_SHIFT   6   /* 64 B */
+#define SECMEM_CLASSES     9   /* up to 16 KiB */
+#define SECMEM_CHUNK_SIZE  (64 * 1024)
+#define SECMEM_LARGE       SECMEM_CLASSES
+
+typedef union secmem_header {
+    struct {
+        size_t size;            /* requested size */
+        unsigned int cls;       /* class or SECMEM_LARGE */
+        union secmem_header *next;  /* free list link */
+    } h;
+    long double align;
+} secmem_header_t;
+
+static secmem_header_t *free_lists[SECMEM_CLASSES];
+static pthread_mutex_t secmem_lock = PTHREAD_MUTEX_INITIALIZER;
+
+/* memset() through volatile pointer is not optimized out */
+static void *(*const volatile secmem_memset)(void *, int, size_t) = memset;
+
+void secmem_zeroize(void *ptr, size_t size) {
+    if (ptr != NULL)
+        secmem_memset(ptr, 0, size);
+}
+
+static size_t class_size(unsigned int cls) {
+    return (size_t) 1 << (cls + SECMEM_MIN_SHIFT);
+}
+
+/**
+ * Map and lock memory
+ *
+ * Failure to lock is ignored, pages are still excluded from core dumps.
+ */
+static void *map_locked(size_t size) {
+    void *p;
+
+    p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS,
+            -1, 0);
+    if (p == MAP_FAILED)
+        return NULL;
+    (void) mlock(p, size);
+#ifdef MADV_DONTDUMP
+    (void) madvise(p, size, MADV_DONTDUMP);
+#endif
+    return p;
+}
+
+/**
+ * Add one chunk of blocks to the free list of class, lock has to be held
+ */
+static int grow_class(unsigned int cls) {
+    size_t block = sizeof(secmem_header_t) + class_size(cls);
+    size_t count = SECMEM_CHUNK_SIZE / block;
+    char *chunk;
+    size_t i;
+
+    chunk = map_locked(SECMEM_CHUNK_SIZE);
+    if (chunk == NULL)
+        return 0;
+    for (i = 0; i < count; i++) {
+        secmem_header_t *hdr = (secmem_header_t *) (chunk + i * block);
+
+        hdr->h.cls = cls;
+        hdr->h.next = free_lists[cls];
+        free_lists[cls] = hdr;
+    }
+    return 1;
+}
+
+void *secmem_alloc(size_t size) {
+    secmem_header_t *hdr;
+    unsigned int cls = 0;
+
+    while (cls < SECMEM_CLASSES && class_size(cls) < size)
+        cls++;
+
+    if (cls == SECMEM_CLASSES) {
+        if (size > (size_t) -1 - sizeof(secmem_header_t))
+            return NULL;
+        hdr = map_locked(sizeof(secmem_header_t) + size);
+        if (hdr == NULL)
+            return NULL;
+        hdr->h.cls = SECMEM_LARGE;
+    } else {
+        pthread_mutex_lock(&secmem_lock);
+        if (free_lists[cls] == NULL && !grow_class(cls)) {
+            pthread_mutex_unlock(&secmem_lock);
+            return NULL;
+        }
+        hdr = free_lists[cls];
+        free_lists[cls] = hdr->h.next;
+        pthread_mutex_unlock(&secmem_lock);
+    }
+    hdr->h.size = size;
+    hdr->h.next = NULL;
+    return hdr + 1;
+}
+
+/**
+ * Resize buffer, contents of the old one are zeroized
+ */
+void *secmem_realloc(void *ptr, size_t size) {
+    secmem_header_t *hdr;
+    void *p;
+
+    if (ptr == NULL)
+        return secmem_alloc(size);
+    hdr = (secmem_header_t *) ptr - 1;
+    if (hdr->h.cls != SECMEM_LARGE && size <= class_size(hdr->h.cls)) {
+        if (size < hdr->h.size)
+            secmem_zeroize((char *) ptr + size, hdr->h.size - size);
+        hdr->h.size = size;
+        return ptr;
+    }
+
+    p = secmem_alloc(size);
+    if (p == NULL)
+        return NULL;
+    memcpy(p, ptr, hdr->h.size < size ? hdr->h.size : size);
+    secmem_free(ptr);
+    return p;
+}
+
+void secmem_free(void *ptr) {
+    secmem_header_t *hdr;
+    size_t len;
+
+    if (ptr == NULL)
+        return;
+    hdr = (secmem_header_t *) ptr - 1;
+    secmem_zeroize(ptr, hdr->h.size);
+
+    if (hdr->h.cls == SECMEM_LARGE) {
+        len = sizeof(secmem_header_t) + hdr->h.size;
+        munlock(hdr, len);
+        munmap(hdr, len);
+        return;
+    }
+
+    pthread_mutex_lock(&secmem_lock);
+    hdr->h.next = free_lists[hdr->h.cls];
+    free_lists[hdr->h.cls] = hdr;
+    pthread_mutex_unlock(&secmem_lock);
+}
@@ -0,0 +1,103 @@
+/*
+ * Copyright (C) 2014  Red Hat
+ * Author: Petr Spacek <pspacek@redhat.com>
+ *
+ * This program is free software; you can redistribute it and/or
+ * modify it under the terms of the GNU General Public License
+ * as published by the Free Software Foundation; either version 2
+ * of the License, or (at your option) any later version.
+ *
+ * This program is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with this program; if not, write to the Free Software
+ * Foundation, Inc., 51 Franklin Street, Fifth Floor, Boston, MA  02110-1301, USA.
+ */
+
+/*****************************************************************************
+ spki.h
+
+ Minimal DER encoder and decoder for SubjectPublicKeyInfo (RFC 5280)
+ *****************************************************************************/
+
+#ifndef _IPA_P11_SPKI_H
+#define _IPA_P11_SPKI_H
+
+#include "pkcs11.h"
+
+/* Largest key material we are willing to handle on the stack */
+#define SPKI_RSA_MAX_MODULUS_LEN   2048 /* 16384 bits */
+#define SPKI_RSA_MAX_EXPONENT_LEN  64
+#define SPKI_EC_MAX_POINT_LEN      133  /* uncompressed P-521 point */
+#define SPKI_EC_MAX_PARAMS_LEN     16   /* namedCurve OID */
+
+typedef enum {
+    SPKI_ALG_UNKNOWN = 0,
+    SPKI_ALG_RSA,
+    SPKI_ALG_DSA,
+    SPKI_ALG_EC
+} spki_alg_t;
+
+/**
+ * Decoded SubjectPublicKeyInfo
+ *
+ * All pointers point inside of the decoded DER buffer.
+ */
+typedef struct {
+    spki_alg_t algorithm;
+    const CK_BYTE *params;  /* DER of AlgorithmIdentifier.parameters or NULL */
+    CK_ULONG params_len;
+    const CK_BYTE *key;     /* subjectPublicKey without unused bits octet */
+    CK_ULONG key_len;
+} spki_t;
+
+/**
+ * One SubjectPublicKeyInfo from DER or PEM bundle
+ */
+typedef struct {
+    const CK_BYTE *der;
+    CK_ULONG der_len;
+    const char *headers;    /* PEM "Name: value" header lines or NULL */
+    CK_ULONG headers_len;
+} spki_record_t;
+
+CK_RV spki_rsa_encode(const CK_BYTE *modulus, CK_ULONG modulus_len,
+        const CK_BYTE *exponent, CK_ULONG exponent_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+
+CK_RV spki_decode(const CK_BYTE *der, CK_ULONG der_len, spki_t *spki);
+
+CK_RV spki_rsa_decode(const spki_t *spki,
+        const CK_BYTE **modulus, CK_ULONG_PTR modulus_len,
+        const CK_BYTE **exponent, CK_ULONG_PTR exponent_len);
+
+CK_RV spki_ec_params(CK_ULONG bits, const CK_BYTE **params,
+        CK_ULONG_PTR params_len);
+
+CK_ULONG spki_ec_bits(const CK_BYTE *params, CK_ULONG params_len);
+
+CK_RV spki_ec_point(const CK_BYTE *value, CK_ULONG value_len,
+        const CK_BYTE **point, CK_ULONG_PTR point_len);
+
+CK_RV spki_ec_point_encode(const CK_BYTE *point, CK_ULONG point_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+
+CK_RV spki_ec_encode(const CK_BYTE *params, CK_ULONG params_len,
+        const CK_BYTE *point, CK_ULONG point_len,
+        CK_BYTE_PTR out, CK_ULONG_PTR out_len);
+
+CK_RV spki_ec_decode(const spki_t *spki,
+        const CK_BYTE **params, CK_ULONG_PTR params_len,
+        const CK_BYTE **point, CK_ULONG_PTR point_len);
+
+CK_RV spki_bundle_next(const CK_BYTE *buf, CK_ULONG buf_len,
+        CK_ULONG_PTR offset, CK_BYTE_PTR *scratch, CK_ULONG_PTR scratch_len,
+        spki_record_t *rec);
+
+int spki_record_header(const spki_record_t *rec, const char *name,
+        const char **value, CK_ULONG_PTR value_len);
+
+#endif // !_IPA_P11_SPKI_H